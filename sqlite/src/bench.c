@@ -0,0 +1,128 @@
+// SQL-level benchmark: loads the extension into an in-memory database and
+// times the aggregate, scalar, window and table-valued paths per row.
+//
+//   gcc -O2 -o kmh_sqlbench sqlite/src/bench.c -lsqlite3 -lm -lpthread
+//   ./kmh_sqlbench [path/to/kmh.so] [--trials N] [--csv FILE | --json FILE]
+#include "../../src/bench.h"
+#include <sqlite3.h>
+#include <assert.h>
+
+#define ROWS (1 << 19)
+#define GROUPS 1000
+
+static sqlite3 *db;
+
+static void die(const char *what) {
+    fprintf(stderr, "%s: %s\n", what, sqlite3_errmsg(db));
+    exit(1);
+}
+
+static void exec(const char *sql) {
+    char *err = NULL;
+    if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", sql, err);
+        exit(1);
+    }
+}
+
+static sqlite3_stmt *prepare(const char *sql) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) die(sql);
+    return stmt;
+}
+
+// Steps stmt to the end, reading column 0 of every row so results are
+// materialized; returns the row count
+static int drain(sqlite3_stmt *stmt) {
+    int rows = 0, rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        BENCH_KEEP(sqlite3_column_bytes(stmt, 0));
+        rows++;
+    }
+    if (rc != SQLITE_DONE) die(sqlite3_sql(stmt));
+    return rows;
+}
+
+// One statement per trial, reported per input row
+static void bench_sql(const char *name, const char *sql, double rows, int k) {
+    sqlite3_stmt *stmt = prepare(sql);
+    if (k && sqlite3_bind_int(stmt, 1, k) != SQLITE_OK) die(sql);
+    BENCH_RUN(name, 1, rows, sqlite3_reset(stmt), drain(stmt));
+    sqlite3_finalize(stmt);
+}
+
+// v(g, x): ROWS values of one distribution spread over GROUPS groups
+static void fill(int dist, uint32_t *values) {
+    int filled = bench_fill(values, ROWS, dist, 42);
+    assert(filled);
+    (void)filled;
+    exec("DROP TABLE IF EXISTS v; CREATE TABLE v(g INTEGER, x INTEGER); BEGIN");
+    sqlite3_stmt *ins = prepare("INSERT INTO v VALUES (?, ?)");
+    for (int i = 0; i < ROWS; i++) {
+        sqlite3_bind_int(ins, 1, i % GROUPS);
+        sqlite3_bind_int64(ins, 2, values[i]);
+        if (sqlite3_step(ins) != SQLITE_DONE) die("insert");
+        sqlite3_reset(ins);
+    }
+    sqlite3_finalize(ins);
+    exec("COMMIT");
+}
+
+int main(int argc, char **argv) {
+    const char *ext = "./kmh.so";
+    if (argc > 1 && strncmp(argv[1], "--", 2) != 0) {
+        ext = argv[1];
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+    if (sqlite3_open(":memory:", &db) != SQLITE_OK) die("open");
+    sqlite3_db_config(db, SQLITE_DBCONFIG_ENABLE_LOAD_EXTENSION, 1, NULL);
+    char *err = NULL;
+    if (sqlite3_load_extension(db, ext, "sqlite3_kmh_init", &err) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", ext, err);
+        return 1;
+    }
+    printf("KValue MinHash SQL Benchmark (%s, %d rows, %d groups, sqlite %s)\n", ext, ROWS, GROUPS,
+           sqlite3_libversion());
+    printf("================================================\n");
+    bench_start(argc, argv, "sqlite");
+
+    uint32_t *values = malloc(ROWS * sizeof(uint32_t));
+    assert(values);
+    const int sweep_k[] = { 16, 256, 1024, 4096 };
+    for (int dist = 0; dist < BENCH_DISTS; dist++) {
+        fill(dist, values);
+        bench_tags.dist = bench_dist_names[dist];
+        for (size_t s = 0; s < sizeof(sweep_k) / sizeof(*sweep_k); s++) {
+            int k = sweep_k[s];
+            bench_tags.k = k;
+            printf("%s, k %d:\n", bench_dist_names[dist], k);
+            // Aggregates over every row, one group and GROUPS groups
+            bench_sql("  group_create", "SELECT kmh_group_create(x, ?1) FROM v", ROWS, k);
+            bench_sql("  group_create by g", "SELECT kmh_group_create(x, ?1) FROM v GROUP BY g", ROWS, k);
+            bench_sql("  create + add", "SELECT kmh_add(kmh_create_k(?1), x) FROM v", ROWS, k);
+
+            // Per-sketch paths over the GROUPS sketches
+            exec("DROP TABLE IF EXISTS s; CREATE TABLE s(g INTEGER PRIMARY KEY, sig BLOB)");
+            sqlite3_stmt *build = prepare("INSERT INTO s SELECT g, kmh_group_create(x, ?1) FROM v GROUP BY g");
+            sqlite3_bind_int(build, 1, k);
+            drain(build);
+            sqlite3_finalize(build);
+            bench_sql("  cardinality", "SELECT sum(kmh_cardinality(sig)) FROM s", GROUPS, 0);
+            bench_sql("  distance", "SELECT sum(kmh_distance(a.sig, b.sig)) FROM s a JOIN s b ON b.g = a.g + 1",
+                      GROUPS - 1, 0);
+            bench_sql("  group_merge", "SELECT kmh_cardinality(kmh_group_merge(sig)) FROM s", GROUPS, 0);
+            bench_sql("  merge window 7", "SELECT kmh_cardinality(kmh_group_merge(sig) OVER "
+                      "(ORDER BY g ROWS 6 PRECEDING)) FROM s", GROUPS, 0);
+            bench_sql("  each", "SELECT count(*) FROM s, kmh_each(s.sig)", GROUPS, 0);
+        }
+    }
+    bench_tags.k = 0;
+    bench_tags.dist = "";
+
+    free(values);
+    sqlite3_close(db);
+    bench_finish();
+    return 0;
+}
@@ -1,13 +1,36 @@
 #include <sqlite3ext.h>
 SQLITE_EXTENSION_INIT1
 
+#include <stddef.h>
+
+// Sketch memory comes from SQLite, so it shows up in sqlite3_memory_used()
+// and respects sqlite3_soft_heap_limit64()
+static void *kmh_sqlite_malloc(size_t size) {
+    return sqlite3_malloc64(size);
+}
+
+static void kmh_sqlite_free(void *ptr) {
+    sqlite3_free(ptr);
+}
+
+// SQLite may dlclose the extension while threads that used it live on, so
+// the block caches are striped in the image rather than per thread (their
+// exit hooks would outlive it) and handed back when the last connection
+// closes, and the allocator hook is fixed at build time rather than set per
+// connection
+#define KMH_STRIPED_CACHE
+#define KMH_MALLOC kmh_sqlite_malloc
+#define KMH_FREE   kmh_sqlite_free
 #include "../../src/kmh.h"
 #include <assert.h>
+#include <math.h>
 
 // Default parameters
 #define DEFAULT_K 400
 #define DEFAULT_SPACE_SIZE 0xFFFFFFFF
 #define DEFAULT_SEED 42
+#define DEFAULT_SPACE_SIZE64 0xFFFFFFFFFFFFFFFFULL
+#define DEFAULT_SIMILARITY 0.5
 
 // Helper function to extract MinHash from blob
 static kvalue_minhash_t* kmh_from_blob(sqlite3_value *val) {
@@ -22,245 +45,2755 @@ static kvalue_minhash_t* kmh_from_blob(sqlite3_value *val) {
         return NULL;
     }
     
+    if (kmh_serialized_width(blob_data, blob_size) != sizeof(uint32_t)) {
+        return NULL; // 64-bit sketches go through kmh64_from_blob
+    }
+    
     return kmh_deserialize(blob_data, blob_size);
 }
 
-// Helper function to convert MinHash to blob
-static void kmh_to_blob(sqlite3_context *context, kvalue_minhash_t *kmh) {
-    uint8_t *serialized_data;
-    uint32_t size = kmh_serialize(kmh, &serialized_data);
+// Helper function to convert MinHash to blob. Results are serialized straight
+// into sqlite3_malloc memory that SQLite takes over, so there is no second
+// copy; compressed encodings are sized by their bound, which saves the pass
+// that computes the exact size.
+static void kmh_to_blob_encoded(sqlite3_context *context, kvalue_minhash_t *kmh, uint8_t encoding) {
+    uint32_t bound = kmh_serialized_bound(kmh, encoding);
+    uint8_t *buf = sqlite3_malloc64(bound);
+    if (!buf) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
     
-    if (size > 0 && serialized_data) {
-        sqlite3_result_blob(context, serialized_data, size, SQLITE_TRANSIENT);
-        kmh_free_buffer(serialized_data);
+    uint32_t size = kmh_serialize_into(kmh, encoding, buf, bound);
+    if (size > 0) {
+        sqlite3_result_blob(context, buf, size, sqlite3_free);
     } else {
+        sqlite3_free(buf);
         sqlite3_result_null(context);
     }
 }
 
-// kmh_create(value1, value2, ..., valueN)
-static void kmh_create_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (argc == 0) {
-        sqlite3_result_null(context);
+static void kmh_to_blob(sqlite3_context *context, kvalue_minhash_t *kmh) {
+    kmh_to_blob_encoded(context, kmh, KMH_ENCODING_RAW);
+}
+
+// Blobs with a block directory (written by kmh_blocked_t, possibly with K
+// above KMH_SQL_MAX_K) are updated as blocked sketches, so they keep it
+static int kmh_blob_is_blocked(sqlite3_value *val) {
+    kmh_blob_info_t info;
+    return sqlite3_value_type(val) == SQLITE_BLOB &&
+           kmh_blob_parse(&info, sqlite3_value_blob(val), sqlite3_value_bytes(val)) &&
+           (info.flags & KMH_FLAG_BLOCKS);
+}
+
+static void kmh_blocked_to_blob(sqlite3_context *context, const kmh_blocked_t *s) {
+    uint32_t size = kmh_blocked_serialized_size(s);
+    uint8_t *buf = sqlite3_malloc64(size);
+    if (!buf) {
+        sqlite3_result_error_nomem(context);
         return;
     }
+    kmh_blocked_serialize_into(s, buf, size);
+    sqlite3_result_blob(context, buf, size, sqlite3_free);
+}
+
+// Encoding of a portable sketch blob (legacy blobs are raw)
+static uint8_t kmh_blob_encoding(sqlite3_value *val) {
+    kmh_blob_info_t info;
+    if (!kmh_blob_parse(&info, sqlite3_value_blob(val), sqlite3_value_bytes(val))) {
+        return KMH_ENCODING_RAW;
+    }
+    return info.encoding;
+}
+
+// Zero-copy views of a sketch blob, valid for the duration of the call.
+// Compressed blobs are decoded into a little-endian copy kept as the
+// argument's auxdata, so SQLite frees it, and reuses it while the argument is
+// a constant (e.g. the query sketch in kmh_distance(sig, :query)).
+typedef struct {
+    kmh_view_t view;
+    uint8_t hashes[];
+} kmh_decoded_blob;
+
+// Decodes a compressed 32-bit blob into hashes (count little-endian words)
+// and points view at them
+static int kmh_decode_to_view(const kmh_blob_info_t *info, const uint8_t *blob_data, int blob_size,
+                              uint8_t *hashes, kmh_view_t *view) {
+    if (info->width != sizeof(uint32_t) || info->space_size > UINT32_MAX || info->seed > UINT32_MAX ||
+        !kmh_blob_decode(info, blob_data, blob_size, (uint32_t *)hashes)) {
+        return 0;
+    }
+#ifdef KMH_BIG_ENDIAN
+    for (uint32_t j = 0; j < info->count; j++) {
+        kmh_store_le32(hashes + j * sizeof(uint32_t), ((uint32_t *)hashes)[j]);
+    }
+#endif
+    *view = (kmh_view_t){ info->k, info->count, (uint32_t)info->space_size, (uint32_t)info->seed, hashes,
+                          NULL, 0 };
+    return 1;
+}
+
+static int kmh_view_from_blob(sqlite3_context *context, sqlite3_value **argv, int i, kmh_view_t *view) {
+    sqlite3_value *val = argv[i];
+    if (sqlite3_value_type(val) != SQLITE_BLOB) {
+        return 0;
+    }
+    const uint8_t *blob_data = sqlite3_value_blob(val);
+    int blob_size = sqlite3_value_bytes(val);
+    kmh_blob_info_t info;
+    if (!kmh_blob_parse(&info, blob_data, blob_size) || info.encoding == KMH_ENCODING_RAW) {
+        return kmh_view_init(view, blob_data, blob_size);
+    }
     
-    kvalue_minhash_t *kmh = kmh_init(DEFAULT_K, DEFAULT_SPACE_SIZE, DEFAULT_SEED);
-    if (!kmh) {
+    kmh_decoded_blob *decoded = sqlite3_get_auxdata(context, i);
+    if (!decoded) {
+        decoded = sqlite3_malloc64(sizeof(kmh_decoded_blob) + (uint64_t)info.count * sizeof(uint32_t));
+        if (!decoded) return 0;
+        if (!kmh_decode_to_view(&info, blob_data, blob_size, decoded->hashes, &decoded->view)) {
+            sqlite3_free(decoded);
+            return 0;
+        }
+        sqlite3_set_auxdata(context, i, decoded, sqlite3_free);
+        // set_auxdata frees the copy right away if it can't keep it
+        if (sqlite3_get_auxdata(context, i) != decoded) return 0;
+    }
+    *view = decoded->view;
+    return 1;
+}
+
+static int kmh64_view_from_blob(sqlite3_value *val, kmh64_view_t *view) {
+    if (sqlite3_value_type(val) != SQLITE_BLOB) {
+        return 0;
+    }
+    const uint8_t *blob_data = sqlite3_value_blob(val);
+    return kmh64_view_init(view, blob_data, sqlite3_value_bytes(val));
+}
+
+// Width (bytes per hash) of a sketch blob, 0 if the value is not a blob
+static int kmh_blob_width(sqlite3_value *val) {
+    if (sqlite3_value_type(val) != SQLITE_BLOB) {
+        return 0;
+    }
+    return (int)kmh_serialized_width(sqlite3_value_blob(val), sqlite3_value_bytes(val));
+}
+
+// 64-bit counterparts of kmh_from_blob / kmh_to_blob
+static kvalue_minhash64_t* kmh64_from_blob(sqlite3_value *val) {
+    if (sqlite3_value_type(val) != SQLITE_BLOB) {
+        return NULL;
+    }
+    return kmh64_deserialize(sqlite3_value_blob(val), sqlite3_value_bytes(val));
+}
+
+static void kmh64_to_blob(sqlite3_context *context, kvalue_minhash64_t *kmh) {
+    uint32_t size = kmh64_serialized_size(kmh);
+    uint8_t *buf = sqlite3_malloc64(size);
+    if (!buf) {
         sqlite3_result_error_nomem(context);
         return;
     }
     
-    // Add all values
-    for (int i = 0; i < argc; i++) {
-        if (sqlite3_value_type(argv[i]) == SQLITE_INTEGER) {
-            uint32_t value = (uint32_t)sqlite3_value_int64(argv[i]);
-            kmh_add(kmh, value);
+    kmh64_serialize_into(kmh, buf, size);
+    sqlite3_result_blob(context, buf, size, sqlite3_free);
+}
+
+// Hash a SQL value without copying it. Integers in [0, 2^32) keep the
+// xxh32_hash mapping used so far, so existing sketches stay valid; other
+// integers hash their 8 little-endian bytes instead of being truncated, and
+// TEXT/BLOB are hashed straight from sqlite3_value memory.
+// Returns 0 for values that are ignored (NULL, REAL).
+static int kmh_value_hash32(sqlite3_value *val, uint32_t seed, uint32_t *hash) {
+    switch (sqlite3_value_type(val)) {
+    case SQLITE_INTEGER: {
+        sqlite3_int64 v = sqlite3_value_int64(val);
+        if (v >= 0 && v <= (sqlite3_int64)UINT32_MAX) {
+            *hash = xxh32_hash((uint32_t)v, seed);
+        } else {
+            uint8_t le[8];
+            kmh_store_le64(le, (uint64_t)v);
+            *hash = xxh32_bytes(le, sizeof(le), seed);
         }
-        // Gracefully ignore NULL and non-integer values
+        return 1;
+    }
+    case SQLITE_TEXT: {
+        const unsigned char *text = sqlite3_value_text(val);
+        if (!text) return 0;
+        *hash = xxh32_bytes(text, sqlite3_value_bytes(val), seed);
+        return 1;
+    }
+    case SQLITE_BLOB: {
+        const void *blob = sqlite3_value_blob(val);
+        *hash = xxh32_bytes(blob ? blob : "", sqlite3_value_bytes(val), seed);
+        return 1;
+    }
+    default:
+        return 0;
     }
-    
-    kmh_to_blob(context, kmh);
-    kmh_free(kmh);
 }
 
-// kmh_add(kmh_blob, value)
-static void kmh_add_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (argc != 2) {
-        sqlite3_result_error(context, "kmh_add requires exactly 2 arguments", -1);
-        return;
+static int kmh_value_hash64(sqlite3_value *val, uint64_t seed, uint64_t *hash) {
+    switch (sqlite3_value_type(val)) {
+    case SQLITE_INTEGER:
+        *hash = xxh3_hash64((uint64_t)sqlite3_value_int64(val), seed);
+        return 1;
+    case SQLITE_TEXT: {
+        const unsigned char *text = sqlite3_value_text(val);
+        if (!text) return 0;
+        *hash = xxh64_bytes(text, sqlite3_value_bytes(val), seed);
+        return 1;
+    }
+    case SQLITE_BLOB: {
+        const void *blob = sqlite3_value_blob(val);
+        *hash = xxh64_bytes(blob ? blob : "", sqlite3_value_bytes(val), seed);
+        return 1;
+    }
+    default:
+        return 0;
+    }
+}
+
+// The counts go to stats, which the calling function flushes once
+static void kmh_add_value(kvalue_minhash_t *kmh, sqlite3_value *val, kmh_stats_local_t *stats) {
+    uint32_t hash;
+    if (kmh_value_hash32(val, kmh->seed, &hash)) {
+        kmh_insert_hash_counted(kmh, kmh_reduce(hash, kmh->space_size, kmh->reduce_mode, kmh->reduce_m), stats);
+    }
+}
+
+static void kmh_blocked_add_value(kmh_blocked_t *s, sqlite3_value *val, kmh_stats_local_t *stats) {
+    uint32_t hash;
+    if (kmh_value_hash32(val, s->seed, &hash)) {
+        kmh_blocked_insert_hash_counted(s, kmh_reduce(hash, s->space_size, s->reduce_mode, s->reduce_m), stats);
+    }
+}
+
+static void kmh64_add_value(kvalue_minhash64_t *kmh, sqlite3_value *val, kmh_stats_local_t *stats) {
+    uint64_t hash;
+    if (kmh_value_hash64(val, kmh->seed, &hash)) {
+        kmh64_insert_hash_counted(kmh, kmh64_reduce(hash, kmh->space_size, kmh->reduce_mode), stats);
     }
+}
+
+// kmh_debug_stats() -> '{"enabled": 1, "adds": 123, ...}', the process-wide
+// hot-path counters from kmh_stats_snapshot(). All zero (and "enabled": 0)
+// unless the extension was built with -DKMH_STATS.
+static void kmh_debug_stats_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    (void)argv;
+    kmh_stats_t stats;
+    kmh_stats_snapshot(&stats);
     
-    kvalue_minhash_t *kmh = kmh_from_blob(argv[0]);
-    if (!kmh) {
-        sqlite3_result_null(context);
-        return;
+    char json[64 + KMH_STAT_COUNT * 48];
+    int len = snprintf(json, sizeof(json), "{\"enabled\": %d", stats.enabled);
+    for (int i = 0; i < KMH_STAT_COUNT; i++) {
+        len += snprintf(json + len, sizeof(json) - len, ", \"%s\": %llu", kmh_stat_names[i],
+                        (unsigned long long)stats.counters[i]);
+    }
+    snprintf(json + len, sizeof(json) - len, "}");
+    sqlite3_result_text(context, json, -1, SQLITE_TRANSIENT);
+}
+
+// Per-connection defaults for k, seed and space_size, changed with
+// kmh_config() and handed to the functions that build sketches as their
+// sqlite3_user_data
+typedef struct {
+    uint32_t k;
+    uint32_t space_size;
+    uint32_t seed;
+} kmh_config_t;
+
+// Connections with the extension loaded; the last one to close hands the
+// cached blocks back to SQLite, so none are left when it is unloaded
+static atomic_uint kmh_connections;
+
+static void kmh_config_free(void *config) {
+    sqlite3_free(config);
+    if (atomic_fetch_sub_explicit(&kmh_connections, 1, memory_order_acq_rel) == 1) {
+        kmh_cache_stripes_flush();
+    }
+}
+
+// Largest k of a flat sketch blob (what kmh_blob_parse reads back without
+// a block directory), and so of the connection default. kmh_create_k and
+// kmh_group_create take k up to KMH_HUGE_MAX_K and build sketches past
+// KMH_SQL_MAX_K as kmh_blocked_t, stored as blocked blobs.
+#define KMH_SQL_MAX_K (MAX_K * 10)
+
+// Explicit (k [, seed]) arguments of kmh_create_k and kmh_group_create
+typedef struct {
+    uint32_t k;
+    uint32_t seed;
+    sqlite3_int64 seed_arg; // seed as passed, to check the cache against
+    int has_seed;
+} kmh_params_t;
+
+static int kmh_arg_uint32(sqlite3_value *val, sqlite3_int64 lo, sqlite3_int64 hi, uint32_t *out) {
+    if (sqlite3_value_numeric_type(val) != SQLITE_INTEGER) return 0;
+    sqlite3_int64 v = sqlite3_value_int64(val);
+    if (v < lo || v > hi) return 0;
+    *out = (uint32_t)v;
+    return 1;
+}
+
+// Parses argv[pos] as k and, if has_seed, argv[pos + 1] as the seed into
+// *out. Both are nearly always literals, so the result is cached as auxdata
+// on the k argument and later rows only compare the seed. Returns 0 with
+// the error set if either is invalid.
+static int kmh_params_get(sqlite3_context *context, sqlite3_value **argv, int pos, int has_seed, const char *name,
+                          kmh_params_t *out) {
+    const kmh_params_t *cached = sqlite3_get_auxdata(context, pos);
+    if (cached && cached->has_seed == has_seed &&
+        (!has_seed || sqlite3_value_int64(argv[pos + 1]) == cached->seed_arg)) {
+        *out = *cached;
+        return 1;
     }
     
-    // Add the value if it's an integer
-    if (sqlite3_value_type(argv[1]) == SQLITE_INTEGER) {
-        uint32_t value = (uint32_t)sqlite3_value_int64(argv[1]);
-        kmh_add(kmh, value);
+    memset(out, 0, sizeof(*out));
+    out->has_seed = has_seed;
+    if (!kmh_arg_uint32(argv[pos], 1, KMH_HUGE_MAX_K, &out->k)) {
+        char *err = sqlite3_mprintf("%s: k must be an integer between 1 and %u", name, KMH_HUGE_MAX_K);
+        sqlite3_result_error(context, err ? err : name, -1);
+        sqlite3_free(err);
+        return 0;
+    }
+    if (has_seed) {
+        if (!kmh_arg_uint32(argv[pos + 1], 0, UINT32_MAX, &out->seed)) {
+            char *err = sqlite3_mprintf("%s: seed must be an integer between 0 and %u", name, UINT32_MAX);
+            sqlite3_result_error(context, err ? err : name, -1);
+            sqlite3_free(err);
+            return 0;
+        }
+        out->seed_arg = sqlite3_value_int64(argv[pos + 1]);
     }
     
-    kmh_to_blob(context, kmh);
-    kmh_free(kmh);
+    // Caching is best effort: without it the next row parses again
+    kmh_params_t *keep = sqlite3_malloc(sizeof(kmh_params_t));
+    if (keep) {
+        *keep = *out;
+        sqlite3_set_auxdata(context, pos, keep, sqlite3_free);
+    }
+    return 1;
 }
 
-// kmh_merge(kmh1, kmh2)
-static void kmh_merge_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (argc != 2) {
-        sqlite3_result_error(context, "kmh_merge requires exactly 2 arguments", -1);
+// kmh_config() -> 'k=400 seed=42 space_size=4294967295'
+// kmh_config(name) -> the connection's default for name
+// kmh_config(name, value) -> sets it and returns the new value
+// Names are 'k', 'seed' and 'space_size'; the defaults apply to sketches
+// created afterwards with kmh_create, kmh_group_create, etc.
+static void kmh_config_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    kmh_config_t *config = sqlite3_user_data(context);
+    
+    if (argc == 0) {
+        char *summary = sqlite3_mprintf("k=%u seed=%u space_size=%u", config->k, config->seed, config->space_size);
+        if (!summary) {
+            sqlite3_result_error_nomem(context);
+            return;
+        }
+        sqlite3_result_text(context, summary, -1, sqlite3_free);
         return;
     }
     
-    kvalue_minhash_t *kmh1 = kmh_from_blob(argv[0]);
-    kvalue_minhash_t *kmh2 = kmh_from_blob(argv[1]);
-    
-    if (!kmh1 || !kmh2) {
-        if (kmh1) kmh_free(kmh1);
-        if (kmh2) kmh_free(kmh2);
-        sqlite3_result_null(context);
+    if (argc > 2) {
+        sqlite3_result_error(context, "kmh_config takes at most a name and a value", -1);
         return;
     }
     
-    kvalue_minhash_t *result = kmh_merge(kmh1, kmh2);
-    
-    kmh_free(kmh1);
-    kmh_free(kmh2);
-    
-    if (result) {
-        kmh_to_blob(context, result);
-        kmh_free(result);
+    const char *name = (const char *)sqlite3_value_text(argv[0]);
+    uint32_t *field = NULL;
+    sqlite3_int64 lo = 1, hi = UINT32_MAX;
+    if (name && sqlite3_stricmp(name, "k") == 0) {
+        field = &config->k;
+        hi = KMH_SQL_MAX_K;
+    } else if (name && sqlite3_stricmp(name, "seed") == 0) {
+        field = &config->seed;
+        lo = 0;
+    } else if (name && sqlite3_stricmp(name, "space_size") == 0) {
+        field = &config->space_size;
     } else {
-        sqlite3_result_null(context);
+        sqlite3_result_error(context, "kmh_config: name must be 'k', 'seed' or 'space_size'", -1);
+        return;
+    }
+    
+    if (argc == 2) {
+        if (!kmh_arg_uint32(argv[1], lo, hi, field)) {
+            char *err = sqlite3_mprintf("kmh_config: %s must be an integer between %lld and %lld", name, lo, hi);
+            sqlite3_result_error(context, err ? err : "kmh_config: value out of range", -1);
+            sqlite3_free(err);
+            return;
+        }
     }
+    sqlite3_result_int64(context, *field);
 }
 
-// kmh_cardinality(kmh)
-static void kmh_cardinality_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (argc != 1) {
-        sqlite3_result_error(context, "kmh_cardinality requires exactly 1 argument", -1);
+static void kmh_create_sketch(sqlite3_context *context, uint32_t k, uint32_t space_size, uint32_t seed,
+                              sqlite3_value **argv, int argc) {
+    if (k > KMH_SQL_MAX_K) {
+        kmh_blocked_t *s = kmh_blocked_init(k, space_size, seed);
+        if (!s) {
+            sqlite3_result_error_nomem(context);
+            return;
+        }
+        KMH_LOCAL_STATS(local);
+        for (int i = 0; i < argc; i++) kmh_blocked_add_value(s, argv[i], &local);
+        KMH_LOCAL_FLUSH(local);
+        kmh_blocked_to_blob(context, s);
+        kmh_blocked_free(s);
         return;
     }
     
-    kvalue_minhash_t *kmh = kmh_from_blob(argv[0]);
+    kvalue_minhash_t *kmh = kmh_init(k, space_size, seed);
     if (!kmh) {
-        sqlite3_result_null(context);
+        sqlite3_result_error_nomem(context);
         return;
     }
     
-    double cardinality = kmh_cardinality(kmh);
-    sqlite3_result_double(context, cardinality);
+    // Add all values
+    KMH_LOCAL_STATS(local);
+    for (int i = 0; i < argc; i++) {
+        // Gracefully ignores NULL and REAL values
+        kmh_add_value(kmh, argv[i], &local);
+    }
+    KMH_LOCAL_FLUSH(local);
     
+    kmh_to_blob(context, kmh);
     kmh_free(kmh);
 }
 
-// kmh_merge_cardinality(kmh1, kmh2)
-static void kmh_merge_cardinality_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (argc != 2) {
-        sqlite3_result_error(context, "kmh_merge_cardinality requires exactly 2 arguments", -1);
+// kmh_create(value1, value2, ..., valueN)
+static void kmh_create_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc == 0) {
+        sqlite3_result_null(context);
+        return;
+    }
+    
+    const kmh_config_t *config = sqlite3_user_data(context);
+    kmh_create_sketch(context, config->k, config->space_size, config->seed, argv, argc);
+}
+
+// kmh_create_k(k, value1, ..., valueN): kmh_create with an explicit k
+static void kmh_create_k_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc == 0) {
+        sqlite3_result_error(context, "kmh_create_k requires k", -1);
         return;
     }
     
-    kvalue_minhash_t *kmh1 = kmh_from_blob(argv[0]);
-    kvalue_minhash_t *kmh2 = kmh_from_blob(argv[1]);
+    kmh_params_t params;
+    if (!kmh_params_get(context, argv, 0, 0, "kmh_create_k", &params)) return;
+    if (argc == 1) {
+        sqlite3_result_null(context);
+        return;
+    }
     
-    if (!kmh1 || !kmh2) {
-        if (kmh1) kmh_free(kmh1);
-        if (kmh2) kmh_free(kmh2);
+    const kmh_config_t *config = sqlite3_user_data(context);
+    kmh_create_sketch(context, params.k, config->space_size, config->seed, argv + 1, argc - 1);
+}
+
+// kmh_create64(value1, value2, ..., valueN)
+static void kmh_create64_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc == 0) {
         sqlite3_result_null(context);
         return;
     }
     
-    kvalue_minhash_t *result = kmh_merge(kmh1, kmh2);
+    const kmh_config_t *config = sqlite3_user_data(context);
+    kvalue_minhash64_t *kmh = kmh64_init(config->k, DEFAULT_SPACE_SIZE64, config->seed);
+    if (!kmh) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
     
-    kmh_free(kmh1);
-    kmh_free(kmh2);
+    KMH_LOCAL_STATS(local);
+    for (int i = 0; i < argc; i++) {
+        kmh64_add_value(kmh, argv[i], &local);
+    }
+    KMH_LOCAL_FLUSH(local);
     
-    if (result) {
-        double cardinality = kmh_cardinality(result);
-        sqlite3_result_double(context, cardinality);
-        kmh_free(result);
-    } else {
-        sqlite3_result_null(context);
+    kmh64_to_blob(context, kmh);
+    kmh64_free(kmh);
+}
+
+#define KMH_ADD_STACK 64 // new hashes of at most this many values live on the stack
+
+static int kmh_add_hash_desc(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x < y) - (x > y);
+}
+
+static inline uint64_t kmh_raw_hash(const uint8_t *hashes, uint32_t width, uint32_t i) {
+    return width == sizeof(uint32_t) ? kmh_load_le32(hashes + (size_t)i * width)
+                                     : kmh_load_le64(hashes + (size_t)i * width);
+}
+
+// kmh_search over a blob's little-endian hashes
+static inline uint32_t kmh_raw_search(const uint8_t *hashes, uint32_t width, uint32_t n, uint64_t hash) {
+    uint32_t base = 0;
+    if (n == 0) return 0;
+    while (n > 1) {
+        uint32_t half = n >> 1;
+        base = kmh_raw_hash(hashes, width, base + half - 1) > hash ? base + half : base;
+        n -= half;
     }
+    return base + (kmh_raw_hash(hashes, width, base) > hash);
 }
 
-// Aggregate function context
-typedef struct {
-    kvalue_minhash_t *kmh;
-} kmh_agg_context;
+// A block directory kmh_add_raw can splice around: starts from 0 up,
+// strictly increasing and inside hashes[], each at its block's first hash
+static int kmh_raw_dir_valid(const kmh_view_t *v) {
+    if (v->nblocks == 0) return v->count == 0;
+    for (uint32_t b = 0; b < v->nblocks; b++) {
+        const uint8_t *entry = v->dir + (size_t)b * KMH_DIR_ENTRY_SIZE;
+        uint32_t start = kmh_load_le32(entry + 4);
+        if (b == 0 ? start != 0 : start <= kmh_load_le32(entry - KMH_DIR_ENTRY_SIZE + 4)) return 0;
+        if (start >= v->count || kmh_view_hash(v, start) != kmh_load_le32(entry)) return 0;
+    }
+    return 1;
+}
 
-// kmh_group_create aggregate
-static void kmh_group_create_step(sqlite3_context *context, int argc, sqlite3_value **argv) {
-    kmh_agg_context *agg_ctx = sqlite3_aggregate_context(context, sizeof(kmh_agg_context));
-    
-    if (!agg_ctx) {
-        sqlite3_result_error_nomem(context);
-        return;
+// Start of block b of a view, count past the last one
+static inline uint32_t kmh_raw_block_start(const kmh_view_t *v, uint32_t b) {
+    return b < v->nblocks ? kmh_load_le32(v->dir + (size_t)b * KMH_DIR_ENTRY_SIZE + 4) : v->count;
+}
+
+// Directory of a blocked blob after kmh_add_raw splices the nnew hashes in
+// at slots at[] and drops the skip largest. A new hash joins the block its
+// slot falls in (first in the block if the slot is the block's start),
+// emptied top blocks go, and a block grown past KMH_LEAF_HASHES is cut into
+// equal parts, as kmh_blocked_t splits full leaves; the other entries only
+// have their starts shifted. Writes the entries to dir, reading first
+// hashes from the spliced hashes out, unless dir is NULL; returns their
+// number either way.
+static uint32_t kmh_raw_splice_dir(const kmh_view_t *v, const uint32_t *at, uint32_t nnew, uint32_t skip,
+                                   const uint8_t *out, uint8_t *dir) {
+    uint32_t nblocks = v->nblocks ? v->nblocks : 1, entries = 0, end = 0, f = 0;
+    for (uint32_t b = 0; b < nblocks; b++) {
+        uint32_t next = kmh_raw_block_start(v, b + 1), grown = next - kmh_raw_block_start(v, b);
+        for (; f < nnew && (at[f] < next || b + 1 == nblocks); f++) grown++;
+        
+        // The block spans [start, end) of the spliced hashes before the drop
+        uint32_t start = end;
+        end += grown;
+        if (end <= skip) continue;
+        if (start < skip) start = skip;
+        uint32_t n = end - start, parts = (n + KMH_LEAF_HASHES - 1) / KMH_LEAF_HASHES;
+        for (uint32_t p = 0; p < parts; p++, entries++) {
+            if (!dir) continue;
+            uint32_t first = start - skip + (uint32_t)((uint64_t)n * p / parts);
+            uint8_t *entry = dir + (size_t)entries * KMH_DIR_ENTRY_SIZE;
+            memcpy(entry, out + (size_t)first * sizeof(uint32_t), sizeof(uint32_t));
+            kmh_store_le32(entry + 4, first);
+        }
+    }
+    return entries;
+}
+
+// kmh_add fast path for portable raw blobs of either width. The values are
+// hashed and looked up in the blob in place: if none can enter the sketch
+// (at or above a full sketch's hashes[0], or already present), the result is
+// the input, copied once; otherwise the blob's hashes are spliced around the
+// new ones, as runs of memcpy, into one sqlite3_malloc buffer that SQLite
+// takes over. Blocked blobs are looked up through their directory, which is
+// rewritten after the hashes (see kmh_raw_splice_dir) instead of the sketch
+// being rebuilt as a kmh_blocked_t. Returns 0 for blobs it leaves to the
+// decoding path (legacy, compressed, malformed, or a directory it can't
+// splice around).
+static int kmh_add_raw(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    const uint8_t *blob = sqlite3_value_blob(argv[0]);
+    int blob_size = sqlite3_value_bytes(argv[0]);
+    kmh_blob_info_t info;
+    if (!kmh_blob_parse(&info, blob, blob_size) || info.data_offset != KMH_BLOB_HEADER_SIZE ||
+        info.encoding != KMH_ENCODING_RAW || info.k == 0 ||
+        (info.width != sizeof(uint32_t) && info.width != sizeof(uint64_t)) ||
+        (info.width == sizeof(uint32_t) && (info.space_size > UINT32_MAX || info.seed > UINT32_MAX)) ||
+        (uint64_t)blob_size < KMH_BLOB_HEADER_SIZE + (uint64_t)info.count * info.width) {
+        return 0;
     }
+    kmh_view_t view;
+    int blocked = info.flags & KMH_FLAG_BLOCKS;
+    if (blocked && (!kmh_view_init(&view, blob, blob_size) || !kmh_raw_dir_valid(&view))) return 0;
     
-    // Initialize on first call
-    if (!agg_ctx->kmh) {
-        agg_ctx->kmh = kmh_init(DEFAULT_K, DEFAULT_SPACE_SIZE, DEFAULT_SEED);
-        if (!agg_ctx->kmh) {
+    const uint8_t *hashes = blob + KMH_BLOB_HEADER_SIZE;
+    uint32_t width = info.width, count = info.count;
+    uint64_t limit = count == info.k ? kmh_raw_hash(hashes, width, 0) : UINT64_MAX;
+    
+    // fresh: candidate hashes; at: their slots in the blob
+    uint64_t fresh_stack[KMH_ADD_STACK], *fresh = fresh_stack;
+    uint32_t at_stack[KMH_ADD_STACK], *at = at_stack;
+    uint32_t nvalues = (uint32_t)argc - 1, nfresh = 0;
+    void *heap = NULL;
+    if (nvalues > KMH_ADD_STACK) {
+        heap = sqlite3_malloc64((uint64_t)nvalues * (sizeof(uint64_t) + sizeof(uint32_t)));
+        if (!heap) {
             sqlite3_result_error_nomem(context);
-            return;
+            return 1;
         }
+        fresh = heap;
+        at = (uint32_t *)(fresh + nvalues);
     }
+    if (width == sizeof(uint32_t)) {
+        uint32_t space_size = (uint32_t)info.space_size;
+        int mode = kmh_reduce_mode(space_size);
+        uint64_t m = mode == KMH_REDUCE_MOD ? kmh_fastmod_m(space_size) : 0;
+        for (uint32_t v = 0; v < nvalues; v++) {
+            uint32_t hash;
+            if (!kmh_value_hash32(argv[v + 1], (uint32_t)info.seed, &hash)) continue;
+            hash = kmh_reduce(hash, space_size, mode, m);
+            if (hash < limit) fresh[nfresh++] = hash;
+        }
+    } else {
+        int mode = kmh64_reduce_mode(info.space_size);
+        for (uint32_t v = 0; v < nvalues; v++) {
+            uint64_t hash;
+            if (!kmh_value_hash64(argv[v + 1], info.seed, &hash)) continue;
+            hash = kmh64_reduce(hash, info.space_size, mode);
+            if (hash < limit) fresh[nfresh++] = hash;
+        }
+    }
+    if (nfresh > 1) qsort(fresh, nfresh, sizeof(uint64_t), kmh_add_hash_desc);
     
-    // Add value if it's an integer
-    if (argc > 0 && sqlite3_value_type(argv[0]) == SQLITE_INTEGER) {
-        uint32_t value = (uint32_t)sqlite3_value_int64(argv[0]);
-        kmh_add(agg_ctx->kmh, value);
+    // Keep the distinct hashes the blob doesn't have, with their slots
+    uint32_t nnew = 0;
+    for (uint32_t f = 0; f < nfresh; f++) {
+        uint64_t hash = fresh[f];
+        if (nnew > 0 && hash == fresh[nnew - 1]) continue;
+        uint32_t pos = blocked ? kmh_view_search(&view, (uint32_t)hash) : kmh_raw_search(hashes, width, count, hash);
+        if (pos < count && kmh_raw_hash(hashes, width, pos) == hash) continue;
+        fresh[nnew] = hash;
+        at[nnew++] = pos;
     }
-}
-
-static void kmh_group_create_final(sqlite3_context *context) {
-    kmh_agg_context *agg_ctx = sqlite3_aggregate_context(context, 0);
     
-    if (!agg_ctx || !agg_ctx->kmh) {
-        sqlite3_result_null(context);
-        return;
+    if (nnew == 0) {
+        // sqlite3_result_value measured slower than this single copy
+        sqlite3_free(heap);
+        sqlite3_result_blob(context, blob, blob_size, SQLITE_TRANSIENT);
+        return 1;
     }
     
-    kmh_to_blob(context, agg_ctx->kmh);
-    kmh_free(agg_ctx->kmh);
+    uint32_t total = count + nnew, n = total < info.k ? total : info.k;
+    uint32_t ndir = blocked ? kmh_raw_splice_dir(&view, at, nnew, total - n, NULL, NULL) : 0;
+    uint64_t out_size = KMH_BLOB_HEADER_SIZE + (uint64_t)n * width +
+                        (blocked ? sizeof(uint32_t) + (uint64_t)ndir * KMH_DIR_ENTRY_SIZE : 0);
+    uint8_t *out = sqlite3_malloc64(out_size);
+    if (!out) {
+        sqlite3_free(heap);
+        sqlite3_result_error_nomem(context);
+        return 1;
+    }
+    memcpy(out, blob, KMH_BLOB_HEADER_SIZE);
+    kmh_store_le32(out + 12, n);
+    
+    // Blob runs and new hashes in descending order, less the total - n
+    // largest once the sketch overflows
+    uint8_t *dst = out + KMH_BLOB_HEADER_SIZE;
+    uint32_t skip = total - n, prev = 0;
+    for (uint32_t f = 0; f <= nnew; f++) {
+        uint32_t pos = f < nnew ? at[f] : count, run = pos - prev, cut = skip < run ? skip : run;
+        skip -= cut;
+        memcpy(dst, hashes + (size_t)(prev + cut) * width, (size_t)(run - cut) * width);
+        dst += (size_t)(run - cut) * width;
+        prev = pos;
+        if (f == nnew) break;
+        if (skip > 0) {
+            skip--;
+        } else if (width == sizeof(uint32_t)) {
+            kmh_store_le32(dst, (uint32_t)fresh[f]);
+            dst += width;
+        } else {
+            kmh_store_le64(dst, fresh[f]);
+            dst += width;
+        }
+    }
+    if (blocked) {
+        kmh_store_le32(dst, ndir);
+        kmh_raw_splice_dir(&view, at, nnew, total - n, out + KMH_BLOB_HEADER_SIZE, dst + sizeof(uint32_t));
+    }
+    sqlite3_free(heap);
+    sqlite3_result_blob(context, out, (int)out_size, sqlite3_free);
+    return 1;
 }
 
-// kmh_group_merge aggregate
-static void kmh_group_merge_step(sqlite3_context *context, int argc, sqlite3_value **argv) {
-    kmh_agg_context *agg_ctx = sqlite3_aggregate_context(context, sizeof(kmh_agg_context));
+// kmh_add(kmh_blob, value1, ..., valueN)
+static void kmh_add_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc < 2) {
+        sqlite3_result_error(context, "kmh_add requires a sketch and at least one value", -1);
+        return;
+    }
     
-    if (!agg_ctx) {
-        sqlite3_result_error_nomem(context);
+    if (sqlite3_value_type(argv[0]) == SQLITE_BLOB && kmh_add_raw(context, argc, argv)) return;
+    
+    // Blocked blobs kmh_add_raw couldn't splice: rebuilt, at O(K) per call
+    if (kmh_blob_is_blocked(argv[0])) {
+        kmh_blocked_t *s = kmh_blocked_deserialize(sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]));
+        if (!s) {
+            sqlite3_result_null(context);
+            return;
+        }
+        KMH_LOCAL_STATS(local);
+        for (int i = 1; i < argc; i++) kmh_blocked_add_value(s, argv[i], &local);
+        KMH_LOCAL_FLUSH(local);
+        kmh_blocked_to_blob(context, s);
+        kmh_blocked_free(s);
         return;
     }
     
-    if (argc > 0 && sqlite3_value_type(argv[0]) == SQLITE_BLOB) {
-        kvalue_minhash_t *input_kmh = kmh_from_blob(argv[0]);
-        if (input_kmh) {
-            if (!agg_ctx->kmh) {
-                // First MinHash becomes the base
-                agg_ctx->kmh = input_kmh;
-            } else {
-                // Merge with existing
-                kvalue_minhash_t *merged = kmh_merge(agg_ctx->kmh, input_kmh);
-                kmh_free(agg_ctx->kmh);
-                kmh_free(input_kmh);
-                agg_ctx->kmh = merged;
-            }
+    if (kmh_blob_width(argv[0]) == sizeof(uint64_t)) {
+        kvalue_minhash64_t *kmh64 = kmh64_from_blob(argv[0]);
+        if (!kmh64) {
+            sqlite3_result_null(context);
+            return;
         }
+        KMH_LOCAL_STATS(local);
+        for (int i = 1; i < argc; i++) kmh64_add_value(kmh64, argv[i], &local);
+        KMH_LOCAL_FLUSH(local);
+        kmh64_to_blob(context, kmh64);
+        kmh64_free(kmh64);
+        return;
     }
-}
-
-static void kmh_group_merge_final(sqlite3_context *context) {
-    kmh_agg_context *agg_ctx = sqlite3_aggregate_context(context, 0);
     
-    if (!agg_ctx || !agg_ctx->kmh) {
+    kvalue_minhash_t *kmh = kmh_from_blob(argv[0]);
+    if (!kmh) {
         sqlite3_result_null(context);
         return;
     }
     
-    kmh_to_blob(context, agg_ctx->kmh);
-    kmh_free(agg_ctx->kmh);
+    KMH_LOCAL_STATS(local);
+    for (int i = 1; i < argc; i++) kmh_add_value(kmh, argv[i], &local);
+    KMH_LOCAL_FLUSH(local);
+    
+    // Stored sketches keep the encoding they were written with
+    kmh_to_blob_encoded(context, kmh, kmh_blob_encoding(argv[0]));
+    kmh_free(kmh);
 }
 
-// kmh_group_merge_cardinality aggregate
-static void kmh_group_merge_cardinality_final(sqlite3_context *context) {
-    kmh_agg_context *agg_ctx = sqlite3_aggregate_context(context, 0);
+// kmh_compress(kmh[, encoding]): re-encode a 32-bit sketch as 'bitpack'
+// (default), 'varint' or 'raw'. 64-bit sketches are returned unchanged.
+static void kmh_compress_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc < 1 || argc > 2) {
+        sqlite3_result_error(context, "kmh_compress requires 1 or 2 arguments", -1);
+        return;
+    }
     
-    if (!agg_ctx || !agg_ctx->kmh) {
+    uint8_t encoding = KMH_ENCODING_BITPACK;
+    if (argc == 2) {
+        const char *name = (const char *)sqlite3_value_text(argv[1]);
+        if (name && sqlite3_stricmp(name, "bitpack") == 0) {
+            encoding = KMH_ENCODING_BITPACK;
+        } else if (name && sqlite3_stricmp(name, "varint") == 0) {
+            encoding = KMH_ENCODING_VARINT;
+        } else if (name && sqlite3_stricmp(name, "raw") == 0) {
+            encoding = KMH_ENCODING_RAW;
+        } else {
+            sqlite3_result_error(context, "kmh_compress encoding must be 'bitpack', 'varint' or 'raw'", -1);
+            return;
+        }
+    }
+    
+    // Block directories only follow raw hashes
+    if (kmh_blob_width(argv[0]) == sizeof(uint64_t) || kmh_blob_is_blocked(argv[0])) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    
+    kvalue_minhash_t *kmh = kmh_from_blob(argv[0]);
+    if (!kmh) {
         sqlite3_result_null(context);
         return;
     }
     
-    double cardinality = kmh_cardinality(agg_ctx->kmh);
-    sqlite3_result_double(context, cardinality);
+    kmh_to_blob_encoded(context, kmh, encoding);
+    kmh_free(kmh);
+}
+
+// kmh_merge(kmh1, kmh2)
+static void kmh_merge_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc != 2) {
+        sqlite3_result_error(context, "kmh_merge requires exactly 2 arguments", -1);
+        return;
+    }
+    
+    int width = kmh_blob_width(argv[0]);
+    if (width != kmh_blob_width(argv[1])) {
+        sqlite3_result_null(context);
+        return;
+    }
+    
+    if (width == sizeof(uint64_t)) {
+        kmh64_view_t a, b;
+        kvalue_minhash64_t *merged = NULL;
+        if (kmh64_view_from_blob(argv[0], &a) && kmh64_view_from_blob(argv[1], &b)) {
+            merged = kmh64_view_merge(&a, &b);
+        }
+        if (merged) {
+            kmh64_to_blob(context, merged);
+            kmh64_free(merged);
+        } else {
+            sqlite3_result_null(context);
+        }
+        return;
+    }
+    
+    if (kmh_blob_is_blocked(argv[0]) || kmh_blob_is_blocked(argv[1])) {
+        kmh_blocked_t *a = kmh_blocked_deserialize(sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]));
+        kmh_blocked_t *b = kmh_blocked_deserialize(sqlite3_value_blob(argv[1]), sqlite3_value_bytes(argv[1]));
+        kmh_blocked_t *merged = a && b ? kmh_blocked_merge(a, b) : NULL;
+        if (merged) {
+            kmh_blocked_to_blob(context, merged);
+        } else {
+            sqlite3_result_null(context);
+        }
+        kmh_blocked_free(a); kmh_blocked_free(b); kmh_blocked_free(merged);
+        return;
+    }
+    
+    kmh_view_t a, b;
+    if (!kmh_view_from_blob(context, argv, 0, &a) || !kmh_view_from_blob(context, argv, 1, &b)) {
+        sqlite3_result_null(context);
+        return;
+    }
+    
+    kvalue_minhash_t *result = kmh_view_merge(&a, &b);
+    
+    if (result) {
+        kmh_to_blob(context, result);
+        kmh_free(result);
+    } else {
+        sqlite3_result_null(context);
+    }
+}
+
+// kmh_cardinality(kmh)
+static void kmh_cardinality_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc != 1) {
+        sqlite3_result_error(context, "kmh_cardinality requires exactly 1 argument", -1);
+        return;
+    }
+    
+    if (kmh_blob_width(argv[0]) == sizeof(uint64_t)) {
+        kmh64_view_t view64;
+        if (kmh64_view_from_blob(argv[0], &view64)) {
+            sqlite3_result_double(context, kmh64_view_cardinality(&view64));
+        } else {
+            sqlite3_result_null(context);
+        }
+        return;
+    }
+    
+    // Reads hashes[0] only, so compressed blobs aren't decoded
+    double cardinality = -1.0;
+    if (sqlite3_value_type(argv[0]) == SQLITE_BLOB) {
+        cardinality = kmh_cardinality_from_serialized(sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]));
+    }
+    
+    if (cardinality < 0) {
+        sqlite3_result_null(context);
+    } else {
+        sqlite3_result_double(context, cardinality);
+    }
+}
+
+// Set-operation estimates over two sketch arguments, read in place with one
+// walk and no merged sketch
+#define KMH_SETOP_UNION        0
+#define KMH_SETOP_INTERSECTION 1
+#define KMH_SETOP_DIFFERENCE   2
+#define KMH_SETOP_CONTAINMENT  3
+
+static void kmh_setop_result(sqlite3_context *context, int argc, sqlite3_value **argv, const char *name,
+                             int op) {
+    if (argc != 2) {
+        char *msg = sqlite3_mprintf("%s requires exactly 2 arguments", name);
+        sqlite3_result_error(context, msg ? msg : name, -1);
+        sqlite3_free(msg);
+        return;
+    }
+    
+    int width = kmh_blob_width(argv[0]);
+    kmh_setop_t s;
+    uint32_t k;
+    double space_size;
+    if (width != kmh_blob_width(argv[1])) {
+        sqlite3_result_null(context); // Mixed widths are never comparable
+        return;
+    } else if (width == sizeof(uint64_t)) {
+        kmh64_view_t a, b;
+        if (!kmh64_view_from_blob(argv[0], &a) || !kmh64_view_from_blob(argv[1], &b) ||
+            !kmh64_view_setop(&a, &b, &s)) {
+            sqlite3_result_null(context);
+            return;
+        }
+        k = a.k;
+        space_size = (double)a.space_size;
+    } else {
+        kmh_view_t a, b;
+        if (!kmh_view_from_blob(context, argv, 0, &a) || !kmh_view_from_blob(context, argv, 1, &b) ||
+            !kmh_view_setop(&a, &b, &s)) {
+            sqlite3_result_null(context);
+            return;
+        }
+        k = a.k;
+        space_size = a.space_size;
+    }
+    
+    switch (op) {
+    case KMH_SETOP_UNION:
+        sqlite3_result_double(context, kmh_setop_union(&s, k, space_size));
+        break;
+    case KMH_SETOP_INTERSECTION:
+        sqlite3_result_double(context, kmh_setop_share(&s, k, space_size, s.both));
+        break;
+    case KMH_SETOP_DIFFERENCE:
+        sqlite3_result_double(context, kmh_setop_share(&s, k, space_size, s.only_a));
+        break;
+    default:
+        sqlite3_result_double(context, kmh_setop_containment(&s));
+        break;
+    }
+}
+
+// kmh_merge_cardinality(kmh1, kmh2): same as kmh_union_cardinality
+static void kmh_merge_cardinality_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    kmh_setop_result(context, argc, argv, "kmh_merge_cardinality", KMH_SETOP_UNION);
+}
+
+// kmh_union_cardinality(kmh1, kmh2)
+static void kmh_union_cardinality_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    kmh_setop_result(context, argc, argv, "kmh_union_cardinality", KMH_SETOP_UNION);
+}
+
+// kmh_intersection_cardinality(kmh1, kmh2)
+static void kmh_intersection_cardinality_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    kmh_setop_result(context, argc, argv, "kmh_intersection_cardinality", KMH_SETOP_INTERSECTION);
+}
+
+// kmh_difference_cardinality(kmh1, kmh2): |kmh1 \ kmh2|
+static void kmh_difference_cardinality_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    kmh_setop_result(context, argc, argv, "kmh_difference_cardinality", KMH_SETOP_DIFFERENCE);
+}
+
+// kmh_containment(kmh1, kmh2): the fraction of kmh1 contained in kmh2
+static void kmh_containment_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    kmh_setop_result(context, argc, argv, "kmh_containment", KMH_SETOP_CONTAINMENT);
+}
+
+// Distance between two sketch arguments, -1 if they aren't comparable
+static double kmh_blob_distance(sqlite3_context *context, sqlite3_value **argv) {
+    int width = kmh_blob_width(argv[0]);
+    double distance = -1.0;
+    if (width != kmh_blob_width(argv[1])) {
+        // Mixed widths are never comparable
+    } else if (width == sizeof(uint64_t)) {
+        kmh64_view_t a, b;
+        if (kmh64_view_from_blob(argv[0], &a) && kmh64_view_from_blob(argv[1], &b)) {
+            distance = kmh64_view_distance(&a, &b);
+        }
+    } else {
+        kmh_view_t a, b;
+        if (kmh_view_from_blob(context, argv, 0, &a) && kmh_view_from_blob(context, argv, 1, &b)) {
+            distance = kmh_view_distance(&a, &b);
+        }
+    }
+    return distance;
+}
+
+// kmh_distance(kmh1, kmh2)
+static void kmh_distance_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc != 2) {
+        sqlite3_result_error(context, "kmh_distance requires exactly 2 arguments", -1);
+        return;
+    }
+    
+    double distance = kmh_blob_distance(context, argv);
+    if (distance < 0) {
+        sqlite3_result_null(context);
+    } else {
+        sqlite3_result_double(context, distance);
+    }
+}
+
+// Result of kmh_similar: whether the similarity (1 - distance) reaches threshold
+static void kmh_similar_result(sqlite3_context *context, sqlite3_value **argv, double threshold) {
+    double distance = kmh_blob_distance(context, argv);
+    if (distance < 0) {
+        sqlite3_result_null(context);
+    } else {
+        sqlite3_result_int(context, 1.0 - distance >= threshold);
+    }
+}
+
+// kmh_similar(kmh1, kmh2[, threshold])
+static void kmh_similar_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc != 2 && argc != 3) {
+        sqlite3_result_error(context, "kmh_similar requires 2 or 3 arguments", -1);
+        return;
+    }
+    
+    kmh_similar_result(context, argv, argc == 3 ? sqlite3_value_double(argv[2]) : DEFAULT_SIMILARITY);
+}
+
+// Rows kmh_group_merge buffers before merging them into the accumulator
+#define KMH_GROUP_MERGE_BATCH 32
+
+// Rows kmh_group_create hashes before handing them to its builder and frame
+#define KMH_GROUP_CREATE_STAGE 64
+
+// Aggregate function context
+typedef struct {
+    kvalue_minhash_t *kmh;
+    kmh_builder_t *builder; // kmh_group_create ingests in build mode
+    kvalue_minhash64_t *kmh64; // 64-bit aggregates (kmh_group_create64, merges of 64-bit blobs)
+    kmh_blocked_t *blocks;     // blocked aggregates (k past KMH_SQL_MAX_K, merges of blocked blobs)
+    kmh_blocked_t *spare;      // kmh_group_merge: the next merge of blocks goes here
+    void *scratch;             // kmh_group_merge: merge scratch, reused across rows
+    sqlite3_uint64 scratch_size;
+    uint32_t *batch;           // kmh_group_merge: hashes of the buffered rows
+    sqlite3_uint64 batch_size;
+    uint32_t batch_count;
+    kvalue_minhash_t pending[KMH_GROUP_MERGE_BATCH]; // buffered rows (count and hashes only)
+    uint32_t stage[KMH_GROUP_CREATE_STAGE]; // kmh_group_create: reduced hashes of the staged rows
+    uint32_t staged;
+    uint32_t threshold;        // kmh_group_create: the builder's largest hash once full
+    kmh_frame_t *frame;        // every row, for window frames (OVER ...); never with blocks
+    uint64_t frame_lead;       // kmh_group_merge: rows before the frame's first 32-bit sketch
+    int framed;                // xInverse was called: results come from the frame
+} kmh_agg_context;
+
+// Aggregate-owned buffer that only grows, so steady-state rows don't allocate
+static void *kmh_agg_buffer(void **buf, sqlite3_uint64 *size, sqlite3_uint64 needed) {
+    if (*size < needed) {
+        void *grown = sqlite3_realloc64(*buf, needed);
+        if (!grown) return NULL;
+        *buf = grown;
+        *size = needed;
+    }
+    return *buf;
+}
+
+static void kmh_agg_free_buffers(kmh_agg_context *agg_ctx) {
+    sqlite3_free(agg_ctx->scratch);
+    sqlite3_free(agg_ctx->batch);
+    kmh_frame_free(agg_ctx->frame);
+    kmh_blocked_free(agg_ctx->spare);
+    agg_ctx->scratch = NULL;
+    agg_ctx->batch = NULL;
+    agg_ctx->frame = NULL;
+    agg_ctx->spare = NULL;
+}
+
+// xValue/xFinal of an aggregate holding a kmh_blocked_t
+static void kmh_blocked_result(sqlite3_context *context, const kmh_blocked_t *s, int cardinality_only) {
+    if (cardinality_only) {
+        sqlite3_result_double(context, kmh_blocked_cardinality(s));
+    } else {
+        kmh_blocked_to_blob(context, s);
+    }
+}
+
+// Feeds the staged rows to the builder, skipping in O(1) the hashes the
+// cached threshold already rules out, and to the frame; 0 on OOM. Blocked
+// aggregates insert straight into their kmh_blocked_t, which rejects hashes
+// above its top leaf just as cheaply, and keep no frame.
+static int kmh_group_create_flush(kmh_agg_context *agg_ctx) {
+    if (agg_ctx->blocks) {
+        KMH_LOCAL_STATS(local);
+        for (uint32_t i = 0; i < agg_ctx->staged; i++) {
+            if (agg_ctx->stage[i] != KMH_SET_EMPTY) {
+                kmh_blocked_insert_hash_counted(agg_ctx->blocks, agg_ctx->stage[i], &local);
+            }
+        }
+        KMH_LOCAL_FLUSH(local);
+        agg_ctx->staged = 0;
+        return 1;
+    }
+    
+    kmh_builder_t *b = agg_ctx->builder;
+    uint32_t threshold = agg_ctx->threshold;
+    KMH_LOCAL_STATS(local);
+    for (uint32_t i = 0; i < agg_ctx->staged; i++) {
+        uint32_t hash = agg_ctx->stage[i];
+        if (hash >= threshold) {
+            // As kmh_builder_insert_hash would count it; ignored values aren't adds
+            KMH_LOCAL_COUNT(&local, KMH_STAT_ADDS, hash != KMH_SET_EMPTY);
+            continue;
+        }
+        if (kmh_builder_insert_hash_counted(b, hash, &local) && b->count == b->k) {
+            threshold = b->heap[0];
+        }
+    }
+    KMH_LOCAL_FLUSH(local);
+    agg_ctx->threshold = threshold;
+    
+    uint32_t n = agg_ctx->staged;
+    agg_ctx->staged = 0;
+    return kmh_frame_push_rows(agg_ctx->frame, agg_ctx->stage, n);
+}
+
+// Window frames: the aggregates below are also window functions, e.g.
+//   SELECT day, kmh_group_merge_cardinality(sig) OVER (ORDER BY day ROWS 6 PRECEDING) FROM daily;
+// Every row also goes into a kmh_frame_t, whose two stacks stand in for the
+// xInverse a KMV sketch can't do, so each row costs amortized O(k) whatever
+// the frame's length. Until the first xInverse the aggregate's own
+// accumulator holds the same rows, and xFinal keeps using it. Blocked
+// aggregates keep no frame: a kmh_frame_t of K ~ 1M sketches would cost
+// several times the accumulator per group, so they only take frames that
+// never shrink.
+static void kmh_frame_result(sqlite3_context *context, kmh_frame_t *frame, int cardinality_only) {
+    if (!frame || frame->rows == 0) {
+        sqlite3_result_null(context);
+    } else if (cardinality_only) {
+        sqlite3_result_double(context, kmh_frame_cardinality(frame));
+    } else {
+        kvalue_minhash_t kmh = *frame->back;
+        kmh.count = kmh_frame_collect(frame);
+        kmh.hashes = frame->scratch + kmh.k - kmh.count;
+        kmh_to_blob(context, &kmh);
+    }
+}
+
+// xInverse for every framed aggregate: the oldest row leaves the frame
+static void kmh_group_inverse(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    kmh_agg_context *agg_ctx = sqlite3_aggregate_context(context, sizeof(kmh_agg_context));
+    (void)argc;
+    (void)argv;
+    
+    if (!agg_ctx) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (agg_ctx->kmh64) {
+        // kmh_frame_t holds 32-bit hashes only; growing frames still work
+        sqlite3_result_error(context, "kmh_group_merge of 64-bit sketches requires frames starting at UNBOUNDED PRECEDING", -1);
+        return;
+    }
+    if (agg_ctx->blocks) {
+        sqlite3_result_error(context, "blocked sketches require frames starting at UNBOUNDED PRECEDING", -1);
+        return;
+    }
+    
+    agg_ctx->framed = 1;
+    if (agg_ctx->staged && !kmh_group_create_flush(agg_ctx)) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (!agg_ctx->frame) {
+        if (agg_ctx->frame_lead) agg_ctx->frame_lead--;
+        return;
+    }
+    if (!kmh_frame_pop(agg_ctx->frame)) {
+        sqlite3_result_error_nomem(context);
+    }
+}
+
+// kmh_group_create(value [, k [, seed]]) aggregate
+static void kmh_group_create_step(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    kmh_agg_context *agg_ctx = sqlite3_aggregate_context(context, sizeof(kmh_agg_context));
+    
+    if (!agg_ctx) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    
+    // Initialize on first call; k and seed are read once per group
+    if (!agg_ctx->builder && !agg_ctx->blocks) {
+        const kmh_config_t *config = sqlite3_user_data(context);
+        kmh_params_t params = {config->k, config->seed, 0, 0};
+        if (argc > 3) {
+            sqlite3_result_error(context, "kmh_group_create takes a value, k and seed", -1);
+            return;
+        }
+        if (argc > 1 && !kmh_params_get(context, argv, 1, argc == 3, "kmh_group_create", &params)) return;
+        if (argc < 3) params.seed = config->seed;
+        
+        if (params.k > KMH_SQL_MAX_K) {
+            agg_ctx->blocks = kmh_blocked_init(params.k, config->space_size, params.seed);
+            if (!agg_ctx->blocks) {
+                sqlite3_result_error_nomem(context);
+                return;
+            }
+        } else {
+            agg_ctx->builder = kmh_builder_init(params.k, config->space_size, params.seed);
+            agg_ctx->frame = kmh_frame_init(params.k, config->space_size, params.seed);
+            if (!agg_ctx->builder || !agg_ctx->frame) {
+                kmh_builder_free(agg_ctx->builder);
+                kmh_frame_free(agg_ctx->frame);
+                agg_ctx->builder = NULL;
+                agg_ctx->frame = NULL;
+                sqlite3_result_error_nomem(context);
+                return;
+            }
+            agg_ctx->threshold = UINT32_MAX; // Nothing ruled out until the builder fills
+        }
+    }
+    
+    uint32_t hash;
+    if (agg_ctx->blocks) {
+        const kmh_blocked_t *s = agg_ctx->blocks;
+        if (argc > 0 && kmh_value_hash32(argv[0], s->seed, &hash)) {
+            hash = kmh_reduce(hash, s->space_size, s->reduce_mode, s->reduce_m);
+        } else {
+            hash = KMH_SET_EMPTY;
+        }
+    } else {
+        const kmh_builder_t *b = agg_ctx->builder;
+        if (argc > 0 && kmh_value_hash32(argv[0], b->seed, &hash)) {
+            hash = kmh_reduce(hash, b->space_size, b->reduce_mode, b->reduce_m);
+        } else {
+            hash = KMH_SET_EMPTY; // Ignored values still take a row in the frame, for xInverse to drop
+        }
+    }
+    agg_ctx->stage[agg_ctx->staged++] = hash;
+    if (agg_ctx->staged == KMH_GROUP_CREATE_STAGE && !kmh_group_create_flush(agg_ctx)) {
+        sqlite3_result_error_nomem(context);
+    }
+}
+
+static void kmh_group_create_value(sqlite3_context *context) {
+    kmh_agg_context *agg_ctx = sqlite3_aggregate_context(context, 0);
+    if (agg_ctx && agg_ctx->staged && !kmh_group_create_flush(agg_ctx)) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (agg_ctx && agg_ctx->blocks) {
+        kmh_blocked_result(context, agg_ctx->blocks, 0);
+        return;
+    }
+    kmh_frame_result(context, agg_ctx ? agg_ctx->frame : NULL, 0);
+}
+
+static void kmh_group_create_final(sqlite3_context *context) {
+    kmh_agg_context *agg_ctx = sqlite3_aggregate_context(context, 0);
+    
+    if (agg_ctx && agg_ctx->blocks) {
+        kmh_group_create_flush(agg_ctx); // Never fails without a frame
+        kmh_blocked_result(context, agg_ctx->blocks, 0);
+        kmh_blocked_free(agg_ctx->blocks);
+        return;
+    }
+    if (!agg_ctx || !agg_ctx->builder) {
+        sqlite3_result_null(context);
+        return;
+    }
+    if (agg_ctx->staged && !kmh_group_create_flush(agg_ctx)) {
+        sqlite3_result_error_nomem(context);
+        kmh_builder_free(agg_ctx->builder);
+        kmh_frame_free(agg_ctx->frame);
+        return;
+    }
+    
+    if (agg_ctx->framed) {
+        kmh_frame_result(context, agg_ctx->frame, 0);
+        kmh_builder_free(agg_ctx->builder);
+        kmh_frame_free(agg_ctx->frame);
+        return;
+    }
+    kmh_frame_free(agg_ctx->frame);
+    agg_ctx->frame = NULL;
+    
+    kvalue_minhash_t *kmh = kmh_finalize(agg_ctx->builder);
+    kmh_builder_free(agg_ctx->builder);
+    agg_ctx->builder = NULL;
+    if (!kmh) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    
+    kmh_to_blob(context, kmh);
+    kmh_free(kmh);
+}
+
+// kmh_group_create64 aggregate
+static void kmh_group_create64_step(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    kmh_agg_context *agg_ctx = sqlite3_aggregate_context(context, sizeof(kmh_agg_context));
+    
+    if (!agg_ctx) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    
+    if (!agg_ctx->kmh64) {
+        const kmh_config_t *config = sqlite3_user_data(context);
+        agg_ctx->kmh64 = kmh64_init(config->k, DEFAULT_SPACE_SIZE64, config->seed);
+        if (!agg_ctx->kmh64) {
+            sqlite3_result_error_nomem(context);
+            return;
+        }
+    }
+    
+    if (argc > 0) {
+        KMH_LOCAL_STATS(local);
+        kmh64_add_value(agg_ctx->kmh64, argv[0], &local);
+        KMH_LOCAL_FLUSH(local);
+    }
+}
+
+// Shared by every aggregate that may end up holding a 64-bit sketch
+static void kmh_group64_final(sqlite3_context *context, kmh_agg_context *agg_ctx, int cardinality_only) {
+    if (cardinality_only) {
+        sqlite3_result_double(context, kmh64_cardinality(agg_ctx->kmh64));
+    } else {
+        kmh64_to_blob(context, agg_ctx->kmh64);
+    }
+    kmh64_free(agg_ctx->kmh64);
+    agg_ctx->kmh64 = NULL;
+}
+
+static void kmh_group_create64_final(sqlite3_context *context) {
+    kmh_agg_context *agg_ctx = sqlite3_aggregate_context(context, 0);
+    
+    if (!agg_ctx || !agg_ctx->kmh64) {
+        sqlite3_result_null(context);
+        return;
+    }
+    
+    kmh_group64_final(context, agg_ctx, 0);
+}
+
+// Merges the buffered rows and the accumulator in one N-way merge; 0 on OOM
+static int kmh_group_merge_flush(kmh_agg_context *agg_ctx) {
+    if (agg_ctx->batch_count == 0) return 1;
+    
+    kvalue_minhash_t *acc = agg_ctx->kmh;
+    uint32_t *scratch = kmh_agg_buffer(&agg_ctx->scratch, &agg_ctx->scratch_size,
+                                       (sqlite3_uint64)acc->k * sizeof(uint32_t));
+    if (!scratch) return 0;
+    
+    const kvalue_minhash_t *inputs[KMH_GROUP_MERGE_BATCH + 1];
+    inputs[0] = acc;
+    for (uint32_t i = 0; i < agg_ctx->batch_count; i++) {
+        inputs[i + 1] = &agg_ctx->pending[i];
+    }
+    // At most KMH_GROUP_MERGE_BATCH + 1 inputs, so the loser tree stays on the stack
+    uint32_t m = kmh_merge_many_hashes(inputs, agg_ctx->batch_count + 1, acc->k, scratch);
+    memcpy(acc->hashes, scratch + acc->k - m, m * sizeof(uint32_t));
+    acc->count = m;
+    agg_ctx->batch_count = 0;
+    return 1;
+}
+
+// Pushes a kmh_group_merge row onto the frame; rows the aggregate ignores
+// push no hashes (and are only counted until the first 32-bit sketch sets
+// the frame's parameters). 0 if out of memory.
+static int kmh_group_frame_push(kmh_agg_context *agg_ctx, const kvalue_minhash_t *row) {
+    if (agg_ctx->blocks) return 1;
+    if (!agg_ctx->frame && row) {
+        const kvalue_minhash_t *acc = agg_ctx->kmh;
+        agg_ctx->frame = kmh_frame_init(acc->k, acc->space_size, acc->seed);
+        if (!agg_ctx->frame) return 0;
+        for (; agg_ctx->frame_lead > 0; agg_ctx->frame_lead--) {
+            if (!kmh_frame_push_hashes(agg_ctx->frame, NULL, 0)) return 0;
+        }
+    }
+    if (!agg_ctx->frame) {
+        agg_ctx->frame_lead++;
+        return 1;
+    }
+    return kmh_frame_push_hashes(agg_ctx->frame, row ? row->hashes : NULL, row ? row->count : 0);
+}
+
+// Merges a 32-bit row into the blocked accumulator, which the first blocked
+// row creates (from the flat one so far, if any). The row is decoded into
+// scratch and streamed leaf by leaf into the spare sketch, which then
+// becomes the accumulator: O(K) per row, with no batch of K-sized rows and
+// no frame. 0 if out of memory.
+static int kmh_group_merge_blocked(kmh_agg_context *agg_ctx, const kmh_blob_info_t *info,
+                                   const uint8_t *blob_data, int blob_size) {
+    if (!agg_ctx->blocks) {
+        if (!agg_ctx->kmh) {
+            // First blocked row becomes the base; malformed rows are ignored
+            agg_ctx->blocks = kmh_blocked_deserialize(blob_data, blob_size);
+            return 1;
+        }
+        const kvalue_minhash_t *acc = agg_ctx->kmh;
+        if (!kmh_group_merge_flush(agg_ctx) ||
+            !(agg_ctx->blocks = kmh_blocked_init(acc->k, acc->space_size, acc->seed))) {
+            return 0;
+        }
+        kmh_blocked_load(agg_ctx->blocks, acc->hashes, acc->count);
+        kmh_free(agg_ctx->kmh);
+        agg_ctx->kmh = NULL;
+        kmh_frame_free(agg_ctx->frame);
+        agg_ctx->frame = NULL;
+    }
+    
+    kmh_blocked_t *acc = agg_ctx->blocks;
+    uint32_t *hashes = kmh_agg_buffer(&agg_ctx->scratch, &agg_ctx->scratch_size,
+                                      (sqlite3_uint64)acc->k * sizeof(uint32_t));
+    if (!hashes) return 0;
+    if (!kmh_blob_decode(info, blob_data, blob_size, hashes)) return 1;
+    if (!agg_ctx->spare && !(agg_ctx->spare = kmh_blocked_init(acc->k, acc->space_size, acc->seed))) return 0;
+    
+    kmh_blocked_reset(agg_ctx->spare);
+    kmh_blocked_merge_into(agg_ctx->spare, acc, NULL, hashes, info->count);
+    agg_ctx->blocks = agg_ctx->spare;
+    agg_ctx->spare = acc;
+    return 1;
+}
+
+// kmh_group_merge aggregate: the first row is deserialized into the
+// accumulator; later 32-bit rows are decoded into a batch that is merged in
+// with kmh_merge_many_hashes every KMH_GROUP_MERGE_BATCH rows, 64-bit rows
+// are merged straight from the blob. Once a row is a blocked blob the
+// accumulator is a kmh_blocked_t (see kmh_group_merge_blocked). A sketch
+// that doesn't match the first one is an error rather than a partial
+// estimate. Returns the row's 32-bit sketch for the frame, NULL if the row
+// is 64-bit, blocked or ignored (or an error, which has been reported).
+static const kvalue_minhash_t *kmh_group_merge_add(sqlite3_context *context, kmh_agg_context *agg_ctx,
+                                                   sqlite3_value *val) {
+    if (sqlite3_value_type(val) != SQLITE_BLOB) {
+        return NULL;
+    }
+    const uint8_t *blob_data = sqlite3_value_blob(val);
+    int blob_size = sqlite3_value_bytes(val);
+    
+    if (kmh_blob_width(val) == sizeof(uint64_t)) {
+        kmh64_view_t view;
+        if (!kmh64_view_init(&view, blob_data, blob_size)) return NULL;
+        const kvalue_minhash64_t *acc = agg_ctx->kmh64;
+        if (agg_ctx->kmh || agg_ctx->blocks ||
+            (acc && (view.k != acc->k || view.space_size != acc->space_size || view.seed != acc->seed))) {
+            sqlite3_result_error(context, "kmh_group_merge: sketches must share width, k, space_size and seed", -1);
+            return NULL;
+        }
+        if (!agg_ctx->kmh64) {
+            agg_ctx->kmh64 = kmh64_deserialize(blob_data, blob_size);
+            if (!agg_ctx->kmh64) sqlite3_result_error_nomem(context);
+            return NULL;
+        }
+        uint64_t *scratch = kmh_agg_buffer(&agg_ctx->scratch, &agg_ctx->scratch_size,
+                                           (sqlite3_uint64)agg_ctx->kmh64->k * sizeof(uint64_t));
+        if (!scratch) {
+            sqlite3_result_error_nomem(context);
+            return NULL;
+        }
+        kmh64_merge_into(agg_ctx->kmh64, &view, scratch);
+        return NULL;
+    }
+    
+    kmh_blob_info_t info;
+    if (!kmh_blob_parse(&info, blob_data, blob_size) || info.width != sizeof(uint32_t)) return NULL;
+    const kvalue_minhash_t *acc = agg_ctx->kmh;
+    const kmh_blocked_t *blocks = agg_ctx->blocks;
+    if (agg_ctx->kmh64 ||
+        (acc && (info.k != acc->k || info.space_size != acc->space_size || info.seed != acc->seed)) ||
+        (blocks && (info.k != blocks->k || info.space_size != blocks->space_size || info.seed != blocks->seed))) {
+        sqlite3_result_error(context, "kmh_group_merge: sketches must share width, k, space_size and seed", -1);
+        return NULL;
+    }
+    
+    if (blocks || (info.flags & KMH_FLAG_BLOCKS)) {
+        if (agg_ctx->framed) {
+            sqlite3_result_error(context, "blocked sketches require frames starting at UNBOUNDED PRECEDING", -1);
+        } else if (!kmh_group_merge_blocked(agg_ctx, &info, blob_data, blob_size)) {
+            sqlite3_result_error_nomem(context);
+        }
+        return NULL;
+    }
+    
+    if (!agg_ctx->kmh) {
+        // First MinHash becomes the base; malformed rows are ignored
+        agg_ctx->kmh = kmh_deserialize(blob_data, blob_size);
+        return agg_ctx->kmh;
+    }
+    
+    uint32_t *batch = kmh_agg_buffer((void **)&agg_ctx->batch, &agg_ctx->batch_size,
+                                     (sqlite3_uint64)KMH_GROUP_MERGE_BATCH * acc->k * sizeof(uint32_t));
+    if (!batch) {
+        sqlite3_result_error_nomem(context);
+        return NULL;
+    }
+    kvalue_minhash_t *row = &agg_ctx->pending[agg_ctx->batch_count];
+    row->hashes = batch + (size_t)agg_ctx->batch_count * acc->k;
+    if (!kmh_blob_decode(&info, blob_data, blob_size, row->hashes)) return NULL;
+    row->count = info.count;
+    agg_ctx->batch_count++;
+    return row;
+}
+
+static void kmh_group_merge_step(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    kmh_agg_context *agg_ctx = sqlite3_aggregate_context(context, sizeof(kmh_agg_context));
+    
+    if (!agg_ctx) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    
+    const kvalue_minhash_t *row = argc > 0 ? kmh_group_merge_add(context, agg_ctx, argv[0]) : NULL;
+    // Into the frame before a flush reuses the batch
+    if (!kmh_group_frame_push(agg_ctx, row)) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (agg_ctx->batch_count == KMH_GROUP_MERGE_BATCH && !kmh_group_merge_flush(agg_ctx)) {
+        sqlite3_result_error_nomem(context);
+    }
+}
+
+// xValue and xFinal of kmh_group_merge and kmh_group_merge_cardinality
+static void kmh_group_merge_value_common(sqlite3_context *context, int cardinality_only) {
+    kmh_agg_context *agg_ctx = sqlite3_aggregate_context(context, 0);
+    
+    if (agg_ctx && agg_ctx->kmh64) {
+        if (cardinality_only) {
+            sqlite3_result_double(context, kmh64_cardinality(agg_ctx->kmh64));
+        } else {
+            kmh64_to_blob(context, agg_ctx->kmh64);
+        }
+        return;
+    }
+    if (agg_ctx && agg_ctx->blocks) {
+        kmh_blocked_result(context, agg_ctx->blocks, cardinality_only);
+        return;
+    }
+    kmh_frame_result(context, agg_ctx ? agg_ctx->frame : NULL, cardinality_only);
+}
+
+static void kmh_group_merge_value(sqlite3_context *context) {
+    kmh_group_merge_value_common(context, 0);
+}
+
+static void kmh_group_merge_cardinality_value(sqlite3_context *context) {
+    kmh_group_merge_value_common(context, 1);
+}
+
+static void kmh_group_merge_final_common(sqlite3_context *context, int cardinality_only) {
+    kmh_agg_context *agg_ctx = sqlite3_aggregate_context(context, 0);
+    if (agg_ctx && agg_ctx->blocks) {
+        kmh_blocked_result(context, agg_ctx->blocks, cardinality_only);
+        kmh_agg_free_buffers(agg_ctx);
+        kmh_blocked_free(agg_ctx->blocks);
+        return;
+    }
+    if (agg_ctx && agg_ctx->framed) {
+        kmh_frame_result(context, agg_ctx->frame, cardinality_only);
+        kmh_agg_free_buffers(agg_ctx);
+        kmh_free(agg_ctx->kmh);
+        kmh64_free(agg_ctx->kmh64);
+        return;
+    }
+    if (agg_ctx) {
+        int flushed = !agg_ctx->kmh || kmh_group_merge_flush(agg_ctx);
+        kmh_agg_free_buffers(agg_ctx);
+        if (!flushed) {
+            kmh_free(agg_ctx->kmh);
+            kmh64_free(agg_ctx->kmh64);
+            sqlite3_result_error_nomem(context);
+            return;
+        }
+    }
+    
+    if (agg_ctx && agg_ctx->kmh64) {
+        kmh_free(agg_ctx->kmh);
+        kmh_group64_final(context, agg_ctx, cardinality_only);
+        return;
+    }
+    
+    if (!agg_ctx || !agg_ctx->kmh) {
+        sqlite3_result_null(context);
+        return;
+    }
+    
+    if (cardinality_only) {
+        sqlite3_result_double(context, kmh_cardinality(agg_ctx->kmh));
+    } else {
+        kmh_to_blob(context, agg_ctx->kmh);
+    }
     kmh_free(agg_ctx->kmh);
 }
 
+static void kmh_group_merge_final(sqlite3_context *context) {
+    kmh_group_merge_final_common(context, 0);
+}
+
+// kmh_group_merge_cardinality aggregate
+static void kmh_group_merge_cardinality_final(sqlite3_context *context) {
+    kmh_group_merge_final_common(context, 1);
+}
+
+// Sliding windows (kmh_window_t) persisted as ring blobs:
+//   SELECT kmh_group_window(ts, user_id, 60, 60) FROM events;  -- last hour by minute
+//   UPDATE rings SET ring = kmh_window_add(ring, :ts, :user_id);
+//   SELECT kmh_window_cardinality(ring, unixepoch()) FROM rings;
+// Times are non-negative integers in the unit of bucket_width (e.g. unix
+// seconds). A row older than the window ending at the newest time seen is
+// dropped. The window queries take the end time, defaulting to the ring's
+// newest bucket; a later time expires buckets first.
+static int kmh_window_time(sqlite3_context *context, sqlite3_value *val, uint64_t *time) {
+    if (sqlite3_value_type(val) != SQLITE_INTEGER || sqlite3_value_int64(val) < 0) {
+        sqlite3_result_error(context, "kmh window times must be non-negative integers", -1);
+        return 0;
+    }
+    *time = (uint64_t)sqlite3_value_int64(val);
+    return 1;
+}
+
+static void kmh_window_add_value(kmh_window_t *w, uint64_t time, sqlite3_value *val) {
+    const kvalue_minhash_t *b = w->prefix;
+    uint32_t hash;
+    if (kmh_value_hash32(val, b->seed, &hash)) {
+        kmh_window_insert_hash(w, time, kmh_reduce(hash, b->space_size, b->reduce_mode, b->reduce_m));
+    }
+}
+
+static void kmh_window_to_blob(sqlite3_context *context, const kmh_window_t *w) {
+    uint32_t bound = kmh_window_serialized_bound(w);
+    uint8_t *buf = bound ? sqlite3_malloc64(bound) : NULL;
+    if (!buf) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    sqlite3_result_blob(context, buf, kmh_window_serialize_into(w, buf, bound), sqlite3_free);
+}
+
+static kmh_window_t *kmh_window_from_blob(sqlite3_value *val) {
+    if (sqlite3_value_type(val) != SQLITE_BLOB) return NULL;
+    return kmh_window_deserialize(sqlite3_value_blob(val), sqlite3_value_bytes(val));
+}
+
+typedef struct {
+    kmh_window_t *window;
+    int failed;
+} kmh_window_agg_context;
+
+// kmh_group_window(time, value, nbuckets, bucket_width) aggregate
+static void kmh_group_window_step(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    kmh_window_agg_context *agg_ctx = sqlite3_aggregate_context(context, sizeof(kmh_window_agg_context));
+    if (!agg_ctx) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (agg_ctx->failed) return;
+    
+    if (!agg_ctx->window) {
+        sqlite3_int64 nbuckets = sqlite3_value_int64(argv[2]), width = sqlite3_value_int64(argv[3]);
+        if (nbuckets < 1 || nbuckets > 1000000 || width < 1) {
+            agg_ctx->failed = 1;
+            sqlite3_result_error(context, "kmh_group_window: nbuckets and bucket_width must be positive", -1);
+            return;
+        }
+        const kmh_config_t *config = sqlite3_user_data(context);
+        agg_ctx->window = kmh_window_init((uint32_t)nbuckets, (uint64_t)width, config->k, config->space_size,
+                                          config->seed);
+        if (!agg_ctx->window) {
+            agg_ctx->failed = 1;
+            sqlite3_result_error_nomem(context);
+            return;
+        }
+    }
+    
+    uint64_t time;
+    if (!kmh_window_time(context, argv[0], &time)) {
+        agg_ctx->failed = 1;
+        return;
+    }
+    kmh_window_add_value(agg_ctx->window, time, argv[1]);
+}
+
+static void kmh_group_window_final(sqlite3_context *context) {
+    kmh_window_agg_context *agg_ctx = sqlite3_aggregate_context(context, 0);
+    if (!agg_ctx || !agg_ctx->window) {
+        sqlite3_result_null(context);
+        return;
+    }
+    if (!agg_ctx->failed) kmh_window_to_blob(context, agg_ctx->window);
+    kmh_window_free(agg_ctx->window);
+}
+
+// kmh_window_add at the head bucket, the common case of times that arrive
+// in order: the head's entry is decoded, the value inserted and, if it
+// entered, re-encoded into a copy of the blob whose other entries are moved
+// with two memcpy (a head add touches neither suffix[] nor prefix).
+// Returns 0 for rings it leaves to the loading path (version 1, malformed,
+// or a time outside the head bucket).
+static int kmh_window_add_raw(sqlite3_context *context, sqlite3_value **argv, uint64_t time) {
+    kmh_window_view_t v;
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB ||
+        !kmh_window_view_init(&v, sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0])) ||
+        v.nentries != 2 * v.nbuckets + 1 || time / v.bucket_width != v.head) {
+        return 0;
+    }
+    uint32_t hash;
+    if (!kmh_value_hash32(argv[2], v.seed, &hash)) {
+        sqlite3_result_blob(context, v.buf, v.size, SQLITE_TRANSIENT);
+        return 1;
+    }
+    int mode = kmh_reduce_mode(v.space_size);
+    uint64_t m = mode == KMH_REDUCE_MOD ? kmh_fastmod_m(v.space_size) : 0;
+    hash = kmh_reduce(hash, v.space_size, mode, m);
+
+    kvalue_minhash_t bucket = { v.k, 0, v.space_size, v.seed, sqlite3_malloc64((uint64_t)v.k * sizeof(uint32_t)),
+                                mode, m };
+    if (!bucket.hashes) {
+        sqlite3_result_error_nomem(context);
+        return 1;
+    }
+    uint32_t at = kmh_window_view_offset(&v, (uint32_t)(v.head % v.nbuckets));
+    uint32_t entry_size = 8 + kmh_load_le32(v.buf + at + 4);
+    if (!kmh_window_view_decode(&v, at, &bucket)) {
+        sqlite3_free(bucket.hashes);
+        return 0;
+    }
+    uint32_t count = bucket.count, largest = count > 0 ? bucket.hashes[0] : 0;
+    KMH_LOCAL_STATS(local);
+    kmh_insert_hash_counted(&bucket, hash, &local);
+    KMH_LOCAL_FLUSH(local);
+    if (bucket.count == count && (count == 0 || bucket.hashes[0] == largest)) {
+        sqlite3_free(bucket.hashes);
+        sqlite3_result_blob(context, v.buf, v.size, SQLITE_TRANSIENT);
+        return 1;
+    }
+
+    uint64_t bound = (uint64_t)v.size - entry_size + 8 + kmh_encoded_bound(bucket.count);
+    uint8_t *out = sqlite3_malloc64(bound);
+    if (!out) {
+        sqlite3_free(bucket.hashes);
+        sqlite3_result_error_nomem(context);
+        return 1;
+    }
+    memcpy(out, v.buf, at);
+    uint32_t written = kmh_window_put_entry(&bucket, out + at);
+    memcpy(out + at + written, v.buf + at + entry_size, v.size - at - entry_size);
+    sqlite3_free(bucket.hashes);
+    sqlite3_result_blob(context, out, (int)(v.size - entry_size + written), sqlite3_free);
+    return 1;
+}
+
+// kmh_window_add(ring, time, value)
+static void kmh_window_add_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    uint64_t time;
+    if (!kmh_window_time(context, argv[1], &time)) return;
+    if (kmh_window_add_raw(context, argv, time)) return;
+    kmh_window_t *w = kmh_window_from_blob(argv[0]);
+    if (!w) {
+        sqlite3_result_null(context);
+        return;
+    }
+    kmh_window_add_value(w, time, argv[2]);
+    kmh_window_to_blob(context, w);
+    kmh_window_free(w);
+}
+
+// Parses the ring and the end time (default: the newest bucket) of a window
+// query, with KMH_WINDOW_VIEW_WORK * k entries of scratch for
+// kmh_window_view_collect in *work. Returns 0 with the result set otherwise.
+static int kmh_window_query_args(sqlite3_context *context, int argc, sqlite3_value **argv, kmh_window_view_t *v,
+                                 uint64_t *now, uint32_t **work) {
+    if (argc < 1 || argc > 2) {
+        sqlite3_result_error(context, "kmh window queries take a ring and an optional time", -1);
+        return 0;
+    }
+    if (argc == 2 && !kmh_window_time(context, argv[1], now)) return 0;
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB ||
+        !kmh_window_view_init(v, sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]))) {
+        sqlite3_result_null(context);
+        return 0;
+    }
+    if (argc == 1) *now = v->head * v->bucket_width;
+    *work = sqlite3_malloc64((uint64_t)KMH_WINDOW_VIEW_WORK * v->k * sizeof(uint32_t));
+    if (!*work) {
+        sqlite3_result_error_nomem(context);
+        return 0;
+    }
+    return 1;
+}
+
+// kmh_window_cardinality(ring[, now]): merged from at most three entries of
+// the blob; version 1 rings are loaded and rebuilt
+static void kmh_window_cardinality_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    kmh_window_view_t v;
+    uint64_t now;
+    uint32_t *work;
+    if (!kmh_window_query_args(context, argc, argv, &v, &now, &work)) return;
+    double cardinality = kmh_window_view_cardinality(&v, now, work);
+    sqlite3_free(work);
+    if (cardinality >= 0) {
+        sqlite3_result_double(context, cardinality);
+        return;
+    }
+    kmh_window_t *w = kmh_window_deserialize(v.buf, v.size);
+    if (!w) {
+        sqlite3_result_null(context);
+        return;
+    }
+    sqlite3_result_double(context, kmh_window_cardinality(w, now));
+    kmh_window_free(w);
+}
+
+// kmh_window_sketch(ring[, now]): the window as a sketch blob
+static void kmh_window_sketch_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    kmh_window_view_t v;
+    uint64_t now;
+    uint32_t *work;
+    if (!kmh_window_query_args(context, argc, argv, &v, &now, &work)) return;
+    uint32_t m = kmh_window_view_collect(&v, now, work);
+    if (m != UINT32_MAX) {
+        kvalue_minhash_t window = { v.k, m, v.space_size, v.seed, work + v.k - m, 0, 0 };
+        kmh_to_blob(context, &window);
+        sqlite3_free(work);
+        return;
+    }
+    sqlite3_free(work);
+    kmh_window_t *w = kmh_window_deserialize(v.buf, v.size);
+    if (!w) {
+        sqlite3_result_null(context);
+        return;
+    }
+    kvalue_minhash_t *kmh = kmh_window_sketch(w, now);
+    kmh_window_free(w);
+    if (!kmh) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    kmh_to_blob(context, kmh);
+    kmh_free(kmh);
+}
+
+#ifdef KMH_HAVE_MMAP
+// Sketch store files (kmh_store_t): bulk export of a table's sketches into a
+// memory-mapped key -> blob file, and lookups from SQL.
+//   SELECT kmh_store_save('docs.kmhs', id, sig) FROM docs;
+//   SELECT kmh_cardinality(kmh_store_get('docs.kmhs', 42));
+// kmh_store_save appends every (integer key, sketch) row and commits once
+// after the last, returning the number of rows written; NULL sketches are
+// skipped. kmh_store_get keeps the file mapped for the rest of the statement.
+typedef struct {
+    kmh_store_writer_t *writer;
+    sqlite3_int64 rows;
+    int failed;
+} kmh_store_agg_context;
+
+static void kmh_store_save_step(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    kmh_store_agg_context *agg_ctx = sqlite3_aggregate_context(context, sizeof(kmh_store_agg_context));
+    (void)argc;
+    if (!agg_ctx) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (agg_ctx->failed) return;
+    
+    if (!agg_ctx->writer) {
+        const char *path = (const char *)sqlite3_value_text(argv[0]);
+        agg_ctx->writer = path ? kmh_store_writer_open(path) : NULL;
+        if (!agg_ctx->writer) {
+            agg_ctx->failed = 1;
+            sqlite3_result_error(context, "kmh_store_save: cannot open the store for writing", -1);
+            return;
+        }
+    }
+    
+    if (sqlite3_value_type(argv[2]) == SQLITE_NULL) return;
+    const uint8_t *blob = sqlite3_value_blob(argv[2]);
+    int blob_size = sqlite3_value_bytes(argv[2]);
+    kmh_blob_info_t info;
+    const char *error = NULL;
+    if (sqlite3_value_type(argv[1]) != SQLITE_INTEGER) {
+        error = "kmh_store_save: key must be an integer";
+    } else if (sqlite3_value_type(argv[2]) != SQLITE_BLOB || !kmh_blob_parse(&info, blob, blob_size)) {
+        error = "kmh_store_save: not a sketch";
+    } else if (!kmh_store_put(agg_ctx->writer, (uint64_t)sqlite3_value_int64(argv[1]), blob, blob_size)) {
+        error = "kmh_store_save: write failed";
+    }
+    if (error) {
+        agg_ctx->failed = 1;
+        sqlite3_result_error(context, error, -1);
+        return;
+    }
+    agg_ctx->rows++;
+}
+
+static void kmh_store_save_final(sqlite3_context *context) {
+    kmh_store_agg_context *agg_ctx = sqlite3_aggregate_context(context, 0);
+    if (!agg_ctx || !agg_ctx->writer) {
+        if (!agg_ctx || !agg_ctx->failed) sqlite3_result_int64(context, 0);
+        return;
+    }
+    if (agg_ctx->failed) {
+        kmh_store_writer_abort(agg_ctx->writer);
+        return;
+    }
+    if (!kmh_store_writer_close(agg_ctx->writer)) {
+        sqlite3_result_error(context, "kmh_store_save: commit failed", -1);
+        return;
+    }
+    sqlite3_result_int64(context, agg_ctx->rows);
+}
+
+static void kmh_store_auxdata_free(void *store) {
+    kmh_store_close(store);
+}
+
+static void kmh_store_get_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    kmh_store_t *store = sqlite3_get_auxdata(context, 0);
+    (void)argc;
+    if (!store) {
+        const char *path = (const char *)sqlite3_value_text(argv[0]);
+        store = path ? kmh_store_open(path) : NULL;
+        if (!store) {
+            sqlite3_result_error(context, "kmh_store_get: cannot open the store", -1);
+            return;
+        }
+        sqlite3_set_auxdata(context, 0, store, kmh_store_auxdata_free);
+        // set_auxdata closes the store right away if it can't keep it
+        if (sqlite3_get_auxdata(context, 0) != store) {
+            sqlite3_result_error_nomem(context);
+            return;
+        }
+    }
+    
+    uint32_t blob_size;
+    const uint8_t *blob = sqlite3_value_type(argv[1]) == SQLITE_INTEGER
+                              ? kmh_store_get(store, (uint64_t)sqlite3_value_int64(argv[1]), &blob_size)
+                              : NULL;
+    if (!blob) {
+        sqlite3_result_null(context);
+        return;
+    }
+    sqlite3_result_blob(context, blob, (int)blob_size, SQLITE_TRANSIENT);
+}
+#endif // KMH_HAVE_MMAP
+
+// kmh_lsh virtual table: an LSH index (kmh_lsh_t) over 32-bit sketches.
+//   CREATE VIRTUAL TABLE docs_lsh USING kmh_lsh(bands=20, rows=5, threshold=0.8);
+//   INSERT INTO docs_lsh(rowid, sig) VALUES (:id, :sig);
+//   SELECT rowid, similarity FROM docs_lsh WHERE kmh_similar(sig, :query);
+//   SELECT rowid, similarity FROM docs_lsh(:query, 0.9);
+// Both queries probe the index instead of scanning. SQLite only offers
+// two-argument functions to a virtual table, so kmh_similar(sig, :query)
+// uses the table's threshold; the table-valued form (hidden columns query and
+// threshold) takes one per query. Rows live in the shadow table <name>_data;
+// the index is held in memory, built when the table is connected and rebuilt
+// after a rollback or a commit from another connection.
+#define KMH_LSH_DEFAULT_BANDS 20
+#define KMH_LSH_DEFAULT_ROWS 5
+
+#define KMH_LSH_COL_SIG        0
+#define KMH_LSH_COL_SIMILARITY 1
+#define KMH_LSH_COL_QUERY      2
+#define KMH_LSH_COL_THRESHOLD  3
+
+// idxNum bits chosen by xBestIndex
+#define KMH_LSH_PLAN_QUERY     1 // argv[0] is the query sketch
+#define KMH_LSH_PLAN_THRESHOLD 2 // argv[1] is the threshold
+#define KMH_LSH_PLAN_ROWID     4 // argv[0] is a rowid
+
+#define KMH_LSH_SIMILAR_OP SQLITE_INDEX_CONSTRAINT_FUNCTION
+
+typedef struct {
+    sqlite3_vtab base;
+    sqlite3 *db;
+    char *schema;
+    char *name;
+    uint32_t bands;
+    uint32_t rows;
+    double threshold;
+    kmh_lsh_t *lsh;       // NULL until loaded, or after it went stale
+    sqlite3_int64 data_version;
+} kmh_lsh_vtab;
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    sqlite3_stmt *scan;        // full scan or rowid lookup over the shadow table
+    sqlite3_stmt *lookup;      // sig by rowid, for query results
+    kmh_lsh_match_t *matches;  // query results
+    size_t count;
+    size_t pos;
+    int eof;
+} kmh_lsh_cursor;
+
+static sqlite3_int64 kmh_lsh_data_version(sqlite3 *db, const char *schema) {
+    sqlite3_int64 version = -1;
+    char *sql = sqlite3_mprintf("PRAGMA \"%w\".data_version", schema);
+    sqlite3_stmt *stmt = NULL;
+    if (sql && sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_free(sql);
+    return version;
+}
+
+// Builds the in-memory index from the shadow table if it isn't current
+static int kmh_lsh_load(kmh_lsh_vtab *vtab) {
+    sqlite3_int64 version = kmh_lsh_data_version(vtab->db, vtab->schema);
+    if (vtab->lsh && version == vtab->data_version) return SQLITE_OK;
+    kmh_lsh_free(vtab->lsh);
+    vtab->lsh = NULL;
+
+    kmh_lsh_t *lsh = kmh_lsh_init(vtab->bands, vtab->rows);
+    if (!lsh) return SQLITE_NOMEM;
+    char *sql = sqlite3_mprintf("SELECT id, sig FROM \"%w\".\"%w_data\"", vtab->schema, vtab->name);
+    if (!sql) {
+        kmh_lsh_free(lsh);
+        return SQLITE_NOMEM;
+    }
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(vtab->db, sql, -1, &stmt, NULL);
+    sqlite3_free(sql);
+    while (rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        kvalue_minhash_t *kmh = kmh_from_blob(sqlite3_column_value(stmt, 1));
+        rc = SQLITE_OK;
+        if (kmh && !kmh_lsh_insert(lsh, sqlite3_column_int64(stmt, 0), kmh)) rc = SQLITE_NOMEM;
+        kmh_free(kmh);
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        kmh_lsh_free(lsh);
+        return rc;
+    }
+    vtab->lsh = lsh;
+    vtab->data_version = version;
+    return SQLITE_OK;
+}
+
+static int kmh_lsh_exec(kmh_lsh_vtab *vtab, const char *fmt) {
+    char *sql = sqlite3_mprintf(fmt, vtab->schema, vtab->name);
+    if (!sql) return SQLITE_NOMEM;
+    int rc = sqlite3_exec(vtab->db, sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+    return rc;
+}
+
+static void kmh_lsh_vtab_free(kmh_lsh_vtab *vtab) {
+    kmh_lsh_free(vtab->lsh);
+    sqlite3_free(vtab->schema);
+    sqlite3_free(vtab->name);
+    sqlite3_free(vtab);
+}
+
+// Arguments are bands=N, rows=N and threshold=X
+static int kmh_lsh_connect_common(sqlite3 *db, int argc, const char *const *argv, sqlite3_vtab **ppVtab,
+                                  char **pzErr, int create) {
+    uint32_t bands = KMH_LSH_DEFAULT_BANDS, rows = KMH_LSH_DEFAULT_ROWS;
+    double threshold = -1.0;
+    for (int i = 3; i < argc; i++) {
+        const char *arg = argv[i];
+        while (*arg == ' ') arg++;
+        if (sqlite3_strnicmp(arg, "bands=", 6) == 0) {
+            bands = (uint32_t)atoi(arg + 6);
+        } else if (sqlite3_strnicmp(arg, "rows=", 5) == 0) {
+            rows = (uint32_t)atoi(arg + 5);
+        } else if (sqlite3_strnicmp(arg, "threshold=", 10) == 0) {
+            threshold = atof(arg + 10);
+        } else {
+            *pzErr = sqlite3_mprintf("kmh_lsh: unknown argument '%s'", arg);
+            return SQLITE_ERROR;
+        }
+    }
+    if (bands == 0 || rows == 0 || (uint64_t)bands * rows > KMH_LSH_MAX_BINS) {
+        *pzErr = sqlite3_mprintf("kmh_lsh: bands * rows must be between 1 and %d", KMH_LSH_MAX_BINS);
+        return SQLITE_ERROR;
+    }
+    // By default, the similarity at which a pair is found half the time
+    if (threshold < 0) threshold = pow(1.0 / bands, 1.0 / rows);
+
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(sig BLOB, similarity REAL, query HIDDEN, threshold HIDDEN)");
+    if (rc != SQLITE_OK) return rc;
+
+    kmh_lsh_vtab *vtab = sqlite3_malloc(sizeof(kmh_lsh_vtab));
+    if (!vtab) return SQLITE_NOMEM;
+    memset(vtab, 0, sizeof(*vtab));
+    vtab->db = db;
+    vtab->bands = bands;
+    vtab->rows = rows;
+    vtab->threshold = threshold;
+    vtab->schema = sqlite3_mprintf("%s", argv[1]);
+    vtab->name = sqlite3_mprintf("%s", argv[2]);
+    if (!vtab->schema || !vtab->name) {
+        kmh_lsh_vtab_free(vtab);
+        return SQLITE_NOMEM;
+    }
+    if (create) {
+        rc = kmh_lsh_exec(vtab, "CREATE TABLE \"%w\".\"%w_data\"(id INTEGER PRIMARY KEY, sig BLOB)");
+        if (rc != SQLITE_OK) {
+            *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+            kmh_lsh_vtab_free(vtab);
+            return rc;
+        }
+    }
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+    *ppVtab = &vtab->base;
+    return SQLITE_OK;
+}
+
+static int kmh_lsh_create(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                          sqlite3_vtab **ppVtab, char **pzErr) {
+    (void)aux;
+    return kmh_lsh_connect_common(db, argc, argv, ppVtab, pzErr, 1);
+}
+
+static int kmh_lsh_connect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                           sqlite3_vtab **ppVtab, char **pzErr) {
+    (void)aux;
+    return kmh_lsh_connect_common(db, argc, argv, ppVtab, pzErr, 0);
+}
+
+static int kmh_lsh_disconnect(sqlite3_vtab *pVtab) {
+    kmh_lsh_vtab_free((kmh_lsh_vtab *)pVtab);
+    return SQLITE_OK;
+}
+
+static int kmh_lsh_destroy(sqlite3_vtab *pVtab) {
+    kmh_lsh_vtab *vtab = (kmh_lsh_vtab *)pVtab;
+    int rc = kmh_lsh_exec(vtab, "DROP TABLE \"%w\".\"%w_data\"");
+    if (rc == SQLITE_OK) kmh_lsh_vtab_free(vtab);
+    return rc;
+}
+
+static int kmh_lsh_best_index(sqlite3_vtab *pVtab, sqlite3_index_info *info) {
+    kmh_lsh_vtab *vtab = (kmh_lsh_vtab *)pVtab;
+    int query = -1, threshold = -1, rowid = -1;
+    for (int i = 0; i < info->nConstraint; i++) {
+        const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+        if (!c->usable) continue;
+        if (c->iColumn == KMH_LSH_COL_QUERY && c->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+            query = i;
+        } else if (c->iColumn == KMH_LSH_COL_SIG && c->op == KMH_LSH_SIMILAR_OP && query < 0) {
+            query = i;
+        } else if (c->iColumn == KMH_LSH_COL_THRESHOLD && c->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+            threshold = i;
+        } else if (c->iColumn == -1 && c->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+            rowid = i;
+        }
+    }
+
+    double size = vtab->lsh ? vtab->lsh->size : 1e6;
+    if (query >= 0) {
+        info->idxNum = KMH_LSH_PLAN_QUERY;
+        info->aConstraintUsage[query].argvIndex = 1;
+        info->aConstraintUsage[query].omit = 1;
+        if (threshold >= 0) {
+            info->idxNum |= KMH_LSH_PLAN_THRESHOLD;
+            info->aConstraintUsage[threshold].argvIndex = 2;
+            info->aConstraintUsage[threshold].omit = 1;
+        }
+        info->estimatedCost = 100.0 + size / 1e4;
+        info->estimatedRows = 10;
+    } else if (rowid >= 0) {
+        info->idxNum = KMH_LSH_PLAN_ROWID;
+        info->aConstraintUsage[rowid].argvIndex = 1;
+        info->aConstraintUsage[rowid].omit = 1;
+        info->estimatedCost = 10.0;
+        info->estimatedRows = 1;
+        info->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+    } else {
+        info->estimatedCost = 1000.0 + size * 10;
+        info->estimatedRows = (sqlite3_int64)size;
+    }
+    return SQLITE_OK;
+}
+
+static int kmh_lsh_open(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+    (void)pVtab;
+    kmh_lsh_cursor *cur = sqlite3_malloc(sizeof(kmh_lsh_cursor));
+    if (!cur) return SQLITE_NOMEM;
+    memset(cur, 0, sizeof(*cur));
+    *ppCursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static void kmh_lsh_cursor_reset(kmh_lsh_cursor *cur) {
+    sqlite3_finalize(cur->scan);
+    cur->scan = NULL;
+    kmh_dealloc(cur->matches);
+    cur->matches = NULL;
+    cur->count = cur->pos = 0;
+    cur->eof = 1;
+}
+
+static int kmh_lsh_close(sqlite3_vtab_cursor *pCursor) {
+    kmh_lsh_cursor *cur = (kmh_lsh_cursor *)pCursor;
+    kmh_lsh_cursor_reset(cur);
+    sqlite3_finalize(cur->lookup);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+static int kmh_lsh_prepare(kmh_lsh_vtab *vtab, sqlite3_stmt **stmt, const char *fmt) {
+    char *sql = sqlite3_mprintf(fmt, vtab->schema, vtab->name);
+    if (!sql) return SQLITE_NOMEM;
+    int rc = sqlite3_prepare_v2(vtab->db, sql, -1, stmt, NULL);
+    sqlite3_free(sql);
+    return rc;
+}
+
+static int kmh_lsh_scan_step(kmh_lsh_cursor *cur) {
+    int rc = sqlite3_step(cur->scan);
+    cur->eof = rc != SQLITE_ROW;
+    return rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int kmh_lsh_filter(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+                          int argc, sqlite3_value **argv) {
+    (void)idxStr; (void)argc;
+    kmh_lsh_cursor *cur = (kmh_lsh_cursor *)pCursor;
+    kmh_lsh_vtab *vtab = (kmh_lsh_vtab *)pCursor->pVtab;
+    kmh_lsh_cursor_reset(cur);
+
+    if (idxNum & KMH_LSH_PLAN_ROWID) {
+        int rc = kmh_lsh_prepare(vtab, &cur->scan, "SELECT id, sig FROM \"%w\".\"%w_data\" WHERE id = ?");
+        if (rc != SQLITE_OK) return rc;
+        sqlite3_bind_value(cur->scan, 1, argv[0]);
+        return kmh_lsh_scan_step(cur);
+    }
+    if (!(idxNum & KMH_LSH_PLAN_QUERY)) {
+        int rc = kmh_lsh_prepare(vtab, &cur->scan, "SELECT id, sig FROM \"%w\".\"%w_data\"");
+        if (rc != SQLITE_OK) return rc;
+        return kmh_lsh_scan_step(cur);
+    }
+
+    // A query that isn't a 32-bit sketch matches nothing
+    kvalue_minhash_t *query = kmh_from_blob(argv[0]);
+    if (!query) return SQLITE_OK;
+    double threshold = idxNum & KMH_LSH_PLAN_THRESHOLD ? sqlite3_value_double(argv[1]) : vtab->threshold;
+    int rc = kmh_lsh_load(vtab);
+    if (rc == SQLITE_OK) {
+        cur->count = kmh_lsh_query(vtab->lsh, query, threshold, &cur->matches);
+        if (cur->count == SIZE_MAX) {
+            cur->count = 0;
+            rc = SQLITE_NOMEM;
+        }
+    }
+    kmh_free(query);
+    cur->eof = cur->count == 0;
+    return rc;
+}
+
+static int kmh_lsh_next(sqlite3_vtab_cursor *pCursor) {
+    kmh_lsh_cursor *cur = (kmh_lsh_cursor *)pCursor;
+    if (cur->scan) return kmh_lsh_scan_step(cur);
+    cur->eof = ++cur->pos >= cur->count;
+    return SQLITE_OK;
+}
+
+static int kmh_lsh_eof(sqlite3_vtab_cursor *pCursor) {
+    return ((kmh_lsh_cursor *)pCursor)->eof;
+}
+
+static int kmh_lsh_rowid(sqlite3_vtab_cursor *pCursor, sqlite3_int64 *pRowid) {
+    kmh_lsh_cursor *cur = (kmh_lsh_cursor *)pCursor;
+    *pRowid = cur->scan ? sqlite3_column_int64(cur->scan, 0) : cur->matches[cur->pos].id;
+    return SQLITE_OK;
+}
+
+static int kmh_lsh_column(sqlite3_vtab_cursor *pCursor, sqlite3_context *context, int col) {
+    kmh_lsh_cursor *cur = (kmh_lsh_cursor *)pCursor;
+    if (col == KMH_LSH_COL_SIMILARITY) {
+        if (!cur->scan) sqlite3_result_double(context, cur->matches[cur->pos].similarity);
+        return SQLITE_OK;
+    }
+    if (col != KMH_LSH_COL_SIG) return SQLITE_OK;
+    if (cur->scan) {
+        sqlite3_result_value(context, sqlite3_column_value(cur->scan, 1));
+        return SQLITE_OK;
+    }
+
+    // Query results carry only the rowid; the stored blob comes from the shadow table
+    if (!cur->lookup) {
+        int rc = kmh_lsh_prepare((kmh_lsh_vtab *)pCursor->pVtab, &cur->lookup,
+                                 "SELECT sig FROM \"%w\".\"%w_data\" WHERE id = ?");
+        if (rc != SQLITE_OK) return rc;
+    }
+    sqlite3_bind_int64(cur->lookup, 1, cur->matches[cur->pos].id);
+    if (sqlite3_step(cur->lookup) == SQLITE_ROW) {
+        sqlite3_result_value(context, sqlite3_column_value(cur->lookup, 0));
+    }
+    return sqlite3_reset(cur->lookup);
+}
+
+// argc == 1: DELETE argv[0]; argv[0] NULL: INSERT; otherwise UPDATE argv[0]
+static int kmh_lsh_update(sqlite3_vtab *pVtab, int argc, sqlite3_value **argv, sqlite3_int64 *pRowid) {
+    kmh_lsh_vtab *vtab = (kmh_lsh_vtab *)pVtab;
+    int rc = kmh_lsh_load(vtab);
+    if (rc != SQLITE_OK) return rc;
+
+    sqlite3_stmt *stmt = NULL;
+    kvalue_minhash_t *kmh = NULL;
+    if (argc > 1) {
+        kmh = kmh_from_blob(argv[2 + KMH_LSH_COL_SIG]);
+        if (!kmh) {
+            sqlite3_free(pVtab->zErrMsg);
+            pVtab->zErrMsg = sqlite3_mprintf("kmh_lsh: sig must be a 32-bit sketch");
+            return SQLITE_CONSTRAINT;
+        }
+    }
+
+    int remove = sqlite3_value_type(argv[0]) != SQLITE_NULL;
+    sqlite3_int64 old_id = remove ? sqlite3_value_int64(argv[0]) : 0;
+    if (remove) {
+        rc = kmh_lsh_prepare(vtab, &stmt, "DELETE FROM \"%w\".\"%w_data\" WHERE id = ?");
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, old_id);
+            sqlite3_step(stmt);
+            rc = sqlite3_finalize(stmt);
+        }
+    }
+    if (rc == SQLITE_OK && kmh) {
+        rc = kmh_lsh_prepare(vtab, &stmt, "INSERT INTO \"%w\".\"%w_data\"(id, sig) VALUES (?, ?)");
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_value(stmt, 1, argv[1]);
+            sqlite3_bind_value(stmt, 2, argv[2 + KMH_LSH_COL_SIG]);
+            sqlite3_step(stmt);
+            rc = sqlite3_finalize(stmt);
+        }
+        if (rc == SQLITE_OK) *pRowid = sqlite3_last_insert_rowid(vtab->db);
+    }
+
+    if (rc == SQLITE_OK) {
+        if (remove) kmh_lsh_remove(vtab->lsh, old_id);
+        if (kmh && !kmh_lsh_insert(vtab->lsh, *pRowid, kmh)) rc = SQLITE_NOMEM;
+    } else {
+        sqlite3_free(pVtab->zErrMsg);
+        pVtab->zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+    }
+    if (rc != SQLITE_OK) {
+        // The statement is rolled back; rebuild from the shadow table next time
+        kmh_lsh_free(vtab->lsh);
+        vtab->lsh = NULL;
+    }
+    kmh_free(kmh);
+    return rc;
+}
+
+static int kmh_lsh_rollback(sqlite3_vtab *pVtab) {
+    kmh_lsh_vtab *vtab = (kmh_lsh_vtab *)pVtab;
+    kmh_lsh_free(vtab->lsh);
+    vtab->lsh = NULL;
+    return SQLITE_OK;
+}
+
+static int kmh_lsh_rollback_to(sqlite3_vtab *pVtab, int savepoint) {
+    (void)savepoint;
+    return kmh_lsh_rollback(pVtab);
+}
+
+static int kmh_lsh_tx_ok(sqlite3_vtab *pVtab) {
+    (void)pVtab;
+    return SQLITE_OK;
+}
+
+static int kmh_lsh_savepoint_ok(sqlite3_vtab *pVtab, int savepoint) {
+    (void)pVtab; (void)savepoint;
+    return SQLITE_OK;
+}
+
+// kmh_similar(sig, query) on the table: the overload the planner hands to xBestIndex
+static void kmh_lsh_similar_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    kmh_lsh_vtab *vtab = sqlite3_user_data(context);
+    kmh_similar_result(context, argv, vtab->threshold);
+}
+
+static int kmh_lsh_find_function(sqlite3_vtab *pVtab, int argc, const char *name,
+                                 void (**pxFunc)(sqlite3_context *, int, sqlite3_value **), void **ppArg) {
+    if (argc != 2 || sqlite3_stricmp(name, "kmh_similar") != 0) return 0;
+    *pxFunc = kmh_lsh_similar_func;
+    *ppArg = pVtab;
+    return KMH_LSH_SIMILAR_OP;
+}
+
+static int kmh_lsh_rename(sqlite3_vtab *pVtab, const char *new_name) {
+    kmh_lsh_vtab *vtab = (kmh_lsh_vtab *)pVtab;
+    char *sql = sqlite3_mprintf("ALTER TABLE \"%w\".\"%w_data\" RENAME TO \"%w_data\"",
+                                vtab->schema, vtab->name, new_name);
+    if (!sql) return SQLITE_NOMEM;
+    int rc = sqlite3_exec(vtab->db, sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+    if (rc == SQLITE_OK) {
+        char *name = sqlite3_mprintf("%s", new_name);
+        if (!name) return SQLITE_NOMEM;
+        sqlite3_free(vtab->name);
+        vtab->name = name;
+    }
+    return rc;
+}
+
+static int kmh_lsh_shadow_name(const char *suffix) {
+    return sqlite3_stricmp(suffix, "data") == 0;
+}
+
+static sqlite3_module kmh_lsh_module = {
+    3,                      // iVersion
+    kmh_lsh_create,
+    kmh_lsh_connect,
+    kmh_lsh_best_index,
+    kmh_lsh_disconnect,
+    kmh_lsh_destroy,
+    kmh_lsh_open,
+    kmh_lsh_close,
+    kmh_lsh_filter,
+    kmh_lsh_next,
+    kmh_lsh_eof,
+    kmh_lsh_column,
+    kmh_lsh_rowid,
+    kmh_lsh_update,
+    kmh_lsh_tx_ok,          // xBegin
+    kmh_lsh_tx_ok,          // xSync
+    kmh_lsh_tx_ok,          // xCommit
+    kmh_lsh_rollback,
+    kmh_lsh_find_function,
+    kmh_lsh_rename,
+    kmh_lsh_savepoint_ok,   // xSavepoint
+    kmh_lsh_savepoint_ok,   // xRelease
+    kmh_lsh_rollback_to,
+    kmh_lsh_shadow_name,
+};
+
+// kmh_each(sig): the hashes of a 32-bit sketch, one row each, largest first
+//   SELECT hash FROM kmh_each(:sig) WHERE hash < 1000000;
+//   SELECT count(*) FROM kmh_each(:a) JOIN kmh_each(:b) USING (hash);
+// kmh_stats(sig): one row of k, count, threshold (the largest kept hash once
+// the sketch is full, NULL before), cardinality and rse, the relative
+// standard error of cardinality (0 while it is exact)
+//   SELECT id, s.cardinality, s.rse FROM docs, kmh_stats(docs.sig) AS s;
+// Both are eponymous table-valued functions; anything but a 32-bit sketch
+// yields no rows. A table-valued function's arguments don't outlive xFilter,
+// so kmh_each keeps a copy of the blob and xNext reads hashes straight out of
+// a view of it (a compressed blob is decoded once instead). Constraints on
+// hash narrow the scan to a binary-searched slice of the descending hashes,
+// and ORDER BY hash DESC needs no sort. kmh_stats reads the header and
+// hashes[0] only.
+#define KMH_EACH_COL_HASH 0
+#define KMH_EACH_COL_SIG  1
+
+#define KMH_STATS_COL_K           0
+#define KMH_STATS_COL_COUNT       1
+#define KMH_STATS_COL_THRESHOLD   2
+#define KMH_STATS_COL_CARDINALITY 3
+#define KMH_STATS_COL_RSE         4
+#define KMH_STATS_COL_SIG         5
+
+// Bounds kmh_each's xBestIndex hands to xFilter after sig, one idxStr
+// character each
+#define KMH_EACH_BOUND_EQ '='
+#define KMH_EACH_BOUND_LT '<'
+#define KMH_EACH_BOUND_LE 'l'
+#define KMH_EACH_BOUND_GT '>'
+#define KMH_EACH_BOUND_GE 'g'
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    sqlite3_value *sig;  // kmh_each: the cursor's copy of a raw blob
+    uint8_t *decoded;    // kmh_each: hashes of a compressed blob
+    kmh_view_t view;     // kmh_stats: only the header fields
+    uint32_t threshold;  // kmh_stats: hashes[0]
+    double cardinality;  // kmh_stats
+    uint32_t pos, end;   // rows left: [pos, end)
+} kmh_sig_cursor;
+
+static int kmh_sig_connect(sqlite3 *db, const char *schema, sqlite3_vtab **ppVtab, char **pzErr) {
+    int rc = sqlite3_declare_vtab(db, schema);
+    if (rc != SQLITE_OK) return rc;
+    sqlite3_vtab *vtab = sqlite3_malloc(sizeof(sqlite3_vtab));
+    if (!vtab) return SQLITE_NOMEM;
+    memset(vtab, 0, sizeof(*vtab));
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+    *ppVtab = vtab;
+    (void)pzErr;
+    return SQLITE_OK;
+}
+
+static int kmh_each_connect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                            sqlite3_vtab **ppVtab, char **pzErr) {
+    (void)aux; (void)argc; (void)argv;
+    return kmh_sig_connect(db, "CREATE TABLE x(hash INTEGER, sig HIDDEN)", ppVtab, pzErr);
+}
+
+static int kmh_stats_connect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                             sqlite3_vtab **ppVtab, char **pzErr) {
+    (void)aux; (void)argc; (void)argv;
+    return kmh_sig_connect(db, "CREATE TABLE x(k INTEGER, count INTEGER, threshold INTEGER, cardinality REAL, "
+                               "rse REAL, sig HIDDEN)", ppVtab, pzErr);
+}
+
+static int kmh_sig_disconnect(sqlite3_vtab *pVtab) {
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+// Finds the usable sig = ? constraint; SQLITE_CONSTRAINT steers the planner
+// to an order that can supply it
+static int kmh_sig_best_index_arg(sqlite3_index_info *info, int col, int *arg) {
+    int unusable = 0;
+    *arg = -1;
+    for (int i = 0; i < info->nConstraint; i++) {
+        const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+        if (c->iColumn != col || c->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+        if (!c->usable) {
+            unusable = 1;
+        } else if (*arg < 0) {
+            *arg = i;
+            info->aConstraintUsage[i].argvIndex = 1;
+            info->aConstraintUsage[i].omit = 1;
+        }
+    }
+    return *arg < 0 && unusable ? SQLITE_CONSTRAINT : SQLITE_OK;
+}
+
+static int kmh_each_best_index(sqlite3_vtab *pVtab, sqlite3_index_info *info) {
+    (void)pVtab;
+    int sig;
+    int rc = kmh_sig_best_index_arg(info, KMH_EACH_COL_SIG, &sig);
+    if (rc != SQLITE_OK || sig < 0) {
+        info->estimatedCost = 1e12;
+        return rc;
+    }
+    
+    char bounds[16];
+    int nbounds = 0;
+    for (int i = 0; i < info->nConstraint && nbounds < (int)sizeof(bounds) - 1; i++) {
+        const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+        if (!c->usable || c->iColumn != KMH_EACH_COL_HASH) continue;
+        char bound;
+        switch (c->op) {
+            case SQLITE_INDEX_CONSTRAINT_EQ: bound = KMH_EACH_BOUND_EQ; break;
+            case SQLITE_INDEX_CONSTRAINT_LT: bound = KMH_EACH_BOUND_LT; break;
+            case SQLITE_INDEX_CONSTRAINT_LE: bound = KMH_EACH_BOUND_LE; break;
+            case SQLITE_INDEX_CONSTRAINT_GT: bound = KMH_EACH_BOUND_GT; break;
+            case SQLITE_INDEX_CONSTRAINT_GE: bound = KMH_EACH_BOUND_GE; break;
+            default: continue;
+        }
+        // xFilter only narrows the scan; SQLite still checks each row, which
+        // keeps its comparison rules for non-integer operands
+        bounds[nbounds++] = bound;
+        info->aConstraintUsage[i].argvIndex = 1 + nbounds;
+    }
+    bounds[nbounds] = '\0';
+    
+    info->estimatedRows = DEFAULT_K;
+    for (int b = 0; b < nbounds; b++) info->estimatedRows /= bounds[b] == KMH_EACH_BOUND_EQ ? DEFAULT_K : 4;
+    if (info->estimatedRows < 1) info->estimatedRows = 1;
+    info->estimatedCost = 10.0 + (double)info->estimatedRows;
+    if (nbounds) {
+        info->idxStr = sqlite3_mprintf("%s", bounds);
+        if (!info->idxStr) return SQLITE_NOMEM;
+        info->needToFreeIdxStr = 1;
+    }
+    if (info->nOrderBy == 1 && info->aOrderBy[0].iColumn == KMH_EACH_COL_HASH && info->aOrderBy[0].desc) {
+        info->orderByConsumed = 1;
+    }
+    return SQLITE_OK;
+}
+
+static int kmh_stats_best_index(sqlite3_vtab *pVtab, sqlite3_index_info *info) {
+    (void)pVtab;
+    int sig;
+    int rc = kmh_sig_best_index_arg(info, KMH_STATS_COL_SIG, &sig);
+    info->estimatedCost = sig < 0 ? 1e12 : 1.0;
+    info->estimatedRows = 1;
+    return rc;
+}
+
+static int kmh_sig_open(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+    (void)pVtab;
+    kmh_sig_cursor *cur = sqlite3_malloc(sizeof(kmh_sig_cursor));
+    if (!cur) return SQLITE_NOMEM;
+    memset(cur, 0, sizeof(*cur));
+    *ppCursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static void kmh_sig_cursor_reset(kmh_sig_cursor *cur) {
+    sqlite3_value_free(cur->sig);
+    sqlite3_free(cur->decoded);
+    cur->sig = NULL;
+    cur->decoded = NULL;
+    cur->pos = cur->end = 0;
+}
+
+static int kmh_sig_close(sqlite3_vtab_cursor *pCursor) {
+    kmh_sig_cursor *cur = (kmh_sig_cursor *)pCursor;
+    kmh_sig_cursor_reset(cur);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+// Narrows [*lo, *hi] (hash values, as 64-bit integers) by hash <op> val.
+// Operands that aren't numbers don't narrow; SQLite's own check decides.
+static void kmh_each_narrow(char op, sqlite3_value *val, sqlite3_int64 *lo, sqlite3_int64 *hi) {
+    int type = sqlite3_value_numeric_type(val);
+    sqlite3_int64 floor_v, ceil_v;
+    if (type == SQLITE_INTEGER) {
+        floor_v = ceil_v = sqlite3_value_int64(val);
+    } else if (type == SQLITE_FLOAT) {
+        double d = sqlite3_value_double(val);
+        if (d != d) return;
+        if (d < -1.0) d = -1.0;
+        if (d > 4294967296.0) d = 4294967296.0;
+        floor_v = (sqlite3_int64)floor(d);
+        ceil_v = (sqlite3_int64)ceil(d);
+    } else {
+        return;
+    }
+    // Past the hash range a bound either keeps everything or nothing; the
+    // clamp to [-1, 2^32] also keeps the +1 and -1 below from overflowing
+    if (floor_v < -1) floor_v = -1;
+    if (floor_v > 4294967296LL) floor_v = 4294967296LL;
+    if (ceil_v < -1) ceil_v = -1;
+    if (ceil_v > 4294967296LL) ceil_v = 4294967296LL;
+    
+    sqlite3_int64 new_lo = *lo, new_hi = *hi;
+    switch (op) {
+        case KMH_EACH_BOUND_EQ: new_lo = ceil_v; new_hi = floor_v; break;
+        case KMH_EACH_BOUND_LT: new_hi = ceil_v - 1; break;
+        case KMH_EACH_BOUND_LE: new_hi = floor_v; break;
+        case KMH_EACH_BOUND_GT: new_lo = floor_v + 1; break;
+        case KMH_EACH_BOUND_GE: new_lo = ceil_v; break;
+    }
+    if (new_lo > *lo) *lo = new_lo;
+    if (new_hi < *hi) *hi = new_hi;
+}
+
+static int kmh_each_filter(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+                           int argc, sqlite3_value **argv) {
+    (void)idxNum;
+    kmh_sig_cursor *cur = (kmh_sig_cursor *)pCursor;
+    kmh_sig_cursor_reset(cur);
+    if (argc == 0 || sqlite3_value_type(argv[0]) != SQLITE_BLOB) return SQLITE_OK;
+    
+    const uint8_t *blob = sqlite3_value_blob(argv[0]);
+    int blob_size = sqlite3_value_bytes(argv[0]);
+    kmh_blob_info_t info;
+    if (!kmh_blob_parse(&info, blob, blob_size) || info.width != sizeof(uint32_t)) return SQLITE_OK;
+    if (info.encoding == KMH_ENCODING_RAW) {
+        if (!(cur->sig = sqlite3_value_dup(argv[0]))) return SQLITE_NOMEM;
+        if (!kmh_view_init(&cur->view, sqlite3_value_blob(cur->sig), blob_size)) return SQLITE_OK;
+    } else {
+        if (!(cur->decoded = sqlite3_malloc64((uint64_t)info.count * sizeof(uint32_t) + 1))) return SQLITE_NOMEM;
+        if (!kmh_decode_to_view(&info, blob, blob_size, cur->decoded, &cur->view)) return SQLITE_OK;
+    }
+    
+    sqlite3_int64 lo = 0, hi = UINT32_MAX;
+    for (int i = 1; i < argc && idxStr && idxStr[i - 1]; i++) kmh_each_narrow(idxStr[i - 1], argv[i], &lo, &hi);
+    if (lo > hi) return SQLITE_OK;
+    // Descending: the hashes <= hi start at pos, the ones >= lo end before end
+    cur->pos = kmh_view_search(&cur->view, (uint32_t)hi);
+    cur->end = lo > 0 ? kmh_view_search(&cur->view, (uint32_t)(lo - 1)) : cur->view.count;
+    return SQLITE_OK;
+}
+
+static int kmh_stats_filter(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+                            int argc, sqlite3_value **argv) {
+    (void)idxNum; (void)idxStr;
+    kmh_sig_cursor *cur = (kmh_sig_cursor *)pCursor;
+    kmh_sig_cursor_reset(cur);
+    if (argc == 0 || sqlite3_value_type(argv[0]) != SQLITE_BLOB) return SQLITE_OK;
+    
+    const uint8_t *blob = sqlite3_value_blob(argv[0]);
+    int blob_size = sqlite3_value_bytes(argv[0]);
+    kmh_blob_info_t info;
+    // Every encoding stores hashes[0] as is, so the view's first hash is readable
+    if (!kmh_blob_parse(&info, blob, blob_size) || info.width != sizeof(uint32_t) ||
+        info.space_size > UINT32_MAX || info.seed > UINT32_MAX ||
+        (info.count && (uint32_t)blob_size < info.data_offset + sizeof(uint32_t))) {
+        return SQLITE_OK;
+    }
+    cur->view = (kmh_view_t){ info.k, info.count, (uint32_t)info.space_size, (uint32_t)info.seed,
+                              blob + info.data_offset, NULL, 0 };
+    cur->threshold = info.count ? kmh_view_hash(&cur->view, 0) : 0;
+    cur->cardinality = kmh_view_cardinality(&cur->view);
+    cur->view.hashes = NULL; // not valid past xFilter
+    cur->end = 1;
+    return SQLITE_OK;
+}
+
+static int kmh_sig_next(sqlite3_vtab_cursor *pCursor) {
+    ((kmh_sig_cursor *)pCursor)->pos++;
+    return SQLITE_OK;
+}
+
+static int kmh_sig_eof(sqlite3_vtab_cursor *pCursor) {
+    kmh_sig_cursor *cur = (kmh_sig_cursor *)pCursor;
+    return cur->pos >= cur->end;
+}
+
+static int kmh_sig_rowid(sqlite3_vtab_cursor *pCursor, sqlite3_int64 *pRowid) {
+    *pRowid = ((kmh_sig_cursor *)pCursor)->pos;
+    return SQLITE_OK;
+}
+
+static int kmh_each_column(sqlite3_vtab_cursor *pCursor, sqlite3_context *context, int col) {
+    kmh_sig_cursor *cur = (kmh_sig_cursor *)pCursor;
+    if (col == KMH_EACH_COL_HASH) sqlite3_result_int64(context, kmh_view_hash(&cur->view, cur->pos));
+    return SQLITE_OK;
+}
+
+static int kmh_stats_column(sqlite3_vtab_cursor *pCursor, sqlite3_context *context, int col) {
+    kmh_sig_cursor *cur = (kmh_sig_cursor *)pCursor;
+    uint32_t k = cur->view.k;
+    int full = cur->view.count == k && k > 0;
+    switch (col) {
+        case KMH_STATS_COL_K: sqlite3_result_int64(context, k); break;
+        case KMH_STATS_COL_COUNT: sqlite3_result_int64(context, cur->view.count); break;
+        case KMH_STATS_COL_THRESHOLD:
+            if (full) sqlite3_result_int64(context, cur->threshold);
+            break;
+        case KMH_STATS_COL_CARDINALITY: sqlite3_result_double(context, cur->cardinality); break;
+        case KMH_STATS_COL_RSE:
+            // KMV's (k - 1) / U(k) estimator has a relative standard error of 1 / sqrt(k - 2)
+            if (!full) {
+                sqlite3_result_double(context, 0.0);
+            } else if (k > 2) {
+                sqlite3_result_double(context, 1.0 / sqrt(k - 2.0));
+            }
+            break;
+    }
+    return SQLITE_OK;
+}
+
+// Eponymous-only: xCreate is NULL, so CREATE VIRTUAL TABLE can't name them
+static sqlite3_module kmh_each_module = {
+    0,                      // iVersion
+    NULL,                   // xCreate
+    kmh_each_connect,
+    kmh_each_best_index,
+    kmh_sig_disconnect,
+    NULL,                   // xDestroy
+    kmh_sig_open,
+    kmh_sig_close,
+    kmh_each_filter,
+    kmh_sig_next,
+    kmh_sig_eof,
+    kmh_each_column,
+    kmh_sig_rowid,
+    NULL,                   // xUpdate
+    NULL,                   // xBegin
+    NULL,                   // xSync
+    NULL,                   // xCommit
+    NULL,                   // xRollback
+    NULL,                   // xFindFunction
+    NULL,                   // xRename
+    NULL,                   // xSavepoint
+    NULL,                   // xRelease
+    NULL,                   // xRollbackTo
+    NULL,                   // xShadowName
+};
+
+static sqlite3_module kmh_stats_module = {
+    0,                      // iVersion
+    NULL,                   // xCreate
+    kmh_stats_connect,
+    kmh_stats_best_index,
+    kmh_sig_disconnect,
+    NULL,                   // xDestroy
+    kmh_sig_open,
+    kmh_sig_close,
+    kmh_stats_filter,
+    kmh_sig_next,
+    kmh_sig_eof,
+    kmh_stats_column,
+    kmh_sig_rowid,
+    NULL,                   // xUpdate
+    NULL,                   // xBegin
+    NULL,                   // xSync
+    NULL,                   // xCommit
+    NULL,                   // xRollback
+    NULL,                   // xFindFunction
+    NULL,                   // xRename
+    NULL,                   // xSavepoint
+    NULL,                   // xRelease
+    NULL,                   // xRollbackTo
+    NULL,                   // xShadowName
+};
+
 // Extension entry point
 #ifdef _WIN32
 __declspec(dllexport)
@@ -270,11 +2803,31 @@ int sqlite3_kmh_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *p
     
     int rc = SQLITE_OK;
     
+    // Connection defaults, freed along with the kmh_config function. Direct
+    // only: they change every later sketch, so schema can't set them
+    kmh_config_t *config = sqlite3_malloc(sizeof(kmh_config_t));
+    if (!config) return SQLITE_NOMEM;
+    config->k = DEFAULT_K;
+    config->space_size = DEFAULT_SPACE_SIZE;
+    config->seed = DEFAULT_SEED;
+    atomic_fetch_add_explicit(&kmh_connections, 1, memory_order_relaxed);
+    rc = sqlite3_create_function_v2(db, "kmh_config", -1, SQLITE_UTF8 | SQLITE_DIRECTONLY, config, kmh_config_func, NULL, NULL, kmh_config_free);
+    if (rc != SQLITE_OK) return rc;
+    
     // Register scalar functions
-    rc = sqlite3_create_function(db, "kmh_create", -1, SQLITE_UTF8, NULL, kmh_create_func, NULL, NULL);
+    rc = sqlite3_create_function(db, "kmh_create", -1, SQLITE_UTF8, config, kmh_create_func, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_create_function(db, "kmh_create_k", -1, SQLITE_UTF8, config, kmh_create_k_func, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_create_function(db, "kmh_create64", -1, SQLITE_UTF8, config, kmh_create64_func, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_create_function(db, "kmh_add", -1, SQLITE_UTF8, NULL, kmh_add_func, NULL, NULL);
     if (rc != SQLITE_OK) return rc;
     
-    rc = sqlite3_create_function(db, "kmh_add", 2, SQLITE_UTF8, NULL, kmh_add_func, NULL, NULL);
+    rc = sqlite3_create_function(db, "kmh_compress", -1, SQLITE_UTF8, NULL, kmh_compress_func, NULL, NULL);
     if (rc != SQLITE_OK) return rc;
     
     rc = sqlite3_create_function(db, "kmh_merge", 2, SQLITE_UTF8, NULL, kmh_merge_func, NULL, NULL);
@@ -283,17 +2836,73 @@ int sqlite3_kmh_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *p
     rc = sqlite3_create_function(db, "kmh_cardinality", 1, SQLITE_UTF8, NULL, kmh_cardinality_func, NULL, NULL);
     if (rc != SQLITE_OK) return rc;
     
+    rc = sqlite3_create_function(db, "kmh_distance", 2, SQLITE_UTF8, NULL, kmh_distance_func, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_create_function(db, "kmh_similar", -1, SQLITE_UTF8, NULL, kmh_similar_func, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
     rc = sqlite3_create_function(db, "kmh_merge_cardinality", 2, SQLITE_UTF8, NULL, kmh_merge_cardinality_func, NULL, NULL);
     if (rc != SQLITE_OK) return rc;
     
+    rc = sqlite3_create_function(db, "kmh_union_cardinality", 2, SQLITE_UTF8, NULL, kmh_union_cardinality_func, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_create_function(db, "kmh_intersection_cardinality", 2, SQLITE_UTF8, NULL, kmh_intersection_cardinality_func, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_create_function(db, "kmh_difference_cardinality", 2, SQLITE_UTF8, NULL, kmh_difference_cardinality_func, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_create_function(db, "kmh_containment", 2, SQLITE_UTF8, NULL, kmh_containment_func, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_create_function(db, "kmh_debug_stats", 0, SQLITE_UTF8, NULL, kmh_debug_stats_func, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
     // Register aggregate functions
-    rc = sqlite3_create_function(db, "kmh_group_create", 1, SQLITE_UTF8, NULL, NULL, kmh_group_create_step, kmh_group_create_final);
+    rc = sqlite3_create_window_function(db, "kmh_group_create", -1, SQLITE_UTF8, config, kmh_group_create_step, kmh_group_create_final, kmh_group_create_value, kmh_group_inverse, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_create_function(db, "kmh_group_create64", 1, SQLITE_UTF8, config, NULL, kmh_group_create64_step, kmh_group_create64_final);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_create_window_function(db, "kmh_group_merge", 1, SQLITE_UTF8, NULL, kmh_group_merge_step, kmh_group_merge_final, kmh_group_merge_value, kmh_group_inverse, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_create_window_function(db, "kmh_group_merge_cardinality", 1, SQLITE_UTF8, NULL, kmh_group_merge_step, kmh_group_merge_cardinality_final, kmh_group_merge_cardinality_value, kmh_group_inverse, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_create_function(db, "kmh_group_window", 4, SQLITE_UTF8, config, NULL, kmh_group_window_step, kmh_group_window_final);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_create_function(db, "kmh_window_add", 3, SQLITE_UTF8, NULL, kmh_window_add_func, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_create_function(db, "kmh_window_cardinality", -1, SQLITE_UTF8, NULL, kmh_window_cardinality_func, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_create_function(db, "kmh_window_sketch", -1, SQLITE_UTF8, NULL, kmh_window_sketch_func, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+#ifdef KMH_HAVE_MMAP
+    // They touch files by path: like readfile/writefile, not from triggers,
+    // views or schema, which an untrusted database file could carry
+    rc = sqlite3_create_function(db, "kmh_store_save", 3, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, NULL, kmh_store_save_step, kmh_store_save_final);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_create_function(db, "kmh_store_get", 2, SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL, kmh_store_get_func, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+#endif
+    
+    // Register virtual tables
+    rc = sqlite3_create_module(db, "kmh_lsh", &kmh_lsh_module, NULL);
     if (rc != SQLITE_OK) return rc;
     
-    rc = sqlite3_create_function(db, "kmh_group_merge", 1, SQLITE_UTF8, NULL, NULL, kmh_group_merge_step, kmh_group_merge_final);
+    rc = sqlite3_create_module(db, "kmh_each", &kmh_each_module, NULL);
     if (rc != SQLITE_OK) return rc;
     
-    rc = sqlite3_create_function(db, "kmh_group_merge_cardinality", 1, SQLITE_UTF8, NULL, NULL, kmh_group_merge_step, kmh_group_merge_cardinality_final);
+    rc = sqlite3_create_module(db, "kmh_stats", &kmh_stats_module, NULL);
     if (rc != SQLITE_OK) return rc;
     
     return SQLITE_OK;
@@ -0,0 +1,790 @@
+// SQL-level tests: loads the extension into an in-memory database and checks
+// the SQL functions against the C API.
+//
+//   gcc -O2 -fPIC -shared -o kmh.so sqlite/src/kmh.c
+//   gcc -O2 -o kmh_sqltest sqlite/src/test.c -lsqlite3 -lm -lpthread
+//   ./kmh_sqltest [path/to/kmh.so]
+#include "../../src/kmh.h"
+#include <sqlite3.h>
+#include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+
+#define TEST(name, condition) do { \
+    if (condition) { \
+        printf("✓ %s\n", name); \
+    } else { \
+        printf("✗ %s FAILED\n", name); \
+        failures++; \
+    } \
+} while(0)
+
+static sqlite3 *db;
+static int failures;
+
+static void die(const char *what) {
+    fprintf(stderr, "%s: %s\n", what, sqlite3_errmsg(db));
+    exit(1);
+}
+
+static sqlite3_stmt *prepare(const char *sql) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) die(sql);
+    return stmt;
+}
+
+// Binds blobs to ?1, ?2, ... and steps to the first row; the caller reads
+// it and finalizes. Returns the sqlite3_step code.
+static int query(sqlite3_stmt **stmt, const char *sql, const uint8_t *const *blobs, const uint32_t *sizes,
+                 int nblobs) {
+    *stmt = prepare(sql);
+    for (int i = 0; i < nblobs; i++) {
+        sqlite3_bind_blob(*stmt, i + 1, blobs[i], (int)sizes[i], SQLITE_STATIC);
+    }
+    return sqlite3_step(*stmt);
+}
+
+// Column 0 of the first row as a double; NAN for NULL or an error
+static double query_double(const char *sql, const uint8_t *const *blobs, const uint32_t *sizes, int nblobs) {
+    sqlite3_stmt *stmt;
+    double result = NAN;
+    if (query(&stmt, sql, blobs, sizes, nblobs) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        result = sqlite3_column_double(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return result;
+}
+
+// 1 if column 0 of both queries is the same blob
+static int same_blob(const char *sql_a, const char *sql_b, const uint8_t *const *blobs, const uint32_t *sizes,
+                     int nblobs) {
+    sqlite3_stmt *a, *b;
+    int same = query(&a, sql_a, blobs, sizes, nblobs) == SQLITE_ROW &&
+               query(&b, sql_b, blobs, sizes, nblobs) == SQLITE_ROW &&
+               sqlite3_column_type(a, 0) == SQLITE_BLOB &&
+               sqlite3_column_bytes(a, 0) == sqlite3_column_bytes(b, 0) &&
+               memcmp(sqlite3_column_blob(a, 0), sqlite3_column_blob(b, 0), sqlite3_column_bytes(a, 0)) == 0;
+    sqlite3_finalize(a);
+    sqlite3_finalize(b);
+    return same;
+}
+
+// "from, from + 1, ..., to" into buf
+static const char *value_list(char *buf, size_t size, int from, int to) {
+    size_t n = 0;
+    buf[0] = '\0';
+    for (int v = from; v <= to && n < size; v++) {
+        n += (size_t)snprintf(buf + n, size - n, v == from ? "%d" : ", %d", v);
+    }
+    return buf;
+}
+
+// 1 if both queries return the same integer rows (NULLs included) in the
+// same order; *rows gets the count, so callers can rule out empty results
+static int same_rows(const char *sql_a, const char *sql_b, const uint8_t *const *blobs, const uint32_t *sizes,
+                     int nblobs, int *rows) {
+    sqlite3_stmt *a, *b;
+    int ra = query(&a, sql_a, blobs, sizes, nblobs), rb = query(&b, sql_b, blobs, sizes, nblobs);
+    int same = 1, n = 0;
+    for (; ra == SQLITE_ROW && rb == SQLITE_ROW; ra = sqlite3_step(a), rb = sqlite3_step(b), n++) {
+        same &= sqlite3_column_type(a, 0) == sqlite3_column_type(b, 0) &&
+                sqlite3_column_int64(a, 0) == sqlite3_column_int64(b, 0);
+    }
+    same &= ra == SQLITE_DONE && rb == SQLITE_DONE;
+    sqlite3_finalize(a);
+    sqlite3_finalize(b);
+    if (rows) *rows = n;
+    return same;
+}
+
+// Column 0 of the first row as a fresh blob; returns its size, 0 if none
+static uint32_t query_blob(const char *sql, uint8_t **out) {
+    sqlite3_stmt *stmt;
+    uint32_t size = 0;
+    *out = NULL;
+    if (query(&stmt, sql, NULL, NULL, 0) == SQLITE_ROW && sqlite3_column_type(stmt, 0) == SQLITE_BLOB &&
+        (*out = malloc((size_t)sqlite3_column_bytes(stmt, 0)))) {
+        size = (uint32_t)sqlite3_column_bytes(stmt, 0);
+        memcpy(*out, sqlite3_column_blob(stmt, 0), size);
+    }
+    sqlite3_finalize(stmt);
+    return size;
+}
+
+// Column 0 of the first row as text into buf ("" for NULL or no row)
+static const char *query_text(const char *sql, const uint8_t *const *blobs, const uint32_t *sizes, int nblobs,
+                              char *buf, size_t size) {
+    sqlite3_stmt *stmt;
+    buf[0] = '\0';
+    if (query(&stmt, sql, blobs, sizes, nblobs) == SQLITE_ROW && sqlite3_column_text(stmt, 0)) {
+        snprintf(buf, size, "%s", (const char *)sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    return buf;
+}
+
+// Opens path with the extension loaded
+static sqlite3 *open_with(const char *path, const char *ext) {
+    sqlite3 *conn;
+    char *err = NULL;
+    if (sqlite3_open(path, &conn) != SQLITE_OK) die(path);
+    sqlite3_db_config(conn, SQLITE_DBCONFIG_ENABLE_LOAD_EXTENSION, 1, NULL);
+    if (sqlite3_load_extension(conn, ext, "sqlite3_kmh_init", &err) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", ext, err);
+        exit(1);
+    }
+    return conn;
+}
+
+// 1 if sql fails with an error mentioning what
+static int fails_with(const char *sql, const char *what) {
+    return sqlite3_exec(db, sql, NULL, NULL, NULL) == SQLITE_ERROR && strstr(sqlite3_errmsg(db), what) != NULL;
+}
+
+// 1 if blob is a blocked sketch whose directory has a start and first hash
+// per block, in order, with blocks no bigger than kmh_blocked_t leaves
+static int blocked_dir_ok(const uint8_t *blob, uint32_t size) {
+    kmh_view_t v;
+    if (!blob || !kmh_view_init(&v, blob, size) || (!v.dir && v.count > 0)) return 0;
+    for (uint32_t b = 0; b < v.nblocks; b++) {
+        uint32_t start = kmh_load_le32(v.dir + b * KMH_DIR_ENTRY_SIZE + 4);
+        uint32_t end = b + 1 < v.nblocks ? kmh_load_le32(v.dir + (b + 1) * KMH_DIR_ENTRY_SIZE + 4) : v.count;
+        if ((b == 0 && start != 0) || end <= start || end - start > KMH_LEAF_HASHES || end > v.count ||
+            kmh_load_le32(v.dir + b * KMH_DIR_ENTRY_SIZE) != kmh_view_hash(&v, start)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// kmh_add on a blocked blob (sql_a) against the sketch built at once
+// (sql_b): the same count hashes, and a directory readers can use
+static int blocked_add_matches(const char *sql_a, const char *sql_b, const uint8_t *const *blobs,
+                               const uint32_t *sizes, int nblobs, uint32_t count) {
+    sqlite3_stmt *a = NULL, *b = NULL;
+    int ok = query(&a, sql_a, blobs, sizes, nblobs) == SQLITE_ROW &&
+             query(&b, sql_b, blobs, sizes, nblobs) == SQLITE_ROW;
+    if (ok) {
+        const uint8_t *blob = sqlite3_column_blob(a, 0);
+        uint32_t size = (uint32_t)sqlite3_column_bytes(a, 0);
+        kmh_blocked_t *x = kmh_blocked_deserialize(blob, size);
+        kmh_blocked_t *y = kmh_blocked_deserialize(sqlite3_column_blob(b, 0), (uint32_t)sqlite3_column_bytes(b, 0));
+        ok = blocked_dir_ok(blob, size) && x && y && x->count == count && y->count == count &&
+             kmh_blocked_distance(x, y) == 0.0;
+        kmh_blocked_free(x);
+        kmh_blocked_free(y);
+    }
+    sqlite3_finalize(a);
+    sqlite3_finalize(b);
+    return ok;
+}
+
+// kmh_add on a raw blob (the in-place splice) against the sketch built from
+// every value at once, for kmh_create and kmh_create64; the 32-bit one also
+// against the decoding path, through a varint copy of the blob
+static int add_matches(const char *initial, const char *added) {
+    static const char *const create[2] = { "kmh_create", "kmh_create64" };
+    char sql_a[2048], sql_b[2048];
+    int ok = 1;
+    for (int w = 0; w < 2; w++) {
+        snprintf(sql_a, sizeof(sql_a), "SELECT kmh_add(%s(%s), %s)", create[w], initial, added);
+        snprintf(sql_b, sizeof(sql_b), "SELECT %s(%s, %s)", create[w], initial, added);
+        ok &= same_blob(sql_a, sql_b, NULL, NULL, 0);
+    }
+    snprintf(sql_a, sizeof(sql_a), "SELECT kmh_add(kmh_create(%s), %s)", initial, added);
+    snprintf(sql_b, sizeof(sql_b), "SELECT kmh_compress(kmh_add(kmh_compress(kmh_create(%s), 'varint'), %s), 'raw')",
+             initial, added);
+    return ok && same_blob(sql_a, sql_b, NULL, NULL, 0);
+}
+
+int main(int argc, char **argv) {
+    const char *ext = argc > 1 ? argv[1] : "./kmh.so";
+    if (sqlite3_open(":memory:", &db) != SQLITE_OK) die("open");
+    sqlite3_db_config(db, SQLITE_DBCONFIG_ENABLE_LOAD_EXTENSION, 1, NULL);
+    char *err = NULL;
+    if (sqlite3_load_extension(db, ext, "sqlite3_kmh_init", &err) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", ext, err);
+        return 1;
+    }
+    printf("KValue MinHash SQL Tests\n");
+    printf("========================\n");
+
+    // Blocked blobs past MAX_K * 10 stay blocked through the aggregates
+    kmh_blocked_t *ba = kmh_blocked_init(20000, 0xFFFFFFFF, 42), *bb = kmh_blocked_init(20000, 0xFFFFFFFF, 42);
+    for (uint32_t i = 0; i < 200000; i++) kmh_blocked_add(ba, i);
+    for (uint32_t i = 100000; i < 300000; i++) kmh_blocked_add(bb, i);
+    uint8_t *blocked[2];
+    uint32_t blocked_size[2] = { kmh_blocked_serialize(ba, &blocked[0]), kmh_blocked_serialize(bb, &blocked[1]) };
+    kmh_blocked_t *bm = kmh_blocked_merge(ba, bb);
+    double merged_card = kmh_blocked_cardinality(bm);
+    const uint8_t *const *bl = (const uint8_t *const *)blocked;
+    TEST("Blocked kmh_merge", query_double("SELECT kmh_cardinality(kmh_merge(?1, ?2))", bl, blocked_size, 2) ==
+         merged_card);
+    const char *group_merge = "SELECT kmh_group_merge(sig) FROM (SELECT ?1 AS sig UNION ALL SELECT ?2)";
+    TEST("Blocked kmh_group_merge", same_blob(group_merge, "SELECT kmh_merge(?1, ?2)", bl, blocked_size, 2));
+    TEST("Blocked kmh_group_merge cardinality",
+         query_double("SELECT kmh_cardinality(kmh_group_merge(sig)) FROM (SELECT ?1 AS sig UNION ALL SELECT ?2)",
+                      bl, blocked_size, 2) == merged_card &&
+         query_double("SELECT kmh_group_merge_cardinality(sig) FROM (SELECT ?1 AS sig UNION ALL SELECT ?2)",
+                      bl, blocked_size, 2) == merged_card);
+    // Blocked aggregates keep no frame: growing frames only
+    TEST("Blocked kmh_group_merge framed",
+         query_double("SELECT kmh_cardinality(m) FROM (SELECT kmh_group_merge(sig) OVER (ROWS UNBOUNDED PRECEDING) "
+                      "AS m FROM (SELECT ?1 AS sig UNION ALL SELECT ?2)) LIMIT 1 OFFSET 1", bl, blocked_size, 2) ==
+         merged_card);
+    sqlite3_stmt *sliding;
+    int sliding_rc = query(&sliding, "SELECT kmh_group_merge(sig) OVER (ROWS 1 PRECEDING) "
+                           "FROM (SELECT ?1 AS sig UNION ALL SELECT ?2 UNION ALL SELECT ?1)", bl, blocked_size, 2);
+    while (sliding_rc == SQLITE_ROW) sliding_rc = sqlite3_step(sliding);
+    TEST("Blocked kmh_group_merge sliding frame",
+         sliding_rc == SQLITE_ERROR && strstr(sqlite3_errmsg(db), "UNBOUNDED PRECEDING") != NULL);
+    sqlite3_finalize(sliding);
+    // Flat rows around a blocked one: the accumulator turns blocked
+    kmh_blocked_t *small_blocked = kmh_blocked_init(400, 0xFFFFFFFF, 42);
+    for (uint32_t i = 10; i <= 20; i++) kmh_blocked_add(small_blocked, i);
+    uint8_t *small_blob = NULL;
+    uint32_t small_size = kmh_blocked_serialize(small_blocked, &small_blob);
+    const uint8_t *const small_bl[1] = { small_blob };
+    sqlite3_stmt *mixed_stmt;
+    int mixed_ok = query(&mixed_stmt, "SELECT kmh_group_merge(sig) FROM (SELECT kmh_create(1, 2, 3) AS sig "
+                         "UNION ALL SELECT ?1 UNION ALL SELECT kmh_create(4, 5, 10))", small_bl, &small_size, 1) ==
+                   SQLITE_ROW;
+    if (mixed_ok) {
+        const uint8_t *blob = sqlite3_column_blob(mixed_stmt, 0);
+        uint32_t size = (uint32_t)sqlite3_column_bytes(mixed_stmt, 0);
+        kmh_blocked_t *result = kmh_blocked_deserialize(blob, size);
+        mixed_ok = blocked_dir_ok(blob, size) && result && result->count == 16;
+        kmh_blocked_free(result);
+    }
+    sqlite3_finalize(mixed_stmt);
+    TEST("Blocked kmh_group_merge after flat rows", mixed_ok);
+    kmh_blocked_free(small_blocked);
+    kmh_free_buffer(small_blob);
+
+    // k past MAX_K * 10 through SQL: sketches are built blocked, and kmh_add
+    // splices into blocked blobs, directory included
+    const char *rows_0_1999 = "WITH RECURSIVE v(x) AS (SELECT 0 UNION ALL SELECT x + 1 FROM v WHERE x < 1999) ";
+    char huge_a[1024], huge_b[1024], huge_values[1024];
+    uint8_t *huge_blob = NULL;
+    uint32_t huge_size = query_blob("SELECT kmh_create_k(20000, 1, 2, 3, 'x')", &huge_blob);
+    TEST("Huge k kmh_create_k",
+         huge_size > 0 && (huge_blob[7] & KMH_FLAG_BLOCKS) && blocked_dir_ok(huge_blob, huge_size) &&
+         query_double("SELECT kmh_cardinality(kmh_create_k(20000, 1, 2, 3, 'x'))", NULL, NULL, 0) == 4 &&
+         query_double("SELECT k FROM kmh_stats(kmh_create_k(1048576, 1))", NULL, NULL, 0) == 1048576);
+    free(huge_blob);
+    snprintf(huge_a, sizeof(huge_a), "%sSELECT kmh_group_create(x, 20000) FROM v", rows_0_1999);
+    huge_size = query_blob(huge_a, &huge_blob);
+    int huge_group_ok = huge_size > 0 && blocked_dir_ok(huge_blob, huge_size) &&
+                        query_double("SELECT count(*) FROM kmh_each(?1)", (const uint8_t *const *)&huge_blob,
+                                     &huge_size, 1) == 2000;
+    free(huge_blob);
+    // Blocked aggregates keep no frame either
+    snprintf(huge_a, sizeof(huge_a), "%sSELECT kmh_cardinality(m) FROM (SELECT kmh_group_create(x, 20000) "
+             "OVER (ROWS UNBOUNDED PRECEDING) AS m FROM v) LIMIT 1 OFFSET 1999", rows_0_1999);
+    huge_group_ok &= query_double(huge_a, NULL, NULL, 0) == 2000;
+    snprintf(huge_a, sizeof(huge_a), "%sSELECT kmh_group_create(x, 20000) OVER (ROWS 1 PRECEDING) FROM v",
+             rows_0_1999);
+    huge_group_ok &= fails_with(huge_a, "UNBOUNDED PRECEDING");
+    TEST("Huge k kmh_group_create", huge_group_ok);
+    
+    // One value at a time grows blocks past a leaf, so they split; on the
+    // full sketch (ba holds 0 .. 199999) the largest hashes drop off the top
+    // blocks, which empty and go
+    snprintf(huge_b, sizeof(huge_b), "%sSELECT kmh_group_create(x, 20000) FROM v", rows_0_1999);
+    int add_ok = blocked_add_matches("WITH RECURSIVE a(i, s) AS (SELECT 0, kmh_create_k(20000, NULL) UNION ALL "
+                                     "SELECT i + 1, kmh_add(s, i) FROM a WHERE i < 2000) SELECT s FROM a "
+                                     "WHERE i = 2000", huge_b, bl, blocked_size, 1, 2000);
+    add_ok &= blocked_add_matches("WITH RECURSIVE a(i, s) AS (SELECT 200000, ?1 UNION ALL "
+                                  "SELECT i + 1, kmh_add(s, i) FROM a WHERE i < 202000) SELECT s FROM a "
+                                  "WHERE i = 202000",
+                                  "WITH RECURSIVE v(x) AS (SELECT 0 UNION ALL SELECT x + 1 FROM v WHERE x < 201999) "
+                                  "SELECT kmh_group_create(x, 20000) FROM v", bl, blocked_size, 1, 20000);
+    // Many values per call
+    snprintf(huge_a, sizeof(huge_a), "SELECT kmh_add(kmh_create_k(20000, 0), %s)",
+             value_list(huge_values, sizeof(huge_values), 1, 120));
+    snprintf(huge_b, sizeof(huge_b), "SELECT kmh_create_k(20000, %s)",
+             value_list(huge_values, sizeof(huge_values), 0, 120));
+    add_ok &= blocked_add_matches(huge_a, huge_b, NULL, NULL, 0, 121);
+    snprintf(huge_a, sizeof(huge_a), "SELECT kmh_add(?1, %s)",
+             value_list(huge_values, sizeof(huge_values), 200000, 200099));
+    add_ok &= blocked_add_matches(huge_a, "WITH RECURSIVE v(x) AS (SELECT 0 UNION ALL SELECT x + 1 FROM v "
+                                  "WHERE x < 200099) SELECT kmh_group_create(x, 20000) FROM v",
+                                  bl, blocked_size, 1, 20000);
+    // Nothing enters (kept already, or above the top hash): the blob as is
+    add_ok &= same_blob("SELECT kmh_add(?1, 5, 199999, NULL)", "SELECT ?1", bl, blocked_size, 1);
+    TEST("Huge k kmh_add splice", add_ok);
+
+    kmh_blocked_free(ba); kmh_blocked_free(bb); kmh_blocked_free(bm);
+    kmh_free_buffer(blocked[0]); kmh_free_buffer(blocked[1]);
+
+    // Sketches kmh_group_merge can't combine are an error, not a partial
+    // estimate, in either order and in window frames
+    const char *mixed = "sketches must share";
+    TEST("Group merge of mixed widths",
+         fails_with("SELECT kmh_group_merge_cardinality(sig) FROM (SELECT kmh_create(1, 2, 3) AS sig "
+                    "UNION ALL SELECT kmh_create64(4, 5, 6, 7, 8))", mixed) &&
+         fails_with("SELECT kmh_group_merge(sig) FROM (SELECT kmh_create64(4, 5, 6, 7, 8) AS sig "
+                    "UNION ALL SELECT kmh_create(1, 2, 3))", mixed));
+    TEST("Group merge of mixed k",
+         fails_with("SELECT kmh_group_merge_cardinality(sig) FROM (SELECT kmh_create_k(400, 1, 2, 3) AS sig "
+                    "UNION ALL SELECT kmh_create_k(50, 4, 5))", mixed) &&
+         fails_with("SELECT kmh_group_merge(sig) OVER (ROWS 1 PRECEDING) FROM (SELECT kmh_create_k(50, 1) AS sig "
+                    "UNION ALL SELECT kmh_create_k(50, 2) UNION ALL SELECT kmh_create_k(400, 3))", mixed));
+    TEST("Group merge of matching sketches",
+         query_double("SELECT kmh_group_merge_cardinality(sig) FROM (SELECT kmh_create_k(50, 1, 2, 3) AS sig "
+                      "UNION ALL SELECT kmh_create_k(50, 4, 5) UNION ALL SELECT NULL)", NULL, NULL, 0) == 5.0);
+
+    // kmh_config: get and set the connection defaults that later sketches use
+    TEST("kmh_config get/set",
+         query_double("SELECT kmh_config() = 'k=400 seed=42 space_size=4294967295'", NULL, NULL, 0) == 1 &&
+         query_double("SELECT kmh_config('k')", NULL, NULL, 0) == 400 &&
+         query_double("SELECT kmh_config('K', 64)", NULL, NULL, 0) == 64 &&
+         query_double("SELECT kmh_config('seed', 7)", NULL, NULL, 0) == 7 &&
+         query_double("SELECT kmh_config('space_size', 1000000)", NULL, NULL, 0) == 1000000 &&
+         query_double("SELECT kmh_config() = 'k=64 seed=7 space_size=1000000'", NULL, NULL, 0) == 1 &&
+         query_double("SELECT k FROM kmh_stats(kmh_create(1, 2, 3))", NULL, NULL, 0) == 64 &&
+         same_blob("SELECT kmh_create(1, 2, 3)", "SELECT kmh_create_k(64, 1, 2, 3)", NULL, NULL, 0) &&
+         query_double("SELECT kmh_config('k', 400) + kmh_config('seed', 42) + kmh_config('space_size', 4294967295)",
+                      NULL, NULL, 0) == 400 + 42 + 4294967295.0);
+    TEST("kmh_config errors",
+         fails_with("SELECT kmh_config('bogus')", "name must be") &&
+         fails_with("SELECT kmh_config(NULL)", "name must be") &&
+         fails_with("SELECT kmh_config('k', 1, 2)", "at most a name and a value") &&
+         fails_with("SELECT kmh_config('k', 0)", "k must be an integer between 1 and 10240") &&
+         fails_with("SELECT kmh_config('k', 10241)", "k must be an integer") &&
+         fails_with("SELECT kmh_config('k', 'many')", "k must be an integer") &&
+         fails_with("SELECT kmh_config('k', 8.5)", "k must be an integer") &&
+         fails_with("SELECT kmh_config('seed', -1)", "seed must be an integer") &&
+         fails_with("SELECT kmh_config('space_size', 0)", "space_size must be an integer") &&
+         query_double("SELECT kmh_config('k')", NULL, NULL, 0) == 400);
+    // Schema can't change them: a view or trigger calling kmh_config fails
+    TEST("kmh_config direct only",
+         sqlite3_exec(db, "CREATE VIEW config_view AS SELECT kmh_config('k', 8) AS k", NULL, NULL, NULL) == SQLITE_OK &&
+         sqlite3_exec(db, "SELECT * FROM config_view", NULL, NULL, NULL) == SQLITE_ERROR &&
+         query_double("SELECT kmh_config('k')", NULL, NULL, 0) == 400 &&
+         sqlite3_exec(db, "DROP VIEW config_view", NULL, NULL, NULL) == SQLITE_OK);
+
+    // Explicit k (and seed): the same sketch as with the connection default
+    // set to it, and out-of-range or non-integer arguments are errors
+    const char *rows_1_300 = "WITH RECURSIVE v(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM v WHERE x < 300) ";
+    char explicit_a[512], explicit_b[512];
+    snprintf(explicit_a, sizeof(explicit_a), "%sSELECT kmh_group_create(x, 32) FROM v", rows_1_300);
+    snprintf(explicit_b, sizeof(explicit_b), "%sSELECT kmh_group_create(x, 32, 9) FROM v", rows_1_300);
+    sqlite3_exec(db, "SELECT kmh_config('k', 32)", NULL, NULL, NULL);
+    int explicit_ok = same_blob("SELECT kmh_create_k(32, 5, 6, 7)", "SELECT kmh_create(5, 6, 7)", NULL, NULL, 0);
+    char default_sql[512];
+    snprintf(default_sql, sizeof(default_sql), "%sSELECT kmh_group_create(x) FROM v", rows_1_300);
+    explicit_ok &= same_blob(explicit_a, default_sql, NULL, NULL, 0);
+    sqlite3_exec(db, "SELECT kmh_config('seed', 9)", NULL, NULL, NULL);
+    explicit_ok &= same_blob(explicit_b, default_sql, NULL, NULL, 0);
+    sqlite3_exec(db, "SELECT kmh_config('k', 400), kmh_config('seed', 42)", NULL, NULL, NULL);
+    explicit_ok &= !same_blob(explicit_a, explicit_b, NULL, NULL, 0); // seed 42 against 9
+    explicit_ok &= query_double("SELECT kmh_create_k(8) IS NULL", NULL, NULL, 0) == 1 &&
+                   query_double("SELECT k FROM kmh_stats(kmh_create_k(1, 1, 2, 3))", NULL, NULL, 0) == 1 &&
+                   query_double("SELECT k FROM kmh_stats(kmh_create_k(10240, 1))", NULL, NULL, 0) == 10240;
+    TEST("Explicit k and seed", explicit_ok);
+    TEST("Explicit k and seed errors",
+         fails_with("SELECT kmh_create_k()", "requires k") &&
+         fails_with("SELECT kmh_create_k(0, 1)", "kmh_create_k: k must be an integer between 1 and 1048576") &&
+         fails_with("SELECT kmh_create_k(1048577, 1)", "kmh_create_k: k must be") &&
+         fails_with("SELECT kmh_create_k('8', 1)", "kmh_create_k: k must be") == 0 &&
+         fails_with("SELECT kmh_create_k('eight', 1)", "kmh_create_k: k must be") &&
+         fails_with("SELECT kmh_create_k(8.5, 1)", "kmh_create_k: k must be") &&
+         fails_with("SELECT kmh_create_k(NULL, 1)", "kmh_create_k: k must be") &&
+         fails_with("SELECT kmh_group_create(1, 0)", "kmh_group_create: k must be") &&
+         fails_with("SELECT kmh_group_create(1, 1048577)", "kmh_group_create: k must be") &&
+         fails_with("SELECT kmh_group_create(1, 8, -1)", "kmh_group_create: seed must be an integer between 0 and") &&
+         fails_with("SELECT kmh_group_create(1, 8, 4294967296)", "kmh_group_create: seed must be") &&
+         fails_with("SELECT kmh_group_create(1, 8, 'x')", "kmh_group_create: seed must be") &&
+         fails_with("SELECT kmh_group_create(1, 8, 9, 10)", "takes a value, k and seed"));
+
+    // k is cached as auxdata on the k argument, and a new seed on a later
+    // call must not reuse the cached one: every group matches its own query
+    char per_group[1024], one_group[1024];
+    snprintf(per_group, sizeof(per_group), "%sSELECT kmh_group_create(x, 16, s) FROM v, "
+             "(SELECT 1 AS s UNION ALL SELECT 2 UNION ALL SELECT 3) GROUP BY s ORDER BY s", rows_1_300);
+    sqlite3_stmt *groups = prepare(per_group);
+    int reuse_ok = 1, ngroups = 0;
+    const void *previous = NULL;
+    int previous_size = 0;
+    for (; sqlite3_step(groups) == SQLITE_ROW; ngroups++) {
+        sqlite3_stmt *single;
+        snprintf(one_group, sizeof(one_group), "%sSELECT kmh_group_create(x, 16, %d) FROM v", rows_1_300, ngroups + 1);
+        reuse_ok &= query(&single, one_group, NULL, NULL, 0) == SQLITE_ROW &&
+                    sqlite3_column_bytes(single, 0) == sqlite3_column_bytes(groups, 0) &&
+                    memcmp(sqlite3_column_blob(single, 0), sqlite3_column_blob(groups, 0),
+                           (size_t)sqlite3_column_bytes(groups, 0)) == 0;
+        sqlite3_finalize(single);
+        // Seeds hash differently
+        reuse_ok &= !previous || previous_size != sqlite3_column_bytes(groups, 0) ||
+                    memcmp(previous, sqlite3_column_blob(groups, 0), (size_t)previous_size) != 0;
+        free((void *)previous);
+        previous_size = sqlite3_column_bytes(groups, 0);
+        previous = memcpy(malloc((size_t)previous_size), sqlite3_column_blob(groups, 0), (size_t)previous_size);
+    }
+    free((void *)previous);
+    sqlite3_finalize(groups);
+    // A scalar call with a constant k across rows reuses the cached k
+    char scalar_rows[512];
+    snprintf(scalar_rows, sizeof(scalar_rows), "%sSELECT kmh_cardinality(kmh_create_k(16, x, x + 1)) FROM v", rows_1_300);
+    double scalar_total = 0;
+    sqlite3_stmt *scalar = prepare(scalar_rows);
+    while (sqlite3_step(scalar) == SQLITE_ROW) scalar_total += sqlite3_column_double(scalar, 0);
+    sqlite3_finalize(scalar);
+    TEST("Explicit k and seed reuse", reuse_ok && ngroups == 3 && scalar_total == 2.0 * 300);
+
+    // kmh_add's in-place splice of raw blobs, k = 8
+    char initial[1024], added[1024];
+    sqlite3_exec(db, "SELECT kmh_config('k', 8)", NULL, NULL, NULL);
+    TEST("Raw add, not full", add_matches("1, 2, 3", "4, 5"));
+    TEST("Raw add, duplicates within the call", add_matches("1, 2", "5, 5, 6, 2, 6, 5"));
+    TEST("Raw add, overflow past k", add_matches(value_list(initial, sizeof(initial), 1, 6),
+                                                 value_list(added, sizeof(added), 7, 40)));
+    TEST("Raw add, full sketch", add_matches(value_list(initial, sizeof(initial), 1, 40),
+                                             value_list(added, sizeof(added), 41, 80)));
+    // Only values already kept or above hashes[0] of a full sketch: the
+    // blob comes back as is
+    value_list(initial, sizeof(initial), 1, 40);
+    value_list(added, sizeof(added), 1, 40);
+    char sql_a[4096], sql_b[4096];
+    int unchanged = 1;
+    for (int w = 0; w < 2; w++) {
+        const char *create = w ? "kmh_create64" : "kmh_create";
+        snprintf(sql_a, sizeof(sql_a), "SELECT kmh_add(%s(%s), %s)", create, initial, added);
+        snprintf(sql_b, sizeof(sql_b), "SELECT %s(%s)", create, initial);
+        unchanged &= same_blob(sql_a, sql_b, NULL, NULL, 0);
+    }
+    TEST("Raw add, no-op", unchanged);
+
+    // Ring blobs, k = 8 so the buckets (10 rows each) fill up. kmh_window_add
+    // at the head re-encodes one entry in place; late and advancing times
+    // load the ring. Either way the ring matches the aggregate over the same
+    // rows, byte for byte
+    const char *ring_rows = "WITH RECURSIVE v(t) AS (SELECT 0 UNION ALL SELECT t + 1 FROM v WHERE t < 179), "
+                            "a(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM a WHERE i < 39) ";
+    static const char *const ring_adds[2][2] = {
+        { "175", "CASE WHEN i % 3 = 0 THEN 170 + i % 10 ELSE 1000 + i END" },
+        { "130 + (i * 37) % 90", "1000 + i" },
+    };
+    static const char *const ring_names[2] = { "Window add at the head", "Window add, late and advancing" };
+    for (int r = 0; r < 2; r++) {
+        snprintf(sql_a, sizeof(sql_a), "%s, r(i, ring) AS (SELECT 0, (SELECT kmh_group_window(t, t, 4, 10) FROM v) "
+                 "UNION ALL SELECT i + 1, kmh_window_add(ring, %s, %s) FROM r WHERE i < 40) "
+                 "SELECT ring FROM r WHERE i = 40", ring_rows, ring_adds[r][0], ring_adds[r][1]);
+        snprintf(sql_b, sizeof(sql_b), "%sSELECT kmh_group_window(t, x, 4, 10) FROM "
+                 "(SELECT t, t AS x FROM v UNION ALL SELECT %s, %s FROM a)", ring_rows, ring_adds[r][0], ring_adds[r][1]);
+        TEST(ring_names[r], same_blob(sql_a, sql_b, NULL, NULL, 0));
+    }
+
+    // Window queries read the blob: the sketch of rows from..179, for times
+    // whose window reaches into the previous block, starts inside the head's
+    // block, or (before the head) ends at it
+    static const int ring_now[][2] = { { 179, 140 }, { 0, 140 }, { 195, 160 }, { 205, 170 } };
+    int ring_queries = 1;
+    for (size_t q = 0; q < sizeof(ring_now) / sizeof(ring_now[0]); q++) {
+        snprintf(sql_a, sizeof(sql_a), "%sSELECT kmh_window_sketch((SELECT kmh_group_window(t, t, 4, 10) FROM v), "
+                 "%d)", ring_rows, ring_now[q][0]);
+        snprintf(sql_b, sizeof(sql_b), "%sSELECT kmh_group_create(t) FROM v WHERE t >= %d", ring_rows,
+                 ring_now[q][1]);
+        ring_queries &= same_blob(sql_a, sql_b, NULL, NULL, 0);
+        snprintf(sql_a, sizeof(sql_a), "%sSELECT kmh_window_cardinality((SELECT kmh_group_window(t, t, 4, 10) "
+                 "FROM v), %d)", ring_rows, ring_now[q][0]);
+        snprintf(sql_b, sizeof(sql_b), "%sSELECT kmh_cardinality(kmh_group_create(t)) FROM v WHERE t >= %d",
+                 ring_rows, ring_now[q][1]);
+        ring_queries &= query_double(sql_a, NULL, NULL, 0) == query_double(sql_b, NULL, NULL, 0);
+    }
+    snprintf(sql_a, sizeof(sql_a), "%sSELECT kmh_window_cardinality((SELECT kmh_group_window(t, t, 4, 10) FROM v), "
+             "210)", ring_rows);
+    TEST("Window queries", ring_queries && query_double(sql_a, NULL, NULL, 0) == 0);
+
+    // Version 1 rings (buckets only) are still read, and the first add at
+    // the head rewrites them as version 2
+    kmh_window_t *ring = kmh_window_init(4, 10, 8, 0xFFFFFFFF, 42);
+    for (uint32_t t = 0; t < 180; t++) kmh_window_add(ring, t, t);
+    uint8_t *ring_blob[2];
+    uint32_t ring_size[2];
+    ring_size[0] = kmh_window_serialize(ring, &ring_blob[0]);
+    kmh_window_view_t ring_view;
+    ring_size[1] = kmh_window_view_init(&ring_view, ring_blob[0], ring_size[0]) ?
+                   kmh_window_view_offset(&ring_view, 4) : 0;
+    ring_blob[1] = malloc(ring_size[1]);
+    memcpy(ring_blob[1], ring_blob[0], ring_size[1]);
+    ring_blob[1][4] = 1;
+    const uint8_t *const *rb = (const uint8_t *const *)ring_blob;
+    int ring_v1 = ring_size[1] > 0;
+    for (int v = 1000; v < 1010; v++) {
+        snprintf(sql_a, sizeof(sql_a), "SELECT kmh_window_add(?1, 175, %d)", v);
+        snprintf(sql_b, sizeof(sql_b), "SELECT kmh_window_add(?2, 175, %d)", v);
+        ring_v1 &= same_blob(sql_a, sql_b, rb, ring_size, 2);
+    }
+    for (int now = 0; now < 220; now += 15) {
+        snprintf(sql_a, sizeof(sql_a), "SELECT kmh_window_sketch(?1, %d)", now);
+        snprintf(sql_b, sizeof(sql_b), "SELECT kmh_window_sketch(?2, %d)", now);
+        ring_v1 &= same_blob(sql_a, sql_b, rb, ring_size, 2);
+        snprintf(sql_a, sizeof(sql_a), "SELECT kmh_window_cardinality(?1, %d) = kmh_window_cardinality(?2, %d)",
+                 now, now);
+        ring_v1 &= query_double(sql_a, rb, ring_size, 2) == 1;
+    }
+    TEST("Window version 1 rings", ring_v1);
+    kmh_window_free(ring);
+    kmh_free_buffer(ring_blob[0]);
+    free(ring_blob[1]);
+    sqlite3_exec(db, "SELECT kmh_config('k', 400)", NULL, NULL, NULL);
+
+    // kmh_each: the full scan is the sketch's hashes, largest first; every
+    // pushed-down range (integer, float, text and out-of-range operands)
+    // returns what the same filter gives when SQLite checks every row (+hash
+    // isn't offered to xBestIndex), for raw, compressed and blocked blobs
+    uint8_t *each_blob;
+    uint32_t each_size = query_blob("WITH RECURSIVE v(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM v WHERE x < 1000) "
+                                    "SELECT kmh_group_create(x) FROM v", &each_blob);
+    kvalue_minhash_t *each_kmh = each_size ? kmh_deserialize(each_blob, each_size) : NULL;
+    int each_ok = each_kmh && each_kmh->count == each_kmh->k;
+    if (each_ok) {
+        sqlite3_stmt *stmt;
+        int rc = query(&stmt, "SELECT hash FROM kmh_each(?1)", (const uint8_t *const *)&each_blob, &each_size, 1);
+        uint32_t n = 0;
+        for (; rc == SQLITE_ROW; rc = sqlite3_step(stmt), n++) {
+            each_ok &= n < each_kmh->count && (uint32_t)sqlite3_column_int64(stmt, 0) == each_kmh->hashes[n];
+        }
+        each_ok &= rc == SQLITE_DONE && n == each_kmh->count;
+        sqlite3_finalize(stmt);
+    }
+    TEST("kmh_each hashes", each_ok);
+
+    kmh_blocked_t *each_big = kmh_blocked_init(2000, 0xFFFFFFFF, 42);
+    for (uint32_t i = 0; i < 50000; i++) kmh_blocked_add(each_big, i);
+    uint8_t *each_big_blob;
+    uint32_t each_big_size = kmh_blocked_serialize(each_big, &each_big_blob);
+    kmh_blocked_free(each_big);
+    char ranges[32][96];
+    int nranges = 0;
+    if (each_ok) {
+        uint32_t h_hi = each_kmh->hashes[50], h_mid = each_kmh->hashes[200], h_lo = each_kmh->hashes[350];
+        snprintf(ranges[nranges++], sizeof(ranges[0]), "hash < %u", h_mid);
+        snprintf(ranges[nranges++], sizeof(ranges[0]), "hash <= %u", h_mid);
+        snprintf(ranges[nranges++], sizeof(ranges[0]), "hash > %u", h_mid);
+        snprintf(ranges[nranges++], sizeof(ranges[0]), "hash >= %u", h_mid);
+        snprintf(ranges[nranges++], sizeof(ranges[0]), "hash = %u", h_mid);
+        snprintf(ranges[nranges++], sizeof(ranges[0]), "hash > %u AND hash <= %u AND hash < %u", h_lo, h_hi, h_mid);
+        snprintf(ranges[nranges++], sizeof(ranges[0]), "hash < %u.5 AND hash >= %u.5", h_hi, h_lo);
+        snprintf(ranges[nranges++], sizeof(ranges[0]), "hash = %u.0 OR hash = %u.25", h_mid, h_lo);
+    }
+    const char *edges[] = { "hash > 9223372036854775807", "hash >= 9223372036854775807",
+                            "hash < -9223372036854775808", "hash <= -9223372036854775808",
+                            "hash > -9223372036854775808", "hash < 9223372036854775807",
+                            "hash > 1e30", "hash < -1e30", "hash < 1e30", "hash >= -1e30",
+                            "hash = -1", "hash > 4294967295", "hash < 0", "hash < 'text'", "hash > x'00'" };
+    for (size_t e = 0; e < sizeof(edges) / sizeof(edges[0]); e++) {
+        snprintf(ranges[nranges++], sizeof(ranges[0]), "%s", edges[e]);
+    }
+    const char *inputs[] = { "?1", "kmh_compress(?1, 'varint')", "kmh_compress(?1, 'bitpack')", "?2" };
+    const uint8_t *each_blobs[2] = { each_blob, each_big_blob };
+    uint32_t each_sizes[2] = { each_size, each_big_size };
+    int ranges_ok = each_ok && each_big_size, nonempty = 0;
+    for (size_t in = 0; in < 4 && ranges_ok; in++) {
+        for (int r = 0; r < nranges; r++) {
+            // The oracle writes +hash for every hash
+            char oracle[128];
+            size_t n = 0;
+            for (const char *c = ranges[r]; *c && n + 2 < sizeof(oracle); c++) {
+                if (strncmp(c, "hash", 4) == 0) oracle[n++] = '+';
+                oracle[n++] = *c;
+            }
+            oracle[n] = '\0';
+            char sql_a[4096], sql_b[4096];
+            int rows;
+            snprintf(sql_a, sizeof(sql_a), "SELECT hash FROM kmh_each(%s) WHERE %s", inputs[in], ranges[r]);
+            snprintf(sql_b, sizeof(sql_b), "SELECT hash FROM kmh_each(%s) WHERE %s ORDER BY +hash DESC", inputs[in],
+                     oracle);
+            ranges_ok &= same_rows(sql_a, sql_b, each_blobs, each_sizes, 2, &rows);
+            nonempty += rows > 0;
+        }
+    }
+    // The bounds do reach xFilter (idxStr shows in the plan)
+    sqlite3_stmt *plan = prepare("EXPLAIN QUERY PLAN SELECT hash FROM kmh_each(?1) WHERE hash < 5 AND hash >= 1");
+    int pushed = 0;
+    while (sqlite3_step(plan) == SQLITE_ROW) pushed |= strstr((const char *)sqlite3_column_text(plan, 3), "<g") != NULL;
+    sqlite3_finalize(plan);
+    TEST("kmh_each range pushdown", ranges_ok && pushed && nonempty > 2 * 4);
+
+    // ORDER BY hash DESC is the scan order, so no sorter; ASC still sorts
+    plan = prepare("EXPLAIN QUERY PLAN SELECT hash FROM kmh_each(?1) ORDER BY hash DESC");
+    int sorted = 0;
+    while (sqlite3_step(plan) == SQLITE_ROW) sorted |= strstr((const char *)sqlite3_column_text(plan, 3), "ORDER BY") != NULL;
+    sqlite3_finalize(plan);
+    int rows_desc, rows_asc;
+    TEST("kmh_each ORDER BY hash DESC",
+         !sorted &&
+         same_rows("SELECT hash FROM kmh_each(?1) WHERE hash > 1000 ORDER BY hash DESC",
+                   "SELECT hash FROM kmh_each(?1) WHERE +hash > 1000 ORDER BY +hash DESC", each_blobs, each_sizes, 1,
+                   &rows_desc) &&
+         same_rows("SELECT hash FROM kmh_each(?1) ORDER BY hash", "SELECT hash FROM kmh_each(?1) ORDER BY +hash",
+                   each_blobs, each_sizes, 1, &rows_asc) &&
+         rows_desc > 0 && rows_asc == (int)each_kmh->count &&
+         query_double("SELECT min(hash) FROM (SELECT hash FROM kmh_each(?1) ORDER BY hash LIMIT 1)", each_blobs,
+                      each_sizes, 1) == each_kmh->hashes[each_kmh->count - 1]);
+    TEST("kmh_each blocked",
+         query_double("SELECT count(*) FROM kmh_each(?2)", each_blobs, each_sizes, 2) == 2000 &&
+         query_double("SELECT count(*) FROM kmh_each(?2) WHERE hash <= (SELECT hash FROM kmh_each(?2) LIMIT 1 OFFSET 777)",
+                      each_blobs, each_sizes, 2) == 2000 - 777);
+
+    // Anything but a 32-bit sketch yields no rows
+    kvalue_minhash_t *empty = kmh_init(16, 0xFFFFFFFF, 42);
+    uint8_t *empty_blob = NULL;
+    uint32_t empty_size = kmh_serialize(empty, &empty_blob);
+    kmh_free(empty);
+    const uint8_t *empty_blobs[1] = { empty_blob };
+    TEST("kmh_each of non-sketches",
+         query_double("SELECT count(*) FROM kmh_each(NULL)", NULL, NULL, 0) == 0 &&
+         query_double("SELECT count(*) FROM kmh_each('text')", NULL, NULL, 0) == 0 &&
+         query_double("SELECT count(*) FROM kmh_each(42)", NULL, NULL, 0) == 0 &&
+         query_double("SELECT count(*) FROM kmh_each(x'')", NULL, NULL, 0) == 0 &&
+         query_double("SELECT count(*) FROM kmh_each(x'00112233')", NULL, NULL, 0) == 0 &&
+         query_double("SELECT count(*) FROM kmh_each(kmh_create64(1, 2, 3))", NULL, NULL, 0) == 0 &&
+         query_double("SELECT count(*) FROM kmh_each(?1)", empty_blobs, &empty_size, 1) == 0);
+
+    // kmh_stats: threshold and rse only once the sketch is full
+    char stats_sql[256];
+    snprintf(stats_sql, sizeof(stats_sql), "SELECT k = %u AND count = %u AND threshold = %u AND cardinality = %.17g "
+             "AND abs(rse - 1.0 / sqrt(%u - 2)) < 1e-12 FROM kmh_stats(?1)", each_kmh ? each_kmh->k : 0,
+             each_kmh ? each_kmh->count : 0, each_kmh ? each_kmh->hashes[0] : 0,
+             each_kmh ? kmh_cardinality(each_kmh) : 0.0, each_kmh ? each_kmh->k : 0);
+    TEST("kmh_stats of a full sketch", each_kmh && query_double(stats_sql, each_blobs, each_sizes, 1) == 1);
+    TEST("kmh_stats of a partial sketch",
+         query_double("SELECT k = 400 AND count = 3 AND threshold IS NULL AND cardinality = 3 AND rse = 0 "
+                      "FROM kmh_stats(kmh_compress(kmh_create(1, 2, 3), 'varint'))", NULL, NULL, 0) == 1 &&
+         query_double("SELECT count = 0 AND threshold IS NULL AND cardinality = 0 FROM kmh_stats(?1)", empty_blobs,
+                      &empty_size, 1) == 1);
+    TEST("kmh_stats of non-sketches",
+         query_double("SELECT count(*) FROM kmh_stats(NULL)", NULL, NULL, 0) == 0 &&
+         query_double("SELECT count(*) FROM kmh_stats('text')", NULL, NULL, 0) == 0 &&
+         query_double("SELECT count(*) FROM kmh_stats(x'00112233')", NULL, NULL, 0) == 0 &&
+         query_double("SELECT count(*) FROM kmh_stats(kmh_create64(1, 2, 3))", NULL, NULL, 0) == 0);
+    kmh_free(each_kmh);
+    free(each_blob);
+    kmh_free_buffer(each_big_blob);
+    kmh_free_buffer(empty_blob);
+
+    // Store functions touch files by path, so schema can't call them
+    TEST("Store functions direct only",
+         sqlite3_exec(db, "CREATE VIEW store_view AS SELECT kmh_store_get('kmh_sqltest.kmhs', 1) AS sig",
+                      NULL, NULL, NULL) == SQLITE_OK &&
+         sqlite3_exec(db, "SELECT * FROM store_view", NULL, NULL, NULL) == SQLITE_ERROR &&
+         sqlite3_exec(db, "CREATE TABLE store_log(id INTEGER); "
+                          "CREATE TRIGGER store_trigger AFTER INSERT ON store_log BEGIN "
+                          "SELECT kmh_store_save('kmh_sqltest.kmhs', NEW.id, kmh_create(1)); END",
+                      NULL, NULL, NULL) == SQLITE_OK &&
+         sqlite3_exec(db, "INSERT INTO store_log VALUES (1)", NULL, NULL, NULL) == SQLITE_ERROR &&
+         access("kmh_sqltest.kmhs", F_OK) != 0);
+
+    // kmh_lsh: inserts, deletes and updates reach both the shadow table and
+    // the in-memory index, whose candidate queries (table-valued and through
+    // kmh_similar) match a brute-force scan; a rollback, a commit from
+    // another connection and a reopen all leave the index in step with the
+    // shadow table
+    sqlite3 *memory_db = db;
+    const char *lsh_path = "kmh_sqltest_lsh.db";
+    unlink(lsh_path);
+    db = open_with(lsh_path, ext);
+    const char *lsh_tv = "SELECT group_concat(rowid) FROM (SELECT rowid FROM docs_lsh(?1, 0.8) ORDER BY rowid)";
+    const char *lsh_similar =
+        "SELECT group_concat(rowid) FROM (SELECT rowid FROM docs_lsh WHERE kmh_similar(sig, ?1) ORDER BY rowid)";
+    const char *lsh_scan =
+        "SELECT group_concat(id) FROM (SELECT id FROM docs_lsh_data WHERE kmh_similar(sig, ?1, 0.8) ORDER BY id)";
+    uint8_t *lsh_blobs[40];
+    uint32_t lsh_sizes[40];
+    if (sqlite3_exec(db, "CREATE VIRTUAL TABLE docs_lsh USING kmh_lsh(bands=16, rows=4, threshold=0.8)",
+                     NULL, NULL, NULL) != SQLITE_OK) die("kmh_lsh");
+    sqlite3_stmt *lsh_insert = prepare("INSERT INTO docs_lsh(rowid, sig) VALUES (?1, ?2)");
+    for (int d = 0; d < 40; d++) {
+        kvalue_minhash_t *doc = kmh_init(128, 0xFFFFFFFF, 42);
+        uint32_t base = (uint32_t)(d / 4) * 1000 + (uint32_t)(d % 4) * 5;
+        for (uint32_t v = base; v < base + 400; v++) kmh_add(doc, v);
+        lsh_sizes[d] = kmh_serialize(doc, &lsh_blobs[d]);
+        kmh_free(doc);
+        sqlite3_bind_int(lsh_insert, 1, d);
+        sqlite3_bind_blob(lsh_insert, 2, lsh_blobs[d], (int)lsh_sizes[d], SQLITE_STATIC);
+        if (sqlite3_step(lsh_insert) != SQLITE_DONE) die("kmh_lsh insert");
+        sqlite3_reset(lsh_insert);
+    }
+    sqlite3_finalize(lsh_insert);
+    const uint8_t *const *lsh_docs = (const uint8_t *const *)lsh_blobs;
+    char lsh_a[256], lsh_b[256], lsh_c[256];
+    int lsh_query_ok = query_double("SELECT count(*) FROM docs_lsh", NULL, NULL, 0) == 40;
+    for (int d = 0; d < 40 && lsh_query_ok; d++) {
+        query_text(lsh_tv, lsh_docs + d, lsh_sizes + d, 1, lsh_a, sizeof(lsh_a));
+        query_text(lsh_similar, lsh_docs + d, lsh_sizes + d, 1, lsh_b, sizeof(lsh_b));
+        query_text(lsh_scan, lsh_docs + d, lsh_sizes + d, 1, lsh_c, sizeof(lsh_c));
+        lsh_query_ok &= lsh_a[0] && strcmp(lsh_a, lsh_b) == 0 && strcmp(lsh_a, lsh_c) == 0;
+    }
+    lsh_query_ok &= strcmp(query_text(lsh_tv, lsh_docs, lsh_sizes, 1, lsh_a, sizeof(lsh_a)), "0,1,2,3") == 0;
+    TEST("kmh_lsh queries", lsh_query_ok);
+    // Both query forms probe the index rather than scan the table
+    int lsh_plans = 0;
+    for (int form = 0; form < 2; form++) {
+        sqlite3_stmt *plan = prepare(form ? "EXPLAIN QUERY PLAN SELECT rowid FROM docs_lsh(?1, 0.8)"
+                                          : "EXPLAIN QUERY PLAN SELECT rowid FROM docs_lsh WHERE kmh_similar(sig, ?1)");
+        while (sqlite3_step(plan) == SQLITE_ROW) {
+            lsh_plans += strstr((const char *)sqlite3_column_text(plan, 3), form ? "INDEX 3" : "INDEX 1") != NULL;
+        }
+        sqlite3_finalize(plan);
+    }
+    TEST("kmh_lsh query plans", lsh_plans == 2);
+
+    sqlite3_stmt *lsh_update;
+    TEST("kmh_lsh delete and update",
+         sqlite3_exec(db, "DELETE FROM docs_lsh WHERE rowid = 1", NULL, NULL, NULL) == SQLITE_OK &&
+         query(&lsh_update, "UPDATE docs_lsh SET sig = ?1 WHERE rowid = 2", lsh_docs + 20, lsh_sizes + 20, 1) ==
+             SQLITE_DONE &&
+         sqlite3_finalize(lsh_update) == SQLITE_OK &&
+         sqlite3_exec(db, "UPDATE docs_lsh SET rowid = 100 WHERE rowid = 3", NULL, NULL, NULL) == SQLITE_OK &&
+         strcmp(query_text(lsh_tv, lsh_docs, lsh_sizes, 1, lsh_a, sizeof(lsh_a)), "0,100") == 0 &&
+         strcmp(query_text(lsh_similar, lsh_docs + 20, lsh_sizes + 20, 1, lsh_a, sizeof(lsh_a)), "2,20,21,22,23") ==
+             0 &&
+         strcmp(query_text(lsh_scan, lsh_docs + 20, lsh_sizes + 20, 1, lsh_b, sizeof(lsh_b)), lsh_a) == 0 &&
+         query_double("SELECT count(*) FROM docs_lsh_data", NULL, NULL, 0) == 39 &&
+         sqlite3_exec(db, "INSERT INTO docs_lsh(sig) VALUES (kmh_create64(1, 2, 3))", NULL, NULL, NULL) ==
+             SQLITE_CONSTRAINT &&
+         strstr(sqlite3_errmsg(db), "sig must be a 32-bit sketch") != NULL);
+
+    TEST("kmh_lsh rollback",
+         sqlite3_exec(db, "BEGIN; DELETE FROM docs_lsh WHERE rowid = 0", NULL, NULL, NULL) == SQLITE_OK &&
+         strcmp(query_text(lsh_tv, lsh_docs, lsh_sizes, 1, lsh_a, sizeof(lsh_a)), "100") == 0 &&
+         sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL) == SQLITE_OK &&
+         strcmp(query_text(lsh_tv, lsh_docs, lsh_sizes, 1, lsh_a, sizeof(lsh_a)), "0,100") == 0 &&
+         sqlite3_exec(db, "BEGIN; SAVEPOINT s; DELETE FROM docs_lsh WHERE rowid = 100; ROLLBACK TO s; COMMIT",
+                      NULL, NULL, NULL) == SQLITE_OK &&
+         strcmp(query_text(lsh_tv, lsh_docs, lsh_sizes, 1, lsh_a, sizeof(lsh_a)), "0,100") == 0);
+
+    // A commit from a second connection bumps data_version, so the first
+    // one's index is rebuilt on its next query
+    sqlite3 *lsh_db = db;
+    db = open_with(lsh_path, ext);
+    int lsh_other = query(&lsh_update, "INSERT INTO docs_lsh(rowid, sig) VALUES (200, ?1)", lsh_docs, lsh_sizes, 1);
+    sqlite3_finalize(lsh_update);
+    sqlite3_close(db);
+    db = lsh_db;
+    TEST("kmh_lsh commit from another connection",
+         lsh_other == SQLITE_DONE &&
+         strcmp(query_text(lsh_tv, lsh_docs, lsh_sizes, 1, lsh_a, sizeof(lsh_a)), "0,100,200") == 0);
+
+    sqlite3_close(db);
+    db = open_with(lsh_path, ext);
+    TEST("kmh_lsh reopen",
+         query_double("SELECT count(*) FROM docs_lsh", NULL, NULL, 0) == 40 &&
+         strcmp(query_text(lsh_similar, lsh_docs, lsh_sizes, 1, lsh_a, sizeof(lsh_a)), "0,100,200") == 0 &&
+         strcmp(query_text(lsh_tv, lsh_docs + 20, lsh_sizes + 20, 1, lsh_b, sizeof(lsh_b)), "2,20,21,22,23") == 0);
+    sqlite3_close(db);
+    db = memory_db;
+    unlink(lsh_path);
+    for (int d = 0; d < 40; d++) kmh_free_buffer(lsh_blobs[d]);
+
+    sqlite3_close(db);
+    if (failures) {
+        printf("\n%d tests failed ✗\n", failures);
+        return 1;
+    }
+    printf("\nAll tests passed! ✓\n");
+    return 0;
+}
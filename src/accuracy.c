@@ -0,0 +1,217 @@
+// Accuracy-vs-cost benchmark: builds thousands of sketch pairs over synthetic
+// sets with known cardinality and overlap (in parallel on a kmh_pool), and
+// reports the error of kmh_cardinality, kmh_distance and the cardinality of
+// kmh_merge against K and n, next to ns/op and a HyperLogLog of the same
+// byte budget.
+//
+//   gcc -O2 -o kmh_accuracy src/accuracy.c -lm -lpthread
+//   ./kmh_accuracy [--trials N] [--warmup N] [--cpu N] [--csv FILE | --json FILE]
+//
+// Pair t is A = [0, n) and B = [n - s, 2n - s) with s = overlap * n shared
+// values, hashed with seed t + 1, so |A| = n, |A u B| = 2n - s and
+// J = s / (2n - s). Cardinality errors are relative (est / truth - 1);
+// distance errors are absolute (est - truth), since J can be near 0.
+#include "bench.h"
+#include "kmh.h"
+#include <assert.h>
+
+#define ACC_SPACE 0xFFFFFFFFU
+// Sketch pairs per configuration, fewer for large n so that one
+// configuration stays around ACC_VALUE_BUDGET added values per sketch type
+#define ACC_PAIRS 2000
+#define ACC_MIN_PAIRS 100
+#define ACC_VALUE_BUDGET ((size_t)1 << 28)
+
+// HyperLogLog with 2^p byte registers and 64-bit xxh3 hashes (so no
+// large-range correction). At K hashes of 4 bytes it gets m = 4K
+// registers: the same bytes as the sketch, and still the largest power of
+// two whose usual 6-bit packing fits that budget.
+typedef struct {
+   uint32_t p;
+   uint64_t seed;
+   uint8_t *reg;
+} hll_t;
+
+static inline void hll_add(hll_t *h, uint32_t value) {
+   uint64_t x = xxh3_hash64(value, h->seed);
+   // The low sentinel bit caps the rank at 64 - p + 1
+   uint64_t w = (x << h->p) | ((uint64_t)1 << (h->p - 1));
+   uint8_t rank = (uint8_t)(__builtin_clzll(w) + 1);
+   uint8_t *r = &h->reg[x >> (64 - h->p)];
+   if (rank > *r) *r = rank;
+}
+
+static inline double hll_estimate(const hll_t *h) {
+   uint32_t m = 1u << h->p, zeros = 0;
+   double sum = 0;
+   for (uint32_t i = 0; i < m; i++) {
+       sum += ldexp(1.0, -h->reg[i]);
+       zeros += h->reg[i] == 0;
+   }
+   double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+   // Linear counting while the raw estimate is small
+   if (e <= 2.5 * m && zeros) e = m * log((double)m / zeros);
+   return e;
+}
+
+static inline void hll_merge_into(hll_t *dst, const hll_t *src) {
+   for (uint32_t i = 0; i < 1u << dst->p; i++) {
+       if (src->reg[i] > dst->reg[i]) dst->reg[i] = src->reg[i];
+   }
+}
+
+// Inclusion-exclusion, the usual way to get a Jaccard distance out of HLLs
+static inline double hll_distance(double a, double b, double u) {
+   double j = u > 0 ? (a + b - u) / u : 1.0;
+   return 1.0 - (j < 0 ? 0 : j > 1 ? 1 : j);
+}
+
+enum { ACC_CARD, ACC_DIST, ACC_UNION, HLL_CARD, HLL_DIST, HLL_UNION, ACC_METRICS };
+static const char *const acc_names[ACC_METRICS] = {
+   "kmh cardinality", "kmh distance", "kmh merged card.", "hll cardinality", "hll distance", "hll merged card."
+};
+
+typedef struct {
+   const uint32_t *values; // 0, 1, ..., 2n
+   size_t n, shared;
+   uint32_t k, p;
+   double truth[ACC_METRICS];
+   double *err[ACC_METRICS]; // per pair
+   uint8_t *regs;            // 3 x 2^p registers per worker
+} acc_job_t;
+
+static void acc_pair(void *arg, size_t t, uint32_t worker) {
+   acc_job_t *job = arg;
+   const uint32_t *a_values = job->values, *b_values = job->values + job->n - job->shared;
+   uint32_t seed = (uint32_t)t + 1;
+   double e[ACC_METRICS];
+
+   kvalue_minhash_t *a = kmh_init(job->k, ACC_SPACE, seed), *b = kmh_init(job->k, ACC_SPACE, seed);
+   assert(a && b);
+   kmh_add_batch(a, a_values, job->n);
+   kmh_add_batch(b, b_values, job->n);
+   kvalue_minhash_t *u = kmh_merge(a, b);
+   assert(u);
+   e[ACC_CARD] = kmh_cardinality(a);
+   e[ACC_DIST] = kmh_distance(a, b);
+   e[ACC_UNION] = kmh_cardinality(u);
+   kmh_free(a); kmh_free(b); kmh_free(u);
+
+   size_t m = (size_t)1 << job->p;
+   uint8_t *regs = job->regs + (size_t)worker * 3 * m;
+   memset(regs, 0, 2 * m);
+   hll_t ha = { job->p, seed, regs }, hb = { job->p, seed, regs + m }, hu = { job->p, seed, regs + 2 * m };
+   for (size_t i = 0; i < job->n; i++) hll_add(&ha, a_values[i]);
+   for (size_t i = 0; i < job->n; i++) hll_add(&hb, b_values[i]);
+   memcpy(hu.reg, ha.reg, m);
+   hll_merge_into(&hu, &hb);
+   e[HLL_CARD] = hll_estimate(&ha);
+   e[HLL_UNION] = hll_estimate(&hu);
+   e[HLL_DIST] = hll_distance(e[HLL_CARD], hll_estimate(&hb), e[HLL_UNION]);
+
+   for (int x = 0; x < ACC_METRICS; x++) {
+       int absolute = x == ACC_DIST || x == HLL_DIST;
+       job->err[x][t] = absolute ? e[x] - job->truth[x] : e[x] / job->truth[x] - 1;
+   }
+}
+
+int main(int argc, char **argv) {
+   const uint32_t sweep_k[] = { 64, 256, 1024, 4096 };
+   const size_t sweep_n[] = { 1000, 10000, 100000, 1000000 };
+   const double sweep_overlap[] = { 0.2, 0.8 };
+   const size_t max_n = 1000000;
+
+   printf("KValue MinHash Accuracy Benchmark\n");
+   printf("================================================\n");
+   bench_start(argc, argv, "accuracy");
+
+   uint32_t *values = malloc(2 * max_n * sizeof(uint32_t));
+   double *err[ACC_METRICS];
+   for (int x = 0; x < ACC_METRICS; x++) err[x] = malloc(ACC_PAIRS * sizeof(double));
+   assert(values);
+   for (size_t i = 0; i < 2 * max_n; i++) values[i] = (uint32_t)i;
+
+   // Cost per op at each K, on one pair of n = 100000 sets (pinned)
+   const int cost_n = 100000;
+   for (size_t s = 0; s < sizeof(sweep_k) / sizeof(*sweep_k); s++) {
+       uint32_t k = sweep_k[s], p = 2 + (uint32_t)__builtin_ctz(k);
+       kvalue_minhash_t *a = kmh_init(k, ACC_SPACE, 1), *b = kmh_init(k, ACC_SPACE, 1);
+       uint8_t *regs = calloc((size_t)3 << p, 1);
+       assert(a && b && regs);
+       hll_t ha = { p, 1, regs }, hb = { p, 1, regs + ((size_t)1 << p) }, hu = { p, 1, regs + ((size_t)2 << p) };
+       bench_tags.k = k;
+       printf("k %u (%u bytes; hll %u registers):\n", k, k * 4, 1u << p);
+       BENCH_RUN("  kmh add batch", 1, cost_n, a->count = 0, kmh_add_batch(a, values, cost_n));
+       kmh_add_batch(b, values + cost_n / 2, cost_n);
+       BENCH_RUN("  hll add", cost_n, 1, memset(ha.reg, 0, (size_t)1 << p), hll_add(&ha, values[i]));
+       for (int i = 0; i < cost_n; i++) hll_add(&hb, values[cost_n / 2 + i]);
+       BENCH("  kmh cardinality", 100000, BENCH_KEEP(kmh_cardinality(a)));
+       BENCH("  hll cardinality", 1000, BENCH_KEEP(hll_estimate(&ha)));
+       BENCH("  kmh distance", 10000, BENCH_KEEP(kmh_distance(a, b)));
+       BENCH("  kmh merged card.", 10000, {
+           kvalue_minhash_t *u = kmh_merge(a, b);
+           BENCH_KEEP(kmh_cardinality(u));
+           kmh_free(u);
+       });
+       BENCH("  hll merged card.", 1000, {
+           memcpy(hu.reg, ha.reg, (size_t)1 << p);
+           hll_merge_into(&hu, &hb);
+           BENCH_KEEP(hll_estimate(&hu));
+       });
+       kmh_free(a); kmh_free(b);
+       free(regs);
+   }
+
+   // Error sweep over every core
+   bench_unpin();
+   long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   uint32_t nthreads = cpus > 0 ? (uint32_t)cpus : 1;
+   kmh_pool_t *pool = kmh_pool_create(nthreads);
+   assert(pool);
+   printf("\n%u threads; errors are bias / rse / p99 |err|, relative except distance (absolute)\n", nthreads);
+   for (size_t s = 0; s < sizeof(sweep_k) / sizeof(*sweep_k); s++) {
+       uint32_t k = sweep_k[s], p = 2 + (uint32_t)__builtin_ctz(k);
+       uint8_t *regs = malloc((size_t)nthreads * 3 << p);
+       assert(regs);
+       bench_tags.k = k;
+       printf("k %u (expected rse %.4f; hll %.4f):\n", k, 1 / sqrt(k - 2.0), 1.04 / sqrt((double)(1u << p)));
+       printf("  %8s %7s  %-26s %-26s %-26s %-26s %-26s %-26s\n", "n", "J", acc_names[0], acc_names[1],
+              acc_names[2], acc_names[3], acc_names[4], acc_names[5]);
+       for (size_t c = 0; c < sizeof(sweep_n) / sizeof(*sweep_n); c++) {
+           for (size_t o = 0; o < sizeof(sweep_overlap) / sizeof(*sweep_overlap); o++) {
+               size_t n = sweep_n[c], shared = (size_t)(sweep_overlap[o] * n);
+               size_t pairs = ACC_VALUE_BUDGET / (2 * n);
+               if (pairs > ACC_PAIRS) pairs = ACC_PAIRS;
+               if (pairs < ACC_MIN_PAIRS) pairs = ACC_MIN_PAIRS;
+               double u = 2.0 * n - shared, j = shared / u;
+               acc_job_t job = { values, n, shared, k, p, { n, 1 - j, u, n, 1 - j, u }, { 0 }, regs };
+               memcpy(job.err, err, sizeof(err));
+
+               uint64_t t0 = bench_now_ns();
+               kmh_pool_run(pool, pairs, acc_pair, &job);
+               double secs = (bench_now_ns() - t0) / 1e9;
+
+               char variant[64];
+               snprintf(variant, sizeof(variant), "n %zu overlap %.2f", n, sweep_overlap[o]);
+               bench_tags.variant = variant;
+               printf("  %8zu %7.4f ", n, j);
+               for (int x = 0; x < ACC_METRICS; x++) {
+                   // bench_emit_error sorts |err| in place; take the bias first
+                   double bias = 0;
+                   for (size_t t = 0; t < pairs; t++) bias += err[x][t];
+                   double rse = bench_emit_error(acc_names[x], job.truth[x], err[x], (int)pairs);
+                   printf(" %+8.4f %7.4f %7.4f  ", bias / pairs, rse, err[x][(int)ceil(0.99 * pairs) - 1]);
+               }
+               printf(" (%zu pairs, %.1fs)\n", pairs, secs);
+           }
+       }
+       free(regs);
+   }
+   bench_tags.variant = "";
+   kmh_pool_destroy(pool);
+
+   for (int x = 0; x < ACC_METRICS; x++) free(err[x]);
+   free(values);
+   bench_finish();
+   return 0;
+}
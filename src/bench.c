@@ -1,34 +1,202 @@
+#include "bench.h"
 #include "kmh.h"
-#include <stdio.h>
-#include <time.h>
 #include <assert.h>
-#include <math.h>
 
-#define BENCH(name, iterations, code) do { \
-   clock_t start = clock(); \
-   for(int i = 0; i < iterations; i++) { code; } \
-   double ms = (double)(clock() - start) * 1000 / CLOCKS_PER_SEC; \
-   printf("%-20s: %8.2f ms (%8.1f ops/sec)\n", name, ms, iterations * 1000.0 / ms); \
-} while(0)
+// Allocation churn per thread: init/free pairs, as SQLite functions do per row
+#define ALLOC_THREADS 8
+#define ALLOC_ROUNDS 1000000
 
-int main() {
+static void *alloc_churn(void *arg) {
+   (void)arg;
+   for (int i = 0; i < ALLOC_ROUNDS; i++) {
+       kvalue_minhash_t *kmh = kmh_init(400, 0xFFFFFFFF, 0);
+       kmh->count = 1; // touch it so the pair isn't optimized away
+       kmh_free(kmh);
+   }
+   return NULL;
+}
+
+static double now_ms(void) {
+   return bench_now_ns() / 1e6;
+}
+
+// One wall-clock sample of ms for ops operations, as a record
+static void emit_ms(const char *name, double ops, double ms) {
+   uint64_t ns = (uint64_t)(ms * 1e6);
+   bench_emit(name, ops, &ns, NULL, 1);
+}
+
+// One stream split across workers: a mutex around kmh_add (the old way) vs
+// the concurrent sketch, per value and batched
+typedef struct {
+   int mode; // 0 mutex, 1 concurrent add, 2 concurrent batch
+   uint32_t shard;
+   const uint32_t *values;
+   size_t n;
+} ingest_job_t;
+
+static pthread_mutex_t ingest_mutex = PTHREAD_MUTEX_INITIALIZER;
+static kvalue_minhash_t *ingest_locked;
+static kmh_concurrent_t *ingest_concurrent;
+
+static void *ingest_worker(void *arg) {
+   ingest_job_t *job = arg;
+   if (job->mode == 2) {
+       kmh_concurrent_add_batch(ingest_concurrent, job->shard, job->values, job->n);
+       return NULL;
+   }
+   for (size_t i = 0; i < job->n; i++) {
+       if (job->mode == 1) {
+           kmh_concurrent_add(ingest_concurrent, job->shard, job->values[i]);
+       } else {
+           pthread_mutex_lock(&ingest_mutex);
+           kmh_add(ingest_locked, job->values[i]);
+           pthread_mutex_unlock(&ingest_mutex);
+       }
+   }
+   return NULL;
+}
+
+int main(int argc, char **argv) {
    const int N = 1000000;
    const int K = 400;
    const int SPACE = 10000000;
    
    printf("KValue MinHash Benchmark (N=%d, K=%d)\n", N, K);
    printf("================================================\n");
+   bench_start(argc, argv, "core");
+   bench_tags.k = K;
    
    kvalue_minhash_t *kmh0;
    BENCH("Allocate", 10000, kmh0 = kmh_init(K, SPACE, 0); kmh_free(kmh0););
+   pthread_t alloc_threads[ALLOC_THREADS];
+   bench_unpin();
+   double alloc_ms = now_ms();
+   for (int t = 0; t < ALLOC_THREADS; t++) bench_spawn(&alloc_threads[t], alloc_churn, NULL, t);
+   for (int t = 0; t < ALLOC_THREADS; t++) pthread_join(alloc_threads[t], NULL);
+   alloc_ms = now_ms() - alloc_ms;
+   printf("Allocate x%d threads: %8.2f ms (%8.1f ops/sec)\n", ALLOC_THREADS, alloc_ms,
+          (double)ALLOC_THREADS * ALLOC_ROUNDS * 1000.0 / alloc_ms);
+   bench_tags.threads = ALLOC_THREADS;
+   emit_ms("Allocate threads", (double)ALLOC_THREADS * ALLOC_ROUNDS, alloc_ms);
+   bench_tags.threads = 1;
    // Init
    kvalue_minhash_t *kmh = kmh_init(K, SPACE, 0);
    kvalue_minhash_t *kmh2 = kmh_init(K, SPACE, 0);
    assert(kmh && kmh2);
    
-   // Add benchmark
-   //BENCH("Add", N, kmh_add(kmh, rand()));
-   BENCH("Add", N, kmh_add(kmh, (N/2)+i));
+   // Add benchmark (random values are pre-generated so rand() isn't timed)
+   uint32_t *random_values = malloc(N * sizeof(uint32_t));
+   assert(random_values);
+   for(int i = 0; i < N; i++) random_values[i] = (uint32_t)rand();
+   kvalue_minhash_t *kmh_rand = kmh_init(K, SPACE, 0);
+   assert(kmh_rand);
+   // Every trial starts from an empty sketch
+   BENCH_RUN("Add (random)", N, 1, kmh_rand->count = 0, kmh_add(kmh_rand, random_values[i]));
+   BENCH_RUN("Add (sequential)", N, 1, kmh->count = 0, kmh_add(kmh, (N/2)+i));
+   kmh_free(kmh_rand);
+   
+   // Multithreaded ingest of one N-value stream (wall clock)
+   printf("Concurrent ingest (%ld cores):\n", sysconf(_SC_NPROCESSORS_ONLN));
+   const char *ingest_modes[] = { "mutex", "concurrent", "concurrent batch" };
+   for (uint32_t threads = 1; threads <= 16; threads *= 2) {
+       pthread_t workers[16];
+       ingest_job_t jobs[16];
+       printf("  %2u threads:", threads);
+       for (int mode = 0; mode < 3; mode++) {
+           ingest_locked = kmh_init(K, 0xFFFFFFFF, 0);
+           ingest_concurrent = kmh_concurrent_init(K, 0xFFFFFFFF, 0, threads);
+           assert(ingest_locked && ingest_concurrent);
+           double ms = now_ms();
+           for (uint32_t t = 0; t < threads; t++) {
+               size_t per = N / threads;
+               jobs[t] = (ingest_job_t){ mode, t, random_values + t * per, t + 1 == threads ? N - t * per : per };
+               bench_spawn(&workers[t], ingest_worker, &jobs[t], t);
+           }
+           for (uint32_t t = 0; t < threads; t++) pthread_join(workers[t], NULL);
+           if (mode > 0) kmh_free(kmh_concurrent_snapshot(ingest_concurrent));
+           ms = now_ms() - ms;
+           printf("  %s %7.1f Mvalues/s", ingest_modes[mode], N / ms / 1e3);
+           char rec[64];
+           snprintf(rec, sizeof(rec), "Ingest %s", ingest_modes[mode]);
+           bench_tags.threads = threads;
+           emit_ms(rec, N, ms);
+           kmh_free(ingest_locked);
+           kmh_concurrent_free(ingest_concurrent);
+       }
+       printf("\n");
+   }
+   bench_tags.threads = 1;
+   
+   // Parallel bulk build over one large array, reusing a pool per size
+   size_t bulk_n = (size_t)1 << 25;
+   uint32_t *bulk = malloc(bulk_n * sizeof(uint32_t));
+   assert(bulk);
+   for (size_t i = 0; i < bulk_n; i++) bulk[i] = (uint32_t)(i * 2654435761U);
+   double bulk_ms = now_ms();
+   kvalue_minhash_t *bulk_ref = kmh_init(K, 0xFFFFFFFF, 0);
+   kmh_add_batch(bulk_ref, bulk, bulk_n);
+   bulk_ms = now_ms() - bulk_ms;
+   printf("Bulk build %zu values: kmh_add_batch %.1f Mvalues/s\n", bulk_n, bulk_n / bulk_ms / 1e3);
+   for (uint32_t threads = 1; threads <= 16; threads *= 2) {
+       kmh_pool_t *pool = kmh_pool_create(threads);
+       assert(pool);
+       double best = 1e30;
+       for (int rep = 0; rep < 3; rep++) {
+           double ms = now_ms();
+           kvalue_minhash_t *built = kmh_pool_build(pool, K, 0xFFFFFFFF, 0, bulk, bulk_n);
+           ms = now_ms() - ms;
+           assert(built && built->count == bulk_ref->count &&
+                  memcmp(built->hashes, bulk_ref->hashes, built->count * sizeof(uint32_t)) == 0);
+           kmh_free(built);
+           if (ms < best) best = ms;
+       }
+       printf("  kmh_pool_build %2u threads: %7.1f Mvalues/s\n", threads, bulk_n / best / 1e3);
+       bench_tags.threads = threads;
+       emit_ms("Pool build", bulk_n, best);
+       kmh_pool_destroy(pool);
+   }
+   bench_tags.threads = 1;
+   kmh_free(bulk_ref);
+   free(bulk);
+   bench_pin();
+   
+   // Range reduction: plain modulo vs the precomputed kmh_reduce modes
+   uint32_t red_spaces[] = { SPACE, 1U << 24, 0xFFFFFFFF };
+   for(int s = 0; s < 3; s++) {
+       uint32_t d = red_spaces[s];
+       int mode = kmh_reduce_mode(d);
+       uint64_t m = kmh_fastmod_m(d);
+       volatile uint32_t sink = 0;
+       uint32_t acc = 0;
+       char variant[32];
+       snprintf(variant, sizeof(variant), "space %u", d);
+       bench_tags.variant = variant;
+       printf("reduce space %u (mode %d):\n", d, mode);
+       BENCH("  Reduce (%)", N, acc += random_values[i] % d);
+       sink = acc; acc = 0;
+       BENCH("  Reduce (kmh_reduce)", N, acc += kmh_reduce(random_values[i], d, mode, m));
+       sink = acc;
+       (void)sink;
+   }
+   bench_tags.variant = "";
+   
+   // Batch vs scalar ingest over the same input (bench space and full 32-bit space)
+   uint32_t batch_spaces[] = { SPACE, 0xFFFFFFFF };
+   for(int s = 0; s < 2; s++) {
+       kvalue_minhash_t *kmh_scalar = kmh_init(K, batch_spaces[s], 0);
+       kvalue_minhash_t *kmh_batch = kmh_init(K, batch_spaces[s], 0);
+       assert(kmh_scalar && kmh_batch);
+       char variant[32];
+       snprintf(variant, sizeof(variant), "space %u", batch_spaces[s]);
+       bench_tags.variant = variant;
+       printf("space %u:\n", batch_spaces[s]);
+       BENCH_RUN("  Add loop (scalar)", 1, N, kmh_scalar->count = 0,
+                 for(int j = 0; j < N; j++) kmh_add(kmh_scalar, random_values[j]));
+       BENCH_RUN("  Add batch (SIMD)", 1, N, kmh_batch->count = 0, kmh_add_batch(kmh_batch, random_values, N));
+       kmh_free(kmh_scalar); kmh_free(kmh_batch);
+   }
+   bench_tags.variant = "";
    printf("cardinality kmh %f\n", kmh_cardinality(kmh));
    // Fill second hash for merge/distance tests
    //for(int i = 0; i < N/2; i++) kmh_add(kmh2, rand());
@@ -36,12 +204,179 @@ int main() {
    printf("cardinality kmh2 %f\n", kmh_cardinality(kmh2));  
    
    // Operations benchmark
-   BENCH("Cardinality", 100000, kmh_cardinality(kmh));
-   BENCH("Distance", 10000, kmh_distance(kmh, kmh2));
+   BENCH("Cardinality", 100000, BENCH_KEEP(kmh_cardinality(kmh)));
+   BENCH("Distance", 10000, BENCH_KEEP(kmh_distance(kmh, kmh2)));
+   double setop_sink = 0;
+   BENCH("Merge+cardinality", 10000, {
+       kvalue_minhash_t *m = kmh_merge(kmh, kmh2);
+       setop_sink += kmh_cardinality(m);
+       kmh_free(m);
+   });
+   BENCH("Union cardinality", 10000, BENCH_KEEP(kmh_union_cardinality(kmh, kmh2)));
+   BENCH("Intersection card.", 10000, BENCH_KEEP(kmh_intersection_cardinality(kmh, kmh2)));
+   printf("(%.0f)\n", setop_sink);
+   
+   // Sliding window, 60 buckets: a query is one 3-way merge; the naive
+   // answer merges all 60 buckets
+   {
+       kmh_window_t *win = kmh_window_init(60, 1, K, SPACE, 0);
+       assert(win);
+       for (uint64_t t = 0; t < 120; t++) kmh_window_add_batch(win, t, random_values + (t * 8192) % (N - 8192), 8192);
+       double win_sink = 0;
+       BENCH("Window cardinality", 10000, BENCH_KEEP(kmh_window_cardinality(win, 119)));
+       BENCH("Merge 60 buckets", 10000, {
+           kvalue_minhash_t *m = kmh_merge_many((const kvalue_minhash_t **)win->buckets, 60);
+           win_sink += kmh_cardinality(m);
+           kmh_free(m);
+       });
+       printf("(%.0f)\n", win_sink);
+       kmh_window_free(win);
+   }
+   
+   // Rolling 7-row frame over daily sketches (OVER (... ROWS 6 PRECEDING)):
+   // push, pop and query per day through kmh_frame_t, against re-merging the
+   // 7 days every row
+   {
+       kvalue_minhash_t *days[64];
+       for (int d = 0; d < 64; d++) {
+           days[d] = kmh_init(K, SPACE, 0);
+           assert(days[d]);
+           kmh_add_batch(days[d], random_values + (d * 4096) % (N - 4096), 4096);
+       }
+       kmh_frame_t *frame = kmh_frame_init(K, SPACE, 0);
+       assert(frame);
+       double frame_sink = 0;
+       int day = 0;
+       BENCH("Frame of 7 rows", 10000, {
+           kmh_frame_push_hashes(frame, days[day % 64]->hashes, days[day % 64]->count);
+           if (frame->rows > 7) kmh_frame_pop(frame);
+           frame_sink += kmh_frame_cardinality(frame);
+           day++;
+       });
+       BENCH("Merge 7 rows", 10000, {
+           const kvalue_minhash_t *in[7];
+           for (int d = 0; d < 7; d++) in[d] = days[(day + d) % 64];
+           kvalue_minhash_t *m = kmh_merge_many(in, 7);
+           frame_sink += kmh_cardinality(m);
+           kmh_free(m);
+           day++;
+       });
+       printf("(%.0f)\n", frame_sink);
+       kmh_frame_free(frame);
+       for (int d = 0; d < 64; d++) kmh_free(days[d]);
+   }
+
+   // kmh_group_create's row path: one-value rows into a frame one at a time,
+   // against staged batches of 64 through kmh_frame_push_rows
+   {
+       kmh_frame_t *one = kmh_frame_init(K, SPACE, 0), *staged = kmh_frame_init(K, SPACE, 0);
+       assert(one && staged);
+       uint32_t stage[64];
+       BENCH_RUN("Frame row push", N, 1, { kmh_frame_free(one); one = kmh_frame_init(K, SPACE, 0); },
+                 kmh_frame_push_hash(one, random_values[i] % SPACE));
+       BENCH_RUN("Frame rows x64", N / 64, 64, { kmh_frame_free(staged); staged = kmh_frame_init(K, SPACE, 0); }, {
+           for (int r = 0; r < 64; r++) stage[r] = random_values[i * 64 + r] % SPACE;
+           kmh_frame_push_rows(staged, stage, 64);
+       });
+       kmh_frame_free(one);
+       kmh_frame_free(staged);
+   }
+   
+   // Similarity search: one query vs 1M stored sketches, and 10k x 10k all pairs (k = 128)
+   {
+       const size_t stored_n = 1000000, pairs_n = 10000;
+       kvalue_minhash_t **stored = malloc(stored_n * sizeof(*stored));
+       double *dist_out = malloc(pairs_n * pairs_n * sizeof(double));
+       assert(stored && dist_out);
+       uint32_t vals[256];
+       for (size_t s = 0; s < stored_n; s++) {
+           stored[s] = kmh_init(128, 0xFFFFFFFF, 0);
+           assert(stored[s]);
+           for (uint32_t v = 0; v < 256; v++) vals[v] = (uint32_t)(s % 5000) * 64 + v;
+           kmh_add_batch(stored[s], vals, 256);
+       }
+       const kvalue_minhash_t *const *stored_c = (const kvalue_minhash_t *const *)stored;
+       double sink = 0, ms = now_ms();
+       for (size_t s = 0; s < stored_n; s++) {
+           // The old branchy walk, for reference
+           const kvalue_minhash_t *q = stored[0], *t = stored[s];
+           uint32_t matches = 0, i = 0, j = 0, compared = 0;
+           while (i < q->count && j < t->count && compared < q->k) {
+               if (q->hashes[i] == t->hashes[j]) { matches++; i++; j++; }
+               else if (q->hashes[i] > t->hashes[j]) i++;
+               else j++;
+               compared++;
+           }
+           sink += compared ? 1.0 - (double)matches / compared : 1.0;
+       }
+       printf("Distance 1x1M: branchy %.1f ms", now_ms() - ms);
+       ms = now_ms();
+       kmh_distance_many(stored[0], stored_c, stored_n, dist_out);
+       printf(", kmh_distance_many %.1f ms", now_ms() - ms);
+       kmh_pool_t *pool = kmh_pool_create((uint32_t)sysconf(_SC_NPROCESSORS_ONLN));
+       assert(pool);
+       ms = now_ms();
+       kmh_pool_distance_many(pool, stored[0], stored_c, stored_n, dist_out);
+       printf(", pooled (%u threads) %.1f ms (%.0f %.0f)\n", pool->nthreads, now_ms() - ms, sink,
+              dist_out[stored_n - 1]);
+       ms = now_ms();
+       kmh_pool_distance_all_pairs(pool, stored_c, pairs_n, stored_c + pairs_n, pairs_n, dist_out);
+       ms = now_ms() - ms;
+       printf("Distance 10kx10k: pooled all pairs %.1f ms (%.1f Mpairs/s)\n", ms,
+              pairs_n * pairs_n / ms / 1e3);
+       kmh_pool_destroy(pool);
+       
+       // The same 1M sketches behind an LSH index: 1000 queries vs one scan
+       kmh_lsh_t *lsh = kmh_lsh_init(16, 4);
+       assert(lsh);
+       ms = now_ms();
+       for (size_t s = 0; s < stored_n; s++) {
+           int inserted = kmh_lsh_insert(lsh, (int64_t)s, stored[s]);
+           assert(inserted);
+           (void)inserted;
+       }
+       printf("LSH 1M: insert %.1f ms", now_ms() - ms);
+       size_t hits = 0;
+       ms = now_ms();
+       for (size_t q = 0; q < 1000; q++) {
+           kmh_lsh_match_t *found;
+           hits += kmh_lsh_query(lsh, stored[q * 997 % stored_n], 0.8, &found);
+           kmh_dealloc(found);
+       }
+       printf(", 1000 queries %.1f ms (%zu matches)\n", now_ms() - ms, hits);
+       kmh_lsh_free(lsh);
+       
+       // 100k of them in a sketch store: lookups read the mapped blobs in place
+       const char *store_path = "/tmp/kmh_bench.kmhs";
+       const size_t store_n = 100000;
+       unlink(store_path);
+       ms = now_ms();
+       kmh_store_writer_t *sw = kmh_store_writer_open(store_path);
+       assert(sw);
+       for (size_t s = 0; s < store_n; s++) kmh_store_put_sketch(sw, s, stored[s]);
+       int committed = kmh_store_writer_close(sw);
+       assert(committed);
+       (void)committed;
+       printf("Store 100k: write %.1f ms", now_ms() - ms);
+       kmh_store_t *st = kmh_store_open(store_path);
+       assert(st);
+       double store_sink = 0;
+       ms = now_ms();
+       for (size_t q = 0; q < 1000000; q++) store_sink += kmh_store_cardinality(st, q * 7919 % store_n);
+       printf(", 1M cardinalities %.1f ms", now_ms() - ms);
+       ms = now_ms();
+       for (size_t q = 0; q < 1000000; q++) store_sink += kmh_store_distance(st, q % store_n, q * 7919 % store_n);
+       printf(", 1M distances %.1f ms (%.0f)\n", now_ms() - ms, store_sink);
+       kmh_store_close(st);
+       unlink(store_path);
+       for (size_t s = 0; s < stored_n; s++) kmh_free(stored[s]);
+       free(stored);
+       free(dist_out);
+   }
    
    // Serialization benchmark
    uint8_t *buf;
-   uint32_t size;
+   uint32_t size = 0;
    BENCH("Serialize", 10000, { 
        size = kmh_serialize(kmh, &buf); 
        kmh_free_buffer(buf); // Use pooled buffer
@@ -55,12 +390,38 @@ int main() {
        kmh_free(tmp);
    });
 
-   //BENCH("Deserialize Zero Copy", 10000, {
-   //    kvalue_minhash_t *tmp = kmh_deserialize_zerocopy(buf, size);
-       //kmh_free_zerocopy(tmp);
-   //});
+   kmh_view_t view;
+   BENCH("View (zero copy)", 10000, {
+       if (kmh_view_init(&view, buf, size)) BENCH_KEEP(kmh_view_cardinality(&view));
+   });
+
+   BENCH("Fast cardinality", 100000, BENCH_KEEP(kmh_cardinality_from_serialized(buf, size)));
 
-   BENCH("Fast cardinality", 100000, kmh_cardinality_from_serialized(buf, size));
+   // Compressed encodings: size against raw and decode throughput (K hashes per op)
+   const char *encoding_names[] = { "raw", "varint", "bitpack" };
+   kvalue_minhash_t *kmh_full = kmh_init(K, 0xFFFFFFFF, 0);
+   assert(kmh_full);
+   kmh_add_batch(kmh_full, random_values, N);
+   kvalue_minhash_t *encoded_sketches[] = { kmh, kmh_full };
+   uint32_t decoded[K];
+   for (int s = 0; s < 2; s++) {
+       printf("space %u:\n", encoded_sketches[s]->space_size);
+       for (uint8_t enc = KMH_ENCODING_RAW; enc <= KMH_ENCODING_BITPACK; enc++) {
+           uint8_t *cbuf;
+           uint32_t csize = kmh_serialize_encoded(encoded_sketches[s], enc, &cbuf);
+           kmh_blob_info_t info;
+           kmh_blob_parse(&info, cbuf, csize);
+           printf("  %-8s %5u bytes (%.2fx of raw)\n", encoding_names[enc], csize,
+                  (double)csize / (KMH_BLOB_HEADER_SIZE + info.count * sizeof(uint32_t)));
+           char variant[64];
+           snprintf(variant, sizeof(variant), "%s space %u", encoding_names[enc], encoded_sketches[s]->space_size);
+           bench_tags.variant = variant;
+           BENCH("  Decode", 100000, BENCH_KEEP(kmh_blob_decode(&info, cbuf, csize, decoded)));
+           kmh_free_buffer(cbuf);
+       }
+   }
+   bench_tags.variant = "";
+   kmh_free(kmh_full);
    
    // Merge benchmark (create fresh hashes to avoid realloc issues)
    kvalue_minhash_t *a = kmh_init(K, SPACE, 42);
@@ -71,6 +432,107 @@ int main() {
        kvalue_minhash_t *merged = kmh_merge(a, b);
        kmh_free(merged);
    });
+
+   // Aggregate-style merge: one accumulator, a view per row, no allocation
+   // (the reset memcpy is timed too)
+   kvalue_minhash_t *merged_acc = kmh_init(K, SPACE, 42);
+   assert(merged_acc);
+   uint8_t *b_buf;
+   uint32_t b_size = kmh_serialize(b, &b_buf);
+   kmh_view_t b_view;
+   kmh_view_init(&b_view, b_buf, b_size);
+   uint32_t merge_scratch[K];
+   BENCH("Merge into", 10000, {
+       merged_acc->count = a->count;
+       memcpy(merged_acc->hashes, a->hashes, a->count * sizeof(uint32_t));
+       kmh_merge_into(merged_acc, &b_view, merge_scratch);
+   });
+   kmh_free_buffer(b_buf);
+   kmh_free(merged_acc);
+
+   // Rollup of 1000 shard sketches: one N-way merge vs 999 pairwise merges
+   const int SHARDS = 1000;
+   kvalue_minhash_t **shards = malloc(SHARDS * sizeof(*shards));
+   assert(shards);
+   for (int s = 0; s < SHARDS; s++) {
+       shards[s] = kmh_init(K, 0xFFFFFFFF, 42);
+       assert(shards[s]);
+       kmh_add_batch(shards[s], random_values + (size_t)s * (N / SHARDS), N / SHARDS);
+   }
+   BENCH("Merge pairwise x1000", 10, {
+       kvalue_minhash_t *acc = kmh_merge(shards[0], shards[1]);
+       for (int s = 2; s < SHARDS; s++) {
+           kvalue_minhash_t *next = kmh_merge(acc, shards[s]);
+           kmh_free(acc);
+           acc = next;
+       }
+       kmh_free(acc);
+   });
+   BENCH("Merge many x1000", 10, {
+       kmh_free(kmh_merge_many((const kvalue_minhash_t **)shards, SHARDS));
+   });
+   // Two-way kernels over rotating inputs, so branch history can't learn one pattern
+   uint32_t merge2_out[K];
+   volatile uint32_t merge2_sink = 0;
+   BENCH("Merge2 scalar", 100000, merge2_sink += kmh_merge2_scalar(
+       shards[i % SHARDS]->hashes, shards[i % SHARDS]->count,
+       shards[(i + 1) % SHARDS]->hashes, shards[(i + 1) % SHARDS]->count, K, merge2_out));
+   kmh_merge2_fn merge2 = kmh_merge2_select();
+   BENCH("Merge2 SIMD", 100000, merge2_sink += merge2(
+       shards[i % SHARDS]->hashes, shards[i % SHARDS]->count,
+       shards[(i + 1) % SHARDS]->hashes, shards[(i + 1) % SHARDS]->count, K, merge2_out));
+   (void)merge2_sink;
+   for (int s = 0; s < SHARDS; s++) kmh_free(shards[s]);
+   free(shards);
+   
+   // Sweep K x input distribution: batch ingest per value, then the merge
+   // kernel and distance between two such sketches, flat and blocked. K past
+   // MAX_K only exists in memory for flat sketches (their blobs stop at
+   // MAX_K * 10), but kmh_init takes any K.
+   {
+       const size_t sweep_n = (size_t)1 << 18;
+       const uint32_t sweep_k[] = { 16, 64, 256, 1024, 4096, 16384, 65536 };
+       uint32_t *sweep_values = malloc(2 * sweep_n * sizeof(uint32_t));
+       uint32_t *sweep_out = malloc(65536 * sizeof(uint32_t));
+       assert(sweep_values && sweep_out);
+       for (int dist = 0; dist < BENCH_DISTS; dist++) {
+           int filled = bench_fill(sweep_values, 2 * sweep_n, dist, 42);
+           assert(filled);
+           (void)filled;
+           bench_tags.dist = bench_dist_names[dist];
+           for (size_t s = 0; s < sizeof(sweep_k) / sizeof(*sweep_k); s++) {
+               uint32_t k = sweep_k[s];
+               kvalue_minhash_t *x = kmh_init(k, 0xFFFFFFFF, 0), *y = kmh_init(k, 0xFFFFFFFF, 0);
+               assert(x && y);
+               bench_tags.k = k;
+               printf("%s, k %u, %zu values:\n", bench_dist_names[dist], k, sweep_n);
+               BENCH_RUN("  Add batch", 1, sweep_n, x->count = 0, kmh_add_batch(x, sweep_values, sweep_n));
+               kmh_add_batch(y, sweep_values + sweep_n, sweep_n);
+               int reps = (1 << 20) / k;
+               BENCH("  Merge2", reps, BENCH_KEEP(merge2(x->hashes, x->count, y->hashes, y->count, k, sweep_out)));
+               BENCH("  Distance", reps, BENCH_KEEP(kmh_distance(x, y)));
+               kmh_blocked_t *bx = kmh_blocked_init(k, 0xFFFFFFFF, 0), *by = kmh_blocked_init(k, 0xFFFFFFFF, 0);
+               assert(bx && by);
+               BENCH_RUN("  Blocked add batch", 1, sweep_n, kmh_blocked_reset(bx),
+                         kmh_blocked_add_batch(bx, sweep_values, sweep_n));
+               kmh_blocked_add_batch(by, sweep_values + sweep_n, sweep_n);
+               BENCH("  Blocked merge", reps, {
+                   kmh_blocked_t *m = kmh_blocked_merge(bx, by);
+                   BENCH_KEEP(m->count);
+                   kmh_blocked_free(m);
+               });
+               BENCH("  Blocked distance", reps, BENCH_KEEP(kmh_blocked_distance(bx, by)));
+               kmh_free(x);
+               kmh_free(y);
+               kmh_blocked_free(bx);
+               kmh_blocked_free(by);
+           }
+       }
+       bench_tags.k = K;
+       bench_tags.dist = "";
+       free(sweep_values);
+       free(sweep_out);
+   }
    
    // Accuracy test
    printf("\nAccuracy Test:\n");
@@ -81,5 +543,7 @@ int main() {
    // Cleanup
    // free(buf);
    kmh_free(kmh); kmh_free(kmh2); kmh_free(a); kmh_free(b);
+   free(random_values);
+   bench_finish();
    return 0;
 }
@@ -0,0 +1,315 @@
+#ifndef KMH_BENCH_H
+#define KMH_BENCH_H
+
+// Benchmark harness shared by src/bench.c and sqlite/src/bench.c: monotonic
+// (and, on x86, TSC) timing, warmup plus repeated trials reported as
+// min/p50/p99 per op, CPU pinning, input distributions, and CSV/JSON records
+// that can be diffed between commits.
+//
+//   bench [--trials N] [--warmup N] [--cpu N] [--csv FILE | --json FILE]
+//
+// Include this before anything else: pinning needs _GNU_SOURCE.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#endif
+
+#define BENCH_MAX_TRIALS 101
+
+// Keep a value (and everything it was computed from) alive without storing it
+#define BENCH_KEEP(x) __asm__ volatile("" : : "r,m"(x) : "memory")
+#define BENCH_CLOBBER() __asm__ volatile("" : : : "memory")
+
+typedef struct {
+   int trials, warmup, cpu;
+   int format; // 0 none, 1 csv, 2 json
+   const char *suite;
+   FILE *out;
+   size_t records;
+   int pinned;
+   cpu_set_t all; // affinity at startup, restored by bench_unpin()
+} bench_config_t;
+
+// Tags attached to every record, so that (name, k, dist, threads, variant)
+// is unique; sweeps and loops set them and put them back
+typedef struct {
+   uint32_t k, threads;
+   const char *dist, *variant;
+} bench_tags_t;
+
+static bench_config_t bench_cfg = { .trials = 7, .warmup = 1, .cpu = -1, .suite = "" };
+static bench_tags_t bench_tags = { .threads = 1, .dist = "", .variant = "" };
+
+static inline uint64_t bench_now_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t bench_cycles(void) {
+#ifdef BENCH_HAVE_TSC
+   return __rdtsc();
+#else
+   return 0;
+#endif
+}
+
+static inline int bench_pin(void) {
+   if (bench_cfg.cpu < 0) return 0;
+   cpu_set_t one;
+   CPU_ZERO(&one);
+   CPU_SET(bench_cfg.cpu, &one);
+   bench_cfg.pinned = pthread_setaffinity_np(pthread_self(), sizeof(one), &one) == 0;
+   return bench_cfg.pinned;
+}
+
+// Multithreaded sections run unpinned so workers (and kmh_pool threads,
+// which inherit the caller's mask) can spread out
+static inline void bench_unpin(void) {
+   if (!bench_cfg.pinned) return;
+   pthread_setaffinity_np(pthread_self(), sizeof(bench_cfg.all), &bench_cfg.all);
+   bench_cfg.pinned = 0;
+}
+
+// Worker t of a sweep goes on the t-th allowed CPU (wrapping)
+static inline int bench_spawn(pthread_t *thread, void *(*fn)(void *), void *arg, uint32_t t) {
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   int n = CPU_COUNT(&bench_cfg.all);
+   if (n > 0) {
+       int want = (int)(t % (uint32_t)n), cpu = 0;
+       for (; cpu < CPU_SETSIZE; cpu++) {
+           if (CPU_ISSET(cpu, &bench_cfg.all) && want-- == 0) break;
+       }
+       cpu_set_t one;
+       CPU_ZERO(&one);
+       CPU_SET(cpu, &one);
+       pthread_attr_setaffinity_np(&attr, sizeof(one), &one);
+   }
+   int rc = pthread_create(thread, &attr, fn, arg);
+   pthread_attr_destroy(&attr);
+   return rc;
+}
+
+static void bench_usage(const char *prog) {
+   fprintf(stderr, "usage: %s [--trials N] [--warmup N] [--cpu N] [--csv FILE | --json FILE]\n", prog);
+   exit(2);
+}
+
+// Parses the command line, opens the record file and pins the main thread
+// (to --cpu, or to whatever CPU it is on)
+static void bench_start(int argc, char **argv, const char *suite) {
+   const char *path = NULL;
+   bench_cfg.suite = suite;
+   sched_getaffinity(0, sizeof(bench_cfg.all), &bench_cfg.all);
+   bench_cfg.cpu = sched_getcpu();
+   for (int i = 1; i < argc; i++) {
+       if (i + 1 >= argc) bench_usage(argv[0]);
+       const char *opt = argv[i], *val = argv[++i];
+       if (strcmp(opt, "--trials") == 0) bench_cfg.trials = atoi(val);
+       else if (strcmp(opt, "--warmup") == 0) bench_cfg.warmup = atoi(val);
+       else if (strcmp(opt, "--cpu") == 0) bench_cfg.cpu = atoi(val);
+       else if (strcmp(opt, "--csv") == 0) { bench_cfg.format = 1; path = val; }
+       else if (strcmp(opt, "--json") == 0) { bench_cfg.format = 2; path = val; }
+       else bench_usage(argv[0]);
+   }
+   if (bench_cfg.trials < 1) bench_cfg.trials = 1;
+   if (bench_cfg.trials > BENCH_MAX_TRIALS) bench_cfg.trials = BENCH_MAX_TRIALS;
+   if (bench_cfg.warmup < 0) bench_cfg.warmup = 0;
+   if (path) {
+       bench_cfg.out = fopen(path, "w");
+       if (!bench_cfg.out) { perror(path); exit(1); }
+       if (bench_cfg.format == 1) {
+           fprintf(bench_cfg.out, "suite,name,k,dist,threads,variant,ops,trials,min_ns,p50_ns,p99_ns,mean_ns,p50_cycles,"
+                   "truth,bias,rse,p99_err\n");
+       } else {
+           fprintf(bench_cfg.out, "{\"suite\": \"%s\", \"trials\": %d, \"warmup\": %d, \"records\": [", suite,
+                   bench_cfg.trials, bench_cfg.warmup);
+       }
+   }
+   bench_pin();
+   printf("%d trials after %d warmup, pinned to cpu %d%s\n", bench_cfg.trials, bench_cfg.warmup, bench_cfg.cpu,
+          bench_cfg.pinned ? "" : " (failed)");
+}
+
+static void bench_finish(void) {
+   if (!bench_cfg.out) return;
+   if (bench_cfg.format == 2) fprintf(bench_cfg.out, "\n]}\n");
+   fclose(bench_cfg.out);
+   bench_cfg.out = NULL;
+}
+
+static int bench_cmp_u64(const void *a, const void *b) {
+   uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+   return (x > y) - (x < y);
+}
+
+static int bench_cmp_double(const void *a, const void *b) {
+   double x = *(const double *)a, y = *(const double *)b;
+   return (x > y) - (x < y);
+}
+
+// Nearest rank on a sorted sample
+static inline uint64_t bench_rank(const uint64_t *sorted, int n, double q) {
+   int r = (int)ceil(q * n);
+   return sorted[r < 1 ? 0 : r - 1];
+}
+
+// Writes one record to the CSV/JSON file; ns[] and cycles[] hold whole-trial
+// totals for ops operations each (cycles may be NULL). Returns p50 ns per op.
+static double bench_emit(const char *name, double ops, uint64_t *ns, uint64_t *cycles, int trials) {
+   qsort(ns, trials, sizeof(*ns), bench_cmp_u64);
+   if (cycles) qsort(cycles, trials, sizeof(*cycles), bench_cmp_u64);
+   double sum = 0;
+   for (int t = 0; t < trials; t++) sum += (double)ns[t];
+   double min = ns[0] / ops, p50 = bench_rank(ns, trials, 0.5) / ops, p99 = bench_rank(ns, trials, 0.99) / ops;
+   double mean = sum / trials / ops, cyc = cycles ? bench_rank(cycles, trials, 0.5) / ops : 0;
+   if (!bench_cfg.out) return p50;
+   // Names in this tree are plain ASCII without quotes or commas: drop the
+   // leading indentation used for the text layout and write them as is
+   while (*name == ' ') name++;
+   if (bench_cfg.format == 1) {
+       fprintf(bench_cfg.out, "%s,%s,%u,%s,%u,%s,%.0f,%d,%.3f,%.3f,%.3f,%.3f,%.1f,,,,\n", bench_cfg.suite, name,
+               bench_tags.k, bench_tags.dist, bench_tags.threads, bench_tags.variant, ops, trials,
+               min, p50, p99, mean, cyc);
+   } else {
+       fprintf(bench_cfg.out, "%s\n  {\"name\": \"%s\", \"k\": %u, \"dist\": \"%s\", \"threads\": %u, "
+               "\"variant\": \"%s\", \"ops\": %.0f, \"trials\": %d, \"min_ns\": %.3f, \"p50_ns\": %.3f, "
+               "\"p99_ns\": %.3f, \"mean_ns\": %.3f, \"p50_cycles\": %.1f}", bench_cfg.records ? "," : "", name,
+               bench_tags.k, bench_tags.dist, bench_tags.threads, bench_tags.variant, ops, trials,
+               min, p50, p99, mean, cyc);
+   }
+   bench_cfg.records++;
+   return p50;
+}
+
+// Writes one estimator-error record: err[] holds one signed error per
+// sketch (relative or absolute, as the caller defines it) against truth.
+// Reports bias (mean), rse (root mean square) and the nearest-rank p99 of
+// |err|; err is reordered. Returns rse.
+static inline double bench_emit_error(const char *name, double truth, double *err, int n) {
+   double sum = 0, sq = 0;
+   for (int i = 0; i < n; i++) {
+       sum += err[i];
+       sq += err[i] * err[i];
+       err[i] = fabs(err[i]);
+   }
+   qsort(err, n, sizeof(*err), bench_cmp_double);
+   int r = (int)ceil(0.99 * n);
+   double bias = sum / n, rse = sqrt(sq / n), tail = err[r < 1 ? 0 : r - 1];
+   if (!bench_cfg.out) return rse;
+   while (*name == ' ') name++;
+   if (bench_cfg.format == 1) {
+       fprintf(bench_cfg.out, "%s,%s,%u,%s,%u,%s,%d,,,,,,,%.6g,%.6g,%.6g,%.6g\n", bench_cfg.suite, name,
+               bench_tags.k, bench_tags.dist, bench_tags.threads, bench_tags.variant, n, truth, bias, rse, tail);
+   } else {
+       fprintf(bench_cfg.out, "%s\n  {\"name\": \"%s\", \"k\": %u, \"dist\": \"%s\", \"threads\": %u, "
+               "\"variant\": \"%s\", \"sketches\": %d, \"truth\": %.6g, \"bias\": %.6g, \"rse\": %.6g, "
+               "\"p99_err\": %.6g}", bench_cfg.records ? "," : "", name, bench_tags.k, bench_tags.dist,
+               bench_tags.threads, bench_tags.variant, n, truth, bias, rse, tail);
+   }
+   bench_cfg.records++;
+   return rse;
+}
+
+// bench_emit plus the text line
+static void bench_report(const char *name, double ops, uint64_t *ns, uint64_t *cycles, int trials) {
+   double p50 = bench_emit(name, ops, ns, cycles, trials);
+   double min = ns[0] / ops, p99 = bench_rank(ns, trials, 0.99) / ops;
+   printf("%-20s: %10.1f ns/op (min %10.1f, p99 %10.1f) %14.1f ops/sec\n", name, p50, min, p99, 1e9 / p50);
+}
+
+// Runs setup (untimed) then iterations x code, warmup + trials times, and
+// reports per op, counting ops_per_iteration ops per pass of code. The loop
+// index is i. Wrap results that would otherwise be dead in BENCH_KEEP.
+#define BENCH_RUN(name, iterations, ops_per_iteration, setup, ...) do { \
+   uint64_t bench_ns_[BENCH_MAX_TRIALS], bench_cycles_[BENCH_MAX_TRIALS]; \
+   for (int bench_t_ = -bench_cfg.warmup; bench_t_ < bench_cfg.trials; bench_t_++) { \
+       setup; \
+       BENCH_CLOBBER(); \
+       uint64_t bench_c0_ = bench_cycles(), bench_t0_ = bench_now_ns(); \
+       for (int i = 0; i < (iterations); i++) { __VA_ARGS__; } \
+       BENCH_CLOBBER(); \
+       uint64_t bench_t1_ = bench_now_ns(), bench_c1_ = bench_cycles(); \
+       if (bench_t_ >= 0) { \
+           bench_ns_[bench_t_] = bench_t1_ - bench_t0_; \
+           bench_cycles_[bench_t_] = bench_c1_ - bench_c0_; \
+       } \
+   } \
+   bench_report(name, (double)(iterations) * (ops_per_iteration), bench_ns_, \
+                BENCH_HAVE_CYCLES ? bench_cycles_ : NULL, bench_cfg.trials); \
+} while (0)
+
+#define BENCH(name, iterations, ...) BENCH_RUN(name, iterations, 1, (void)0, __VA_ARGS__)
+
+#ifdef BENCH_HAVE_TSC
+#define BENCH_HAVE_CYCLES 1
+#else
+#define BENCH_HAVE_CYCLES 0
+#endif
+
+// Input distributions for the sweeps
+enum { BENCH_SEQUENTIAL, BENCH_UNIFORM, BENCH_ZIPF, BENCH_DUPLICATE, BENCH_DISTS };
+static const char *const bench_dist_names[BENCH_DISTS] = { "sequential", "uniform", "zipf", "duplicate" };
+
+#define BENCH_ZIPF_RANKS (1u << 20)
+#define BENCH_ZIPF_S 1.1
+#define BENCH_DUPLICATE_DISTINCT 1024
+
+static inline uint64_t bench_splitmix(uint64_t *state) {
+   uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+   return z ^ (z >> 31);
+}
+
+// Fills out[0..n) deterministically from seed. Zipf draws a rank by inverse
+// CDF over BENCH_ZIPF_RANKS ranks; ranks and duplicates are spread over 32
+// bits (odd multiplier, so distinct ranks stay distinct values).
+static inline int bench_fill(uint32_t *out, size_t n, int dist, uint64_t seed) {
+   uint64_t state = seed;
+   double *cdf = NULL;
+   if (dist == BENCH_ZIPF) {
+       cdf = malloc(BENCH_ZIPF_RANKS * sizeof(double));
+       if (!cdf) return 0;
+       double sum = 0;
+       for (uint32_t r = 0; r < BENCH_ZIPF_RANKS; r++) cdf[r] = sum += pow(r + 1.0, -BENCH_ZIPF_S);
+       for (uint32_t r = 0; r < BENCH_ZIPF_RANKS; r++) cdf[r] /= sum;
+   }
+   for (size_t i = 0; i < n; i++) {
+       uint64_t x = bench_splitmix(&state);
+       switch (dist) {
+       case BENCH_SEQUENTIAL: out[i] = (uint32_t)(seed + i); break;
+       case BENCH_UNIFORM: out[i] = (uint32_t)x; break;
+       case BENCH_ZIPF: {
+           double u = (x >> 11) * 0x1.0p-53;
+           uint32_t lo = 0, hi = BENCH_ZIPF_RANKS - 1;
+           while (lo < hi) {
+               uint32_t mid = lo + (hi - lo) / 2;
+               if (cdf[mid] < u) lo = mid + 1; else hi = mid;
+           }
+           out[i] = lo * 2654435761u;
+           break;
+       }
+       default: out[i] = (uint32_t)(x % BENCH_DUPLICATE_DISTINCT) * 2654435761u; break;
+       }
+   }
+   free(cdf);
+   return 1;
+}
+
+#endif
@@ -1,12 +1,34 @@
 #ifndef KVALUE_MINHASH_H
 #define KVALUE_MINHASH_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdatomic.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define KMH_HAVE_PTHREAD 1
+#define KMH_HAVE_MMAP 1
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define KMH_HAVE_X86_SIMD 1
+#elif defined(__GNUC__) && defined(__aarch64__)
+#include <arm_neon.h>
+#define KMH_HAVE_NEON 1
+#endif
+
 // xxHash32 implementation (optimized for speed)
 #define XXH_PRIME32_1 0x9E3779B1U
 #define XXH_PRIME32_2 0x85EBCA77U
@@ -30,76 +52,764 @@ static inline uint32_t xxh32_hash(uint32_t input, uint32_t seed) {
     return h32;
 }
 
-// Static buffer pool
-#define MAX_INSTANCES 4
-#define MAX_K 1024
+// Little-endian loads/stores for portable blobs (memcpy keeps them
+// alignment-safe; on little-endian hosts they compile to plain moves)
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define KMH_BIG_ENDIAN 1
+#endif
+
+static inline uint32_t kmh_load_le32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#ifdef KMH_BIG_ENDIAN
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static inline uint64_t kmh_load_le64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#ifdef KMH_BIG_ENDIAN
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline void kmh_store_le32(uint8_t *p, uint32_t v) {
+#ifdef KMH_BIG_ENDIAN
+    v = __builtin_bswap32(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline void kmh_store_le64(uint8_t *p, uint64_t v) {
+#ifdef KMH_BIG_ENDIAN
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+// Streaming xxHash32 / xxHash64 over byte buffers (reference-compatible
+// with XXH32() / XXH64()), for hashing strings and blobs directly
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh64_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
 
 typedef struct {
-    uint32_t k;          // Max capacity
-    uint32_t count;      // Current count
-    uint32_t space_size; // Hash space modulo
-    uint32_t seed;       // Hash seed
-    uint32_t *hashes;    // Sorted descending
-} kvalue_minhash_t;
+    uint64_t total_len;
+    uint32_t v[4];
+    uint32_t seed;
+    uint32_t memsize;
+    uint8_t mem[16];
+} xxh32_state_t;
+
+typedef struct {
+    uint64_t total_len;
+    uint64_t v[4];
+    uint64_t seed;
+    uint32_t memsize;
+    uint8_t mem[32];
+} xxh64_state_t;
+
+static inline uint32_t xxh32_round(uint32_t acc, uint32_t input) {
+    acc += input * XXH_PRIME32_2;
+    return xxh32_rotl(acc, 13) * XXH_PRIME32_1;
+}
+
+static inline void xxh32_reset(xxh32_state_t *st, uint32_t seed) {
+    st->total_len = 0;
+    st->seed = seed;
+    st->memsize = 0;
+    st->v[0] = seed + XXH_PRIME32_1 + XXH_PRIME32_2;
+    st->v[1] = seed + XXH_PRIME32_2;
+    st->v[2] = seed;
+    st->v[3] = seed - XXH_PRIME32_1;
+}
+
+static inline void xxh32_update(xxh32_state_t *st, const void *data, size_t len) {
+    const uint8_t *p = data;
+    const uint8_t *end = p + len;
+    st->total_len += len;
+
+    if (st->memsize + len < 16) {
+        memcpy(st->mem + st->memsize, p, len);
+        st->memsize += (uint32_t)len;
+        return;
+    }
+    if (st->memsize) {
+        uint32_t fill = 16 - st->memsize;
+        memcpy(st->mem + st->memsize, p, fill);
+        for (int i = 0; i < 4; i++) st->v[i] = xxh32_round(st->v[i], kmh_load_le32(st->mem + 4 * i));
+        p += fill;
+        st->memsize = 0;
+    }
+    while (p + 16 <= end) {
+        for (int i = 0; i < 4; i++) st->v[i] = xxh32_round(st->v[i], kmh_load_le32(p + 4 * i));
+        p += 16;
+    }
+    if (p < end) {
+        memcpy(st->mem, p, end - p);
+        st->memsize = (uint32_t)(end - p);
+    }
+}
+
+static inline uint32_t xxh32_digest(const xxh32_state_t *st) {
+    uint32_t h32;
+    if (st->total_len >= 16) {
+        h32 = xxh32_rotl(st->v[0], 1) + xxh32_rotl(st->v[1], 7) +
+              xxh32_rotl(st->v[2], 12) + xxh32_rotl(st->v[3], 18);
+    } else {
+        h32 = st->seed + XXH_PRIME32_5;
+    }
+    h32 += (uint32_t)st->total_len;
+
+    const uint8_t *p = st->mem;
+    const uint8_t *end = p + st->memsize;
+    while (p + 4 <= end) {
+        h32 += kmh_load_le32(p) * XXH_PRIME32_3;
+        h32 = xxh32_rotl(h32, 17) * XXH_PRIME32_4;
+        p += 4;
+    }
+    while (p < end) {
+        h32 += (*p++) * XXH_PRIME32_5;
+        h32 = xxh32_rotl(h32, 11) * XXH_PRIME32_1;
+    }
+
+    h32 ^= h32 >> 15;
+    h32 *= XXH_PRIME32_2;
+    h32 ^= h32 >> 13;
+    h32 *= XXH_PRIME32_3;
+    h32 ^= h32 >> 16;
+    return h32;
+}
+
+// One-shot XXH32; xxh32_bytes(&v_le, 4, seed) == xxh32_hash(v, seed)
+static inline uint32_t xxh32_bytes(const void *data, size_t len, uint32_t seed) {
+    xxh32_state_t st;
+    xxh32_reset(&st, seed);
+    xxh32_update(&st, data, len);
+    return xxh32_digest(&st);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    return xxh64_rotl(acc, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static inline void xxh64_reset(xxh64_state_t *st, uint64_t seed) {
+    st->total_len = 0;
+    st->seed = seed;
+    st->memsize = 0;
+    st->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    st->v[1] = seed + XXH_PRIME64_2;
+    st->v[2] = seed;
+    st->v[3] = seed - XXH_PRIME64_1;
+}
+
+static inline void xxh64_update(xxh64_state_t *st, const void *data, size_t len) {
+    const uint8_t *p = data;
+    const uint8_t *end = p + len;
+    st->total_len += len;
+
+    if (st->memsize + len < 32) {
+        memcpy(st->mem + st->memsize, p, len);
+        st->memsize += (uint32_t)len;
+        return;
+    }
+    if (st->memsize) {
+        uint32_t fill = 32 - st->memsize;
+        memcpy(st->mem + st->memsize, p, fill);
+        for (int i = 0; i < 4; i++) st->v[i] = xxh64_round(st->v[i], kmh_load_le64(st->mem + 8 * i));
+        p += fill;
+        st->memsize = 0;
+    }
+    while (p + 32 <= end) {
+        for (int i = 0; i < 4; i++) st->v[i] = xxh64_round(st->v[i], kmh_load_le64(p + 8 * i));
+        p += 32;
+    }
+    if (p < end) {
+        memcpy(st->mem, p, end - p);
+        st->memsize = (uint32_t)(end - p);
+    }
+}
+
+static inline uint64_t xxh64_digest(const xxh64_state_t *st) {
+    uint64_t h64;
+    if (st->total_len >= 32) {
+        h64 = xxh64_rotl(st->v[0], 1) + xxh64_rotl(st->v[1], 7) +
+              xxh64_rotl(st->v[2], 12) + xxh64_rotl(st->v[3], 18);
+        for (int i = 0; i < 4; i++) h64 = xxh64_merge_round(h64, st->v[i]);
+    } else {
+        h64 = st->seed + XXH_PRIME64_5;
+    }
+    h64 += st->total_len;
+
+    const uint8_t *p = st->mem;
+    const uint8_t *end = p + st->memsize;
+    while (p + 8 <= end) {
+        h64 ^= xxh64_round(0, kmh_load_le64(p));
+        h64 = xxh64_rotl(h64, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h64 ^= (uint64_t)kmh_load_le32(p) * XXH_PRIME64_1;
+        h64 = xxh64_rotl(h64, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h64 ^= (*p++) * XXH_PRIME64_5;
+        h64 = xxh64_rotl(h64, 11) * XXH_PRIME64_1;
+    }
+
+    h64 ^= h64 >> 33;
+    h64 *= XXH_PRIME64_2;
+    h64 ^= h64 >> 29;
+    h64 *= XXH_PRIME64_3;
+    h64 ^= h64 >> 32;
+    return h64;
+}
+
+// One-shot XXH64
+static inline uint64_t xxh64_bytes(const void *data, size_t len, uint64_t seed) {
+    xxh64_state_t st;
+    xxh64_reset(&st, seed);
+    xxh64_update(&st, data, len);
+    return xxh64_digest(&st);
+}
+
+// Range reduction of a raw hash into [0, space_size).
+// This is the hottest line of kmh_add, so the mode is picked once when the
+// sketch is created instead of paying an integer division per value. Every
+// mode returns exactly hash % space_size, so sketches built before or after
+// (and persisted blobs) stay interchangeable.
+#define KMH_REDUCE_MOD  0 // Generic: Lemire's fastmod, multiply-shift by ceil(2^64 / d)
+#define KMH_REDUCE_FULL 1 // space_size == 0xFFFFFFFF: only 0xFFFFFFFF wraps to 0
+#define KMH_REDUCE_POW2 2 // Power of two: a mask
+
+static inline int kmh_reduce_mode(uint32_t space_size) {
+    if (space_size == 0xFFFFFFFFU) return KMH_REDUCE_FULL;
+    if (space_size != 0 && (space_size & (space_size - 1)) == 0) return KMH_REDUCE_POW2;
+    return KMH_REDUCE_MOD;
+}
+
+static inline uint64_t kmh_fastmod_m(uint32_t space_size) {
+    return space_size ? UINT64_C(0xFFFFFFFFFFFFFFFF) / space_size + 1 : 0;
+}
+
+// Lemire, Kaser, Kurz: "Faster Remainder by Direct Computation" (exact for all 32-bit operands)
+static inline uint32_t kmh_fastmod(uint32_t hash, uint64_t m, uint32_t space_size) {
+#if defined(__SIZEOF_INT128__)
+    uint64_t lowbits = m * hash;
+    return (uint32_t)(((__uint128_t)lowbits * space_size) >> 64);
+#else
+    (void)m;
+    return hash % space_size;
+#endif
+}
 
-static struct {
-    kvalue_minhash_t kmh;
-    atomic_int in_use;  // Changed from int to atomic_int
-    uint32_t hashes[MAX_K];
-} kmh_pool[MAX_INSTANCES];
+static inline uint32_t kmh_reduce(uint32_t hash, uint32_t space_size, int mode, uint64_t m) {
+    switch (mode) {
+    case KMH_REDUCE_FULL: return hash + (hash == 0xFFFFFFFFU); // 0xFFFFFFFF wraps to 0
+    case KMH_REDUCE_POW2: return hash & (space_size - 1);
+    default:              return kmh_fastmod(hash, m, space_size);
+    }
+}
+
+#define KMH_CACHE_LINE 64
+
+#ifdef KMH_STRIPED_CACHE
+// Images that can be unloaded while threads live on (the SQLite extension)
+// keep no per-thread state with exit hooks; what would be per thread lives
+// in KMH_STRIPES slots in the image instead. A thread draws a ticket on
+// first use and keeps it: its stripe is the ticket mod KMH_STRIPES, and the
+// first KMH_STRIPES threads have theirs to themselves.
+#define KMH_STRIPES 64
+
+static atomic_uint kmh_next_ticket;
+static _Thread_local uint32_t kmh_thread_ticket; // 1 + the ticket, 0 until drawn
+
+static inline uint32_t kmh_ticket(void) {
+    if (__builtin_expect(!kmh_thread_ticket, 0)) {
+        kmh_thread_ticket = 1 + atomic_fetch_add_explicit(&kmh_next_ticket, 1, memory_order_relaxed);
+    }
+    return kmh_thread_ticket - 1;
+}
 
-#define MAX_SERIALIZE_BUFFERS 4
+static inline uint32_t kmh_stripe(void) {
+    return kmh_ticket() % KMH_STRIPES;
+}
+#endif
+
+// Hot-path counters, compiled in with -DKMH_STATS. Each thread bumps its own
+// block of counters (relaxed load + store, so plain adds on the owner's
+// cache line), linked into a global list the first time it takes a path
+// other than an early reject; kmh_stats_snapshot() sums the live blocks plus
+// those of exited threads under a mutex. Early rejects are not counted but
+// derived (adds - duplicates - inserts), so a rejected add costs a single
+// increment without the registration check; a thread whose adds were all
+// rejected and that never allocated, batch-added or inserted isn't listed.
+// Batches and SQL calls sum their counts in a kmh_stats_local_t on the
+// stack and flush it once. With KMH_STRIPED_CACHE the blocks are
+// cache-line-padded stripes instead: the first KMH_STRIPES threads each bump
+// one of their own, later ones share a last stripe with atomic adds.
+// Without KMH_STATS, KMH_COUNT is empty and the snapshot reports zeros.
+enum {
+    KMH_STAT_ADDS,          // hashes offered to a sketch (kmh_add*, batch lanes)
+    KMH_STAT_EARLY_REJECTS, // not below the k-th smallest (incl. SIMD-filtered lanes), derived
+    KMH_STAT_DUPLICATES,    // found by the binary search
+    KMH_STAT_INSERTS,
+    KMH_STAT_MEMMOVE_BYTES, // shifted to open or close a slot
+    KMH_STAT_POOL_HITS,     // kmh_alloc served from the thread's block cache
+    KMH_STAT_POOL_MISSES,   // fell back to the allocator hook
+    KMH_STAT_BUFFER_HITS,   // the same, for kmh_get_buffer
+    KMH_STAT_BUFFER_MISSES,
+    KMH_STAT_DESERIALIZES,  // blobs decoded into owned sketches
+    KMH_STAT_COUNT
+};
+
+static const char *const kmh_stat_names[KMH_STAT_COUNT] = {
+    "adds", "early_rejects", "duplicates", "inserts", "memmove_bytes",
+    "pool_hits", "pool_misses", "buffer_hits", "buffer_misses", "deserializes"
+};
+
+typedef struct {
+    int enabled;
+    uint64_t counters[KMH_STAT_COUNT];
+} kmh_stats_t;
 
+#if defined(KMH_STATS) && defined(KMH_STRIPED_CACHE)
 typedef struct {
-    uint8_t buffer[(MAX_K+5)*sizeof(uint32_t)];
-    atomic_int busy;  // 0 = free, 1 = busy
-    int heap_allocated; // 0 = pooled, 1 = heap allocated
-} kmh_buffer_t;
+    _Alignas(KMH_CACHE_LINE) _Atomic uint64_t counters[KMH_STAT_COUNT];
+} kmh_stats_stripe_t;
 
-static kmh_buffer_t kmh_buffer_pool[MAX_SERIALIZE_BUFFERS];
+// One stripe per ticket below KMH_STRIPES, then one that later threads share
+static kmh_stats_stripe_t kmh_stats_stripes[KMH_STRIPES + 1];
+static _Thread_local _Atomic uint64_t *kmh_stats_own; // the thread's stripe, if it has one to itself
 
-static inline kvalue_minhash_t* kmh_init(uint32_t k, uint32_t space_size, uint32_t seed) {
-    // Try pool first
-    if (k <= MAX_K) {
-        for (int i = 0; i < MAX_INSTANCES; i++) {
-            int expected = 0;
-            if (atomic_compare_exchange_weak(&kmh_pool[i].in_use, &expected, 1)) {
-                // Successfully acquired this instance
-                kmh_pool[i].kmh.k = k;
-                kmh_pool[i].kmh.count = 0;
-                kmh_pool[i].kmh.space_size = space_size;
-                kmh_pool[i].kmh.seed = seed;
-                kmh_pool[i].kmh.hashes = kmh_pool[i].hashes;
-                return &kmh_pool[i].kmh;
+static void kmh_stats_add_shared(int counter, uint64_t n) {
+    uint32_t ticket = kmh_ticket();
+    if (ticket < KMH_STRIPES) {
+        kmh_stats_own = kmh_stats_stripes[ticket].counters;
+        atomic_store_explicit(&kmh_stats_own[counter],
+                              atomic_load_explicit(&kmh_stats_own[counter], memory_order_relaxed) + n,
+                              memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&kmh_stats_stripes[KMH_STRIPES].counters[counter], n, memory_order_relaxed);
+    }
+}
+
+static inline void kmh_stats_add(int counter, uint64_t n) {
+    _Atomic uint64_t *own = kmh_stats_own;
+    if (__builtin_expect(own != NULL, 1)) {
+        atomic_store_explicit(&own[counter], atomic_load_explicit(&own[counter], memory_order_relaxed) + n,
+                              memory_order_relaxed);
+    } else {
+        kmh_stats_add_shared(counter, n);
+    }
+}
+
+#define KMH_COUNT(counter, n) kmh_stats_add(counter, (uint64_t)(n))
+#define KMH_COUNT_ADDS(n) KMH_COUNT(KMH_STAT_ADDS, n)
+#elif defined(KMH_STATS)
+typedef struct kmh_thread_stats {
+    _Atomic uint64_t counters[KMH_STAT_COUNT];
+    struct kmh_thread_stats *prev, *next;
+    int registered;
+} kmh_thread_stats_t;
+
+static _Thread_local kmh_thread_stats_t kmh_thread_stats;
+static kmh_thread_stats_t *kmh_stats_live;
+static uint64_t kmh_stats_retired[KMH_STAT_COUNT];
+
+#ifdef KMH_HAVE_PTHREAD
+static pthread_mutex_t kmh_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t kmh_stats_key;
+static pthread_once_t kmh_stats_once = PTHREAD_ONCE_INIT;
+
+// Folds an exiting thread's counts into kmh_stats_retired
+static void kmh_stats_destroy(void *arg) {
+    kmh_thread_stats_t *s = arg;
+    pthread_mutex_lock(&kmh_stats_mutex);
+    for (int i = 0; i < KMH_STAT_COUNT; i++) {
+        kmh_stats_retired[i] += atomic_load_explicit(&s->counters[i], memory_order_relaxed);
+    }
+    if (s->prev) s->prev->next = s->next; else kmh_stats_live = s->next;
+    if (s->next) s->next->prev = s->prev;
+    pthread_mutex_unlock(&kmh_stats_mutex);
+}
+
+static void kmh_stats_key_init(void) {
+    pthread_key_create(&kmh_stats_key, kmh_stats_destroy);
+}
+#endif
+
+static void kmh_stats_register(kmh_thread_stats_t *s) {
+    s->registered = 1;
+#ifdef KMH_HAVE_PTHREAD
+    pthread_once(&kmh_stats_once, kmh_stats_key_init);
+    pthread_setspecific(kmh_stats_key, s);
+    pthread_mutex_lock(&kmh_stats_mutex);
+#endif
+    s->next = kmh_stats_live;
+    if (s->next) s->next->prev = s;
+    kmh_stats_live = s;
+#ifdef KMH_HAVE_PTHREAD
+    pthread_mutex_unlock(&kmh_stats_mutex);
+#endif
+}
+
+static inline void kmh_stats_bump(int counter, uint64_t n) {
+    _Atomic uint64_t *c = &kmh_thread_stats.counters[counter];
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void kmh_stats_add(int counter, uint64_t n) {
+    if (__builtin_expect(!kmh_thread_stats.registered, 0)) kmh_stats_register(&kmh_thread_stats);
+    kmh_stats_bump(counter, n);
+}
+
+#define KMH_COUNT(counter, n) kmh_stats_add(counter, n)
+#define KMH_COUNT_ADDS(n) kmh_stats_bump(KMH_STAT_ADDS, n) // the one counter on the reject path
+#else
+#define KMH_COUNT(counter, n) ((void)0)
+#define KMH_COUNT_ADDS(n) ((void)0)
+#endif
+
+// A call's or a batch's counts: KMH_LOCAL_STATS(local) declares them,
+// KMH_LOCAL_COUNT(&local, counter, n) adds to them in registers and
+// KMH_LOCAL_FLUSH(local) hands them to the thread's counters in one go
+#ifdef KMH_STATS
+typedef struct {
+    uint64_t counters[KMH_STAT_COUNT];
+} kmh_stats_local_t;
+
+static inline void kmh_stats_flush(const kmh_stats_local_t *local) {
+#ifdef KMH_STRIPED_CACHE
+    for (int i = 0; i < KMH_STAT_COUNT; i++) {
+        if (local->counters[i]) kmh_stats_add(i, local->counters[i]);
+    }
+#else
+    if (__builtin_expect(!kmh_thread_stats.registered, 0)) kmh_stats_register(&kmh_thread_stats);
+    for (int i = 0; i < KMH_STAT_COUNT; i++) {
+        if (local->counters[i]) kmh_stats_bump(i, local->counters[i]);
+    }
+#endif
+}
+
+#define KMH_LOCAL_STATS(local) kmh_stats_local_t local = { { 0 } }
+#define KMH_LOCAL_COUNT(stats, counter, n) ((stats)->counters[counter] += (uint64_t)(n))
+#define KMH_LOCAL_FLUSH(local) kmh_stats_flush(&(local))
+#else
+typedef struct {
+    char unused;
+} kmh_stats_local_t;
+
+#define KMH_LOCAL_STATS(local) kmh_stats_local_t local
+#define KMH_LOCAL_COUNT(stats, counter, n) ((void)(stats))
+#define KMH_LOCAL_FLUSH(local) ((void)&(local))
+#endif
+
+// Totals over every thread since start; enabled is 0 without KMH_STATS
+static inline void kmh_stats_snapshot(kmh_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+#if defined(KMH_STATS) && defined(KMH_STRIPED_CACHE)
+    out->enabled = 1;
+    for (uint32_t s = 0; s <= KMH_STRIPES; s++) {
+        for (int i = 0; i < KMH_STAT_COUNT; i++) {
+            out->counters[i] += atomic_load_explicit(&kmh_stats_stripes[s].counters[i], memory_order_relaxed);
+        }
+    }
+#elif defined(KMH_STATS)
+    out->enabled = 1;
+#ifdef KMH_HAVE_PTHREAD
+    pthread_mutex_lock(&kmh_stats_mutex);
+#endif
+    memcpy(out->counters, kmh_stats_retired, sizeof(out->counters));
+    for (kmh_thread_stats_t *s = kmh_stats_live; s; s = s->next) {
+        for (int i = 0; i < KMH_STAT_COUNT; i++) {
+            out->counters[i] += atomic_load_explicit(&s->counters[i], memory_order_relaxed);
+        }
+    }
+#ifdef KMH_HAVE_PTHREAD
+    pthread_mutex_unlock(&kmh_stats_mutex);
+#endif
+#endif
+#ifdef KMH_STATS
+    out->counters[KMH_STAT_EARLY_REJECTS] = out->counters[KMH_STAT_ADDS] - out->counters[KMH_STAT_DUPLICATES] -
+                                            out->counters[KMH_STAT_INSERTS];
+#endif
+}
+
+static inline void kmh_cpu_relax(void) {
+#if defined(KMH_HAVE_X86_SIMD)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static inline void kmh_spin_lock(atomic_uint *lock) {
+    while (atomic_exchange_explicit(lock, 1, memory_order_acquire)) {
+        // Spin on a plain load; yield in case the holder was preempted
+        for (unsigned spins = 0; atomic_load_explicit(lock, memory_order_relaxed); spins++) {
+            if (spins < 64) {
+                kmh_cpu_relax();
+            } else {
+#ifdef KMH_HAVE_PTHREAD
+                sched_yield();
+#endif
+                spins = 0;
             }
         }
     }
-    
-    // Fallback to malloc
-    kvalue_minhash_t *kmh = malloc(sizeof(kvalue_minhash_t) + k * sizeof(uint32_t));
+}
+
+static inline void kmh_spin_unlock(atomic_uint *lock) {
+    atomic_store_explicit(lock, 0, memory_order_release);
+}
+
+// Allocator. Sketches, builders and serialize buffers are blocks from
+// kmh_alloc: a 16-byte header recording the block's size class, then the
+// payload, rounded up to a power-of-two number of cache lines. Freed blocks
+// go on a freelist for their class, and kmh_dealloc finds the class in the
+// header, so freeing is O(1). Blocks above the largest class, or beyond
+// KMH_CACHE_DEPTH per class, go back to the allocator hook.
+// By default the freelists are per thread, so threads share no state (no
+// CAS on shared cache lines), and a thread-exit hook hands them back.
+// KMH_STRIPED_CACHE is for images that can be unloaded while threads live
+// on (the SQLite extension), where that hook would run after the image is
+// gone: the freelists live in KMH_STRIPES cache-line-padded stripes
+// in the image instead (one per kmh_stripe()), each behind a spinlock; with
+// no more threads than stripes every lock stays uncontended.
+// kmh_cache_stripes_flush() hands the cached blocks back at teardown.
+// KMH_MALLOC / KMH_FREE set the hook at compile time, kmh_set_allocator
+// before the first allocation.
+#define MAX_K 1024
+#define KMH_SIZE_CLASSES 13 // payloads of 64 bytes .. 256KB
+#define KMH_CACHE_DEPTH  8  // cached blocks per class per thread (or stripe)
+#define KMH_CLASS_DIRECT 0xFFFFFFFFU
+
+typedef struct {
+    void *(*malloc_fn)(size_t size);
+    void (*free_fn)(void *ptr);
+} kmh_allocator_t;
+
+#ifndef KMH_MALLOC
+#define KMH_MALLOC malloc
+#define KMH_FREE   free
+#endif
+
+static kmh_allocator_t kmh_allocator = { KMH_MALLOC, KMH_FREE };
+static atomic_int kmh_allocator_used; // a block came from the hook: it can't change any more
+
+typedef struct {
+    uint32_t size_class; // KMH_CLASS_DIRECT: never cached
+    uint32_t reserved;
+    uint64_t pad;        // keeps the payload 16-byte aligned
+} kmh_block_t;
+
+typedef struct {
+    _Alignas(KMH_CACHE_LINE) void *head[KMH_SIZE_CLASSES]; // payloads, linked through their first word
+    uint32_t depth[KMH_SIZE_CLASSES];
+    int registered;
+} kmh_thread_cache_t;
+
+static inline void kmh_thread_cache_release(kmh_thread_cache_t *cache) {
+    for (int c = 0; c < KMH_SIZE_CLASSES; c++) {
+        while (cache->head[c]) {
+            void *next = *(void **)cache->head[c];
+            kmh_allocator.free_fn((kmh_block_t *)cache->head[c] - 1);
+            cache->head[c] = next;
+        }
+        cache->depth[c] = 0;
+    }
+}
+
+#ifdef KMH_STRIPED_CACHE
+typedef struct {
+    _Alignas(KMH_CACHE_LINE) atomic_uint lock;
+    kmh_thread_cache_t cache;
+} kmh_cache_stripe_t;
+
+static kmh_cache_stripe_t kmh_cache_stripes[KMH_STRIPES];
+
+// The calling thread's freelists, locked; hand them back with kmh_cache_unlock
+static inline kmh_thread_cache_t* kmh_cache_lock(void) {
+    kmh_cache_stripe_t *stripe = &kmh_cache_stripes[kmh_stripe()];
+    kmh_spin_lock(&stripe->lock);
+    return &stripe->cache;
+}
+
+static inline void kmh_cache_unlock(kmh_thread_cache_t *cache) {
+    kmh_spin_unlock(&((kmh_cache_stripe_t *)((char *)cache - offsetof(kmh_cache_stripe_t, cache)))->lock);
+}
+
+// Hands every stripe's cached blocks back to the hook
+static inline void kmh_cache_stripes_flush(void) {
+    for (uint32_t s = 0; s < KMH_STRIPES; s++) {
+        kmh_spin_lock(&kmh_cache_stripes[s].lock);
+        kmh_thread_cache_release(&kmh_cache_stripes[s].cache);
+        kmh_spin_unlock(&kmh_cache_stripes[s].lock);
+    }
+}
+#else
+static _Thread_local kmh_thread_cache_t kmh_thread_cache;
+
+#ifdef KMH_HAVE_PTHREAD
+// Returns a thread's cached blocks when it exits
+static pthread_key_t kmh_cache_key;
+static pthread_once_t kmh_cache_once = PTHREAD_ONCE_INIT;
+
+static void kmh_cache_destroy(void *cache) {
+    kmh_thread_cache_release(cache);
+}
+
+static void kmh_cache_key_init(void) {
+    pthread_key_create(&kmh_cache_key, kmh_cache_destroy);
+}
+#endif
+
+static inline kmh_thread_cache_t* kmh_cache_lock(void) {
+    return &kmh_thread_cache;
+}
+
+static inline void kmh_cache_unlock(kmh_thread_cache_t *cache) {
+    (void)cache;
+}
+#endif
+
+static inline void kmh_thread_cache_register(kmh_thread_cache_t *cache) {
+    if (cache->registered) return;
+    cache->registered = 1;
+#if defined(KMH_HAVE_PTHREAD) && !defined(KMH_STRIPED_CACHE)
+    pthread_once(&kmh_cache_once, kmh_cache_key_init);
+    pthread_setspecific(kmh_cache_key, cache);
+#endif
+}
+
+// Frees the calling thread's cached blocks (its stripe's, with
+// KMH_STRIPED_CACHE), e.g. before a thread without pthread exit hooks goes
+// away
+static inline void kmh_thread_cache_flush(void) {
+    kmh_thread_cache_t *cache = kmh_cache_lock();
+    kmh_thread_cache_release(cache);
+    kmh_cache_unlock(cache);
+}
+
+// Route all allocations through malloc_fn/free_fn (e.g. sqlite3_malloc64 and
+// sqlite3_free). The hook can only be installed before the first block is
+// allocated, so every block goes back to the hook it came from: returns 1
+// if malloc_fn/free_fn is the hook, 0 if another one was already used.
+// Call it before other threads allocate.
+static inline int kmh_set_allocator(void *(*malloc_fn)(size_t), void (*free_fn)(void *)) {
+    if (kmh_allocator.malloc_fn == malloc_fn && kmh_allocator.free_fn == free_fn) return 1;
+    if (atomic_load_explicit(&kmh_allocator_used, memory_order_relaxed)) return 0;
+    kmh_allocator.malloc_fn = malloc_fn;
+    kmh_allocator.free_fn = free_fn;
+    return 1;
+}
+
+static inline void* kmh_hook_malloc(size_t size) {
+    if (__builtin_expect(!atomic_load_explicit(&kmh_allocator_used, memory_order_relaxed), 0)) {
+        atomic_store_explicit(&kmh_allocator_used, 1, memory_order_relaxed);
+    }
+    return kmh_allocator.malloc_fn(size);
+}
+
+// hit_stat is KMH_STAT_POOL_HITS or KMH_STAT_BUFFER_HITS; the miss counter
+// follows it
+static inline void* kmh_alloc_counted(size_t size, int hit_stat) {
+    (void)hit_stat;
+    uint32_t c = 0;
+    while (c < KMH_SIZE_CLASSES && ((size_t)KMH_CACHE_LINE << c) < size) c++;
+
+    kmh_block_t *block;
+    if (c < KMH_SIZE_CLASSES) {
+        kmh_thread_cache_t *cache = kmh_cache_lock();
+        void *cached = cache->head[c];
+        if (cached) {
+            cache->head[c] = *(void **)cached;
+            cache->depth[c]--;
+            kmh_cache_unlock(cache);
+            KMH_COUNT(hit_stat, 1);
+            return cached;
+        }
+        kmh_cache_unlock(cache);
+        block = kmh_hook_malloc(sizeof(kmh_block_t) + ((size_t)KMH_CACHE_LINE << c));
+    } else {
+        c = KMH_CLASS_DIRECT;
+        block = kmh_hook_malloc(sizeof(kmh_block_t) + size);
+    }
+    KMH_COUNT(hit_stat + 1, 1);
+    if (!block) return NULL;
+
+    block->size_class = c;
+    return block + 1;
+}
+
+static inline void* kmh_alloc(size_t size) {
+    return kmh_alloc_counted(size, KMH_STAT_POOL_HITS);
+}
+
+static inline void kmh_dealloc(void *ptr) {
+    if (!ptr) return;
+
+    kmh_block_t *block = (kmh_block_t *)ptr - 1;
+    uint32_t c = block->size_class;
+    if (c < KMH_SIZE_CLASSES) {
+        kmh_thread_cache_t *cache = kmh_cache_lock();
+        if (cache->depth[c] < KMH_CACHE_DEPTH) {
+            kmh_thread_cache_register(cache);
+            *(void **)ptr = cache->head[c];
+            cache->head[c] = ptr;
+            cache->depth[c]++;
+            kmh_cache_unlock(cache);
+            return;
+        }
+        kmh_cache_unlock(cache);
+    }
+    kmh_allocator.free_fn(block);
+}
+
+typedef struct {
+    uint32_t k;          // Max capacity
+    uint32_t count;      // Current count
+    uint32_t space_size; // Hash space modulo
+    uint32_t seed;       // Hash seed
+    uint32_t *hashes;    // Sorted descending
+    // Not serialized, derived from space_size by kmh_init
+    uint32_t reduce_mode; // KMH_REDUCE_*
+    uint64_t reduce_m;    // fastmod multiplier for KMH_REDUCE_MOD
+} kvalue_minhash_t;
+
+static inline kvalue_minhash_t* kmh_init(uint32_t k, uint32_t space_size, uint32_t seed) {
+    kvalue_minhash_t *kmh = kmh_alloc(sizeof(kvalue_minhash_t) + (size_t)k * sizeof(uint32_t));
     if (!kmh) return NULL;
     
     kmh->k = k;
     kmh->count = 0;
     kmh->space_size = space_size;
     kmh->seed = seed;
-    // FIX: Set the hashes pointer to point to the memory allocated after the struct
     kmh->hashes = (uint32_t*)(kmh + 1);
+    kmh->reduce_mode = kmh_reduce_mode(space_size);
+    kmh->reduce_m = kmh_fastmod_m(space_size);
     return kmh;
 }
 
 static inline void kmh_free(kvalue_minhash_t *kmh) {
-    if (!kmh) return;
-    
-    // Check if it's from pool
-    for (int i = 0; i < MAX_INSTANCES; i++) {
-        if (&kmh_pool[i].kmh == kmh) {
-            atomic_store(&kmh_pool[i].in_use, 0);
-            return;
-        }
-    }
-    // Must be malloc'd, free normally
-    free(kmh);
+    kmh_dealloc(kmh);
 }
 
 /*
@@ -123,65 +833,319 @@ static inline void kmh_free(kvalue_minhash_t *kmh) {
 }
 
 */
-// Add value (optimized for speed)
-// Always keeps the K smallest hashes, stored in descending order.
-static inline void kmh_add(kvalue_minhash_t *kmh, uint32_t value) {
-    uint32_t hash = xxh32_hash(value, kmh->seed) % kmh->space_size;
-    
-    // Check for duplicates
-    for (uint32_t j = 0; j < kmh->count; j++) {
-        if (kmh->hashes[j] == hash) {
-            return;
-        }
+// Branchless binary search over the descending hash array.
+// Returns the number of entries strictly greater than hash, i.e. the slot
+// where hash belongs (or already lives, if hashes[pos] == hash).
+static inline uint32_t kmh_search(const uint32_t *hashes, uint32_t n, uint32_t hash) {
+    if (n == 0) return 0;
+    const uint32_t *base = hashes;
+    while (n > 1) {
+        uint32_t half = n >> 1;
+        base = (base[half - 1] > hash) ? base + half : base;
+        n -= half;
+    }
+    return (uint32_t)(base - hashes) + (*base > hash);
+}
+
+// Insert an already reduced hash, keeping the K smallest in descending
+// order; the counts go to stats, for the caller to flush.
+static inline void kmh_insert_hash_counted(kvalue_minhash_t *kmh, uint32_t hash, kmh_stats_local_t *stats) {
+    KMH_LOCAL_COUNT(stats, KMH_STAT_ADDS, 1);
+    // Full sketch: anything not below the current k-th smallest is rejected
+    // before touching the array (the common case once the sketch is warm).
+    if (kmh->count == kmh->k && hash >= kmh->hashes[0]) {
+        return;
+    }
+
+    uint32_t pos = kmh_search(kmh->hashes, kmh->count, hash);
+    if (pos < kmh->count && kmh->hashes[pos] == hash) {
+        KMH_LOCAL_COUNT(stats, KMH_STAT_DUPLICATES, 1);
+        return; // Duplicate
     }
 
-    // List not full yet
     if (kmh->count < kmh->k) {
-        // Insert in sorted order (descending)
-        uint32_t i = kmh->count;
-        while (i > 0 && kmh->hashes[i-1] < hash) {
-            kmh->hashes[i] = kmh->hashes[i-1];
-            i--;
-        }
-        kmh->hashes[i] = hash;
+        // Open a slot at pos by shifting the smaller tail right
+        KMH_LOCAL_COUNT(stats, KMH_STAT_INSERTS, 1);
+        KMH_LOCAL_COUNT(stats, KMH_STAT_MEMMOVE_BYTES, (kmh->count - pos) * sizeof(uint32_t));
+        memmove(&kmh->hashes[pos + 1], &kmh->hashes[pos], (kmh->count - pos) * sizeof(uint32_t));
+        kmh->hashes[pos] = hash;
         kmh->count++;
         return;
     }
-    
-    // List is full (kmh->count == kmh->k)
-    // Check if the new hash is larger than the current largest of the K smallest
-    if (hash >= kmh->hashes[0]) {
-        return; // Not among the K smallest, discard
+
+    // Full: drop hashes[0] (the largest) by shifting the larger head left;
+    // pos >= 1 here since hash < hashes[0].
+    KMH_LOCAL_COUNT(stats, KMH_STAT_INSERTS, 1);
+    KMH_LOCAL_COUNT(stats, KMH_STAT_MEMMOVE_BYTES, (pos - 1) * sizeof(uint32_t));
+    memmove(&kmh->hashes[0], &kmh->hashes[1], (pos - 1) * sizeof(uint32_t));
+    kmh->hashes[pos - 1] = hash;
+}
+
+// Single-hash form: with KMH_STATS an early reject costs one increment and
+// stays inline; the rest is counted locally and flushed once.
+static inline void kmh_insert_hash(kvalue_minhash_t *kmh, uint32_t hash) {
+#ifdef KMH_STATS
+    if (kmh->count == kmh->k && hash >= kmh->hashes[0]) {
+        KMH_COUNT_ADDS(1);
+        return;
     }
+#endif
+    KMH_LOCAL_STATS(local);
+    kmh_insert_hash_counted(kmh, hash, &local);
+    KMH_LOCAL_FLUSH(local);
+}
+
+// Add value (optimized for speed)
+// Always keeps the K smallest hashes, stored in descending order.
+static inline void kmh_add(kvalue_minhash_t *kmh, uint32_t value) {
+    uint32_t hash = kmh_reduce(xxh32_hash(value, kmh->seed), kmh->space_size, kmh->reduce_mode, kmh->reduce_m);
+    kmh_insert_hash(kmh, hash);
+}
+
+// Add an arbitrary byte string (hashed with XXH32 using the sketch seed)
+static inline void kmh_add_bytes(kvalue_minhash_t *kmh, const void *data, size_t len) {
+    uint32_t hash = kmh_reduce(xxh32_bytes(data, len, kmh->seed), kmh->space_size, kmh->reduce_mode, kmh->reduce_m);
+    kmh_insert_hash(kmh, hash);
+}
+
+// Batch ingest: hash a block of values with SIMD, filter the lanes against
+// the current k-th smallest hash in-register and only push the survivors
+// through kmh_insert_hash(). The kernel is picked once at runtime
+// (AVX-512 / AVX2 / NEON) with a scalar fallback.
+#define KMH_BATCH_CHUNK 256
 
-    // Hash is smaller than current largest, so it must be included.
-    // Shift all elements one position to the left, effectively dropping kmh->hashes[0].
-    memmove(&kmh->hashes[0], &kmh->hashes[1], (kmh->k - 1) * sizeof(uint32_t));
+typedef size_t (*kmh_filter_fn)(const uint32_t *values, size_t n, uint32_t seed,
+                                uint32_t space_size, uint32_t threshold, uint32_t *out);
 
-    // Find the correct insertion point for the new hash in the shifted array
-    uint32_t i = kmh->k - 1; // Start from the last valid index
-    while (i > 0 && kmh->hashes[i-1] < hash) {
-        kmh->hashes[i] = kmh->hashes[i-1];
-        i--;
+// Writes the reduced hashes that are below threshold to out, returns how many
+static inline size_t kmh_filter_scalar(const uint32_t *values, size_t n, uint32_t seed,
+                                       uint32_t space_size, uint32_t threshold, uint32_t *out) {
+    const int mode = kmh_reduce_mode(space_size);
+    const uint64_t m = kmh_fastmod_m(space_size);
+    size_t cnt = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t hash = kmh_reduce(xxh32_hash(values[i], seed), space_size, mode, m);
+        out[cnt] = hash;
+        cnt += hash < threshold;
     }
-    kmh->hashes[i] = hash; // Insert the new hash
-    // kmh->count remains kmh->k
+    return cnt;
 }
 
-// Cardinality estimation
-static inline double kmh_cardinality(const kvalue_minhash_t *kmh) {
-    if (kmh->count == 0) return 0.0;
-    if (kmh->count < kmh->k) {
-        // Incomplete sketch - just use the current count
-        return (double)kmh->count;
+#if defined(KMH_HAVE_X86_SIMD)
+
+__attribute__((target("avx2")))
+static inline __m256i kmh_xxh32_avx2(__m256i v, __m256i init) {
+    const __m256i p2 = _mm256_set1_epi32((int)XXH_PRIME32_2);
+    const __m256i p3 = _mm256_set1_epi32((int)XXH_PRIME32_3);
+    const __m256i p4 = _mm256_set1_epi32((int)XXH_PRIME32_4);
+    __m256i h = _mm256_add_epi32(init, _mm256_mullo_epi32(v, p3));
+    h = _mm256_or_si256(_mm256_slli_epi32(h, 17), _mm256_srli_epi32(h, 15));
+    h = _mm256_mullo_epi32(h, p4);
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+    h = _mm256_mullo_epi32(h, p2);
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+    h = _mm256_mullo_epi32(h, p3);
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+    return h;
+}
+
+__attribute__((target("avx2")))
+static size_t kmh_filter_avx2(const uint32_t *values, size_t n, uint32_t seed,
+                              uint32_t space_size, uint32_t threshold, uint32_t *out) {
+    const int mode = kmh_reduce_mode(space_size);
+    const uint64_t m = kmh_fastmod_m(space_size);
+    const __m256i init = _mm256_set1_epi32((int)(seed + XXH_PRIME32_5 + 4));
+    const __m256i mask = _mm256_set1_epi32((int)(space_size - 1));
+    const __m256i ones = _mm256_set1_epi32(-1);
+    const __m256i sign = _mm256_set1_epi32((int)0x80000000U);
+    const __m256i thr = _mm256_xor_si256(_mm256_set1_epi32((int)threshold), sign);
+    size_t cnt = 0, i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i h = kmh_xxh32_avx2(_mm256_loadu_si256((const __m256i*)(values + i)), init);
+        if (mode == KMH_REDUCE_MOD) {
+            // No vector 64x64->128 multiply: finish these lanes with scalar fastmod
+            uint32_t lanes[8];
+            _mm256_storeu_si256((__m256i*)lanes, h);
+            for (int l = 0; l < 8; l++) {
+                uint32_t hash = kmh_fastmod(lanes[l], m, space_size);
+                out[cnt] = hash;
+                cnt += hash < threshold;
+            }
+            continue;
+        }
+        if (mode == KMH_REDUCE_FULL) {
+            h = _mm256_andnot_si256(_mm256_cmpeq_epi32(h, ones), h);
+        } else {
+            h = _mm256_and_si256(h, mask);
+        }
+        // Unsigned h < threshold via the sign-flip trick
+        __m256i lt = _mm256_cmpgt_epi32(thr, _mm256_xor_si256(h, sign));
+        uint32_t keep = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(lt));
+        if (!keep) continue;
+        uint32_t lanes[8];
+        _mm256_storeu_si256((__m256i*)lanes, h);
+        while (keep) {
+            out[cnt++] = lanes[__builtin_ctz(keep)];
+            keep &= keep - 1;
+        }
     }
-    // Complete sketch - use k-th smallest hash
-    return (double)kmh->space_size * (kmh->k - 1) / ( kmh->hashes[0] + 1 );
+    return cnt + kmh_filter_scalar(values + i, n - i, seed, space_size, threshold, out + cnt);
 }
 
-// Merge two MinHashes
-static inline kvalue_minhash_t* kmh_merge(const kvalue_minhash_t *a, const kvalue_minhash_t *b) {
-    if (a->k != b->k || a->space_size != b->space_size || a->seed != b->seed) return NULL;
+__attribute__((target("avx512f")))
+static size_t kmh_filter_avx512(const uint32_t *values, size_t n, uint32_t seed,
+                                uint32_t space_size, uint32_t threshold, uint32_t *out) {
+    const int mode = kmh_reduce_mode(space_size);
+    const uint64_t m = kmh_fastmod_m(space_size);
+    const __m512i init = _mm512_set1_epi32((int)(seed + XXH_PRIME32_5 + 4));
+    const __m512i p2 = _mm512_set1_epi32((int)XXH_PRIME32_2);
+    const __m512i p3 = _mm512_set1_epi32((int)XXH_PRIME32_3);
+    const __m512i p4 = _mm512_set1_epi32((int)XXH_PRIME32_4);
+    const __m512i mask = _mm512_set1_epi32((int)(space_size - 1));
+    const __m512i ones = _mm512_set1_epi32(-1);
+    const __m512i thr = _mm512_set1_epi32((int)threshold);
+    size_t cnt = 0, i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m512i h = _mm512_add_epi32(init, _mm512_mullo_epi32(_mm512_loadu_si512(values + i), p3));
+        h = _mm512_mullo_epi32(_mm512_rol_epi32(h, 17), p4);
+        h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 15));
+        h = _mm512_mullo_epi32(h, p2);
+        h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 13));
+        h = _mm512_mullo_epi32(h, p3);
+        h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 16));
+        if (mode == KMH_REDUCE_MOD) {
+            uint32_t lanes[16];
+            _mm512_storeu_si512(lanes, h);
+            for (int l = 0; l < 16; l++) {
+                uint32_t hash = kmh_fastmod(lanes[l], m, space_size);
+                out[cnt] = hash;
+                cnt += hash < threshold;
+            }
+            continue;
+        }
+        if (mode == KMH_REDUCE_FULL) {
+            h = _mm512_maskz_mov_epi32(_mm512_cmpneq_epi32_mask(h, ones), h);
+        } else {
+            h = _mm512_and_si512(h, mask);
+        }
+        __mmask16 keep = _mm512_cmplt_epu32_mask(h, thr);
+        _mm512_mask_compressstoreu_epi32(out + cnt, keep, h);
+        cnt += (size_t)__builtin_popcount((unsigned)keep);
+    }
+    return cnt + kmh_filter_scalar(values + i, n - i, seed, space_size, threshold, out + cnt);
+}
+
+#elif defined(KMH_HAVE_NEON)
+
+static inline uint32x4_t kmh_xxh32_neon(uint32x4_t v, uint32x4_t init) {
+    uint32x4_t h = vmlaq_n_u32(init, v, XXH_PRIME32_3);
+    h = vorrq_u32(vshlq_n_u32(h, 17), vshrq_n_u32(h, 15));
+    h = vmulq_n_u32(h, XXH_PRIME32_4);
+    h = veorq_u32(h, vshrq_n_u32(h, 15));
+    h = vmulq_n_u32(h, XXH_PRIME32_2);
+    h = veorq_u32(h, vshrq_n_u32(h, 13));
+    h = vmulq_n_u32(h, XXH_PRIME32_3);
+    h = veorq_u32(h, vshrq_n_u32(h, 16));
+    return h;
+}
+
+static size_t kmh_filter_neon(const uint32_t *values, size_t n, uint32_t seed,
+                              uint32_t space_size, uint32_t threshold, uint32_t *out) {
+    const int mode = kmh_reduce_mode(space_size);
+    const uint64_t m = kmh_fastmod_m(space_size);
+    const uint32x4_t init = vdupq_n_u32(seed + XXH_PRIME32_5 + 4);
+    const uint32x4_t mask = vdupq_n_u32(space_size - 1);
+    const uint32x4_t ones = vdupq_n_u32(0xFFFFFFFFU);
+    const uint32x4_t thr = vdupq_n_u32(threshold);
+    size_t cnt = 0, i = 0;
+
+    // Two registers per iteration to cover 8 lanes
+    for (; i + 8 <= n; i += 8) {
+        uint32x4_t h[2];
+        h[0] = kmh_xxh32_neon(vld1q_u32(values + i), init);
+        h[1] = kmh_xxh32_neon(vld1q_u32(values + i + 4), init);
+        for (int r = 0; r < 2; r++) {
+            uint32_t lanes[4];
+            if (mode == KMH_REDUCE_MOD) {
+                vst1q_u32(lanes, h[r]);
+                for (int l = 0; l < 4; l++) {
+                    uint32_t hash = kmh_fastmod(lanes[l], m, space_size);
+                    out[cnt] = hash;
+                    cnt += hash < threshold;
+                }
+                continue;
+            }
+            if (mode == KMH_REDUCE_FULL) {
+                h[r] = vbicq_u32(h[r], vceqq_u32(h[r], ones));
+            } else {
+                h[r] = vandq_u32(h[r], mask);
+            }
+            uint32x4_t lt = vcltq_u32(h[r], thr);
+            if (vmaxvq_u32(lt) == 0) continue;
+            vst1q_u32(lanes, h[r]);
+            for (int l = 0; l < 4; l++) {
+                out[cnt] = lanes[l];
+                cnt += lanes[l] < threshold;
+            }
+        }
+    }
+    return cnt + kmh_filter_scalar(values + i, n - i, seed, space_size, threshold, out + cnt);
+}
+
+#endif
+
+// Pick the widest kernel the CPU supports (resolved once per process)
+static inline kmh_filter_fn kmh_filter_select(void) {
+    // Relaxed is enough: racing first calls all store the same kernel
+    static _Atomic(kmh_filter_fn) selected = NULL;
+    kmh_filter_fn fn = atomic_load_explicit(&selected, memory_order_relaxed);
+    if (fn) return fn;
+    fn = kmh_filter_scalar;
+#if defined(KMH_HAVE_X86_SIMD)
+    if (__builtin_cpu_supports("avx512f")) fn = kmh_filter_avx512;
+    else if (__builtin_cpu_supports("avx2")) fn = kmh_filter_avx2;
+#elif defined(KMH_HAVE_NEON)
+    fn = kmh_filter_neon;
+#endif
+    atomic_store_explicit(&selected, fn, memory_order_relaxed);
+    return fn;
+}
+
+// Add many values at once; same result as calling kmh_add for each value
+static inline void kmh_add_batch(kvalue_minhash_t *kmh, const uint32_t *values, size_t n) {
+    kmh_filter_fn filter = kmh_filter_select();
+    uint32_t survivors[KMH_BATCH_CHUNK];
+    KMH_LOCAL_STATS(local);
+
+    for (size_t off = 0; off < n; off += KMH_BATCH_CHUNK) {
+        size_t m = n - off < KMH_BATCH_CHUNK ? n - off : KMH_BATCH_CHUNK;
+        // Everything survives until the sketch is full
+        uint32_t threshold = kmh->count < kmh->k ? 0xFFFFFFFFU : kmh->hashes[0];
+        size_t s = filter(values + off, m, kmh->seed, kmh->space_size, threshold, survivors);
+        KMH_LOCAL_COUNT(&local, KMH_STAT_ADDS, m - s); // filtered lanes; survivors count as they go in
+        for (size_t i = 0; i < s; i++) {
+            kmh_insert_hash_counted(kmh, survivors[i], &local);
+        }
+    }
+    KMH_LOCAL_FLUSH(local);
+}
+
+// Cardinality estimation
+static inline double kmh_cardinality(const kvalue_minhash_t *kmh) {
+    if (kmh->count == 0) return 0.0;
+    if (kmh->count < kmh->k) {
+        // Incomplete sketch - just use the current count
+        return (double)kmh->count;
+    }
+    // Complete sketch - use k-th smallest hash
+    return (double)kmh->space_size * (kmh->k - 1) / ( kmh->hashes[0] + 1 );
+}
+
+// Merge two MinHashes
+static inline kvalue_minhash_t* kmh_merge(const kvalue_minhash_t *a, const kvalue_minhash_t *b) {
+    if (a->k != b->k || a->space_size != b->space_size || a->seed != b->seed) return NULL;
     
     kvalue_minhash_t *result = kmh_init(a->k, a->space_size, a->seed);
     if (!result) return NULL;
@@ -217,399 +1181,4373 @@ static inline kvalue_minhash_t* kmh_merge(const kvalue_minhash_t *a, const kvalu
         result->hashes[result->count - 1 - idx] = temp;
     }
     
-    return result;`
+    return result;
 }
 
-// Jaccard distance
-static inline double kmh_distance(const kvalue_minhash_t *a, const kvalue_minhash_t *b) {
-    if (a->k != b->k || a->space_size != b->space_size || a->seed != b->seed) return -1.0;
-    
-    uint32_t matches = 0;
-    uint32_t i = 0, j = 0;
-    uint32_t compared = 0;
-    
-    while (i < a->count && j < b->count && compared < a->k) {
-        if (a->hashes[i] == b->hashes[j]) {
-            matches++;
-            i++; j++;
-        } else if (a->hashes[i] > b->hashes[j]) {
-            i++;
-        } else {
-            j++;
-        }
-        compared++;
+// N-way merge. All kernels write the (up to) k smallest distinct hashes of
+// their descending inputs into out[k - m, k), descending, and return m, so
+// the result can be copied or moved over a sketch in one go.
+#define KMH_MERGE_STACK 64 // loser trees over at most this many inputs live on the stack
+
+typedef uint32_t (*kmh_merge2_fn)(const uint32_t *a, uint32_t na, const uint32_t *b, uint32_t nb,
+                                  uint32_t k, uint32_t *out);
+
+static inline uint32_t kmh_merge2_scalar(const uint32_t *a, uint32_t na, const uint32_t *b, uint32_t nb,
+                                         uint32_t k, uint32_t *out) {
+    int i = (int)na - 1, j = (int)nb - 1;
+    uint32_t o = k;
+    while (o > 0 && i >= 0 && j >= 0) {
+        uint32_t ha = a[i], hb = b[j];
+        out[--o] = ha < hb ? ha : hb;
+        i -= ha <= hb;
+        j -= hb <= ha;
     }
-    
-    return compared > 0 ? 1.0 - (double)matches / compared : 1.0;
+    while (o > 0 && i >= 0) out[--o] = a[i--];
+    while (o > 0 && j >= 0) out[--o] = b[j--];
+    return k - o;
 }
 
-// Varint encoding utilities
-static inline uint32_t varint_encode(uint32_t value, uint8_t *buf) {
-    uint32_t len = 0;
-    while (value >= 0x80) {
-        buf[len++] = (value & 0x7F) | 0x80;
-        value >>= 7;
+// The vector two-way merge reads each input from its smallest end four
+// lanes at a time, ascending, padding past the end with 0xFFFFFFFF (reduced
+// hashes are always below space_size, so it never collides), and runs a 4+4
+// bitonic merge network: the low half is final, the high half is merged with
+// the next block from whichever input has the smaller head.
+#if defined(KMH_HAVE_X86_SIMD)
+
+__attribute__((target("sse4.1")))
+static inline __m128i kmh_merge_load4_sse41(const uint32_t *h, int *i) {
+    __m128i v;
+    if (*i >= 3) {
+        v = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(h + *i - 3)), _MM_SHUFFLE(0, 1, 2, 3));
+    } else {
+        uint32_t t[4] = { 0xFFFFFFFFU, 0xFFFFFFFFU, 0xFFFFFFFFU, 0xFFFFFFFFU };
+        for (int l = 0; l <= *i; l++) t[l] = h[*i - l];
+        v = _mm_loadu_si128((const __m128i *)t);
     }
-    buf[len++] = value & 0x7F;
-    return len;
+    *i -= 4;
+    return v;
 }
 
-static inline uint32_t varint_decode(const uint8_t *buf, uint32_t *value) {
-    const uint8_t *p = buf;
-    uint32_t result = 0;
-    uint32_t shift = 0;
-    
-    while (*p & 0x80) {
-        result |= (*p++ & 0x7F) << shift;
-        shift += 7;
-    }
-    result |= *p++ << shift;
-    *value = result;
-    return p - buf;
+// Two ascending vectors in, the four smallest (lo) and four largest (hi) out
+__attribute__((target("sse4.1")))
+static inline void kmh_bitonic4_sse41(__m128i *lo, __m128i *hi) {
+    __m128i b = _mm_shuffle_epi32(*hi, _MM_SHUFFLE(0, 1, 2, 3));
+    __m128i l = _mm_min_epu32(*lo, b), h = _mm_max_epu32(*lo, b);
+    __m128i x = _mm_unpacklo_epi64(l, h), y = _mm_unpackhi_epi64(l, h);
+    l = _mm_min_epu32(x, y);
+    h = _mm_max_epu32(x, y);
+    __m128i t0 = _mm_unpacklo_epi32(l, h), t1 = _mm_unpackhi_epi32(l, h);
+    x = _mm_unpacklo_epi64(t0, t1);
+    y = _mm_unpackhi_epi64(t0, t1);
+    l = _mm_min_epu32(x, y);
+    h = _mm_max_epu32(x, y);
+    *lo = _mm_unpacklo_epi32(l, h);
+    *hi = _mm_unpackhi_epi32(l, h);
 }
 
-// SQLite4 variable integer encoding utilities
-static inline uint32_t sqlite4_encode(uint64_t value, uint8_t *buf) {
-    if (value <= 240) {
-        buf[0] = (uint8_t)value;
-        return 1;
-    }
-    if (value <= 2287) {
-        uint32_t v = (uint32_t)(value - 240);
-        buf[0] = (v / 256) + 241;
-        buf[1] = v % 256;
-        return 2;
-    }
-    if (value <= 67823) {
-        uint32_t v = (uint32_t)(value - 2288);
-        buf[0] = 249;
-        buf[1] = v / 256;
-        buf[2] = v % 256;
-        return 3;
-    }
-    if (value <= 0xFFFFFF) {
-        buf[0] = 250;
-        buf[1] = (value >> 16) & 0xFF;
-        buf[2] = (value >> 8) & 0xFF;
-        buf[3] = value & 0xFF;
-        return 4;
-    }
-    if (value <= 0xFFFFFFFF) {
-        buf[0] = 251;
-        buf[1] = (value >> 24) & 0xFF;
-        buf[2] = (value >> 16) & 0xFF;
-        buf[3] = (value >> 8) & 0xFF;
-        buf[4] = value & 0xFF;
-        return 5;
-    }
-    if (value <= 0xFFFFFFFFFF) {
-        buf[0] = 252;
-        buf[1] = (value >> 32) & 0xFF;
-        buf[2] = (value >> 24) & 0xFF;
-        buf[3] = (value >> 16) & 0xFF;
-        buf[4] = (value >> 8) & 0xFF;
-        buf[5] = value & 0xFF;
-        return 6;
-    }
-    if (value <= 0xFFFFFFFFFFFF) {
-        buf[0] = 253;
-        buf[1] = (value >> 40) & 0xFF;
-        buf[2] = (value >> 32) & 0xFF;
-        buf[3] = (value >> 24) & 0xFF;
-        buf[4] = (value >> 16) & 0xFF;
-        buf[5] = (value >> 8) & 0xFF;
-        buf[6] = value & 0xFF;
-        return 7;
+__attribute__((target("sse4.1")))
+static uint32_t kmh_merge2_sse41(const uint32_t *a, uint32_t na, const uint32_t *b, uint32_t nb,
+                                 uint32_t k, uint32_t *out) {
+    if (na == 0 || nb == 0 || k == 0) return kmh_merge2_scalar(a, na, b, nb, k, out);
+
+    int i = (int)na - 1, j = (int)nb - 1;
+    uint32_t o = k, last = 0xFFFFFFFFU, lanes[4];
+    __m128i lo = kmh_merge_load4_sse41(a, &i);
+    __m128i hi = kmh_merge_load4_sse41(b, &j);
+    for (;;) {
+        kmh_bitonic4_sse41(&lo, &hi);
+        _mm_storeu_si128((__m128i *)lanes, lo);
+        for (int l = 0; l < 4; l++) {
+            out[o - 1] = lanes[l];
+            o -= (lanes[l] != last) & (lanes[l] != 0xFFFFFFFFU);
+            last = lanes[l];
+            if (o == 0) return k;
+        }
+        if (i < 0 && j < 0) break;
+        int take_a = j < 0 || (i >= 0 && a[i] <= b[j]);
+        lo = take_a ? kmh_merge_load4_sse41(a, &i) : kmh_merge_load4_sse41(b, &j);
     }
-    if (value <= 0xFFFFFFFFFFFFFF) {
-        buf[0] = 254;
-        buf[1] = (value >> 48) & 0xFF;
-        buf[2] = (value >> 40) & 0xFF;
-        buf[3] = (value >> 32) & 0xFF;
-        buf[4] = (value >> 24) & 0xFF;
-        buf[5] = (value >> 16) & 0xFF;
-        buf[6] = (value >> 8) & 0xFF;
-        buf[7] = value & 0xFF;
-        return 8;
+    _mm_storeu_si128((__m128i *)lanes, hi);
+    for (int l = 0; l < 4; l++) {
+        out[o - 1] = lanes[l];
+        o -= (lanes[l] != last) & (lanes[l] != 0xFFFFFFFFU);
+        last = lanes[l];
+        if (o == 0) return k;
     }
-    // Full 8-byte value
-    buf[0] = 255;
-    buf[1] = (value >> 56) & 0xFF;
-    buf[2] = (value >> 48) & 0xFF;
-    buf[3] = (value >> 40) & 0xFF;
-    buf[4] = (value >> 32) & 0xFF;
-    buf[5] = (value >> 24) & 0xFF;
-    buf[6] = (value >> 16) & 0xFF;
-    buf[7] = (value >> 8) & 0xFF;
-    buf[8] = value & 0xFF;
-    return 9;
+    return k - o;
 }
 
-static inline uint32_t sqlite4_decode(const uint8_t *buf, uint64_t *value) {
-    uint8_t first = buf[0];
-    
-    if (first <= 240) {
-        *value = first;
-        return 1;
-    }
-    if (first <= 248) {
-        *value = 240 + 256 * (first - 241) + buf[1];
-        return 2;
+#elif defined(KMH_HAVE_NEON)
+
+static inline uint32x4_t kmh_merge_load4_neon(const uint32_t *h, int *i) {
+    uint32x4_t v;
+    if (*i >= 3) {
+        v = vrev64q_u32(vld1q_u32(h + *i - 3));
+        v = vextq_u32(v, v, 2);
+    } else {
+        uint32_t t[4] = { 0xFFFFFFFFU, 0xFFFFFFFFU, 0xFFFFFFFFU, 0xFFFFFFFFU };
+        for (int l = 0; l <= *i; l++) t[l] = h[*i - l];
+        v = vld1q_u32(t);
     }
-    if (first == 249) {
-        *value = 2288 + 256 * buf[1] + buf[2];
-        return 3;
+    *i -= 4;
+    return v;
+}
+
+static inline void kmh_bitonic4_neon(uint32x4_t *lo, uint32x4_t *hi) {
+    uint32x4_t b = vrev64q_u32(*hi);
+    b = vextq_u32(b, b, 2);
+    uint32x4_t l = vminq_u32(*lo, b), h = vmaxq_u32(*lo, b);
+    uint32x4_t x = vcombine_u32(vget_low_u32(l), vget_low_u32(h));
+    uint32x4_t y = vcombine_u32(vget_high_u32(l), vget_high_u32(h));
+    l = vminq_u32(x, y);
+    h = vmaxq_u32(x, y);
+    uint32x4_t t0 = vzip1q_u32(l, h), t1 = vzip2q_u32(l, h);
+    x = vcombine_u32(vget_low_u32(t0), vget_low_u32(t1));
+    y = vcombine_u32(vget_high_u32(t0), vget_high_u32(t1));
+    l = vminq_u32(x, y);
+    h = vmaxq_u32(x, y);
+    *lo = vzip1q_u32(l, h);
+    *hi = vzip2q_u32(l, h);
+}
+
+static uint32_t kmh_merge2_neon(const uint32_t *a, uint32_t na, const uint32_t *b, uint32_t nb,
+                                uint32_t k, uint32_t *out) {
+    if (na == 0 || nb == 0 || k == 0) return kmh_merge2_scalar(a, na, b, nb, k, out);
+
+    int i = (int)na - 1, j = (int)nb - 1;
+    uint32_t o = k, last = 0xFFFFFFFFU, lanes[4];
+    uint32x4_t lo = kmh_merge_load4_neon(a, &i);
+    uint32x4_t hi = kmh_merge_load4_neon(b, &j);
+    for (;;) {
+        kmh_bitonic4_neon(&lo, &hi);
+        vst1q_u32(lanes, lo);
+        for (int l = 0; l < 4; l++) {
+            out[o - 1] = lanes[l];
+            o -= (lanes[l] != last) & (lanes[l] != 0xFFFFFFFFU);
+            last = lanes[l];
+            if (o == 0) return k;
+        }
+        if (i < 0 && j < 0) break;
+        int take_a = j < 0 || (i >= 0 && a[i] <= b[j]);
+        lo = take_a ? kmh_merge_load4_neon(a, &i) : kmh_merge_load4_neon(b, &j);
     }
-    if (first == 250) {
-        *value = ((uint64_t)buf[1] << 16) | 
-                 ((uint64_t)buf[2] << 8) | 
-                 buf[3];
-        return 4;
+    vst1q_u32(lanes, hi);
+    for (int l = 0; l < 4; l++) {
+        out[o - 1] = lanes[l];
+        o -= (lanes[l] != last) & (lanes[l] != 0xFFFFFFFFU);
+        last = lanes[l];
+        if (o == 0) return k;
     }
-    if (first == 251) {
-        *value = ((uint64_t)buf[1] << 24) | 
-                 ((uint64_t)buf[2] << 16) | 
-                 ((uint64_t)buf[3] << 8) | 
-                 buf[4];
-        return 5;
+    return k - o;
+}
+
+#endif
+
+static inline kmh_merge2_fn kmh_merge2_select(void) {
+    static _Atomic(kmh_merge2_fn) selected = NULL;
+    kmh_merge2_fn fn = atomic_load_explicit(&selected, memory_order_relaxed);
+    if (fn) return fn;
+    fn = kmh_merge2_scalar;
+#if defined(KMH_HAVE_X86_SIMD)
+    if (__builtin_cpu_supports("sse4.1")) fn = kmh_merge2_sse41;
+#elif defined(KMH_HAVE_NEON)
+    fn = kmh_merge2_neon;
+#endif
+    atomic_store_explicit(&selected, fn, memory_order_relaxed);
+    return fn;
+}
+
+// Loser tree over the inputs' smallest unconsumed hashes: each output costs
+// one replay from a leaf to the root, log2(n) compares against the stored
+// losers. Two inputs go through the two-way kernel instead. Returns
+// UINT32_MAX if the tree for more than KMH_MERGE_STACK inputs can't be
+// allocated.
+static inline uint32_t kmh_merge_many_hashes(const kvalue_minhash_t *const *inputs, size_t n,
+                                             uint32_t k, uint32_t *out) {
+    if (n == 0) return 0;
+    if (n == 1) {
+        uint32_t m = inputs[0]->count < k ? inputs[0]->count : k;
+        memcpy(out + k - m, inputs[0]->hashes + inputs[0]->count - m, m * sizeof(uint32_t));
+        return m;
     }
-    if (first == 252) {
-        *value = ((uint64_t)buf[1] << 32) | 
-                 ((uint64_t)buf[2] << 24) | 
-                 ((uint64_t)buf[3] << 16) | 
-                 ((uint64_t)buf[4] << 8) | 
-                 buf[5];
-        return 6;
+    if (n == 2) {
+        return kmh_merge2_select()(inputs[0]->hashes, inputs[0]->count,
+                                   inputs[1]->hashes, inputs[1]->count, k, out);
     }
-    if (first == 253) {
-        *value = ((uint64_t)buf[1] << 40) | 
-                 ((uint64_t)buf[2] << 32) | 
-                 ((uint64_t)buf[3] << 24) | 
-                 ((uint64_t)buf[4] << 16) | 
-                 ((uint64_t)buf[5] << 8) | 
-                 buf[6];
-        return 7;
+
+    size_t p = 1;
+    while (p < n) p <<= 1;
+
+    // keys[n] stands for the exhausted padding leaves
+    uint64_t keys_stack[KMH_MERGE_STACK + 1];
+    uint32_t left_stack[KMH_MERGE_STACK + 1], tree_stack[3 * KMH_MERGE_STACK];
+    uint64_t *keys = keys_stack;
+    uint32_t *left = left_stack, *tree = tree_stack;
+    void *heap = NULL;
+    if (n > KMH_MERGE_STACK) {
+        heap = kmh_alloc((n + 1) * (sizeof(uint64_t) + sizeof(uint32_t)) + 3 * p * sizeof(uint32_t));
+        if (!heap) return UINT32_MAX;
+        keys = heap;
+        left = (uint32_t *)(keys + n + 1);
+        tree = left + n + 1;
     }
-    if (first == 254) {
-        *value = ((uint64_t)buf[1] << 48) | 
-                 ((uint64_t)buf[2] << 40) | 
-                 ((uint64_t)buf[3] << 32) | 
-                 ((uint64_t)buf[4] << 24) | 
-                 ((uint64_t)buf[5] << 16) | 
-                 ((uint64_t)buf[6] << 8) | 
-                 buf[7];
-        return 8;
+
+    for (size_t i = 0; i < n; i++) {
+        left[i] = inputs[i]->count;
+        keys[i] = left[i] ? inputs[i]->hashes[left[i] - 1] : UINT64_MAX;
     }
-    // first == 255
-    *value = ((uint64_t)buf[1] << 56) | 
-             ((uint64_t)buf[2] << 48) | 
-             ((uint64_t)buf[3] << 40) | 
-             ((uint64_t)buf[4] << 32) | 
-             ((uint64_t)buf[5] << 24) | 
-             ((uint64_t)buf[6] << 16) | 
-             ((uint64_t)buf[7] << 8) | 
-             buf[8];
-    return 9;
-}
+    keys[n] = UINT64_MAX;
+    left[n] = 0;
 
-// Or just use memcpy if alignment allows (fastest)
-static inline uint32_t int32_encode_direct(uint32_t value, uint8_t *buf) {
-    memcpy(buf, &value, 4);
-    return 4;
-}
+    // Initial tournament: winners move up through win[], the loser of each
+    // match stays in tree[node], the overall winner lands in tree[0]
+    uint32_t *win = tree + p;
+    for (size_t i = 0; i < p; i++) win[p + i] = i < n ? (uint32_t)i : (uint32_t)n;
+    for (size_t node = p - 1; node > 0; node--) {
+        uint32_t a = win[2 * node], b = win[2 * node + 1];
+        int a_wins = keys[a] <= keys[b];
+        win[node] = a_wins ? a : b;
+        tree[node] = a_wins ? b : a;
+    }
+    tree[0] = win[1];
 
-static inline uint32_t int32_decode_direct(const uint8_t *buf, uint32_t *value) {
-    memcpy(value, buf, 4);
-    return 4;
-}
+    uint32_t o = k;
+    uint64_t last = UINT64_MAX;
+    while (o > 0) {
+        uint32_t w = tree[0];
+        uint64_t key = keys[w];
+        if (key == UINT64_MAX) break; // every input is exhausted
+        out[o - 1] = (uint32_t)key;
+        o -= key != last;
+        last = key;
 
-// Get a buffer from pool or allocate from heap
-static inline uint8_t* kmh_get_buffer(size_t needed_size) {
-    // Try to get from pool first
-    for (int i = 0; i < MAX_SERIALIZE_BUFFERS; i++) {
-        int expected = 0;
-        if (atomic_compare_exchange_weak(&kmh_buffer_pool[i].busy, &expected, 1)) {
-            // Successfully acquired this buffer
-            if (needed_size <= sizeof(kmh_buffer_pool[i].buffer)) {
-                return kmh_buffer_pool[i].buffer;
-            } else {
-                // Buffer too small, release and continue
-                atomic_store(&kmh_buffer_pool[i].busy, 0);
-            }
+        left[w]--;
+        keys[w] = left[w] ? inputs[w]->hashes[left[w] - 1] : UINT64_MAX;
+        for (size_t node = (p + w) >> 1; node > 0; node >>= 1) {
+            uint32_t l = tree[node];
+            int l_wins = keys[l] < keys[w];
+            tree[node] = l_wins ? w : l;
+            w = l_wins ? l : w;
         }
+        tree[0] = w;
     }
-    
-    // No available pool buffer, allocate from heap
-    uint8_t* heap_buf = malloc(needed_size + sizeof(int));
-    if (!heap_buf) return NULL;
-    
-    // Mark as heap allocated
-    *((int*)heap_buf) = 1;
-    return heap_buf + sizeof(int);
+
+    kmh_dealloc(heap);
+    return k - o;
 }
 
-// Free buffer back to pool or heap
-static inline void kmh_free_buffer(uint8_t* buf) {
-    if (!buf) return;
-    
-    // Check if it's from our pool
-    for (int i = 0; i < MAX_SERIALIZE_BUFFERS; i++) {
-        if (buf == kmh_buffer_pool[i].buffer) {
-            atomic_store(&kmh_buffer_pool[i].busy, 0);
-            return;
+// Merge n compatible sketches in one pass and one allocation; NULL if the
+// inputs differ in k, space_size or seed
+static inline kvalue_minhash_t* kmh_merge_many(const kvalue_minhash_t **inputs, size_t n) {
+    if (n == 0) return NULL;
+    for (size_t i = 1; i < n; i++) {
+        if (inputs[i]->k != inputs[0]->k || inputs[i]->space_size != inputs[0]->space_size ||
+            inputs[i]->seed != inputs[0]->seed) {
+            return NULL;
         }
     }
-    
-    // Must be heap allocated - check the header
-    uint8_t* actual_ptr = buf - sizeof(int);
-    if (*((int*)actual_ptr) == 1) {
-        free(actual_ptr);
-    }
-}
 
-// Fast serialize - direct struct dump with minimal header
+    kvalue_minhash_t *result = kmh_init(inputs[0]->k, inputs[0]->space_size, inputs[0]->seed);
+    if (!result) return NULL;
+
+    uint32_t m = kmh_merge_many_hashes(inputs, n, result->k, result->hashes);
+    if (m == UINT32_MAX) {
+        kmh_free(result);
+        return NULL;
+    }
+    memmove(result->hashes, result->hashes + result->k - m, m * sizeof(uint32_t));
+    result->count = m;
+    return result;
+}
+
+// Concurrent ingestion into one logical sketch. Each worker writes to a
+// shard (a plain sketch behind its own cache-line-sized spinlock), and all
+// shards share one threshold: the smallest k-th hash of any full shard. The
+// shards together hold k hashes at or below it, so a hash that isn't below
+// the threshold can never reach the merged sketch; it is dropped after one
+// relaxed load, without touching the shard or its lock. Shards lock only to
+// insert and lower the threshold with a CAS when their own k-th hash drops.
+// kmh_concurrent_snapshot merges the shards on demand.
+typedef struct {
+    _Alignas(KMH_CACHE_LINE) atomic_uint lock;
+    kvalue_minhash_t *kmh;
+} kmh_shard_t;
+
+typedef struct {
+    _Alignas(KMH_CACHE_LINE) atomic_uint threshold; // written rarely, read on every add
+    uint32_t k;
+    uint32_t space_size;
+    uint32_t seed;
+    uint32_t nshards;
+    uint32_t reduce_mode;
+    uint64_t reduce_m;
+    void *block;          // allocation this struct was aligned within
+    kmh_shard_t shards[];
+} kmh_concurrent_t;
+
+static inline void kmh_concurrent_free(kmh_concurrent_t *c) {
+    if (!c) return;
+    for (uint32_t s = 0; s < c->nshards; s++) kmh_free(c->shards[s].kmh);
+    kmh_dealloc(c->block);
+}
+
+// nshards is typically the number of worker threads
+static inline kmh_concurrent_t* kmh_concurrent_init(uint32_t k, uint32_t space_size, uint32_t seed,
+                                                    uint32_t nshards) {
+    if (nshards == 0) return NULL;
+
+    size_t size = sizeof(kmh_concurrent_t) + (size_t)nshards * sizeof(kmh_shard_t);
+    void *block = kmh_alloc(size + KMH_CACHE_LINE);
+    if (!block) return NULL;
+    kmh_concurrent_t *c = (kmh_concurrent_t *)(((uintptr_t)block + KMH_CACHE_LINE - 1) &
+                                               ~(uintptr_t)(KMH_CACHE_LINE - 1));
+    memset(c, 0, size);
+    c->block = block;
+    c->k = k;
+    c->space_size = space_size;
+    c->seed = seed;
+    c->reduce_mode = kmh_reduce_mode(space_size);
+    c->reduce_m = kmh_fastmod_m(space_size);
+    // Reduced hashes are always below 0xFFFFFFFF, so nothing is filtered yet
+    atomic_init(&c->threshold, 0xFFFFFFFFU);
+
+    for (uint32_t s = 0; s < nshards; s++) {
+        atomic_init(&c->shards[s].lock, 0);
+        c->shards[s].kmh = kmh_init(k, space_size, seed);
+        c->nshards = s + 1;
+        if (!c->shards[s].kmh) {
+            kmh_concurrent_free(c);
+            return NULL;
+        }
+    }
+    return c;
+}
+
+// Called with the shard locked
+static inline void kmh_concurrent_publish(kmh_concurrent_t *c, const kvalue_minhash_t *shard) {
+    if (shard->count < shard->k) return;
+    uint32_t kth = shard->hashes[0];
+    uint32_t current = atomic_load_explicit(&c->threshold, memory_order_relaxed);
+    while (kth < current &&
+           !atomic_compare_exchange_weak_explicit(&c->threshold, &current, kth,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+// Add from a worker; shard is below nshards, and workers may share a shard
+static inline void kmh_concurrent_add(kmh_concurrent_t *c, uint32_t shard, uint32_t value) {
+    uint32_t hash = kmh_reduce(xxh32_hash(value, c->seed), c->space_size, c->reduce_mode, c->reduce_m);
+    if (hash >= atomic_load_explicit(&c->threshold, memory_order_relaxed)) {
+        KMH_COUNT_ADDS(1);
+        return;
+    }
+
+    kmh_shard_t *s = &c->shards[shard];
+    kmh_spin_lock(&s->lock);
+    kmh_insert_hash(s->kmh, hash);
+    kmh_concurrent_publish(c, s->kmh);
+    kmh_spin_unlock(&s->lock);
+}
+
+// Batch form: values are filtered against the shared threshold with the
+// kmh_add_batch kernels, and the shard is locked once per chunk of survivors
+static inline void kmh_concurrent_add_batch(kmh_concurrent_t *c, uint32_t shard,
+                                            const uint32_t *values, size_t n) {
+    kmh_filter_fn filter = kmh_filter_select();
+    uint32_t survivors[KMH_BATCH_CHUNK];
+    kmh_shard_t *s = &c->shards[shard];
+    KMH_LOCAL_STATS(local);
+
+    for (size_t off = 0; off < n; off += KMH_BATCH_CHUNK) {
+        size_t m = n - off < KMH_BATCH_CHUNK ? n - off : KMH_BATCH_CHUNK;
+        uint32_t threshold = atomic_load_explicit(&c->threshold, memory_order_relaxed);
+        size_t cnt = filter(values + off, m, c->seed, c->space_size, threshold, survivors);
+        KMH_LOCAL_COUNT(&local, KMH_STAT_ADDS, m - cnt);
+        if (cnt == 0) continue;
+
+        kmh_spin_lock(&s->lock);
+        for (size_t i = 0; i < cnt; i++) {
+            kmh_insert_hash_counted(s->kmh, survivors[i], &local);
+        }
+        kmh_concurrent_publish(c, s->kmh);
+        kmh_spin_unlock(&s->lock);
+    }
+    KMH_LOCAL_FLUSH(local);
+}
+
+// Merge of all shards, equal to a single sketch fed every value added so
+// far. Shards are locked in order for the duration of the merge; workers
+// keep going meanwhile unless they need to insert.
+static inline kvalue_minhash_t* kmh_concurrent_snapshot(kmh_concurrent_t *c) {
+    const kvalue_minhash_t *stack_inputs[KMH_MERGE_STACK];
+    const kvalue_minhash_t **inputs = stack_inputs;
+    if (c->nshards > KMH_MERGE_STACK) {
+        inputs = kmh_alloc(c->nshards * sizeof(*inputs));
+        if (!inputs) return NULL;
+    }
+
+    for (uint32_t s = 0; s < c->nshards; s++) {
+        kmh_spin_lock(&c->shards[s].lock);
+        inputs[s] = c->shards[s].kmh;
+    }
+    kvalue_minhash_t *result = kmh_merge_many(inputs, c->nshards);
+    for (uint32_t s = 0; s < c->nshards; s++) {
+        kmh_spin_unlock(&c->shards[s].lock);
+    }
+
+    if (inputs != stack_inputs) kmh_dealloc(inputs);
+    return result;
+}
+
+#ifdef KMH_HAVE_PTHREAD
+// Fork-join pool for data-parallel jobs, kept alive between jobs so batch
+// builds don't pay thread creation each time. kmh_pool_run splits task
+// indices [0, ntasks) evenly across the workers (the caller is worker 0);
+// each worker pops tasks from the front of its own range, and a worker that
+// runs dry steals the back half of another's. A range is one 64-bit word
+// (begin << 32 | end) that other workers change only by CAS, so pops and
+// steals never lock. Jobs over more than UINT32_MAX tasks run as several
+// rounds, each offset by pool->base.
+typedef void (*kmh_task_fn)(void *arg, size_t task, uint32_t worker);
+
+typedef struct {
+    _Alignas(KMH_CACHE_LINE) _Atomic uint64_t range;
+} kmh_pool_slot_t;
+
+typedef struct {
+    uint32_t nthreads;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;     // a job (or shutdown) is posted
+    pthread_cond_t done;      // the last helper finished the job
+    uint64_t generation;      // bumped per job, under mutex
+    uint32_t active;          // helpers still working on the job, under mutex
+    int shutdown;
+    kmh_task_fn fn;
+    void *arg;
+    size_t base;              // task index of the current round's range 0
+    pthread_t *threads;       // nthreads - 1 helpers
+    kmh_pool_slot_t *slots;   // nthreads, cache-line aligned
+    void *slots_block;
+} kmh_pool_t;
+
+typedef struct {
+    kmh_pool_t *pool;
+    uint32_t worker;
+} kmh_pool_worker_t;
+
+static inline void kmh_pool_work(kmh_pool_t *pool, uint32_t worker) {
+    _Atomic uint64_t *own = &pool->slots[worker].range;
+    for (;;) {
+        uint64_t r = atomic_load_explicit(own, memory_order_acquire);
+        uint32_t begin = (uint32_t)(r >> 32), end = (uint32_t)r;
+        if (begin < end) {
+            if (atomic_compare_exchange_weak_explicit(own, &r, ((uint64_t)(begin + 1) << 32) | end,
+                                                      memory_order_acq_rel, memory_order_acquire)) {
+                pool->fn(pool->arg, pool->base + begin, worker);
+            }
+            continue;
+        }
+
+        // Own range is empty: steal the back half of the first non-empty one
+        int stole = 0;
+        for (uint32_t i = 1; i < pool->nthreads && !stole; i++) {
+            _Atomic uint64_t *victim = &pool->slots[(worker + i) % pool->nthreads].range;
+            uint64_t v = atomic_load_explicit(victim, memory_order_acquire);
+            while (!stole) {
+                uint32_t vb = (uint32_t)(v >> 32), ve = (uint32_t)v;
+                if (vb >= ve) break;
+                uint32_t mid = vb + (ve - vb) / 2;
+                if (atomic_compare_exchange_weak_explicit(victim, &v, ((uint64_t)vb << 32) | mid,
+                                                          memory_order_acq_rel, memory_order_acquire)) {
+                    // [mid, ve) is ours now; run one and expose the rest
+                    atomic_store_explicit(own, ((uint64_t)(mid + 1) << 32) | ve, memory_order_release);
+                    pool->fn(pool->arg, pool->base + mid, worker);
+                    stole = 1;
+                }
+            }
+        }
+        // A range grows only when a thief stores the rest of its stolen half
+        // into its own slot, and that thief goes on to run it. A task a pass
+        // misses because it sits with a thief between the CAS and the store
+        // is still run by that thief, so one empty pass means nothing is left
+        // for this worker; the job ends once every worker has returned.
+        if (!stole) return;
+    }
+}
+
+static void *kmh_pool_thread(void *arg) {
+    kmh_pool_worker_t *w = arg;
+    kmh_pool_t *pool = w->pool;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (pool->generation == seen && !pool->shutdown) pthread_cond_wait(&pool->start, &pool->mutex);
+        if (pool->shutdown) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+
+        kmh_pool_work(pool, w->worker);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->active == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    kmh_dealloc(w);
+    kmh_thread_cache_flush();
+    return NULL;
+}
+
+static inline void kmh_pool_destroy(kmh_pool_t *pool) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+    for (uint32_t t = 0; t + 1 < pool->nthreads; t++) pthread_join(pool->threads[t], NULL);
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    kmh_dealloc(pool->threads);
+    kmh_dealloc(pool->slots_block);
+    kmh_dealloc(pool);
+}
+
+// nthreads counts the calling thread, so 1 runs every job inline
+static inline kmh_pool_t* kmh_pool_create(uint32_t nthreads) {
+    if (nthreads == 0) return NULL;
+    kmh_pool_t *pool = kmh_alloc(sizeof(kmh_pool_t));
+    if (!pool) return NULL;
+    memset(pool, 0, sizeof(*pool));
+    pool->threads = kmh_alloc(nthreads * sizeof(pthread_t));
+    pool->slots_block = kmh_alloc((nthreads + 1) * sizeof(kmh_pool_slot_t));
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    if (!pool->threads || !pool->slots_block) {
+        kmh_pool_destroy(pool);
+        return NULL;
+    }
+    pool->slots = (kmh_pool_slot_t *)(((uintptr_t)pool->slots_block + KMH_CACHE_LINE - 1) &
+                                      ~(uintptr_t)(KMH_CACHE_LINE - 1));
+    for (uint32_t t = 0; t < nthreads; t++) atomic_init(&pool->slots[t].range, 0);
+    pool->nthreads = 1;
+
+    for (uint32_t t = 1; t < nthreads; t++) {
+        kmh_pool_worker_t *w = kmh_alloc(sizeof(kmh_pool_worker_t));
+        if (!w) break;
+        w->pool = pool;
+        w->worker = t;
+        if (pthread_create(&pool->threads[t - 1], NULL, kmh_pool_thread, w) != 0) {
+            kmh_dealloc(w);
+            break;
+        }
+        pool->nthreads = t + 1;
+    }
+    if (pool->nthreads != nthreads) {
+        kmh_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// Run fn(arg, task, worker) for every task in [0, ntasks) and wait for all
+// of them; worker is below nthreads and unique among concurrently running
+// tasks, so it can index per-worker state. One job at a time per pool.
+static inline void kmh_pool_run(kmh_pool_t *pool, size_t ntasks, kmh_task_fn fn, void *arg) {
+    pool->fn = fn;
+    pool->arg = arg;
+    // Ranges are 32-bit, so a larger job runs as rounds of UINT32_MAX tasks
+    for (size_t base = 0; base < ntasks; base += UINT32_MAX) {
+        uint64_t n = ntasks - base < UINT32_MAX ? ntasks - base : UINT32_MAX;
+        uint32_t w = pool->nthreads;
+        for (uint32_t t = 0; t < w; t++) {
+            uint64_t begin = n * t / w, end = n * (t + 1) / w;
+            atomic_store_explicit(&pool->slots[t].range, (begin << 32) | end, memory_order_relaxed);
+        }
+        pool->base = base;
+
+        if (w > 1) {
+            pthread_mutex_lock(&pool->mutex);
+            pool->active = w - 1;
+            pool->generation++;
+            pthread_cond_broadcast(&pool->start);
+            pthread_mutex_unlock(&pool->mutex);
+        }
+
+        kmh_pool_work(pool, 0);
+
+        if (w > 1) {
+            pthread_mutex_lock(&pool->mutex);
+            while (pool->active > 0) pthread_cond_wait(&pool->done, &pool->mutex);
+            pthread_mutex_unlock(&pool->mutex);
+        }
+    }
+}
+
+// Parallel bulk build: the input is cut into KMH_BUILD_CHUNK-value tasks,
+// each worker feeds the chunks it runs into its own sketch through
+// kmh_add_batch, and the per-worker sketches are combined with
+// kmh_merge_many. Same result as kmh_add over every value.
+#define KMH_BUILD_CHUNK (1 << 16)
+
+typedef struct {
+    const uint32_t *values;
+    size_t n;
+    kvalue_minhash_t **sketches;
+} kmh_build_job_t;
+
+static void kmh_build_task(void *arg, size_t task, uint32_t worker) {
+    kmh_build_job_t *job = arg;
+    size_t off = task * KMH_BUILD_CHUNK;
+    size_t m = job->n - off < KMH_BUILD_CHUNK ? job->n - off : KMH_BUILD_CHUNK;
+    kmh_add_batch(job->sketches[worker], job->values + off, m);
+}
+
+static inline kvalue_minhash_t* kmh_pool_build(kmh_pool_t *pool, uint32_t k, uint32_t space_size,
+                                               uint32_t seed, const uint32_t *values, size_t n) {
+    kvalue_minhash_t *stack_sketches[KMH_MERGE_STACK];
+    kvalue_minhash_t **sketches = stack_sketches;
+    uint32_t w = pool->nthreads;
+    if (w > KMH_MERGE_STACK) {
+        sketches = kmh_alloc(w * sizeof(*sketches));
+        if (!sketches) return NULL;
+    }
+
+    kvalue_minhash_t *result = NULL;
+    uint32_t made = 0;
+    for (; made < w; made++) {
+        sketches[made] = kmh_init(k, space_size, seed);
+        if (!sketches[made]) goto done;
+    }
+
+    kmh_build_job_t job = { values, n, sketches };
+    kmh_pool_run(pool, (n + KMH_BUILD_CHUNK - 1) / KMH_BUILD_CHUNK, kmh_build_task, &job);
+    result = kmh_merge_many((const kvalue_minhash_t **)sketches, w);
+
+done:
+    for (uint32_t t = 0; t < made; t++) kmh_free(sketches[t]);
+    if (sketches != stack_sketches) kmh_dealloc(sketches);
+    return result;
+}
+
+// One-shot form with a temporary pool of nthreads (including the caller)
+static inline kvalue_minhash_t* kmh_build_parallel(const uint32_t *values, size_t n, uint32_t nthreads,
+                                                   uint32_t k, uint32_t space_size, uint32_t seed) {
+    kmh_pool_t *pool = kmh_pool_create(nthreads);
+    if (!pool) return NULL;
+    kvalue_minhash_t *result = kmh_pool_build(pool, k, space_size, seed, values, n);
+    kmh_pool_destroy(pool);
+    return result;
+}
+#endif
+
+// Overlap of two descending hash arrays as kmh_distance walks them: the walk
+// takes the union in descending order until either side runs out or k
+// elements are taken, and counts the common ones among them.
+typedef struct {
+    uint32_t matches;
+    uint32_t compared;
+} kmh_overlap_t;
+
+// a and b are native-endian descending arrays, possibly unaligned
+typedef kmh_overlap_t (*kmh_overlap_fn)(const void *a, uint32_t na, const void *b, uint32_t nb,
+                                        uint32_t k);
+
+static inline uint32_t kmh_load_u32(const void *p, uint32_t i) {
+    uint32_t v;
+    memcpy(&v, (const uint8_t *)p + (size_t)i * sizeof(uint32_t), sizeof(v));
+    return v;
+}
+
+// Branchless walk from a[i], b[j] with r already taken
+static inline kmh_overlap_t kmh_overlap_walk(const void *a, uint32_t na, const void *b, uint32_t nb,
+                                             uint32_t k, uint32_t i, uint32_t j, kmh_overlap_t r) {
+    while (i < na && j < nb && r.compared < k) {
+        uint32_t x = kmh_load_u32(a, i), y = kmh_load_u32(b, j);
+        r.matches += x == y;
+        i += x >= y;
+        j += y >= x;
+        r.compared++;
+    }
+    return r;
+}
+
+static inline kmh_overlap_t kmh_overlap_scalar(const void *a, uint32_t na, const void *b, uint32_t nb,
+                                               uint32_t k) {
+    kmh_overlap_t r = { 0, 0 };
+    return kmh_overlap_walk(a, na, b, nb, k, 0, 0, r);
+}
+
+// Block intersection: compare W hashes of a against W of b all-pairs, then
+// move past the block with the larger minimum. After a step to frontier
+// v = that minimum, the walk has taken exactly the hashes >= v: the whole
+// advanced block plus those of the other block >= v (one vector compare),
+// and every match >= v has been counted. The block loop stops before that
+// would exceed k, and the scalar walk finishes from the last frontier, so
+// the result equals kmh_overlap_scalar.
+#if defined(KMH_HAVE_X86_SIMD)
+__attribute__((target("avx2,popcnt")))
+static kmh_overlap_t kmh_overlap_avx2(const void *a, uint32_t na, const void *b, uint32_t nb,
+                                      uint32_t k) {
+    const uint32_t *pa = a, *pb = b;
+    kmh_overlap_t r = { 0, 0 };
+    uint32_t i = 0, j = 0;   // current blocks
+    uint32_t ti = 0, tj = 0; // taken up to the last frontier
+    uint32_t found = 0;      // matches seen by the block compares
+
+    while (i + 8 <= na && j + 8 <= nb) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(pa + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(pb + j));
+        // Rotations within each 128-bit lane, over vb and its swapped halves
+        __m256i vs = _mm256_permute2x128_si256(vb, vb, 1);
+        __m256i eq = _mm256_or_si256(
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi32(va, vb),
+                                            _mm256_cmpeq_epi32(va, _mm256_shuffle_epi32(vb, 0x39))),
+                            _mm256_or_si256(_mm256_cmpeq_epi32(va, _mm256_shuffle_epi32(vb, 0x4E)),
+                                            _mm256_cmpeq_epi32(va, _mm256_shuffle_epi32(vb, 0x93)))),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi32(va, vs),
+                                            _mm256_cmpeq_epi32(va, _mm256_shuffle_epi32(vs, 0x39))),
+                            _mm256_or_si256(_mm256_cmpeq_epi32(va, _mm256_shuffle_epi32(vs, 0x4E)),
+                                            _mm256_cmpeq_epi32(va, _mm256_shuffle_epi32(vs, 0x93)))));
+        uint32_t m = found + __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(eq)));
+
+        uint32_t amin = kmh_load_u32(a, i + 7), bmin = kmh_load_u32(b, j + 7);
+        uint32_t ni = i, nj = j, na_taken, nb_taken;
+        if (amin > bmin) {
+            __m256i v = _mm256_set1_epi32((int)amin);
+            ni += 8;
+            na_taken = ni;
+            nb_taken = j + __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(
+                           _mm256_cmpeq_epi32(_mm256_max_epu32(vb, v), vb))));
+        } else if (bmin > amin) {
+            __m256i v = _mm256_set1_epi32((int)bmin);
+            nj += 8;
+            nb_taken = nj;
+            na_taken = i + __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(
+                           _mm256_cmpeq_epi32(_mm256_max_epu32(va, v), va))));
+        } else {
+            ni += 8;
+            nj += 8;
+            na_taken = ni;
+            nb_taken = nj;
+        }
+        if (na_taken + nb_taken - m > k) break;
+
+        i = ni; j = nj;
+        ti = na_taken; tj = nb_taken;
+        found = m;
+    }
+
+    r.matches = found;
+    r.compared = ti + tj - found;
+    return kmh_overlap_walk(a, na, b, nb, k, ti, tj, r);
+}
+#endif
+
+#if defined(KMH_HAVE_NEON)
+static inline uint32_t kmh_neon_count(uint32x4_t mask) {
+    return vaddvq_u32(vshrq_n_u32(mask, 31));
+}
+
+static kmh_overlap_t kmh_overlap_neon(const void *a, uint32_t na, const void *b, uint32_t nb,
+                                      uint32_t k) {
+    const uint32_t *pa = a, *pb = b;
+    kmh_overlap_t r = { 0, 0 };
+    uint32_t i = 0, j = 0, ti = 0, tj = 0, found = 0;
+
+    while (i + 4 <= na && j + 4 <= nb) {
+        uint32x4_t va = vreinterpretq_u32_u8(vld1q_u8((const uint8_t *)(pa + i)));
+        uint32x4_t vb = vreinterpretq_u32_u8(vld1q_u8((const uint8_t *)(pb + j)));
+        uint32x4_t eq = vorrq_u32(vorrq_u32(vceqq_u32(va, vb), vceqq_u32(va, vextq_u32(vb, vb, 1))),
+                                  vorrq_u32(vceqq_u32(va, vextq_u32(vb, vb, 2)),
+                                            vceqq_u32(va, vextq_u32(vb, vb, 3))));
+        uint32_t m = found + kmh_neon_count(eq);
+
+        uint32_t amin = kmh_load_u32(a, i + 3), bmin = kmh_load_u32(b, j + 3);
+        uint32_t ni = i, nj = j, na_taken, nb_taken;
+        if (amin > bmin) {
+            ni += 4;
+            na_taken = ni;
+            nb_taken = j + kmh_neon_count(vcgeq_u32(vb, vdupq_n_u32(amin)));
+        } else if (bmin > amin) {
+            nj += 4;
+            nb_taken = nj;
+            na_taken = i + kmh_neon_count(vcgeq_u32(va, vdupq_n_u32(bmin)));
+        } else {
+            ni += 4;
+            nj += 4;
+            na_taken = ni;
+            nb_taken = nj;
+        }
+        if (na_taken + nb_taken - m > k) break;
+
+        i = ni; j = nj;
+        ti = na_taken; tj = nb_taken;
+        found = m;
+    }
+
+    r.matches = found;
+    r.compared = ti + tj - found;
+    return kmh_overlap_walk(a, na, b, nb, k, ti, tj, r);
+}
+#endif
+
+static inline kmh_overlap_fn kmh_overlap_select(void) {
+    static _Atomic(kmh_overlap_fn) selected = NULL; // every thread resolves the same kernel
+    kmh_overlap_fn fn = atomic_load_explicit(&selected, memory_order_relaxed);
+    if (fn) return fn;
+    fn = kmh_overlap_scalar;
+#if defined(KMH_HAVE_X86_SIMD)
+    if (__builtin_cpu_supports("avx2")) fn = kmh_overlap_avx2;
+#elif defined(KMH_HAVE_NEON)
+    fn = kmh_overlap_neon;
+#endif
+    atomic_store_explicit(&selected, fn, memory_order_relaxed);
+    return fn;
+}
+
+// Jaccard distance
+static inline double kmh_distance(const kvalue_minhash_t *a, const kvalue_minhash_t *b) {
+    if (a->k != b->k || a->space_size != b->space_size || a->seed != b->seed) return -1.0;
+
+    kmh_overlap_t r = kmh_overlap_select()(a->hashes, a->count, b->hashes, b->count, a->k);
+    return r.compared > 0 ? 1.0 - (double)r.matches / r.compared : 1.0;
+}
+
+// One query against many sketches: out[i] = kmh_distance(query, sketches[i])
+static inline void kmh_distance_many(const kvalue_minhash_t *query, const kvalue_minhash_t *const *sketches,
+                                     size_t n, double *out) {
+    kmh_overlap_fn overlap = kmh_overlap_select();
+    for (size_t i = 0; i < n; i++) {
+        const kvalue_minhash_t *s = sketches[i];
+        if (s->k != query->k || s->space_size != query->space_size || s->seed != query->seed) {
+            out[i] = -1.0;
+            continue;
+        }
+        kmh_overlap_t r = overlap(query->hashes, query->count, s->hashes, s->count, query->k);
+        out[i] = r.compared > 0 ? 1.0 - (double)r.matches / r.compared : 1.0;
+    }
+}
+
+// All pairs: out[i * nb + j] = kmh_distance(a[i], b[j]). Pairs are visited
+// in KMH_PAIRS_TILE x KMH_PAIRS_TILE tiles so both tiles' hashes stay in
+// cache while they are compared against each other.
+#define KMH_PAIRS_TILE 64
+
+static inline void kmh_distance_tile(const kvalue_minhash_t *const *a, size_t na,
+                                     const kvalue_minhash_t *const *b, size_t nb,
+                                     size_t ti, size_t tj, double *out) {
+    size_t iend = ti + KMH_PAIRS_TILE < na ? ti + KMH_PAIRS_TILE : na;
+    size_t jend = tj + KMH_PAIRS_TILE < nb ? tj + KMH_PAIRS_TILE : nb;
+    for (size_t i = ti; i < iend; i++) {
+        kmh_distance_many(a[i], b + tj, jend - tj, out + i * nb + tj);
+    }
+}
+
+static inline void kmh_distance_all_pairs(const kvalue_minhash_t *const *a, size_t na,
+                                          const kvalue_minhash_t *const *b, size_t nb, double *out) {
+    for (size_t ti = 0; ti < na; ti += KMH_PAIRS_TILE) {
+        for (size_t tj = 0; tj < nb; tj += KMH_PAIRS_TILE) {
+            kmh_distance_tile(a, na, b, nb, ti, tj, out);
+        }
+    }
+}
+
+#ifdef KMH_HAVE_PTHREAD
+// Threaded forms over a kmh_pool_t; same results as the serial ones
+#define KMH_DISTANCE_CHUNK 4096
+
+typedef struct {
+    const kvalue_minhash_t *query;
+    const kvalue_minhash_t *const *a;
+    const kvalue_minhash_t *const *b;
+    size_t na, nb, tiles_b;
+    double *out;
+} kmh_distance_job_t;
+
+static void kmh_distance_many_task(void *arg, size_t task, uint32_t worker) {
+    (void)worker;
+    kmh_distance_job_t *job = arg;
+    size_t off = task * KMH_DISTANCE_CHUNK;
+    size_t m = job->nb - off < KMH_DISTANCE_CHUNK ? job->nb - off : KMH_DISTANCE_CHUNK;
+    kmh_distance_many(job->query, job->b + off, m, job->out + off);
+}
+
+static inline void kmh_pool_distance_many(kmh_pool_t *pool, const kvalue_minhash_t *query,
+                                          const kvalue_minhash_t *const *sketches, size_t n, double *out) {
+    kmh_distance_job_t job = { query, NULL, sketches, 0, n, 0, out };
+    kmh_pool_run(pool, (n + KMH_DISTANCE_CHUNK - 1) / KMH_DISTANCE_CHUNK, kmh_distance_many_task, &job);
+}
+
+static void kmh_distance_tile_task(void *arg, size_t task, uint32_t worker) {
+    (void)worker;
+    kmh_distance_job_t *job = arg;
+    kmh_distance_tile(job->a, job->na, job->b, job->nb, task / job->tiles_b * KMH_PAIRS_TILE,
+                      task % job->tiles_b * KMH_PAIRS_TILE, job->out);
+}
+
+static inline void kmh_pool_distance_all_pairs(kmh_pool_t *pool, const kvalue_minhash_t *const *a, size_t na,
+                                               const kvalue_minhash_t *const *b, size_t nb, double *out) {
+    size_t tiles_a = (na + KMH_PAIRS_TILE - 1) / KMH_PAIRS_TILE;
+    size_t tiles_b = (nb + KMH_PAIRS_TILE - 1) / KMH_PAIRS_TILE;
+    kmh_distance_job_t job = { NULL, a, b, na, nb, tiles_b, out };
+    kmh_pool_run(pool, tiles_a * tiles_b, kmh_distance_tile_task, &job);
+}
+#endif
+
+// Set-operation estimators (K-minimum-values, Beyer et al.). The k smallest
+// distinct hashes of A and B together are a uniform sample of A u B, and a
+// sampled hash lies in A (or B) exactly when A's (or B's) sketch has it, as it
+// is at or below that sketch's k-th hash. So one merge-style walk up from the
+// smallest hashes, with no merged sketch, gives:
+//   |A u B|  ~ (k - 1) * space / (k-th sampled hash + 1), as kmh_cardinality
+//              of the merge (exact when fewer than k hashes are sampled)
+//   |A n B|  ~ |A u B| * both / taken
+//   |A \ B|  ~ |A u B| * only_a / taken
+//   |A n B| / |A| ~ both / (both + only_a)
+typedef struct {
+    uint32_t taken;   // sampled hashes, at most k
+    uint32_t both;
+    uint32_t only_a;
+    uint32_t only_b;
+    uint64_t kth;     // largest sampled hash
+} kmh_setop_t;
+
+typedef uint64_t (*kmh_setop_load_fn)(const void *hashes, uint32_t i);
+
+static inline uint64_t kmh_setop_load32(const void *hashes, uint32_t i) {
+    return kmh_load_u32(hashes, i);
+}
+
+// a and b are descending; load is a constant, so each caller gets its own
+// copy of the loop. Branches beat a branchless walk here: its loads would
+// depend on the previous compare.
+static inline kmh_setop_t kmh_setop_walk(const void *a, uint32_t na, const void *b, uint32_t nb, uint32_t k,
+                                         kmh_setop_load_fn load) {
+    kmh_setop_t s = { 0, 0, 0, 0, 0 };
+    uint32_t i = na, j = nb;
+    while (i > 0 && j > 0 && s.taken < k) {
+        uint64_t x = load(a, i - 1), y = load(b, j - 1);
+        if (x < y) {
+            s.only_a++;
+            s.kth = x;
+            i--;
+        } else if (y < x) {
+            s.only_b++;
+            s.kth = y;
+            j--;
+        } else {
+            s.both++;
+            s.kth = x;
+            i--;
+            j--;
+        }
+        s.taken++;
+    }
+    // One side is exhausted: the rest of the sample comes from the other
+    if (i > 0 && s.taken < k) {
+        uint32_t t = k - s.taken < i ? k - s.taken : i;
+        s.only_a += t;
+        s.taken += t;
+        s.kth = load(a, i - t);
+    } else if (j > 0 && s.taken < k) {
+        uint32_t t = k - s.taken < j ? k - s.taken : j;
+        s.only_b += t;
+        s.taken += t;
+        s.kth = load(b, j - t);
+    }
+    return s;
+}
+
+static inline double kmh_setop_union(const kmh_setop_t *s, uint32_t k, double space_size) {
+    if (s->taken < k) return (double)s->taken;
+    return space_size * (k - 1) / ((double)s->kth + 1.0);
+}
+
+static inline double kmh_setop_share(const kmh_setop_t *s, uint32_t k, double space_size, uint32_t part) {
+    return s->taken ? kmh_setop_union(s, k, space_size) * part / s->taken : 0.0;
+}
+
+static inline double kmh_setop_containment(const kmh_setop_t *s) {
+    return s->both + s->only_a ? (double)s->both / (s->both + s->only_a) : 0.0;
+}
+
+static inline int kmh_setop(const kvalue_minhash_t *a, const kvalue_minhash_t *b, kmh_setop_t *s) {
+    if (a->k != b->k || a->space_size != b->space_size || a->seed != b->seed) return 0;
+    *s = kmh_setop_walk(a->hashes, a->count, b->hashes, b->count, a->k, kmh_setop_load32);
+    return 1;
+}
+
+// All four return -1.0 for incompatible sketches. The union equals
+// kmh_cardinality(kmh_merge(a, b)).
+static inline double kmh_union_cardinality(const kvalue_minhash_t *a, const kvalue_minhash_t *b) {
+    kmh_setop_t s;
+    return kmh_setop(a, b, &s) ? kmh_setop_union(&s, a->k, a->space_size) : -1.0;
+}
+
+static inline double kmh_intersection_cardinality(const kvalue_minhash_t *a, const kvalue_minhash_t *b) {
+    kmh_setop_t s;
+    return kmh_setop(a, b, &s) ? kmh_setop_share(&s, a->k, a->space_size, s.both) : -1.0;
+}
+
+// |A \ B|
+static inline double kmh_difference_cardinality(const kvalue_minhash_t *a, const kvalue_minhash_t *b) {
+    kmh_setop_t s;
+    return kmh_setop(a, b, &s) ? kmh_setop_share(&s, a->k, a->space_size, s.only_a) : -1.0;
+}
+
+// |A n B| / |A|, the fraction of A contained in B (0 for an empty A)
+static inline double kmh_containment(const kvalue_minhash_t *a, const kvalue_minhash_t *b) {
+    kmh_setop_t s;
+    return kmh_setop(a, b, &s) ? kmh_setop_containment(&s) : -1.0;
+}
+
+// Locality-sensitive hashing index for sublinear similarity search.
+// A bottom-k sketch has no per-position minima to band, so each sketch is
+// first reduced to bands * rows one-permutation minima: a second hash assigns
+// every kept hash to a bin, and a bin keeps its smallest hash. Two sets agree
+// on a bin with probability about their Jaccard similarity, provided k is
+// well above bands * rows so the bins see the sets' true minima. Each band of
+// rows bins hashes to one key in an open-addressing table of posting lists;
+// sketches sharing any band key are candidates, and candidates are verified
+// with kmh_distance. A pair with similarity s is found with probability
+// 1 - (1 - s^rows)^bands, which crosses 1/2 near (1/bands)^(1/rows).
+// Bands with an empty bin aren't indexed, and a sketch without any complete
+// band (a small set) goes on a list that every query verifies, so small sets
+// are never missed. Queries don't modify the index; inserts and removes need
+// exclusive access.
+#define KMH_LSH_MAX_BINS MAX_K
+#define KMH_LSH_BIN_SEED 0x9747B28CU
+#define KMH_LSH_NONE 0xFFFFFFFFU  // empty id-map slot / no free entry
+#define KMH_LSH_EMPTY 0xFFFFFFFFU // empty bin; no reduced hash equals it
+
+typedef struct {
+    uint64_t key;   // band key, 0 marks an unused bucket
+    uint32_t *ids;  // entry indexes
+    uint32_t count;
+    uint32_t capacity;
+} kmh_lsh_bucket_t;
+
+typedef struct {
+    int64_t id;
+    kvalue_minhash_t *kmh; // owned copy, NULL on the free list
+    uint32_t next_free;
+} kmh_lsh_entry_t;
+
+typedef struct {
+    int64_t id;
+    double similarity; // 1 - kmh_distance
+} kmh_lsh_match_t;
+
+typedef struct {
+    uint32_t bands;
+    uint32_t rows;
+    uint32_t size;               // live entries
+    kmh_lsh_bucket_t *buckets;
+    uint32_t bucket_mask;
+    uint32_t bucket_used;
+    kmh_lsh_bucket_t small;      // entries without a complete band
+    kmh_lsh_entry_t *entries;
+    uint32_t entry_count;        // entries in use or on the free list
+    uint32_t entry_capacity;
+    uint32_t free_entry;
+    uint32_t *id_slots;          // id -> entry index, linear probing
+    uint32_t id_mask;
+} kmh_lsh_t;
+
+static inline uint32_t kmh_lsh_id_slot(uint64_t id, uint32_t mask) {
+    return (uint32_t)((id * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+static inline uint32_t kmh_lsh_bucket_slot(uint64_t key, uint32_t mask) {
+    return (uint32_t)(key >> 32) & mask;
+}
+
+// Bin minima of a sketch; empty bins stay KMH_LSH_EMPTY. Walking the
+// descending array backwards visits each bin's smallest hash first.
+static inline void kmh_lsh_bins(const kmh_lsh_t *idx, const kvalue_minhash_t *kmh, uint32_t *bins) {
+    uint32_t nbins = idx->bands * idx->rows;
+    for (uint32_t b = 0; b < nbins; b++) bins[b] = KMH_LSH_EMPTY;
+    for (uint32_t i = kmh->count; i-- > 0;) {
+        uint32_t h = kmh->hashes[i];
+        uint32_t b = (uint32_t)(((uint64_t)xxh32_hash(h, KMH_LSH_BIN_SEED) * nbins) >> 32);
+        if (bins[b] == KMH_LSH_EMPTY) bins[b] = h;
+    }
+}
+
+// Key of band t, or 0 if one of its bins is empty
+static inline uint64_t kmh_lsh_band_key(const kmh_lsh_t *idx, const uint32_t *bins, uint32_t t) {
+    const uint32_t *band = bins + (size_t)t * idx->rows;
+    for (uint32_t r = 0; r < idx->rows; r++) {
+        if (band[r] == KMH_LSH_EMPTY) return 0;
+    }
+    uint64_t key = xxh64_bytes(band, idx->rows * sizeof(uint32_t), t);
+    return key ? key : 1;
+}
+
+static inline kmh_lsh_bucket_t* kmh_lsh_find_bucket(const kmh_lsh_t *idx, uint64_t key) {
+    for (uint32_t s = kmh_lsh_bucket_slot(key, idx->bucket_mask);; s = (s + 1) & idx->bucket_mask) {
+        kmh_lsh_bucket_t *bucket = &idx->buckets[s];
+        if (bucket->key == key) return bucket;
+        if (bucket->key == 0) return NULL;
+    }
+}
+
+static inline int kmh_lsh_list_push(kmh_lsh_bucket_t *list, uint32_t entry) {
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 4;
+        uint32_t *ids = kmh_alloc(capacity * sizeof(uint32_t));
+        if (!ids) return 0;
+        if (list->count) memcpy(ids, list->ids, list->count * sizeof(uint32_t));
+        kmh_dealloc(list->ids);
+        list->ids = ids;
+        list->capacity = capacity;
+    }
+    list->ids[list->count++] = entry;
+    return 1;
+}
+
+static inline void kmh_lsh_list_remove(kmh_lsh_bucket_t *list, uint32_t entry) {
+    for (uint32_t i = 0; i < list->count; i++) {
+        if (list->ids[i] == entry) {
+            list->ids[i] = list->ids[--list->count];
+            return;
+        }
+    }
+}
+
+// Takes entry off the bucket under key; a bucket left empty is freed and
+// its slot closed by backward-shift deletion, so churn never leaves dead
+// buckets on the probe chains
+static inline void kmh_lsh_bucket_remove(kmh_lsh_t *idx, uint64_t key, uint32_t entry) {
+    kmh_lsh_bucket_t *bucket = kmh_lsh_find_bucket(idx, key);
+    if (!bucket) return;
+    kmh_lsh_list_remove(bucket, entry);
+    if (bucket->count) return;
+    kmh_dealloc(bucket->ids);
+    uint32_t s = (uint32_t)(bucket - idx->buckets);
+    memset(bucket, 0, sizeof(*bucket));
+    idx->bucket_used--;
+    for (uint32_t next = (s + 1) & idx->bucket_mask; idx->buckets[next].key != 0;
+         next = (next + 1) & idx->bucket_mask) {
+        uint32_t home = kmh_lsh_bucket_slot(idx->buckets[next].key, idx->bucket_mask);
+        if (((next - home) & idx->bucket_mask) >= ((next - s) & idx->bucket_mask)) {
+            idx->buckets[s] = idx->buckets[next];
+            memset(&idx->buckets[next], 0, sizeof(kmh_lsh_bucket_t));
+            s = next;
+        }
+    }
+}
+
+static inline int kmh_lsh_grow_buckets(kmh_lsh_t *idx) {
+    uint32_t capacity = (idx->bucket_mask + 1) * 2;
+    kmh_lsh_bucket_t *buckets = kmh_alloc(capacity * sizeof(kmh_lsh_bucket_t));
+    if (!buckets) return 0;
+    memset(buckets, 0, capacity * sizeof(kmh_lsh_bucket_t));
+    for (uint32_t s = 0; s <= idx->bucket_mask; s++) {
+        if (idx->buckets[s].key == 0) continue;
+        uint32_t d = kmh_lsh_bucket_slot(idx->buckets[s].key, capacity - 1);
+        while (buckets[d].key != 0) d = (d + 1) & (capacity - 1);
+        buckets[d] = idx->buckets[s];
+    }
+    kmh_dealloc(idx->buckets);
+    idx->buckets = buckets;
+    idx->bucket_mask = capacity - 1;
+    return 1;
+}
+
+static inline int kmh_lsh_grow_ids(kmh_lsh_t *idx) {
+    uint32_t capacity = (idx->id_mask + 1) * 2;
+    uint32_t *slots = kmh_alloc(capacity * sizeof(uint32_t));
+    if (!slots) return 0;
+    memset(slots, 0xFF, capacity * sizeof(uint32_t));
+    for (uint32_t s = 0; s <= idx->id_mask; s++) {
+        uint32_t e = idx->id_slots[s];
+        if (e == KMH_LSH_NONE) continue;
+        uint32_t d = kmh_lsh_id_slot((uint64_t)idx->entries[e].id, capacity - 1);
+        while (slots[d] != KMH_LSH_NONE) d = (d + 1) & (capacity - 1);
+        slots[d] = e;
+    }
+    kmh_dealloc(idx->id_slots);
+    idx->id_slots = slots;
+    idx->id_mask = capacity - 1;
+    return 1;
+}
+
+// Slot of id in the id map, or the empty slot where it would go
+static inline uint32_t kmh_lsh_id_find(const kmh_lsh_t *idx, int64_t id) {
+    uint32_t s = kmh_lsh_id_slot((uint64_t)id, idx->id_mask);
+    while (idx->id_slots[s] != KMH_LSH_NONE && idx->entries[idx->id_slots[s]].id != id) {
+        s = (s + 1) & idx->id_mask;
+    }
+    return s;
+}
+
+static inline void kmh_lsh_free(kmh_lsh_t *idx) {
+    if (!idx) return;
+    if (idx->buckets) {
+        for (uint32_t s = 0; s <= idx->bucket_mask; s++) kmh_dealloc(idx->buckets[s].ids);
+    }
+    for (uint32_t e = 0; e < idx->entry_count; e++) kmh_free(idx->entries[e].kmh);
+    kmh_dealloc(idx->small.ids);
+    kmh_dealloc(idx->buckets);
+    kmh_dealloc(idx->entries);
+    kmh_dealloc(idx->id_slots);
+    kmh_dealloc(idx);
+}
+
+// bands * rows must not exceed KMH_LSH_MAX_BINS
+static inline kmh_lsh_t* kmh_lsh_init(uint32_t bands, uint32_t rows) {
+    if (bands == 0 || rows == 0 || (uint64_t)bands * rows > KMH_LSH_MAX_BINS) return NULL;
+    kmh_lsh_t *idx = kmh_alloc(sizeof(kmh_lsh_t));
+    if (!idx) return NULL;
+    memset(idx, 0, sizeof(*idx));
+    idx->bands = bands;
+    idx->rows = rows;
+    idx->free_entry = KMH_LSH_NONE;
+    idx->bucket_mask = 63;
+    idx->id_mask = 15;
+    idx->buckets = kmh_alloc(64 * sizeof(kmh_lsh_bucket_t));
+    idx->id_slots = kmh_alloc(16 * sizeof(uint32_t));
+    if (!idx->buckets || !idx->id_slots) {
+        kmh_lsh_free(idx);
+        return NULL;
+    }
+    memset(idx->buckets, 0, 64 * sizeof(kmh_lsh_bucket_t));
+    memset(idx->id_slots, 0xFF, 16 * sizeof(uint32_t));
+    return idx;
+}
+
+// Returns 1 if id was indexed
+static inline int kmh_lsh_remove(kmh_lsh_t *idx, int64_t id) {
+    uint32_t s = kmh_lsh_id_find(idx, id);
+    uint32_t e = idx->id_slots[s];
+    if (e == KMH_LSH_NONE) return 0;
+
+    kmh_lsh_entry_t *entry = &idx->entries[e];
+    uint32_t bins[KMH_LSH_MAX_BINS];
+    kmh_lsh_bins(idx, entry->kmh, bins);
+    uint32_t indexed = 0;
+    for (uint32_t t = 0; t < idx->bands; t++) {
+        uint64_t key = kmh_lsh_band_key(idx, bins, t);
+        if (!key) continue;
+        kmh_lsh_bucket_remove(idx, key, e);
+        indexed++;
+    }
+    if (indexed == 0) kmh_lsh_list_remove(&idx->small, e);
+
+    kmh_free(entry->kmh);
+    entry->kmh = NULL;
+    entry->next_free = idx->free_entry;
+    idx->free_entry = e;
+    idx->size--;
+
+    // Backward-shift deletion keeps every probe chain unbroken
+    idx->id_slots[s] = KMH_LSH_NONE;
+    for (uint32_t next = (s + 1) & idx->id_mask; idx->id_slots[next] != KMH_LSH_NONE;
+         next = (next + 1) & idx->id_mask) {
+        uint32_t home = kmh_lsh_id_slot((uint64_t)idx->entries[idx->id_slots[next]].id, idx->id_mask);
+        if (((next - home) & idx->id_mask) >= ((next - s) & idx->id_mask)) {
+            idx->id_slots[s] = idx->id_slots[next];
+            idx->id_slots[next] = KMH_LSH_NONE;
+            s = next;
+        }
+    }
+    return 1;
+}
+
+// Index a copy of kmh under id, replacing any sketch already stored under
+// it. Returns 0 if memory runs out, leaving id unindexed.
+static inline int kmh_lsh_insert(kmh_lsh_t *idx, int64_t id, const kvalue_minhash_t *kmh) {
+    kmh_lsh_remove(idx, id);
+    if ((idx->size + 1) * 2 > idx->id_mask + 1 && !kmh_lsh_grow_ids(idx)) return 0;
+    if ((idx->bucket_used + idx->bands) * 2 > idx->bucket_mask + 1 && !kmh_lsh_grow_buckets(idx)) return 0;
+
+    uint32_t e = idx->free_entry;
+    if (e == KMH_LSH_NONE && idx->entry_count == idx->entry_capacity) {
+        uint32_t capacity = idx->entry_capacity ? idx->entry_capacity * 2 : 16;
+        kmh_lsh_entry_t *entries = kmh_alloc(capacity * sizeof(kmh_lsh_entry_t));
+        if (!entries) return 0;
+        if (idx->entry_count) memcpy(entries, idx->entries, idx->entry_count * sizeof(kmh_lsh_entry_t));
+        kmh_dealloc(idx->entries);
+        idx->entries = entries;
+        idx->entry_capacity = capacity;
+    }
+
+    kvalue_minhash_t *copy = kmh_init(kmh->k, kmh->space_size, kmh->seed);
+    if (!copy) return 0;
+    copy->count = kmh->count;
+    memcpy(copy->hashes, kmh->hashes, kmh->count * sizeof(uint32_t));
+
+    uint32_t bins[KMH_LSH_MAX_BINS];
+    kmh_lsh_bins(idx, copy, bins);
+    if (e == KMH_LSH_NONE) e = idx->entry_count;
+    uint32_t t = 0, indexed = 0;
+    for (; t < idx->bands; t++) {
+        uint64_t key = kmh_lsh_band_key(idx, bins, t);
+        if (!key) continue;
+        kmh_lsh_bucket_t *bucket = kmh_lsh_find_bucket(idx, key);
+        if (!bucket) {
+            uint32_t s = kmh_lsh_bucket_slot(key, idx->bucket_mask);
+            while (idx->buckets[s].key != 0) s = (s + 1) & idx->bucket_mask;
+            bucket = &idx->buckets[s];
+            bucket->key = key;
+            idx->bucket_used++;
+        }
+        if (!kmh_lsh_list_push(bucket, e)) break;
+        indexed++;
+    }
+    if (t < idx->bands || (indexed == 0 && !kmh_lsh_list_push(&idx->small, e))) {
+        // Out of memory: take back the postings made so far, and band t's
+        // bucket if it was created empty for the failed push
+        for (uint32_t u = 0; u <= t && u < idx->bands; u++) {
+            uint64_t key = kmh_lsh_band_key(idx, bins, u);
+            if (key) kmh_lsh_bucket_remove(idx, key, e);
+        }
+        kmh_free(copy);
+        return 0;
+    }
+
+    if (e == idx->free_entry) {
+        idx->free_entry = idx->entries[e].next_free;
+    } else {
+        idx->entry_count++;
+    }
+    idx->entries[e].id = id;
+    idx->entries[e].kmh = copy;
+    idx->entries[e].next_free = KMH_LSH_NONE;
+    idx->id_slots[kmh_lsh_id_find(idx, id)] = e;
+    idx->size++;
+    return 1;
+}
+
+// The indexed sketch stored under id, or NULL
+static inline const kvalue_minhash_t* kmh_lsh_get(const kmh_lsh_t *idx, int64_t id) {
+    uint32_t e = idx->id_slots[kmh_lsh_id_find(idx, id)];
+    return e == KMH_LSH_NONE ? NULL : idx->entries[e].kmh;
+}
+
+static int kmh_lsh_match_cmp(const void *a, const void *b) {
+    const kmh_lsh_match_t *x = a, *y = b;
+    if (x->similarity != y->similarity) return x->similarity < y->similarity ? 1 : -1;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+static int kmh_lsh_u32_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Indexed sketches with similarity >= threshold to kmh, most similar first.
+// *out is allocated with kmh_alloc (NULL when nothing matches) and released
+// with kmh_dealloc. Returns the number of matches, or SIZE_MAX if memory
+// runs out.
+static inline size_t kmh_lsh_query(const kmh_lsh_t *idx, const kvalue_minhash_t *kmh, double threshold,
+                                   kmh_lsh_match_t **out) {
+    *out = NULL;
+    uint32_t bins[KMH_LSH_MAX_BINS];
+    kmh_lsh_bins(idx, kmh, bins);
+
+    // Gather candidate entries from every matching band, then dedupe
+    kmh_lsh_bucket_t *hits[KMH_LSH_MAX_BINS];
+    size_t nhits = 0, ncand = idx->small.count;
+    for (uint32_t t = 0; t < idx->bands; t++) {
+        uint64_t key = kmh_lsh_band_key(idx, bins, t);
+        kmh_lsh_bucket_t *bucket = key ? kmh_lsh_find_bucket(idx, key) : NULL;
+        if (bucket && bucket->count) {
+            hits[nhits++] = bucket;
+            ncand += bucket->count;
+        }
+    }
+    if (ncand == 0) return 0;
+
+    uint32_t *cand = kmh_alloc(ncand * sizeof(uint32_t));
+    if (!cand) return SIZE_MAX;
+    size_t n = 0;
+    for (size_t h = 0; h < nhits; h++) {
+        memcpy(cand + n, hits[h]->ids, hits[h]->count * sizeof(uint32_t));
+        n += hits[h]->count;
+    }
+    if (idx->small.count) memcpy(cand + n, idx->small.ids, idx->small.count * sizeof(uint32_t));
+    if (nhits > 1) qsort(cand, ncand, sizeof(uint32_t), kmh_lsh_u32_cmp);
+
+    kmh_lsh_match_t *matches = NULL;
+    size_t nmatches = 0;
+    for (size_t c = 0; c < ncand; c++) {
+        if (nhits > 1 && c > 0 && cand[c] == cand[c - 1]) continue;
+        const kmh_lsh_entry_t *entry = &idx->entries[cand[c]];
+        double distance = kmh_distance(kmh, entry->kmh);
+        if (distance < 0 || 1.0 - distance < threshold) continue;
+        if (!matches) {
+            matches = kmh_alloc((ncand - c) * sizeof(kmh_lsh_match_t));
+            if (!matches) {
+                kmh_dealloc(cand);
+                return SIZE_MAX;
+            }
+        }
+        matches[nmatches].id = entry->id;
+        matches[nmatches].similarity = 1.0 - distance;
+        nmatches++;
+    }
+    kmh_dealloc(cand);
+
+    if (nmatches > 1) qsort(matches, nmatches, sizeof(kmh_lsh_match_t), kmh_lsh_match_cmp);
+    *out = matches;
+    return nmatches;
+}
+
+// Build-mode sketch for high-K ingestion.
+// kmh_add keeps the sorted array up to date, which costs O(k) per accepted
+// hash. The builder instead keeps a bounded max-heap of the K smallest hashes
+// plus a linear-probing set of the heap members for duplicate rejection, so
+// every update is O(log k). kmh_finalize() compacts it into the regular
+// descending kvalue_minhash_t.
+typedef struct {
+    uint32_t k;          // Max capacity
+    uint32_t count;      // Current count
+    uint32_t space_size; // Hash space modulo
+    uint32_t seed;       // Hash seed
+    uint32_t *heap;      // Max-heap, heap[0] is the largest kept hash
+    uint32_t *set;       // Open-addressing set of heap members
+    uint32_t set_shift;  // 32 - log2(set capacity)
+    uint32_t reduce_mode; // KMH_REDUCE_*
+    uint64_t reduce_m;    // fastmod multiplier for KMH_REDUCE_MOD
+} kmh_builder_t;
+
+// Reduced hashes are always < space_size <= UINT32_MAX, so UINT32_MAX
+// never occurs as a value and can mark empty set slots.
+#define KMH_SET_EMPTY 0xFFFFFFFFU
+
+static inline kmh_builder_t* kmh_builder_init(uint32_t k, uint32_t space_size, uint32_t seed) {
+    // Keep the set at most half full. A replace holds k + 1 hashes for a
+    // moment, and kmh_set_remove needs an empty slot to stop at: for k = 1,
+    // 2 slots would both be taken, so at least 4.
+    uint32_t bits = 2;
+    while (bits < 31 && (1U << bits) < 2 * k) bits++;
+    uint32_t set_size = 1U << bits;
+
+    kmh_builder_t *b = kmh_alloc(sizeof(kmh_builder_t) + ((size_t)k + set_size) * sizeof(uint32_t));
+    if (!b) return NULL;
+
+    b->k = k;
+    b->count = 0;
+    b->space_size = space_size;
+    b->seed = seed;
+    b->heap = (uint32_t*)(b + 1);
+    b->set = b->heap + k;
+    b->set_shift = 32 - bits;
+    b->reduce_mode = kmh_reduce_mode(space_size);
+    b->reduce_m = kmh_fastmod_m(space_size);
+    memset(b->set, 0xFF, set_size * sizeof(uint32_t));
+    return b;
+}
+
+static inline void kmh_builder_free(kmh_builder_t *b) {
+    kmh_dealloc(b);
+}
+
+static inline uint32_t kmh_set_slot(const kmh_builder_t *b, uint32_t hash) {
+    return (hash * XXH_PRIME32_1) >> b->set_shift;
+}
+
+// Returns 1 if the hash was inserted, 0 if it was already present
+static inline int kmh_set_insert(kmh_builder_t *b, uint32_t hash) {
+    uint32_t mask = (1U << (32 - b->set_shift)) - 1;
+    uint32_t i = kmh_set_slot(b, hash);
+    while (b->set[i] != KMH_SET_EMPTY) {
+        if (b->set[i] == hash) return 0;
+        i = (i + 1) & mask;
+    }
+    b->set[i] = hash;
+    return 1;
+}
+
+// Backward-shift deletion, so lookups never need tombstones
+static inline void kmh_set_remove(kmh_builder_t *b, uint32_t hash) {
+    uint32_t mask = (1U << (32 - b->set_shift)) - 1;
+    uint32_t i = kmh_set_slot(b, hash);
+    while (b->set[i] != hash) {
+        if (b->set[i] == KMH_SET_EMPTY) return;
+        i = (i + 1) & mask;
+    }
+    uint32_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (b->set[j] == KMH_SET_EMPTY) break;
+        uint32_t home = kmh_set_slot(b, b->set[j]);
+        // Move set[j] into the hole unless its home lies in (i, j]
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            b->set[i] = b->set[j];
+            i = j;
+        }
+    }
+    b->set[i] = KMH_SET_EMPTY;
+}
+
+// The larger child is picked with a select rather than a branch: which one
+// wins is a coin flip, and the mispredictions cost more than the compares
+static inline void kmh_heap_sift_down(uint32_t *heap, uint32_t n, uint32_t i) {
+    uint32_t v = heap[i], c;
+    while ((c = 2 * i + 2) < n) {
+        c -= heap[c - 1] > heap[c];
+        if (heap[c] <= v) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    if (c == n && heap[c - 1] > v) {
+        // Only a left child
+        heap[i] = heap[c - 1];
+        i = c - 1;
+    }
+    heap[i] = v;
+}
+
+// Returns 1 if the hash is now among the kept ones, 0 if it was rejected
+// or already there; the counts go to stats, for the caller to flush
+static inline int kmh_builder_insert_hash_counted(kmh_builder_t *b, uint32_t hash, kmh_stats_local_t *stats) {
+    KMH_LOCAL_COUNT(stats, KMH_STAT_ADDS, 1);
+    if (b->count == b->k && hash >= b->heap[0]) {
+        return 0; // Not among the K smallest
+    }
+    if (!kmh_set_insert(b, hash)) {
+        KMH_LOCAL_COUNT(stats, KMH_STAT_DUPLICATES, 1);
+        return 0; // Duplicate
+    }
+    KMH_LOCAL_COUNT(stats, KMH_STAT_INSERTS, 1); // no memmove: heap sifts
+
+    if (b->count < b->k) {
+        // Sift up
+        uint32_t i = b->count++;
+        while (i > 0 && b->heap[(i - 1) / 2] < hash) {
+            b->heap[i] = b->heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        b->heap[i] = hash;
+        return 1;
+    }
+
+    // Replace the current largest
+    kmh_set_remove(b, b->heap[0]);
+    b->heap[0] = hash;
+    kmh_heap_sift_down(b->heap, b->count, 0);
+    return 1;
+}
+
+// Single-hash form, counted like kmh_insert_hash
+static inline int kmh_builder_insert_hash(kmh_builder_t *b, uint32_t hash) {
+#ifdef KMH_STATS
+    if (b->count == b->k && hash >= b->heap[0]) {
+        KMH_COUNT_ADDS(1);
+        return 0;
+    }
+#endif
+    KMH_LOCAL_STATS(local);
+    int kept = kmh_builder_insert_hash_counted(b, hash, &local);
+    KMH_LOCAL_FLUSH(local);
+    return kept;
+}
+
+static inline void kmh_builder_add(kmh_builder_t *b, uint32_t value) {
+    uint32_t hash = kmh_reduce(xxh32_hash(value, b->seed), b->space_size, b->reduce_mode, b->reduce_m);
+    kmh_builder_insert_hash(b, hash);
+}
+
+static inline void kmh_builder_add_bytes(kmh_builder_t *b, const void *data, size_t len) {
+    uint32_t hash = kmh_reduce(xxh32_bytes(data, len, b->seed), b->space_size, b->reduce_mode, b->reduce_m);
+    kmh_builder_insert_hash(b, hash);
+}
+
+// Empties the builder for reuse
+static inline void kmh_builder_reset(kmh_builder_t *b) {
+    b->count = 0;
+    memset(b->set, 0xFF, ((size_t)1 << (32 - b->set_shift)) * sizeof(uint32_t));
+}
+
+// The kept hashes into out, descending; returns how many
+static inline uint32_t kmh_builder_sorted(const kmh_builder_t *b, uint32_t *out) {
+    uint32_t n = b->count;
+    memcpy(out, b->heap, n * sizeof(uint32_t));
+
+    // Heapsort the copy: popping the max to the back yields ascending order
+    for (uint32_t end = n; end > 1; end--) {
+        uint32_t top = out[0];
+        out[0] = out[end - 1];
+        out[end - 1] = top;
+        kmh_heap_sift_down(out, end - 1, 0);
+    }
+
+    // Reverse to maintain descending order
+    for (uint32_t idx = 0; idx < n / 2; idx++) {
+        uint32_t temp = out[idx];
+        out[idx] = out[n - 1 - idx];
+        out[n - 1 - idx] = temp;
+    }
+    return n;
+}
+
+// Compact the builder into a regular sketch (descending order).
+// The builder itself is left untouched and can keep ingesting.
+static inline kvalue_minhash_t* kmh_finalize(const kmh_builder_t *b) {
+    kvalue_minhash_t *kmh = kmh_init(b->k, b->space_size, b->seed);
+    if (!kmh) return NULL;
+    kmh->count = kmh_builder_sorted(b, kmh->hashes);
+    return kmh;
+}
+
+// Varint encoding utilities
+static inline uint32_t varint_encode(uint32_t value, uint8_t *buf) {
+    uint32_t len = 0;
+    while (value >= 0x80) {
+        buf[len++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    buf[len++] = value & 0x7F;
+    return len;
+}
+
+static inline uint32_t varint_decode(const uint8_t *buf, uint32_t *value) {
+    const uint8_t *p = buf;
+    uint32_t result = 0;
+    uint32_t shift = 0;
+    
+    while (*p & 0x80) {
+        result |= (*p++ & 0x7F) << shift;
+        shift += 7;
+    }
+    result |= *p++ << shift;
+    *value = result;
+    return p - buf;
+}
+
+// SQLite4 variable integer encoding utilities
+static inline uint32_t sqlite4_encode(uint64_t value, uint8_t *buf) {
+    if (value <= 240) {
+        buf[0] = (uint8_t)value;
+        return 1;
+    }
+    if (value <= 2287) {
+        uint32_t v = (uint32_t)(value - 240);
+        buf[0] = (v / 256) + 241;
+        buf[1] = v % 256;
+        return 2;
+    }
+    if (value <= 67823) {
+        uint32_t v = (uint32_t)(value - 2288);
+        buf[0] = 249;
+        buf[1] = v / 256;
+        buf[2] = v % 256;
+        return 3;
+    }
+    if (value <= 0xFFFFFF) {
+        buf[0] = 250;
+        buf[1] = (value >> 16) & 0xFF;
+        buf[2] = (value >> 8) & 0xFF;
+        buf[3] = value & 0xFF;
+        return 4;
+    }
+    if (value <= 0xFFFFFFFF) {
+        buf[0] = 251;
+        buf[1] = (value >> 24) & 0xFF;
+        buf[2] = (value >> 16) & 0xFF;
+        buf[3] = (value >> 8) & 0xFF;
+        buf[4] = value & 0xFF;
+        return 5;
+    }
+    if (value <= 0xFFFFFFFFFF) {
+        buf[0] = 252;
+        buf[1] = (value >> 32) & 0xFF;
+        buf[2] = (value >> 24) & 0xFF;
+        buf[3] = (value >> 16) & 0xFF;
+        buf[4] = (value >> 8) & 0xFF;
+        buf[5] = value & 0xFF;
+        return 6;
+    }
+    if (value <= 0xFFFFFFFFFFFF) {
+        buf[0] = 253;
+        buf[1] = (value >> 40) & 0xFF;
+        buf[2] = (value >> 32) & 0xFF;
+        buf[3] = (value >> 24) & 0xFF;
+        buf[4] = (value >> 16) & 0xFF;
+        buf[5] = (value >> 8) & 0xFF;
+        buf[6] = value & 0xFF;
+        return 7;
+    }
+    if (value <= 0xFFFFFFFFFFFFFF) {
+        buf[0] = 254;
+        buf[1] = (value >> 48) & 0xFF;
+        buf[2] = (value >> 40) & 0xFF;
+        buf[3] = (value >> 32) & 0xFF;
+        buf[4] = (value >> 24) & 0xFF;
+        buf[5] = (value >> 16) & 0xFF;
+        buf[6] = (value >> 8) & 0xFF;
+        buf[7] = value & 0xFF;
+        return 8;
+    }
+    // Full 8-byte value
+    buf[0] = 255;
+    buf[1] = (value >> 56) & 0xFF;
+    buf[2] = (value >> 48) & 0xFF;
+    buf[3] = (value >> 40) & 0xFF;
+    buf[4] = (value >> 32) & 0xFF;
+    buf[5] = (value >> 24) & 0xFF;
+    buf[6] = (value >> 16) & 0xFF;
+    buf[7] = (value >> 8) & 0xFF;
+    buf[8] = value & 0xFF;
+    return 9;
+}
+
+// Bytes sqlite4_encode writes for value
+static inline uint32_t sqlite4_encode_len(uint64_t value) {
+    if (value <= 240) return 1;
+    if (value <= 2287) return 2;
+    if (value <= 67823) return 3;
+    if (value <= 0xFFFFFF) return 4;
+    if (value <= 0xFFFFFFFF) return 5;
+    if (value <= 0xFFFFFFFFFF) return 6;
+    if (value <= 0xFFFFFFFFFFFF) return 7;
+    if (value <= 0xFFFFFFFFFFFFFF) return 8;
+    return 9;
+}
+
+static inline uint32_t sqlite4_decode(const uint8_t *buf, uint64_t *value) {
+    uint8_t first = buf[0];
+    
+    if (first <= 240) {
+        *value = first;
+        return 1;
+    }
+    if (first <= 248) {
+        *value = 240 + 256 * (first - 241) + buf[1];
+        return 2;
+    }
+    if (first == 249) {
+        *value = 2288 + 256 * buf[1] + buf[2];
+        return 3;
+    }
+    if (first == 250) {
+        *value = ((uint64_t)buf[1] << 16) | 
+                 ((uint64_t)buf[2] << 8) | 
+                 buf[3];
+        return 4;
+    }
+    if (first == 251) {
+        *value = ((uint64_t)buf[1] << 24) | 
+                 ((uint64_t)buf[2] << 16) | 
+                 ((uint64_t)buf[3] << 8) | 
+                 buf[4];
+        return 5;
+    }
+    if (first == 252) {
+        *value = ((uint64_t)buf[1] << 32) | 
+                 ((uint64_t)buf[2] << 24) | 
+                 ((uint64_t)buf[3] << 16) | 
+                 ((uint64_t)buf[4] << 8) | 
+                 buf[5];
+        return 6;
+    }
+    if (first == 253) {
+        *value = ((uint64_t)buf[1] << 40) | 
+                 ((uint64_t)buf[2] << 32) | 
+                 ((uint64_t)buf[3] << 24) | 
+                 ((uint64_t)buf[4] << 16) | 
+                 ((uint64_t)buf[5] << 8) | 
+                 buf[6];
+        return 7;
+    }
+    if (first == 254) {
+        *value = ((uint64_t)buf[1] << 48) | 
+                 ((uint64_t)buf[2] << 40) | 
+                 ((uint64_t)buf[3] << 32) | 
+                 ((uint64_t)buf[4] << 24) | 
+                 ((uint64_t)buf[5] << 16) | 
+                 ((uint64_t)buf[6] << 8) | 
+                 buf[7];
+        return 8;
+    }
+    // first == 255
+    *value = ((uint64_t)buf[1] << 56) | 
+             ((uint64_t)buf[2] << 48) | 
+             ((uint64_t)buf[3] << 40) | 
+             ((uint64_t)buf[4] << 32) | 
+             ((uint64_t)buf[5] << 24) | 
+             ((uint64_t)buf[6] << 16) | 
+             ((uint64_t)buf[7] << 8) | 
+             buf[8];
+    return 9;
+}
+
+// Or just use memcpy if alignment allows (fastest)
+static inline uint32_t int32_encode_direct(uint32_t value, uint8_t *buf) {
+    memcpy(buf, &value, 4);
+    return 4;
+}
+
+static inline uint32_t int32_decode_direct(const uint8_t *buf, uint32_t *value) {
+    memcpy(value, buf, 4);
+    return 4;
+}
+
+// Serialize buffers come from the same per-thread block caches
+static inline uint8_t* kmh_get_buffer(size_t needed_size) {
+    return kmh_alloc_counted(needed_size, KMH_STAT_BUFFER_HITS);
+}
+
+static inline void kmh_free_buffer(uint8_t* buf) {
+    kmh_dealloc(buf);
+}
+
+// Portable blob format (little-endian, fixed offsets, same for both widths):
+//   0  u32 magic "KMH1"     4  u8 version   5  u8 width (bytes per hash)
+//   6  u8  encoding         7  u8 flags     8  u32 k      12 u32 count
+//   16 u64 space_size       24 u64 seed     32 hashes[count], descending
+// The RAW encoding stores hashes[] as is; VARINT and BITPACK store hashes[0]
+// and the gaps after it (see kmh_encode_hashes). Either way hashes[0] (the
+// k-th smallest once full) sits at offset 32, so the cardinality can be read
+// without decoding. Flag KMH_FLAG_BLOCKS (RAW, 32-bit only) marks a block
+// directory right after hashes[]: u32 nblocks, then per block, in order,
+// u32 its first (largest) hash and u32 the index of that hash, so a reader
+// can find the block holding a hash range without touching the others (see
+// kmh_view_search). Such blobs, written by kmh_blocked_t, may have k up to
+// KMH_HUGE_MAX_K instead of MAX_K * 10. Blobs written before the header
+// existed are raw struct dumps of kvalue_minhash_t from 64-bit
+// little-endian hosts (k, count, space_size, seed, 8-byte pointer slot,
+// hashes); their first word is k, which can't be mistaken for the magic.
+#define KMH_BLOB_MAGIC         0x31484D4BU // "KMH1"
+#define KMH_BLOB_VERSION       1
+#define KMH_BLOB_HEADER_SIZE   32
+#define KMH_LEGACY_HEADER_SIZE 24
+#define KMH_ENCODING_RAW       0
+#define KMH_ENCODING_VARINT    1
+#define KMH_ENCODING_BITPACK   2
+#define KMH_FLAG_BLOCKS        0x01
+#define KMH_HUGE_MAX_K         (1U << 20)
+#define KMH_DIR_ENTRY_SIZE     8
+
+static inline void kmh_blob_write_header(uint8_t *buf, uint8_t width, uint32_t k, uint32_t count,
+                                         uint64_t space_size, uint64_t seed) {
+    kmh_store_le32(buf, KMH_BLOB_MAGIC);
+    buf[4] = KMH_BLOB_VERSION;
+    buf[5] = width;
+    buf[6] = 0;
+    buf[7] = 0;
+    kmh_store_le32(buf + 8, k);
+    kmh_store_le32(buf + 12, count);
+    kmh_store_le64(buf + 16, space_size);
+    kmh_store_le64(buf + 24, seed);
+}
+
+// Width of a serialized sketch: from the header, 4 for legacy blobs
+static inline uint32_t kmh_serialized_width(const uint8_t *buf, uint32_t buf_size) {
+    if (buf_size >= KMH_BLOB_HEADER_SIZE && kmh_load_le32(buf) == KMH_BLOB_MAGIC) {
+        return buf[5];
+    }
+    return sizeof(uint32_t);
+}
+
+// Header fields of a portable or legacy blob
+typedef struct {
+    uint32_t k;
+    uint32_t count;
+    uint64_t space_size;
+    uint64_t seed;
+    uint8_t width;        // bytes per hash
+    uint8_t encoding;     // KMH_ENCODING_*
+    uint8_t flags;        // KMH_FLAG_*
+    uint32_t data_offset; // offset of hashes[0]
+} kmh_blob_info_t;
+
+// Parses the header only; returns 0 on a short buffer, an unknown version or
+// encoding, or count > k. Payload sizes are checked by the readers.
+static inline int kmh_blob_parse(kmh_blob_info_t *info, const uint8_t *buf, uint32_t buf_size) {
+    if (!buf) return 0;
+
+    if (buf_size >= KMH_BLOB_HEADER_SIZE && kmh_load_le32(buf) == KMH_BLOB_MAGIC) {
+        if (buf[4] > KMH_BLOB_VERSION || buf[6] > KMH_ENCODING_BITPACK) return 0;
+        // Block directories only follow RAW 32-bit hashes
+        if ((buf[7] & KMH_FLAG_BLOCKS) && (buf[5] != sizeof(uint32_t) || buf[6] != KMH_ENCODING_RAW)) return 0;
+        info->k = kmh_load_le32(buf + 8);
+        info->count = kmh_load_le32(buf + 12);
+        info->space_size = kmh_load_le64(buf + 16);
+        info->seed = kmh_load_le64(buf + 24);
+        info->width = buf[5];
+        info->encoding = buf[6];
+        info->flags = buf[7];
+        info->data_offset = KMH_BLOB_HEADER_SIZE;
+    } else {
+        if (buf_size < KMH_LEGACY_HEADER_SIZE) return 0;
+        info->k = kmh_load_le32(buf);
+        info->count = kmh_load_le32(buf + 4);
+        info->space_size = kmh_load_le32(buf + 8);
+        info->seed = kmh_load_le32(buf + 12);
+        info->width = sizeof(uint32_t);
+        info->encoding = KMH_ENCODING_RAW;
+        info->flags = 0;
+        info->data_offset = KMH_LEGACY_HEADER_SIZE;
+    }
+    return info->count <= info->k && info->k <= (info->flags & KMH_FLAG_BLOCKS ? KMH_HUGE_MAX_K : MAX_K * 10);
+}
+
+// Zero-copy read-only views over serialized sketches.
+// A view points straight into the serialized buffer (e.g. an
+// sqlite3_value_blob) instead of copying the hashes into a pooled sketch, so
+// one-shot readers avoid an allocation and a K*4-byte copy. The buffer may be
+// unaligned; hashes are read through kmh_view_hash.
+typedef struct {
+    uint32_t k;
+    uint32_t count;
+    uint32_t space_size;
+    uint32_t seed;
+    const uint8_t *hashes; // count little-endian hashes, descending
+    const uint8_t *dir;    // KMH_FLAG_BLOCKS directory entries, or NULL
+    uint32_t nblocks;
+} kmh_view_t;
+
+typedef struct {
+    uint32_t k;
+    uint32_t count;
+    uint64_t space_size;
+    uint64_t seed;
+    const uint8_t *hashes; // count little-endian hashes, descending
+} kmh64_view_t;
+
+static inline uint32_t kmh_view_hash(const kmh_view_t *v, uint32_t i) {
+    return kmh_load_le32(v->hashes + (size_t)i * sizeof(uint32_t));
+}
+
+static inline uint64_t kmh64_view_hash(const kmh64_view_t *v, uint32_t i) {
+    return kmh_load_le64(v->hashes + (size_t)i * sizeof(uint64_t));
+}
+
+// kmh_search over a view: the number of hashes strictly greater than hash.
+// With a block directory only the directory and one block are read: the
+// hash lies in the last block whose first hash is above it.
+static inline uint32_t kmh_view_search(const kmh_view_t *v, uint32_t hash) {
+    uint32_t lo = 0, n = v->count;
+    if (v->dir) {
+        uint32_t b = 0, nb = v->nblocks;
+        while (nb > 0) {
+            uint32_t half = nb >> 1;
+            if (kmh_load_le32(v->dir + (size_t)(b + half) * KMH_DIR_ENTRY_SIZE) > hash) {
+                b += half + 1;
+                nb -= half + 1;
+            } else {
+                nb = half;
+            }
+        }
+        if (b == 0) return 0;
+        // Starts are trusted only as far as staying inside hashes[]
+        uint32_t end = b < v->nblocks ? kmh_load_le32(v->dir + (size_t)b * KMH_DIR_ENTRY_SIZE + 4)
+                                      : v->count;
+        lo = kmh_load_le32(v->dir + (size_t)(b - 1) * KMH_DIR_ENTRY_SIZE + 4);
+        if (end > v->count) end = v->count;
+        if (lo > end) lo = end;
+        n = end - lo;
+    }
+    while (n > 0) {
+        uint32_t half = n >> 1;
+        if (kmh_view_hash(v, lo + half) > hash) {
+            lo += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+    return lo;
+}
+
+// Parses a portable (raw encoding) or legacy blob; returns 1 on success, 0 on
+// a bad buffer. Compressed blobs have no view; decode them with kmh_blob_decode.
+static inline int kmh_view_init(kmh_view_t *v, const uint8_t *buf, uint32_t buf_size) {
+    kmh_blob_info_t info;
+    if (!kmh_blob_parse(&info, buf, buf_size) || info.width != sizeof(uint32_t) ||
+        info.encoding != KMH_ENCODING_RAW || info.space_size > UINT32_MAX || info.seed > UINT32_MAX ||
+        buf_size < info.data_offset + (uint64_t)info.count * sizeof(uint32_t)) {
+        return 0;
+    }
+
+    v->k = info.k;
+    v->count = info.count;
+    v->space_size = (uint32_t)info.space_size;
+    v->seed = (uint32_t)info.seed;
+    v->hashes = buf + info.data_offset;
+    v->dir = NULL;
+    v->nblocks = 0;
+    if (info.flags & KMH_FLAG_BLOCKS) {
+        uint64_t at = info.data_offset + (uint64_t)info.count * sizeof(uint32_t);
+        if (buf_size < at + sizeof(uint32_t)) return 0;
+        v->nblocks = kmh_load_le32(buf + at);
+        if (v->nblocks > info.count ||
+            buf_size - at - sizeof(uint32_t) < (uint64_t)v->nblocks * KMH_DIR_ENTRY_SIZE) {
+            return 0;
+        }
+        v->dir = v->nblocks ? buf + at + sizeof(uint32_t) : NULL;
+    }
+    return 1;
+}
+
+static inline int kmh64_view_init(kmh64_view_t *v, const uint8_t *buf, uint32_t buf_size) {
+    kmh_blob_info_t info;
+    if (!kmh_blob_parse(&info, buf, buf_size) || info.width != sizeof(uint64_t) ||
+        info.encoding != KMH_ENCODING_RAW ||
+        buf_size < info.data_offset + (uint64_t)info.count * sizeof(uint64_t)) {
+        return 0;
+    }
+
+    v->k = info.k;
+    v->count = info.count;
+    v->space_size = info.space_size;
+    v->seed = info.seed;
+    v->hashes = buf + info.data_offset;
+    return 1;
+}
+
+static inline double kmh_view_cardinality(const kmh_view_t *v) {
+    if (v->count == 0) return 0.0;
+    if (v->count < v->k) return (double)v->count;
+    return (double)v->space_size * (v->k - 1) / (kmh_view_hash(v, 0) + 1);
+}
+
+static inline double kmh64_view_cardinality(const kmh64_view_t *v) {
+    if (v->count == 0) return 0.0;
+    if (v->count < v->k) return (double)v->count;
+    return (double)v->space_size * (v->k - 1) / ((double)kmh64_view_hash(v, 0) + 1.0);
+}
+
+// Compressed payloads (32-bit sketches). Both encodings keep hashes[0] raw at
+// data_offset, so the cardinality stays an O(1) read, and follow it with the
+// count-1 gaps hashes[i-1] - hashes[i], which are >= 1 and, for a full
+// sketch, about space_size/cardinality.
+//   VARINT:  each gap as an sqlite4 varint.
+//   BITPACK: blocks of 128 gaps, each a byte b (the bit width of the block's
+//            largest gap) and 16*b bytes of four interleaved 32-gap lanes:
+//            gap j sits in lane j%4, and the i-th 32-bit word of every lane
+//            is stored together, so one 128-bit load feeds all four lanes
+//            with the same shift. The last count-1 % 128 gaps are varints.
+#define KMH_PACK_BLOCK 128
+
+// Worst-case payload of either compressed encoding: hashes[0] plus 5 bytes
+// per gap (a 513-byte packed block holds 128 gaps)
+static inline uint32_t kmh_encoded_bound(uint32_t count) {
+    return count ? sizeof(uint32_t) + 5 * (count - 1) : 0;
+}
+
+static inline uint32_t sqlite4_decode_len(uint8_t first) {
+    return first <= 240 ? 1 : first <= 248 ? 2 : first - 246u;
+}
+
+static inline void kmh_pack_block(const uint32_t *gaps, uint32_t b, uint8_t *out) {
+    memset(out, 0, 16 * b);
+    for (uint32_t j = 0; j < KMH_PACK_BLOCK / 4; j++) {
+        uint32_t bit = j * b, w = bit >> 5, s = bit & 31;
+        for (uint32_t lane = 0; lane < 4; lane++) {
+            uint32_t v = gaps[4 * j + lane];
+            uint8_t *word = out + (w * 4 + lane) * sizeof(uint32_t);
+            kmh_store_le32(word, kmh_load_le32(word) | (v << s));
+            if (s + b > 32) {
+                kmh_store_le32(word + 16, kmh_load_le32(word + 16) | (v >> (32 - s)));
+            }
+        }
+    }
+}
+
+// Unpacks one block of 1 <= b <= 32 bits into 128 gaps
+static inline void kmh_unpack_block(const uint8_t *in, uint32_t b, uint32_t *gaps) {
+    uint32_t mask = b == 32 ? 0xFFFFFFFFU : (1U << b) - 1;
+#if defined(KMH_HAVE_X86_SIMD)
+    const __m128i vmask = _mm_set1_epi32((int)mask);
+    for (uint32_t j = 0; j < KMH_PACK_BLOCK / 4; j++) {
+        uint32_t bit = j * b, w = bit >> 5, s = bit & 31;
+        __m128i v = _mm_srl_epi32(_mm_loadu_si128((const __m128i *)(in + w * 16)), _mm_cvtsi32_si128(s));
+        if (s + b > 32) {
+            __m128i hi = _mm_loadu_si128((const __m128i *)(in + (w + 1) * 16));
+            v = _mm_or_si128(v, _mm_sll_epi32(hi, _mm_cvtsi32_si128(32 - s)));
+        }
+        _mm_storeu_si128((__m128i *)(gaps + 4 * j), _mm_and_si128(v, vmask));
+    }
+#elif defined(KMH_HAVE_NEON)
+    const uint32x4_t vmask = vdupq_n_u32(mask);
+    for (uint32_t j = 0; j < KMH_PACK_BLOCK / 4; j++) {
+        uint32_t bit = j * b, w = bit >> 5, s = bit & 31;
+        uint32x4_t v = vshlq_u32(vreinterpretq_u32_u8(vld1q_u8(in + w * 16)), vdupq_n_s32(-(int32_t)s));
+        if (s + b > 32) {
+            uint32x4_t hi = vreinterpretq_u32_u8(vld1q_u8(in + (w + 1) * 16));
+            v = vorrq_u32(v, vshlq_u32(hi, vdupq_n_s32((int32_t)(32 - s))));
+        }
+        vst1q_u32(gaps + 4 * j, vandq_u32(v, vmask));
+    }
+#else
+    for (uint32_t j = 0; j < KMH_PACK_BLOCK / 4; j++) {
+        uint32_t bit = j * b, w = bit >> 5, s = bit & 31;
+        for (uint32_t lane = 0; lane < 4; lane++) {
+            const uint8_t *word = in + (w * 4 + lane) * sizeof(uint32_t);
+            uint32_t v = kmh_load_le32(word) >> s;
+            if (s + b > 32) v |= kmh_load_le32(word + 16) << (32 - s);
+            gaps[4 * j + lane] = v & mask;
+        }
+    }
+#endif
+}
+
+// Writes hashes[0] and the gaps of a descending array; returns bytes written
+// (at most kmh_encoded_bound(count))
+static inline uint32_t kmh_encode_hashes(const uint32_t *hashes, uint32_t count, uint8_t encoding,
+                                         uint8_t *out) {
+    if (count == 0) return 0;
+    kmh_store_le32(out, hashes[0]);
+    uint32_t pos = sizeof(uint32_t), i = 1;
+
+    if (encoding == KMH_ENCODING_BITPACK) {
+        uint32_t gaps[KMH_PACK_BLOCK];
+        for (; count - i >= KMH_PACK_BLOCK; i += KMH_PACK_BLOCK) {
+            uint32_t all = 0;
+            for (uint32_t j = 0; j < KMH_PACK_BLOCK; j++) {
+                gaps[j] = hashes[i + j - 1] - hashes[i + j];
+                all |= gaps[j];
+            }
+            uint32_t b = 32 - __builtin_clz(all);
+            out[pos++] = (uint8_t)b;
+            kmh_pack_block(gaps, b, out + pos);
+            pos += 16 * b;
+        }
+    }
+    for (; i < count; i++) {
+        pos += sqlite4_encode(hashes[i - 1] - hashes[i], out + pos);
+    }
+    return pos;
+}
+
+// Exact number of bytes kmh_encode_hashes writes
+static inline uint32_t kmh_encoded_size(const uint32_t *hashes, uint32_t count, uint8_t encoding) {
+    if (count == 0) return 0;
+    uint32_t size = sizeof(uint32_t), i = 1;
+
+    if (encoding == KMH_ENCODING_BITPACK) {
+        for (; count - i >= KMH_PACK_BLOCK; i += KMH_PACK_BLOCK) {
+            uint32_t all = 0;
+            for (uint32_t j = 0; j < KMH_PACK_BLOCK; j++) all |= hashes[i + j - 1] - hashes[i + j];
+            size += 1 + 16 * (32 - __builtin_clz(all));
+        }
+    }
+    for (; i < count; i++) size += sqlite4_encode_len(hashes[i - 1] - hashes[i]);
+    return size;
+}
+
+// Decodes the hashes of a parsed 32-bit blob of any encoding into out
+// (info->count entries); returns 0 on a truncated payload or gaps that don't
+// describe a strictly descending array
+static inline int kmh_blob_decode(const kmh_blob_info_t *info, const uint8_t *buf, uint32_t buf_size,
+                                  uint32_t *out) {
+    uint32_t n = info->count, pos = info->data_offset;
+    if (info->width != sizeof(uint32_t)) return 0;
+    if (n == 0) return 1;
+
+    if (info->encoding == KMH_ENCODING_RAW) {
+        if (buf_size < pos + (uint64_t)n * sizeof(uint32_t)) return 0;
+#ifdef KMH_BIG_ENDIAN
+        for (uint32_t i = 0; i < n; i++) out[i] = kmh_load_le32(buf + pos + i * sizeof(uint32_t));
+#else
+        memcpy(out, buf + pos, (size_t)n * sizeof(uint32_t));
+#endif
+        return 1;
+    }
+
+    if (buf_size < pos + sizeof(uint32_t)) return 0;
+    out[0] = kmh_load_le32(buf + pos);
+    pos += sizeof(uint32_t);
+
+    // Gaps first, then one pass turns them into hashes
+    uint32_t i = 1;
+    if (info->encoding == KMH_ENCODING_BITPACK) {
+        for (; n - i >= KMH_PACK_BLOCK; i += KMH_PACK_BLOCK) {
+            if (pos >= buf_size) return 0;
+            uint32_t b = buf[pos++];
+            if (b == 0 || b > 32 || buf_size - pos < 16 * b) return 0;
+            kmh_unpack_block(buf + pos, b, out + i);
+            pos += 16 * b;
+        }
+    }
+    for (; i < n; i++) {
+        if (pos >= buf_size) return 0;
+        uint32_t len = sqlite4_decode_len(buf[pos]);
+        if (buf_size - pos < len) return 0;
+        uint64_t gap;
+        pos += sqlite4_decode(buf + pos, &gap);
+        if (gap > UINT32_MAX) return 0;
+        out[i] = (uint32_t)gap;
+    }
+
+    uint32_t prev = out[0], bad = 0;
+    for (i = 1; i < n; i++) {
+        uint32_t gap = out[i];
+        bad |= (gap == 0) | (gap > prev);
+        prev -= gap;
+        out[i] = prev;
+    }
+    return !bad;
+}
+
+// Exact size of the blob kmh_serialize_into writes with encoding, so callers
+// can allocate the final buffer (e.g. SQLite-owned memory) and skip a copy;
+// 0 for an unknown encoding
+static inline uint32_t kmh_serialized_size(const kvalue_minhash_t *kmh, uint8_t encoding) {
+    if (encoding == KMH_ENCODING_RAW) return KMH_BLOB_HEADER_SIZE + kmh->count * sizeof(uint32_t);
+    if (encoding > KMH_ENCODING_BITPACK) return 0;
+    return KMH_BLOB_HEADER_SIZE + kmh_encoded_size(kmh->hashes, kmh->count, encoding);
+}
+
+// Upper bound of kmh_serialized_size without the pass over the gaps
+static inline uint32_t kmh_serialized_bound(const kvalue_minhash_t *kmh, uint8_t encoding) {
+    if (encoding == KMH_ENCODING_RAW) return KMH_BLOB_HEADER_SIZE + kmh->count * sizeof(uint32_t);
+    return KMH_BLOB_HEADER_SIZE + kmh_encoded_bound(kmh->count);
+}
+
+// Serialize into the portable format (see KMH_BLOB_HEADER_SIZE) with any
+// KMH_ENCODING_*, into a caller's buffer; returns the bytes written, or 0
+// for an unknown encoding or a buffer smaller than kmh_serialized_size
+static inline uint32_t kmh_serialize_into(const kvalue_minhash_t *kmh, uint8_t encoding, uint8_t *buf,
+                                          uint32_t buf_size) {
+    if (encoding > KMH_ENCODING_BITPACK) return 0;
+    // Within the bound, the exact size needn't be computed first
+    if (buf_size < kmh_serialized_bound(kmh, encoding) && buf_size < kmh_serialized_size(kmh, encoding)) {
+        return 0;
+    }
+
+    kmh_blob_write_header(buf, sizeof(uint32_t), kmh->k, kmh->count, kmh->space_size, kmh->seed);
+    buf[6] = encoding;
+    if (encoding != KMH_ENCODING_RAW) {
+        return KMH_BLOB_HEADER_SIZE + kmh_encode_hashes(kmh->hashes, kmh->count, encoding,
+                                                        buf + KMH_BLOB_HEADER_SIZE);
+    }
+
+#ifdef KMH_BIG_ENDIAN
+    for (uint32_t i = 0; i < kmh->count; i++) {
+        kmh_store_le32(buf + KMH_BLOB_HEADER_SIZE + i * sizeof(uint32_t), kmh->hashes[i]);
+    }
+#else
+    if (kmh->count > 0) {
+        memcpy(buf + KMH_BLOB_HEADER_SIZE, kmh->hashes, kmh->count * sizeof(uint32_t));
+    }
+#endif
+    return KMH_BLOB_HEADER_SIZE + kmh->count * sizeof(uint32_t);
+}
+
+// Serialize with any KMH_ENCODING_* into a kmh_get_buffer block; the
+// compressed encodings trade a decode (see kmh_blob_decode) for roughly half
+// the bytes of a full sketch
+static inline uint32_t kmh_serialize_encoded(const kvalue_minhash_t *kmh, uint8_t encoding,
+                                             uint8_t **out_buf) {
+    if (encoding > KMH_ENCODING_BITPACK) return 0;
+    uint32_t bound = kmh_serialized_bound(kmh, encoding);
+    uint8_t *buf = kmh_get_buffer(bound);
+    if (!buf) return 0;
+
+    *out_buf = buf;
+    return kmh_serialize_into(kmh, encoding, buf, bound);
+}
+
 static inline uint32_t kmh_serialize(const kvalue_minhash_t *kmh, uint8_t **out_buf) {
-    // Calculate total size: struct + hash array
-    uint32_t struct_size = sizeof(kvalue_minhash_t);
-    uint32_t hash_size = kmh->count * sizeof(uint32_t);
-    uint32_t total_size = struct_size + hash_size;
+    return kmh_serialize_encoded(kmh, KMH_ENCODING_RAW, out_buf);
+}
+
+// Serialize (thread-safe optimized format)
+static inline uint32_t kmh_serialize_old(const kvalue_minhash_t *kmh, uint8_t **out_buf) {
+    // Calculate size needed
+    uint32_t header_size = 4 * sizeof(uint32_t); // k, count, space_size, seed
+    uint32_t data_size = 0;
+    
+    if (kmh->count > 0) {
+        data_size = kmh->count * 4; // 4 bytes per hash
+    }
+    
+    uint32_t total_size = header_size + data_size;
+    
+    uint8_t *buf = kmh_get_buffer(total_size);
+    if (!buf) return 0;
+    
+    uint32_t pos = 0;
+    
+    // Header
+    memcpy(buf + pos, &kmh->k, sizeof(uint32_t)); pos += sizeof(uint32_t);
+    memcpy(buf + pos, &kmh->count, sizeof(uint32_t)); pos += sizeof(uint32_t);
+    memcpy(buf + pos, &kmh->space_size, sizeof(uint32_t)); pos += sizeof(uint32_t);
+    memcpy(buf + pos, &kmh->seed, sizeof(uint32_t)); pos += sizeof(uint32_t);
     
+    if (kmh->count > 0) {
+        for (int32_t i = 0; i < kmh->count; i++) {
+            pos += int32_encode_direct(kmh->hashes[i], buf + pos);
+        }
+    }
+    
+    *out_buf = buf;
+    return pos;
+}
+
+// Deserialize a portable (any encoding) or legacy blob into an owned sketch
+static inline kvalue_minhash_t* kmh_deserialize(const uint8_t *buf, uint32_t buf_size) {
+    KMH_COUNT(KMH_STAT_DESERIALIZES, 1);
+    kmh_blob_info_t info;
+    if (!kmh_blob_parse(&info, buf, buf_size) || info.width != sizeof(uint32_t) ||
+        info.space_size > UINT32_MAX || info.seed > UINT32_MAX) {
+        return NULL;
+    }
+    
+    kvalue_minhash_t *kmh = kmh_init(info.k, (uint32_t)info.space_size, (uint32_t)info.seed);
+    if (!kmh) return NULL;
+    
+    if (!kmh_blob_decode(&info, buf, buf_size, kmh->hashes)) {
+        kmh_free(kmh);
+        return NULL;
+    }
+    kmh->count = info.count;
+    
+    return kmh;
+}
+
+
+// Deserialize
+static inline kvalue_minhash_t* kmh_deserialize_old(const uint8_t *buf, uint32_t buf_size) {
+    if (buf_size < 4 * sizeof(uint32_t)) return NULL;
+    uint32_t pos = 0;
+    uint32_t k, count, space_size, seed;
+    
+    // Header
+    memcpy(&k, buf + pos, sizeof(uint32_t)); pos += sizeof(uint32_t);
+    memcpy(&count, buf + pos, sizeof(uint32_t)); pos += sizeof(uint32_t);
+    memcpy(&space_size, buf + pos, sizeof(uint32_t)); pos += sizeof(uint32_t);
+    memcpy(&seed, buf + pos, sizeof(uint32_t)); pos += sizeof(uint32_t);
+
+    kvalue_minhash_t *kmh = kmh_init(k, space_size, seed);
+    if (!kmh) return NULL;
+    
+    kmh->count = count;
+    // Decode delta-encoded hashes
+    if (count > 0) {
+        for (int32_t i = 0; i < count && pos < buf_size; i++) {
+            uint32_t current;
+            pos += int32_decode_direct(buf + pos, &current);
+            kmh->hashes[i] = current;
+        }
+    }
+    
+    return kmh;
+}
+
+// Fast cardinality from serialized data (without full deserialization):
+// only the header and hashes[0] are read
+static inline double kmh_cardinality_from_serialized(const uint8_t *buf, uint32_t buf_size) {
+    kmh_blob_info_t info;
+    if (!kmh_blob_parse(&info, buf, buf_size) || info.width != sizeof(uint32_t)) return -1.0;
+    if (info.count == 0) return 0.0;
+    if (info.count < info.k) return (double)info.count;
+    if (buf_size < info.data_offset + sizeof(uint32_t)) return -1.0;
+    return (double)info.space_size * (info.k - 1) / (kmh_load_le32(buf + info.data_offset) + 1);
+}
+
+// Huge-K sketches (K up to KMH_HUGE_MAX_K). A flat array makes every insert
+// shift up to 4K bytes and merges/distances walk one K-sized array, which
+// stops fitting in cache past K ~ 64K. kmh_blocked_t keeps the same K
+// smallest hashes in leaves of KMH_LEAF_HASHES (512 bytes, cache-line
+// aligned), each sorted descending, under a fence array of leaf maxima
+// sorted ascending (a two-level B-tree). An insert binary-searches the
+// fences, then works inside one leaf, splitting it when full; the largest
+// hash lives in the last fence's leaf, so overflow drops from there.
+// Merge and distance stream leaf by leaf and give the same results as
+// kmh_merge and kmh_distance on the equivalent flat sketches. Serialized
+// blobs are RAW with a block directory (KMH_FLAG_BLOCKS), one entry per leaf.
+#define KMH_LEAF_HASHES 128
+
+typedef struct {
+    uint32_t max;  // leaf[0], the leaf's largest hash
+    uint32_t n;    // hashes in the leaf, >= 1
+    uint32_t slot; // leaf index in leaves
+} kmh_fence_t;
+
+typedef struct {
+    uint32_t k;
+    uint32_t count;
+    uint32_t space_size;
+    uint32_t seed;
+    uint32_t reduce_mode;
+    uint64_t reduce_m;
+    uint32_t nleaves;     // live fences
+    uint32_t nfree;       // free_slots entries
+    kmh_fence_t *fences;  // ascending by max
+    uint32_t *free_slots; // unused leaf slots
+    uint32_t *leaves;     // KMH_LEAF_HASHES per slot
+} kmh_blocked_t;
+
+// Leaves other than the top and bottom ones are at least half full (they
+// only grow, and splits halve full ones), so 2K/B + 3 slots cover count =
+// K + 1 mid-insert
+static inline uint32_t kmh_blocked_capacity(uint32_t k) {
+    return k / (KMH_LEAF_HASHES / 2) + 3;
+}
+
+static inline void kmh_blocked_reset(kmh_blocked_t *s) {
+    // Slots pop from the end: low ones first
+    uint32_t capacity = kmh_blocked_capacity(s->k);
+    s->count = 0;
+    s->nleaves = 0;
+    s->nfree = capacity;
+    for (uint32_t i = 0; i < capacity; i++) s->free_slots[i] = capacity - 1 - i;
+}
+
+static inline kmh_blocked_t* kmh_blocked_init(uint32_t k, uint32_t space_size, uint32_t seed) {
+    if (k == 0 || k > KMH_HUGE_MAX_K) return NULL;
+    uint32_t capacity = kmh_blocked_capacity(k);
+    size_t meta = sizeof(kmh_blocked_t) + (size_t)capacity * (sizeof(kmh_fence_t) + sizeof(uint32_t));
+    kmh_blocked_t *s = kmh_alloc(meta + KMH_CACHE_LINE + (size_t)capacity * KMH_LEAF_HASHES * sizeof(uint32_t));
+    if (!s) return NULL;
+
+    s->k = k;
+    s->space_size = space_size;
+    s->seed = seed;
+    s->reduce_mode = kmh_reduce_mode(space_size);
+    s->reduce_m = kmh_fastmod_m(space_size);
+    s->fences = (kmh_fence_t *)(s + 1);
+    s->free_slots = (uint32_t *)(s->fences + capacity);
+    s->leaves = (uint32_t *)(((uintptr_t)s + meta + KMH_CACHE_LINE - 1) & ~(uintptr_t)(KMH_CACHE_LINE - 1));
+    kmh_blocked_reset(s);
+    return s;
+}
+
+static inline void kmh_blocked_free(kmh_blocked_t *s) {
+    kmh_dealloc(s);
+}
+
+static inline uint32_t* kmh_blocked_leaf(const kmh_blocked_t *s, uint32_t slot) {
+    return s->leaves + (size_t)slot * KMH_LEAF_HASHES;
+}
+
+// Largest kept hash (the k-th smallest once full); count must be > 0
+static inline uint32_t kmh_blocked_max(const kmh_blocked_t *s) {
+    return s->fences[s->nleaves - 1].max;
+}
+
+// Same contract as kmh_insert_hash_counted
+static inline void kmh_blocked_insert_hash_counted(kmh_blocked_t *s, uint32_t hash, kmh_stats_local_t *stats) {
+    KMH_LOCAL_COUNT(stats, KMH_STAT_ADDS, 1);
+    if (s->count == s->k && hash >= kmh_blocked_max(s)) {
+        return;
+    }
+
+    // First leaf whose max is >= hash; above every max, the top leaf
+    uint32_t j = 0, n = s->nleaves;
+    while (n > 0) {
+        uint32_t half = n >> 1;
+        if (s->fences[j + half].max < hash) {
+            j += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+    if (j == s->nleaves) {
+        if (j == 0) {
+            uint32_t slot = s->free_slots[--s->nfree];
+            kmh_blocked_leaf(s, slot)[0] = hash;
+            s->fences[0] = (kmh_fence_t){ hash, 1, slot };
+            s->nleaves = 1;
+            s->count = 1;
+            KMH_LOCAL_COUNT(stats, KMH_STAT_INSERTS, 1);
+            return;
+        }
+        j--;
+    }
+
+    kmh_fence_t *f = &s->fences[j];
+    uint32_t *leaf = kmh_blocked_leaf(s, f->slot);
+    uint32_t pos = kmh_search(leaf, f->n, hash);
+    if (pos < f->n && leaf[pos] == hash) {
+        KMH_LOCAL_COUNT(stats, KMH_STAT_DUPLICATES, 1);
+        return; // Duplicate
+    }
+
+    if (f->n == KMH_LEAF_HASHES) {
+        // Split: the smaller half moves to a new leaf just below this one
+        const uint32_t half = KMH_LEAF_HASHES / 2;
+        uint32_t slot = s->free_slots[--s->nfree];
+        uint32_t *lower = kmh_blocked_leaf(s, slot);
+        memcpy(lower, leaf + half, half * sizeof(uint32_t));
+        memmove(&s->fences[j + 1], &s->fences[j], (s->nleaves - j) * sizeof(kmh_fence_t));
+        s->fences[j] = (kmh_fence_t){ lower[0], half, slot };
+        s->fences[j + 1].n = half;
+        s->nleaves++;
+        f = &s->fences[j + 1];
+        if (pos > half) {
+            f = &s->fences[j];
+            leaf = lower;
+            pos -= half;
+        }
+    }
+
+    KMH_LOCAL_COUNT(stats, KMH_STAT_INSERTS, 1);
+    KMH_LOCAL_COUNT(stats, KMH_STAT_MEMMOVE_BYTES, (f->n - pos) * sizeof(uint32_t));
+    memmove(&leaf[pos + 1], &leaf[pos], (f->n - pos) * sizeof(uint32_t));
+    leaf[pos] = hash;
+    f->n++;
+    if (pos == 0) f->max = hash;
+    if (++s->count <= s->k) return;
+
+    // Over K: drop the largest, hashes[0] of the top leaf
+    kmh_fence_t *top = &s->fences[s->nleaves - 1];
+    uint32_t *top_leaf = kmh_blocked_leaf(s, top->slot);
+    KMH_LOCAL_COUNT(stats, KMH_STAT_MEMMOVE_BYTES, (top->n - 1) * sizeof(uint32_t));
+    memmove(&top_leaf[0], &top_leaf[1], (top->n - 1) * sizeof(uint32_t));
+    if (--top->n == 0) {
+        s->free_slots[s->nfree++] = top->slot;
+        s->nleaves--;
+    } else {
+        top->max = top_leaf[0];
+    }
+    s->count--;
+}
+
+// Single-hash form, counted like kmh_insert_hash
+static inline void kmh_blocked_insert_hash(kmh_blocked_t *s, uint32_t hash) {
+#ifdef KMH_STATS
+    if (s->count == s->k && hash >= kmh_blocked_max(s)) {
+        KMH_COUNT_ADDS(1);
+        return;
+    }
+#endif
+    KMH_LOCAL_STATS(local);
+    kmh_blocked_insert_hash_counted(s, hash, &local);
+    KMH_LOCAL_FLUSH(local);
+}
+
+static inline void kmh_blocked_add(kmh_blocked_t *s, uint32_t value) {
+    kmh_blocked_insert_hash(s, kmh_reduce(xxh32_hash(value, s->seed), s->space_size, s->reduce_mode,
+                                          s->reduce_m));
+}
+
+static inline void kmh_blocked_add_bytes(kmh_blocked_t *s, const void *data, size_t len) {
+    kmh_blocked_insert_hash(s, kmh_reduce(xxh32_bytes(data, len, s->seed), s->space_size, s->reduce_mode,
+                                          s->reduce_m));
+}
+
+// Same filtering as kmh_add_batch, against the top leaf's max
+static inline void kmh_blocked_add_batch(kmh_blocked_t *s, const uint32_t *values, size_t n) {
+    kmh_filter_fn filter = kmh_filter_select();
+    uint32_t survivors[KMH_BATCH_CHUNK];
+    KMH_LOCAL_STATS(local);
+
+    for (size_t off = 0; off < n; off += KMH_BATCH_CHUNK) {
+        size_t m = n - off < KMH_BATCH_CHUNK ? n - off : KMH_BATCH_CHUNK;
+        uint32_t threshold = s->count < s->k ? 0xFFFFFFFFU : kmh_blocked_max(s);
+        size_t cnt = filter(values + off, m, s->seed, s->space_size, threshold, survivors);
+        KMH_LOCAL_COUNT(&local, KMH_STAT_ADDS, m - cnt);
+        for (size_t i = 0; i < cnt; i++) {
+            kmh_blocked_insert_hash_counted(s, survivors[i], &local);
+        }
+    }
+    KMH_LOCAL_FLUSH(local);
+}
+
+static inline double kmh_blocked_cardinality(const kmh_blocked_t *s) {
+    if (s->count == 0) return 0.0;
+    if (s->count < s->k) return (double)s->count;
+    return (double)s->space_size * (s->k - 1) / ((double)kmh_blocked_max(s) + 1);
+}
+
+// Copies the hashes out as one descending array of count entries
+static inline void kmh_blocked_collect(const kmh_blocked_t *s, uint32_t *out) {
+    for (uint32_t f = s->nleaves; f-- > 0;) {
+        memcpy(out, kmh_blocked_leaf(s, s->fences[f].slot), s->fences[f].n * sizeof(uint32_t));
+        out += s->fences[f].n;
+    }
+}
+
+// Bulk load from a descending array into empty s: full leaves from the
+// smallest hashes up, so only the top leaf (which loses hashes first) is
+// partial
+static inline void kmh_blocked_load(kmh_blocked_t *s, const uint32_t *hashes, uint32_t count) {
+    uint32_t end = count;
+    while (end > 0) {
+        uint32_t n = end < KMH_LEAF_HASHES ? end : KMH_LEAF_HASHES;
+        uint32_t slot = s->free_slots[--s->nfree];
+        memcpy(kmh_blocked_leaf(s, slot), hashes + end - n, n * sizeof(uint32_t));
+        s->fences[s->nleaves++] = (kmh_fence_t){ hashes[end - n], n, slot };
+        end -= n;
+    }
+    s->count = count;
+}
+
+// Merges a with b, or with the descending array hashes[count] if b is NULL,
+// into result, which must be empty and share a's parameters. Aggregates
+// keep result around, so merging a row costs no allocation.
+static inline void kmh_blocked_merge_into(kmh_blocked_t *result, const kmh_blocked_t *a, const kmh_blocked_t *b,
+                                          const uint32_t *hashes, uint32_t count) {
+    // Ascending cursors: next fence to load, and hashes left in the current
+    // leaf (taken from the end); output leaves fill from their last slot, so
+    // each ends up descending. An array b is one leaf of count hashes.
+    uint32_t fa = 0, fb = 0, ia = 0, ib = 0, n = 0, left = a->k;
+    uint32_t nb = b ? b->nleaves : 1;
+    const uint32_t *la = NULL, *lb = NULL;
+    uint32_t *out = NULL;
+    while (left > 0) {
+        if (ia == 0 && fa < a->nleaves) {
+            la = kmh_blocked_leaf(a, a->fences[fa].slot);
+            ia = a->fences[fa++].n;
+        }
+        if (ib == 0 && fb < nb) {
+            lb = b ? kmh_blocked_leaf(b, b->fences[fb].slot) : hashes;
+            ib = b ? b->fences[fb].n : count;
+            fb++;
+        }
+        if (ia == 0 && ib == 0) break;
+        if (n == 0) {
+            uint32_t slot = result->free_slots[--result->nfree];
+            out = kmh_blocked_leaf(result, slot);
+            result->fences[result->nleaves++] = (kmh_fence_t){ 0, 0, slot };
+            n = KMH_LEAF_HASHES;
+        }
+
+        // Up to the end of the output leaf, an input leaf or K
+        uint32_t was = n, stop = n > left ? n - left : 0;
+        if (ia == 0 || ib == 0) {
+            // One side left: copy a run
+            uint32_t *i = ia ? &ia : &ib, c = n - stop < *i ? n - stop : *i;
+            memcpy(out + n - c, (ia ? la : lb) + *i - c, c * sizeof(uint32_t));
+            *i -= c;
+            n -= c;
+        } else {
+            while (ia > 0 && ib > 0 && n > stop) {
+                uint32_t x = la[ia - 1], y = lb[ib - 1];
+                out[--n] = x < y ? x : y;
+                ia -= x <= y;
+                ib -= y <= x;
+            }
+        }
+        kmh_fence_t *f = &result->fences[result->nleaves - 1];
+        f->max = out[n];
+        f->n += was - n;
+        result->count += was - n;
+        left -= was - n;
+    }
+    if (n > 0) {
+        // Top leaf partly filled: move its hashes to the front
+        memmove(out, out + n, (KMH_LEAF_HASHES - n) * sizeof(uint32_t));
+    }
+}
+
+static inline kmh_blocked_t* kmh_blocked_merge(const kmh_blocked_t *a, const kmh_blocked_t *b) {
+    if (a->k != b->k || a->space_size != b->space_size || a->seed != b->seed) return NULL;
+
+    kmh_blocked_t *result = kmh_blocked_init(a->k, a->space_size, a->seed);
+    if (!result) return NULL;
+    kmh_blocked_merge_into(result, a, b, NULL, 0);
+    return result;
+}
+
+// Same walk as kmh_overlap_walk, from the top leaves down
+static inline double kmh_blocked_distance(const kmh_blocked_t *a, const kmh_blocked_t *b) {
+    if (a->k != b->k || a->space_size != b->space_size || a->seed != b->seed) return -1.0;
+
+    kmh_overlap_t r = { 0, 0 };
+    uint32_t fa = a->nleaves, fb = b->nleaves, i = 0, j = 0, na = 0, nb = 0;
+    const uint32_t *la = NULL, *lb = NULL;
+    while (r.compared < a->k) {
+        if (i == na) {
+            if (fa == 0) break;
+            fa--;
+            la = kmh_blocked_leaf(a, a->fences[fa].slot);
+            na = a->fences[fa].n;
+            i = 0;
+        }
+        if (j == nb) {
+            if (fb == 0) break;
+            fb--;
+            lb = kmh_blocked_leaf(b, b->fences[fb].slot);
+            nb = b->fences[fb].n;
+            j = 0;
+        }
+        while (i < na && j < nb && r.compared < a->k) {
+            uint32_t x = la[i], y = lb[j];
+            r.matches += x == y;
+            i += x >= y;
+            j += y >= x;
+            r.compared++;
+        }
+    }
+    return r.compared > 0 ? 1.0 - (double)r.matches / r.compared : 1.0;
+}
+
+// RAW blob with KMH_FLAG_BLOCKS: header, hashes[count] (top leaf first),
+// then the directory with one entry per leaf
+static inline uint32_t kmh_blocked_serialized_size(const kmh_blocked_t *s) {
+    return KMH_BLOB_HEADER_SIZE + s->count * sizeof(uint32_t) + sizeof(uint32_t) +
+           s->nleaves * KMH_DIR_ENTRY_SIZE;
+}
+
+// Returns the bytes written, or 0 if buf is smaller than
+// kmh_blocked_serialized_size
+static inline uint32_t kmh_blocked_serialize_into(const kmh_blocked_t *s, uint8_t *buf, uint32_t buf_size) {
+    uint32_t size = kmh_blocked_serialized_size(s);
+    if (buf_size < size) return 0;
+
+    kmh_blob_write_header(buf, sizeof(uint32_t), s->k, s->count, s->space_size, s->seed);
+    buf[7] = KMH_FLAG_BLOCKS;
+    uint8_t *p = buf + KMH_BLOB_HEADER_SIZE;
+    uint8_t *dir = p + s->count * sizeof(uint32_t);
+    kmh_store_le32(dir, s->nleaves);
+    dir += sizeof(uint32_t);
+    uint32_t start = 0;
+    for (uint32_t f = s->nleaves; f-- > 0; dir += KMH_DIR_ENTRY_SIZE) {
+        const kmh_fence_t *fence = &s->fences[f];
+        const uint32_t *leaf = kmh_blocked_leaf(s, fence->slot);
+        kmh_store_le32(dir, fence->max);
+        kmh_store_le32(dir + 4, start);
+#ifdef KMH_BIG_ENDIAN
+        for (uint32_t i = 0; i < fence->n; i++) kmh_store_le32(p + i * sizeof(uint32_t), leaf[i]);
+#else
+        memcpy(p, leaf, fence->n * sizeof(uint32_t));
+#endif
+        p += fence->n * sizeof(uint32_t);
+        start += fence->n;
+    }
+    return size;
+}
+
+// Serialize into a kmh_get_buffer block
+static inline uint32_t kmh_blocked_serialize(const kmh_blocked_t *s, uint8_t **out_buf) {
+    uint32_t size = kmh_blocked_serialized_size(s);
+    uint8_t *buf = kmh_get_buffer(size);
+    if (!buf) return 0;
+
+    *out_buf = buf;
+    return kmh_blocked_serialize_into(s, buf, size);
+}
+
+// Any 32-bit blob (flat or blocked, any encoding); the directory isn't
+// needed, since leaves are rebuilt full from the hashes
+static inline kmh_blocked_t* kmh_blocked_deserialize(const uint8_t *buf, uint32_t buf_size) {
+    KMH_COUNT(KMH_STAT_DESERIALIZES, 1);
+    kmh_blob_info_t info;
+    if (!kmh_blob_parse(&info, buf, buf_size) || info.width != sizeof(uint32_t) ||
+        info.space_size > UINT32_MAX || info.seed > UINT32_MAX) {
+        return NULL;
+    }
+
+    kmh_blocked_t *s = kmh_blocked_init(info.k, (uint32_t)info.space_size, (uint32_t)info.seed);
+    if (!s || info.count == 0) return s;
+
+    uint32_t *tmp = (uint32_t *)kmh_get_buffer((size_t)info.count * sizeof(uint32_t));
+    if (!tmp || !kmh_blob_decode(&info, buf, buf_size, tmp)) {
+        kmh_free_buffer((uint8_t *)tmp);
+        kmh_blocked_free(s);
+        return NULL;
+    }
+    kmh_blocked_load(s, tmp, info.count);
+    kmh_free_buffer((uint8_t *)tmp);
+    return s;
+}
+
+// Sliding window: distinct counts over the last nbuckets buckets of
+// bucket_width time units, e.g. 60 one-minute buckets. Bucket e (time /
+// bucket_width) lives in buckets[e % nbuckets], so moving the clock forward
+// expires the oldest bucket by clearing it. Queries don't merge the whole
+// ring: time is cut into blocks of nbuckets buckets, and a window ending in
+// bucket h covers a tail of the previous block and a head of the current
+// one. When a block closes, suffix[i] caches the merge of its buckets
+// i..nbuckets-1 (nbuckets-2 merges once per block), and prefix accumulates
+// the current block's closed buckets (one merge per bucket), so a query is
+// a single 3-way merge of suffix[h % nbuckets + 1], prefix and the open
+// bucket.
+#define KMH_WINDOW_MAGIC       0x57484D4BU // "KMHW"
+#define KMH_WINDOW_VERSION     2
+#define KMH_WINDOW_HEADER_SIZE 40
+
+typedef struct {
+    uint32_t nbuckets;
+    uint64_t bucket_width;
+    uint64_t head;              // newest bucket's epoch
+    kvalue_minhash_t **buckets; // buckets[e % nbuckets]: epoch e
+    kvalue_minhash_t **suffix;  // previous block's buckets i..nbuckets-1 merged
+    kvalue_minhash_t *prefix;   // current block's buckets before head merged
+    uint32_t *scratch;          // k entries for in-place merges
+} kmh_window_t;
+
+static inline void kmh_window_free(kmh_window_t *w) {
+    if (!w) return;
+    for (uint32_t i = 0; i < w->nbuckets; i++) {
+        kmh_free(w->buckets[i]);
+        kmh_free(w->suffix[i]);
+    }
+    kmh_free(w->prefix);
+    kmh_dealloc(w);
+}
+
+static inline kmh_window_t* kmh_window_init(uint32_t nbuckets, uint64_t bucket_width, uint32_t k,
+                                            uint32_t space_size, uint32_t seed) {
+    if (nbuckets == 0 || bucket_width == 0) return NULL;
+    kmh_window_t *w = kmh_alloc(sizeof(kmh_window_t) + 2 * (size_t)nbuckets * sizeof(kvalue_minhash_t *) +
+                                (size_t)k * sizeof(uint32_t));
+    if (!w) return NULL;
+    w->nbuckets = nbuckets;
+    w->bucket_width = bucket_width;
+    w->head = 0;
+    w->buckets = (kvalue_minhash_t **)(w + 1);
+    w->suffix = w->buckets + nbuckets;
+    w->scratch = (uint32_t *)(w->suffix + nbuckets);
+    memset(w->buckets, 0, 2 * (size_t)nbuckets * sizeof(kvalue_minhash_t *));
+    int ok = (w->prefix = kmh_init(k, space_size, seed)) != NULL;
+    for (uint32_t i = 0; i < nbuckets && ok; i++) {
+        ok = (w->buckets[i] = kmh_init(k, space_size, seed)) && (w->suffix[i] = kmh_init(k, space_size, seed));
+    }
+    if (!ok) {
+        kmh_window_free(w);
+        return NULL;
+    }
+    return w;
+}
+
+// dst = merge of inputs (dst may be one of them), through the scratch array
+static inline void kmh_window_merge_set(kmh_window_t *w, kvalue_minhash_t *dst,
+                                        const kvalue_minhash_t *const *inputs, size_t n) {
+    uint32_t k = dst->k;
+    uint32_t m = kmh_merge_many_hashes(inputs, n, k, w->scratch); // n <= 3: never allocates
+    memcpy(dst->hashes, w->scratch + k - m, m * sizeof(uint32_t));
+    dst->count = m;
+}
+
+// Caches for the current head from the buckets alone: the previous block's
+// buckets still in the window (slots after head's) and the current block's
+// closed buckets (slots before it)
+static inline void kmh_window_rebuild(kmh_window_t *w) {
+    uint32_t n = w->nbuckets, h = (uint32_t)(w->head % n);
+    for (uint32_t i = 0; i < n; i++) w->suffix[i]->count = 0;
+    if (h + 1 < n) {
+        const kvalue_minhash_t *last[1] = { w->buckets[n - 1] };
+        kmh_window_merge_set(w, w->suffix[n - 1], last, 1);
+        for (uint32_t i = n - 1; i-- > h + 1;) {
+            const kvalue_minhash_t *in[2] = { w->buckets[i], w->suffix[i + 1] };
+            kmh_window_merge_set(w, w->suffix[i], in, 2);
+        }
+    }
+    w->prefix->count = 0;
+    for (uint32_t i = 0; i < h; i++) {
+        const kvalue_minhash_t *in[2] = { w->prefix, w->buckets[i] };
+        kmh_window_merge_set(w, w->prefix, in, 2);
+    }
+}
+
+// Moves the head to epoch, expiring the buckets that fall out of the window
+static inline void kmh_window_advance(kmh_window_t *w, uint64_t epoch) {
+    uint32_t n = w->nbuckets;
+    if (epoch <= w->head) return;
+    if (epoch - w->head >= 2 * (uint64_t)n) {
+        // Neither the window nor the block before it survives
+        for (uint32_t i = 0; i < n; i++) w->buckets[i]->count = w->suffix[i]->count = 0;
+        w->prefix->count = 0;
+        w->head = epoch;
+        return;
+    }
+
+    while (w->head < epoch) {
+        uint32_t slot = (uint32_t)(++w->head % n);
+        if (slot == 0) {
+            // The block that just closed: cache its suffix merges
+            const kvalue_minhash_t *last[1] = { w->buckets[n - 1] };
+            kmh_window_merge_set(w, w->suffix[n - 1], last, 1);
+            for (uint32_t i = n - 1; i-- > 1;) {
+                const kvalue_minhash_t *in[2] = { w->buckets[i], w->suffix[i + 1] };
+                kmh_window_merge_set(w, w->suffix[i], in, 2);
+            }
+            w->prefix->count = 0;
+        } else {
+            const kvalue_minhash_t *in[2] = { w->prefix, w->buckets[slot - 1] };
+            kmh_window_merge_set(w, w->prefix, in, 2);
+        }
+        w->buckets[slot]->count = 0;
+    }
+}
+
+// Insert a reduced hash at time; 0 if its bucket has already expired. Late
+// hashes also go into the caches that cover their bucket.
+static inline int kmh_window_insert_hash(kmh_window_t *w, uint64_t time, uint32_t hash) {
+    uint64_t epoch = time / w->bucket_width;
+    uint32_t n = w->nbuckets;
+    kmh_window_advance(w, epoch);
+    if (epoch + n <= w->head) return 0;
+
+    uint32_t slot = (uint32_t)(epoch % n), h = (uint32_t)(w->head % n);
+    KMH_LOCAL_STATS(local);
+    kmh_insert_hash_counted(w->buckets[slot], hash, &local);
+    if (epoch < w->head) {
+        if (epoch >= w->head - h) {
+            kmh_insert_hash_counted(w->prefix, hash, &local);
+        } else {
+            for (uint32_t i = h + 1; i <= slot; i++) kmh_insert_hash_counted(w->suffix[i], hash, &local);
+        }
+    }
+    KMH_LOCAL_FLUSH(local);
+    return 1;
+}
+
+static inline int kmh_window_add(kmh_window_t *w, uint64_t time, uint32_t value) {
+    const kvalue_minhash_t *b = w->prefix;
+    return kmh_window_insert_hash(w, time, kmh_reduce(xxh32_hash(value, b->seed), b->space_size, b->reduce_mode,
+                                                      b->reduce_m));
+}
+
+// n values at the same time; the newest bucket takes the SIMD batch path
+static inline int kmh_window_add_batch(kmh_window_t *w, uint64_t time, const uint32_t *values, size_t n) {
+    uint64_t epoch = time / w->bucket_width;
+    kmh_window_advance(w, epoch);
+    if (epoch != w->head) {
+        int added = 1;
+        for (size_t i = 0; i < n; i++) added &= kmh_window_add(w, time, values[i]);
+        return added;
+    }
+    kmh_add_batch(w->buckets[epoch % w->nbuckets], values, n);
+    return 1;
+}
+
+// Hashes of the window ending at now's bucket into the back of scratch;
+// returns how many
+static inline uint32_t kmh_window_collect(kmh_window_t *w, uint64_t now) {
+    kmh_window_advance(w, now / w->bucket_width);
+    uint32_t n = w->nbuckets, h = (uint32_t)(w->head % n);
+    const kvalue_minhash_t *in[3] = { w->buckets[h], w->prefix, NULL };
+    size_t nin = 2;
+    if (h + 1 < n) in[nin++] = w->suffix[h + 1];
+    return kmh_merge_many_hashes(in, nin, w->prefix->k, w->scratch);
+}
+
+// Sketch of the window ending at now (a new sketch, NULL if out of memory)
+static inline kvalue_minhash_t* kmh_window_sketch(kmh_window_t *w, uint64_t now) {
+    const kvalue_minhash_t *b = w->prefix;
+    kvalue_minhash_t *kmh = kmh_init(b->k, b->space_size, b->seed);
+    if (!kmh) return NULL;
+    uint32_t m = kmh_window_collect(w, now);
+    memcpy(kmh->hashes, w->scratch + kmh->k - m, m * sizeof(uint32_t));
+    kmh->count = m;
+    return kmh;
+}
+
+// Distinct count of the window ending at now, without building a sketch
+static inline double kmh_window_cardinality(kmh_window_t *w, uint64_t now) {
+    uint32_t k = w->prefix->k, m = kmh_window_collect(w, now);
+    if (m == 0) return 0.0;
+    if (m < k) return (double)m;
+    return (double)w->prefix->space_size * (k - 1) / (w->scratch[0] + 1);
+}
+
+// Ring blob (little-endian): u32 magic "KMHW", u8 version, 3 zero bytes,
+// u32 nbuckets, u32 k, u64 bucket_width, u64 head, u32 space_size, u32 seed,
+// then entries of a u32 count, a u32 payload size and the hashes as a
+// BITPACK payload (see kmh_encode_hashes): one per slot, then (version 2)
+// suffix[0..nbuckets) and prefix. With the caches stored, a query reads at
+// most three entries (kmh_window_view_t) and a load decodes them instead
+// of rebuilding; version 1 blobs, buckets only, are rebuilt on load.
+// Upper bound of a ring blob's size (0 if it would exceed 4GB)
+static inline uint32_t kmh_window_serialized_bound(const kmh_window_t *w) {
+    uint64_t bound = KMH_WINDOW_HEADER_SIZE + (2 * (uint64_t)w->nbuckets + 1) * (8 + kmh_encoded_bound(w->prefix->k));
+    return bound > UINT32_MAX ? 0 : (uint32_t)bound;
+}
+
+static inline uint32_t kmh_window_put_entry(const kvalue_minhash_t *kmh, uint8_t *at) {
+    uint32_t size = kmh_encode_hashes(kmh->hashes, kmh->count, KMH_ENCODING_BITPACK, at + 8);
+    kmh_store_le32(at, kmh->count);
+    kmh_store_le32(at + 4, size);
+    return 8 + size;
+}
+
+// Returns the bytes written, 0 if buf_size < kmh_window_serialized_bound
+static inline uint32_t kmh_window_serialize_into(const kmh_window_t *w, uint8_t *buf, uint32_t buf_size) {
+    const kvalue_minhash_t *b = w->prefix;
+    uint32_t bound = kmh_window_serialized_bound(w);
+    if (!bound || buf_size < bound) return 0;
+
+    kmh_store_le32(buf, KMH_WINDOW_MAGIC);
+    buf[4] = KMH_WINDOW_VERSION;
+    buf[5] = buf[6] = buf[7] = 0;
+    kmh_store_le32(buf + 8, w->nbuckets);
+    kmh_store_le32(buf + 12, b->k);
+    kmh_store_le64(buf + 16, w->bucket_width);
+    kmh_store_le64(buf + 24, w->head);
+    kmh_store_le32(buf + 32, b->space_size);
+    kmh_store_le32(buf + 36, b->seed);
+    uint32_t pos = KMH_WINDOW_HEADER_SIZE, h = (uint32_t)(w->head % w->nbuckets);
+    for (uint32_t i = 0; i < w->nbuckets; i++) pos += kmh_window_put_entry(w->buckets[i], buf + pos);
+    // suffix[0..h] is never read until the next block rebuilds it, so it is
+    // stored empty, as kmh_window_rebuild leaves it
+    kvalue_minhash_t empty = *b;
+    empty.count = 0;
+    for (uint32_t i = 0; i < w->nbuckets; i++) pos += kmh_window_put_entry(i <= h ? &empty : w->suffix[i], buf + pos);
+    return pos + kmh_window_put_entry(w->prefix, buf + pos);
+}
+
+static inline uint32_t kmh_window_serialize(const kmh_window_t *w, uint8_t **out_buf) {
+    uint32_t bound = kmh_window_serialized_bound(w);
+    uint8_t *buf = bound ? kmh_get_buffer(bound) : NULL;
+    if (!buf) return 0;
+
+    *out_buf = buf;
+    return kmh_window_serialize_into(w, buf, bound);
+}
+
+// Read-only view of a ring blob's header. Entries are found by walking
+// their 8-byte headers, which kmh_window_view_init has checked.
+typedef struct {
+    uint32_t nbuckets;
+    uint32_t k;
+    uint32_t space_size;
+    uint32_t seed;
+    uint64_t bucket_width;
+    uint64_t head;
+    uint32_t nentries; // nbuckets, or 2 * nbuckets + 1 with the caches
+    const uint8_t *buf;
+    uint32_t size;
+} kmh_window_view_t;
+
+// Parses a ring blob: every entry must fit the blob and hold at most k
+// hashes. The walk runs before anything is allocated, so a blob whose
+// entries don't fit is turned away cheaply.
+static inline int kmh_window_view_init(kmh_window_view_t *v, const uint8_t *buf, uint32_t buf_size) {
+    if (!buf || buf_size < KMH_WINDOW_HEADER_SIZE || kmh_load_le32(buf) != KMH_WINDOW_MAGIC ||
+        buf[4] > KMH_WINDOW_VERSION) {
+        return 0;
+    }
+    v->nbuckets = kmh_load_le32(buf + 8);
+    v->k = kmh_load_le32(buf + 12);
+    v->bucket_width = kmh_load_le64(buf + 16);
+    v->head = kmh_load_le64(buf + 24);
+    v->space_size = kmh_load_le32(buf + 32);
+    v->seed = kmh_load_le32(buf + 36);
+    v->buf = buf;
+    v->size = buf_size;
+    // Every entry takes at least 8 bytes, which bounds nbuckets by the blob
+    if (v->k == 0 || v->k > MAX_K * 10 || v->nbuckets == 0 || v->bucket_width == 0 ||
+        v->nbuckets > (buf_size - KMH_WINDOW_HEADER_SIZE) / 8) {
+        return 0;
+    }
+    v->nentries = buf[4] >= 2 ? 2 * v->nbuckets + 1 : v->nbuckets;
+
+    uint32_t pos = KMH_WINDOW_HEADER_SIZE;
+    for (uint32_t i = 0; i < v->nentries; i++) {
+        if (buf_size - pos < 8) return 0;
+        uint32_t size = kmh_load_le32(buf + pos + 4);
+        if (kmh_load_le32(buf + pos) > v->k || size > buf_size - pos - 8) return 0;
+        pos += 8 + size;
+    }
+    return 1;
+}
+
+// Decodes the entry at offset pos into kmh, which must have room for k
+static inline int kmh_window_view_decode(const kmh_window_view_t *v, uint32_t pos, kvalue_minhash_t *kmh) {
+    uint32_t count = kmh_load_le32(v->buf + pos), size = kmh_load_le32(v->buf + pos + 4);
+    kmh_blob_info_t info = { v->k, count, v->space_size, v->seed, sizeof(uint32_t),
+                             KMH_ENCODING_BITPACK, 0, 0 }; // no flags, data at 0
+    if (!kmh_blob_decode(&info, v->buf + pos + 8, size, kmh->hashes)) return 0;
+    kmh->count = count;
+    return 1;
+}
+
+// Offset of entry e (slot e, suffix[e - nbuckets], then prefix)
+static inline uint32_t kmh_window_view_offset(const kmh_window_view_t *v, uint32_t e) {
+    uint32_t pos = KMH_WINDOW_HEADER_SIZE;
+    for (uint32_t i = 0; i < e; i++) pos += 8 + kmh_load_le32(v->buf + pos + 4);
+    return pos;
+}
+
+// Hashes of the window ending at now's bucket, the same as
+// kmh_window_collect on the loaded ring, into the back of work[0, k); work
+// holds KMH_WINDOW_VIEW_WORK * k entries. Needs the stored caches (version
+// 2). With h = head % nbuckets, a window that reaches back into the
+// previous block is suffix[j] + prefix + buckets[h], three entries; one
+// that starts inside the head's block (now well past the head) is its
+// buckets from there to h. Returns how many, or UINT32_MAX for a version 1
+// blob or an entry that doesn't decode.
+#define KMH_WINDOW_VIEW_WORK 4
+
+static inline uint32_t kmh_window_view_collect(const kmh_window_view_t *v, uint64_t now, uint32_t *work) {
+    uint32_t n = v->nbuckets, k = v->k, h = (uint32_t)(v->head % n);
+    if (v->nentries != 2 * n + 1) return UINT32_MAX;
+    uint64_t end = now / v->bucket_width > v->head ? now / v->bucket_width : v->head;
+    if (end - v->head >= n) return 0; // Every stored bucket has expired
+
+    // The window starts at epoch first; the head's block at head - h
+    uint64_t first = end + 1 >= n ? end + 1 - n : 0, block = v->head - h;
+    uint32_t from = 0, suffix = 0; // buckets from..h of the head's block; suffix[suffix] if > 0
+    if (first >= block) {
+        from = (uint32_t)(first - block);
+    } else {
+        suffix = (uint32_t)(first + n - block);
+    }
+
+    // Entries are decoded in blob order; every third one first merges the
+    // two before it into a running result, so the common three-entry
+    // window is a single merge
+    kvalue_minhash_t in[3];
+    const kvalue_minhash_t *inputs[3] = { &in[0], &in[1], &in[2] };
+    for (uint32_t i = 0; i < 3; i++) {
+        in[i] = (kvalue_minhash_t){ k, 0, v->space_size, v->seed, work + (i + 1) * (size_t)k, 0, 0 };
+    }
+    uint32_t pos = KMH_WINDOW_HEADER_SIZE, nin = 0;
+    for (uint32_t e = 0; e < v->nentries; e++) {
+        int wanted = e < n ? (e >= (from > 0 ? from : h) && e <= h)
+                           : (suffix > 0 && e == n + suffix) || (e == 2 * n && from == 0 && h > 0);
+        if (wanted) {
+            if (nin == 3) {
+                uint32_t m = kmh_merge_many_hashes(inputs, 3, k, work);
+                memcpy(in[0].hashes, work + k - m, m * sizeof(uint32_t));
+                in[0].count = m;
+                nin = 1;
+            }
+            if (!kmh_window_view_decode(v, pos, &in[nin++])) return UINT32_MAX;
+        }
+        pos += 8 + kmh_load_le32(v->buf + pos + 4);
+    }
+    return kmh_merge_many_hashes(inputs, nin, k, work);
+}
+
+// Distinct count of the window ending at now, as kmh_window_cardinality;
+// -1.0 where kmh_window_view_collect fails
+static inline double kmh_window_view_cardinality(const kmh_window_view_t *v, uint64_t now, uint32_t *work) {
+    uint32_t k = v->k, m = kmh_window_view_collect(v, now, work);
+    if (m == UINT32_MAX) return -1.0;
+    if (m == 0) return 0.0;
+    if (m < k) return (double)m;
+    return (double)v->space_size * (k - 1) / ((double)work[k - m] + 1);
+}
+
+static inline kmh_window_t* kmh_window_deserialize(const uint8_t *buf, uint32_t buf_size) {
+    kmh_window_view_t v;
+    if (!kmh_window_view_init(&v, buf, buf_size)) return NULL;
+    kmh_window_t *w = kmh_window_init(v.nbuckets, v.bucket_width, v.k, v.space_size, v.seed);
+    if (!w) return NULL;
+    w->head = v.head;
+
+    uint32_t n = v.nbuckets, pos = KMH_WINDOW_HEADER_SIZE;
+    for (uint32_t e = 0; e < v.nentries; e++) {
+        kvalue_minhash_t *dst = e < n ? w->buckets[e] : e < 2 * n ? w->suffix[e - n] : w->prefix;
+        if (!kmh_window_view_decode(&v, pos, dst)) {
+            kmh_window_free(w);
+            return NULL;
+        }
+        pos += 8 + kmh_load_le32(buf + pos + 4);
+    }
+    if (v.nentries == n) kmh_window_rebuild(w); // Version 1: no caches stored
+    return w;
+}
+
+// Row frames: the sketch of a queue of rows that leave in the order they
+// came, like SQLite window frames (OVER (ORDER BY day ROWS 6 PRECEDING)).
+// KMV sketches can't delete, so the queue is two stacks. Rows are pushed
+// onto the back stack, whose merge is kept in back, and popped off the
+// front stack, which stores with every row the merge of it and the front
+// rows behind it; when the front runs dry the back stack is turned over
+// into it, one merge per row. A push, a pop and a query (a single 2-way
+// merge of the front's top and back) thus cost amortized O(k) however many
+// rows the frame holds.
+// A back hash with k distinct smaller ones in its own row or the rows after
+// it can't reach the sketch of any frame holding it, since that frame holds
+// those rows too. Pushing only appends; once the back stack has grown
+// KMH_FRAME_PRUNE_GROWTH-fold it is pruned newest to oldest down to the
+// hashes that still can, which keeps it at O(k log n) hashes for n rows, so
+// an aggregate that never pops stays small.
+#define KMH_FRAME_PRUNE_GROWTH 16
+
+typedef struct {
+    uint64_t rows;   // consecutive rows; the hashes belong to the newest
+    uint32_t count;  // hashes at offset in the stack's arena, descending
+    size_t offset;
+} kmh_frame_run_t;
+
+typedef struct {
+    kmh_frame_run_t *runs; // back stack: oldest first; front stack: oldest last
+    size_t nruns, runs_cap;
+    uint32_t *hashes;
+    size_t used, cap;
+} kmh_frame_stack_t;
+
+typedef struct {
+    kmh_frame_stack_t in;   // back stack: each run's own hashes
+    kmh_frame_stack_t out;  // front stack: each run merged with the newer front runs
+    kvalue_minhash_t *back; // merge of in.runs[0, merged)
+    kmh_builder_t *after;   // kmh_frame_prune(): the k smallest of the runs after the current one
+    size_t merged;
+    size_t prune_at;        // in.used that triggers the next prune
+    uint64_t rows;          // rows in the frame
+    uint32_t *scratch;      // k entries
+} kmh_frame_t;
+
+static inline void kmh_frame_free(kmh_frame_t *f) {
+    if (!f) return;
+    kmh_dealloc(f->in.runs);
+    kmh_dealloc(f->in.hashes);
+    kmh_dealloc(f->out.runs);
+    kmh_dealloc(f->out.hashes);
+    kmh_free(f->back);
+    kmh_builder_free(f->after);
+    kmh_dealloc(f);
+}
+
+static inline kmh_frame_t* kmh_frame_init(uint32_t k, uint32_t space_size, uint32_t seed) {
+    kmh_frame_t *f = kmh_alloc(sizeof(kmh_frame_t) + (size_t)k * sizeof(uint32_t));
+    if (!f) return NULL;
+    memset(f, 0, sizeof(kmh_frame_t));
+    f->scratch = (uint32_t *)(f + 1);
+    f->prune_at = KMH_FRAME_PRUNE_GROWTH * (size_t)k;
+    if (!(f->back = kmh_init(k, space_size, seed)) || !(f->after = kmh_builder_init(k, space_size, seed))) {
+        kmh_frame_free(f);
+        return NULL;
+    }
+    return f;
+}
+
+// Room for runs more runs and n more hashes on s
+static inline int kmh_frame_grow(kmh_frame_stack_t *s, size_t runs, size_t n) {
+    if (s->nruns + runs > s->runs_cap) {
+        size_t cap = s->runs_cap ? 2 * s->runs_cap : 16;
+        while (cap < s->nruns + runs) cap *= 2;
+        kmh_frame_run_t *runs = kmh_alloc(cap * sizeof(kmh_frame_run_t));
+        if (!runs) return 0;
+        if (s->nruns) memcpy(runs, s->runs, s->nruns * sizeof(kmh_frame_run_t));
+        kmh_dealloc(s->runs);
+        s->runs = runs;
+        s->runs_cap = cap;
+    }
+    if (s->used + n > s->cap) {
+        size_t cap = s->cap ? 2 * s->cap : 64;
+        while (cap < s->used + n) cap *= 2;
+        uint32_t *hashes = kmh_alloc(cap * sizeof(uint32_t));
+        if (!hashes) return 0;
+        if (s->used) memcpy(hashes, s->hashes, s->used * sizeof(uint32_t));
+        kmh_dealloc(s->hashes);
+        s->hashes = hashes;
+        s->cap = cap;
+    }
+    return 1;
+}
+
+static inline int kmh_frame_reserve(kmh_frame_stack_t *s, size_t runs, size_t n) {
+    return (s->nruns + runs <= s->runs_cap && s->used + n <= s->cap) || kmh_frame_grow(s, runs, n);
+}
+
+// Drops the back hashes no frame can use any more and folds runs left
+// without hashes into the run after them; back ends up as the merge of the
+// whole back stack. Walking the runs newest first, a run keeps the hashes
+// that get into the k smallest of it and the runs after it; taking each
+// run's hashes smallest first, those are exactly the ones the builder
+// accepts. The same pass packs what stays against the end of both arrays
+// (never past what it has still to read), so only the survivors move to
+// the front afterwards.
+static inline void kmh_frame_prune(kmh_frame_t *f) {
+    kmh_frame_stack_t *s = &f->in;
+    kmh_builder_t *after = f->after;
+    kmh_builder_reset(after);
+    KMH_LOCAL_STATS(local);
+    size_t w = s->nruns, at = s->used;
+    for (size_t r = s->nruns; r-- > 0;) {
+        kmh_frame_run_t run = s->runs[r];
+        const uint32_t *h = s->hashes + run.offset;
+        uint32_t kept = 0;
+        for (uint32_t i = run.count; i-- > 0;) {
+            if (after->count == after->k && h[i] >= after->heap[0]) break; // so are the rest
+            if (!kmh_builder_insert_hash_counted(after, h[i], &local)) continue;
+            s->hashes[--at] = h[i];
+            kept++;
+        }
+        if (kept == 0 && w < s->nruns) {
+            s->runs[w].rows += run.rows;
+            continue;
+        }
+        s->runs[--w] = (kmh_frame_run_t){ run.rows, kept, at };
+    }
+    KMH_LOCAL_FLUSH(local);
+
+    size_t nruns = s->nruns - w, used = s->used - at;
+    for (size_t r = 0; r < nruns; r++) {
+        s->runs[r] = s->runs[w + r];
+        s->runs[r].offset -= at;
+    }
+    if (used) memmove(s->hashes, s->hashes + at, used * sizeof(uint32_t));
+    s->nruns = nruns;
+    s->used = used;
+    f->back->count = kmh_builder_sorted(after, f->back->hashes);
+    f->merged = nruns;
+    f->prune_at = KMH_FRAME_PRUNE_GROWTH * (used + after->k);
+}
+
+// Pushes a row: its reduced hashes, descending (only the k smallest are
+// kept; n may be 0). Returns 0 if out of memory.
+static inline int kmh_frame_push_hashes(kmh_frame_t *f, const uint32_t *hashes, uint32_t n) {
+    kmh_frame_stack_t *s = &f->in;
+    uint32_t k = f->back->k;
+    if (n > k) {
+        hashes += n - k;
+        n = k;
+    }
+
+    if (s->nruns && s->runs[s->nruns - 1].count == 0) {
+        // Rows without hashes share the run of the next row that has some
+        kmh_frame_run_t *last = &s->runs[s->nruns - 1];
+        if (n > 0) {
+            if (!kmh_frame_reserve(s, 1, n)) return 0;
+            last = &s->runs[s->nruns - 1];
+            last->count = n;
+            last->offset = s->used;
+            if (f->merged == s->nruns) f->merged--;
+        }
+        last->rows++;
+    } else {
+        if (!kmh_frame_reserve(s, 1, n)) return 0;
+        s->runs[s->nruns++] = (kmh_frame_run_t){ 1, n, s->used };
+    }
+    if (n == 1) {
+        s->hashes[s->used] = hashes[0];
+    } else if (n) {
+        memcpy(s->hashes + s->used, hashes, n * sizeof(uint32_t));
+    }
+    s->used += n;
+    f->rows++;
+
+    if (s->used >= f->prune_at) kmh_frame_prune(f);
+    return 1;
+}
+
+// Pushes n rows of at most one hash each, KMH_SET_EMPTY for a row without
+// one: the same as kmh_frame_push_hashes row by row, with a single reserve
+// and prune check for the lot. Returns 0 if out of memory.
+static inline int kmh_frame_push_rows(kmh_frame_t *f, const uint32_t *hashes, uint32_t n) {
+    kmh_frame_stack_t *s = &f->in;
+    if (!kmh_frame_reserve(s, n, n)) return 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t hash = hashes[i], has = hash != KMH_SET_EMPTY;
+        kmh_frame_run_t *last = s->nruns ? &s->runs[s->nruns - 1] : NULL;
+        if (last && last->count == 0) {
+            if (has) {
+                last->count = 1;
+                last->offset = s->used;
+                if (f->merged == s->nruns) f->merged--;
+            }
+            last->rows++;
+        } else {
+            s->runs[s->nruns++] = (kmh_frame_run_t){ 1, has, s->used };
+        }
+        s->hashes[s->used] = hash;
+        s->used += has;
+    }
+    f->rows += n;
+
+    if (s->used >= f->prune_at) kmh_frame_prune(f);
+    return 1;
+}
+
+static inline int kmh_frame_push_hash(kmh_frame_t *f, uint32_t hash) {
+    return kmh_frame_push_hashes(f, &hash, 1);
+}
+
+static inline int kmh_frame_push(kmh_frame_t *f, uint32_t value) {
+    const kvalue_minhash_t *b = f->back;
+    return kmh_frame_push_hash(f, kmh_reduce(xxh32_hash(value, b->seed), b->space_size, b->reduce_mode,
+                                             b->reduce_m));
+}
+
+// Turns the back stack over onto the empty front stack, newest row first,
+// so each front run holds the merge of itself and the rows after it. A row
+// that doesn't change that merge joins the newer run. Returns 0 (with the
+// frame unchanged) if out of memory.
+static inline int kmh_frame_turn(kmh_frame_t *f) {
+    kmh_frame_stack_t *in = &f->in, *out = &f->out;
+    uint32_t k = f->back->k;
+    out->nruns = out->used = 0;
+    for (size_t r = in->nruns; r-- > 0;) {
+        const kmh_frame_run_t *run = &in->runs[r];
+        if (!kmh_frame_reserve(out, 1, k)) {
+            out->nruns = out->used = 0;
+            return 0;
+        }
+        kmh_frame_run_t *newer = out->nruns ? &out->runs[out->nruns - 1] : NULL;
+        const uint32_t *h = in->hashes + run->offset;
+        uint32_t m = run->count;
+        if (newer) {
+            if (run->count == 0) {
+                newer->rows += run->rows;
+                continue;
+            }
+            m = kmh_merge2_select()(h, run->count, out->hashes + newer->offset, newer->count, k, f->scratch);
+            h = f->scratch + k - m;
+            if (m == newer->count && memcmp(h, out->hashes + newer->offset, m * sizeof(uint32_t)) == 0) {
+                newer->rows += run->rows;
+                continue;
+            }
+        }
+        if (m) memcpy(out->hashes + out->used, h, m * sizeof(uint32_t));
+        out->runs[out->nruns++] = (kmh_frame_run_t){ run->rows, m, out->used };
+        out->used += m;
+    }
+    in->nruns = in->used = 0;
+    f->back->count = 0;
+    f->merged = 0;
+    f->prune_at = KMH_FRAME_PRUNE_GROWTH * (size_t)k;
+    return 1;
+}
+
+// Drops the oldest row (if any); 0 if out of memory
+static inline int kmh_frame_pop(kmh_frame_t *f) {
+    kmh_frame_stack_t *out = &f->out;
+    if (f->rows == 0) return 1;
+    if (out->nruns == 0 && !kmh_frame_turn(f)) return 0;
+
+    kmh_frame_run_t *oldest = &out->runs[out->nruns - 1];
+    if (--oldest->rows == 0) {
+        out->used = oldest->offset;
+        out->nruns--;
+    }
+    f->rows--;
+    return 1;
+}
+
+// Hashes of the frame into the back of scratch; returns how many
+static inline uint32_t kmh_frame_collect(kmh_frame_t *f) {
+    const kmh_frame_stack_t *in = &f->in, *out = &f->out;
+    kvalue_minhash_t *back = f->back;
+    uint32_t k = back->k;
+    // Bring back up to date with the rows pushed since the last query
+    for (; f->merged < in->nruns; f->merged++) {
+        const kmh_frame_run_t *run = &in->runs[f->merged];
+        const uint32_t *h = in->hashes + run->offset;
+        if (run->count <= 1) {
+            if (run->count) kmh_insert_hash(back, h[0]);
+            continue;
+        }
+        uint32_t m = kmh_merge2_select()(back->hashes, back->count, h, run->count, k, f->scratch);
+        memcpy(back->hashes, f->scratch + k - m, m * sizeof(uint32_t));
+        back->count = m;
+    }
+
+    if (out->nruns == 0) {
+        memcpy(f->scratch + k - back->count, back->hashes, back->count * sizeof(uint32_t));
+        return back->count;
+    }
+    const kmh_frame_run_t *oldest = &out->runs[out->nruns - 1];
+    return kmh_merge2_select()(out->hashes + oldest->offset, oldest->count, back->hashes, back->count, k,
+                               f->scratch);
+}
+
+// Sketch of the frame (a new sketch, NULL if out of memory)
+static inline kvalue_minhash_t* kmh_frame_sketch(kmh_frame_t *f) {
+    const kvalue_minhash_t *b = f->back;
+    kvalue_minhash_t *kmh = kmh_init(b->k, b->space_size, b->seed);
+    if (!kmh) return NULL;
+    uint32_t m = kmh_frame_collect(f);
+    memcpy(kmh->hashes, f->scratch + kmh->k - m, m * sizeof(uint32_t));
+    kmh->count = m;
+    return kmh;
+}
+
+// Distinct count of the frame, without building a sketch
+static inline double kmh_frame_cardinality(kmh_frame_t *f) {
+    uint32_t k = f->back->k, m = kmh_frame_collect(f);
+    if (m == 0) return 0.0;
+    if (m < k) return (double)m;
+    return (double)f->back->space_size * (k - 1) / (f->scratch[0] + 1);
+}
+
+// 64-bit sketch: same API as kvalue_minhash_t with an xxh3-based hash, for
+// cardinalities where collisions in the 32-bit space start to bias the
+// estimate low.
+#define XXH_PRIME_MX2 0x9FB21C651E98DF25ULL
+// XXH3 default secret, bytes 8..15 and 16..23
+#define XXH3_SECRET_8  0x1CAD21F72C81017CULL
+#define XXH3_SECRET_16 0xDB979083E96DD4DEULL
+
+// XXH3_64bits_withSeed() of the 8 little-endian bytes of input (4..8 byte path)
+static inline uint64_t xxh3_hash64(uint64_t input, uint64_t seed) {
+    seed ^= (uint64_t)__builtin_bswap32((uint32_t)seed) << 32;
+    uint64_t bitflip = (XXH3_SECRET_8 ^ XXH3_SECRET_16) - seed;
+    uint64_t input64 = (input >> 32) + (input << 32);
+    uint64_t h64 = input64 ^ bitflip;
+    h64 ^= xxh64_rotl(h64, 49) ^ xxh64_rotl(h64, 24);
+    h64 *= XXH_PRIME_MX2;
+    h64 ^= (h64 >> 35) + 8;
+    h64 *= XXH_PRIME_MX2;
+    return h64 ^ (h64 >> 28);
+}
+
+typedef struct {
+    uint32_t k;           // Max capacity
+    uint32_t count;       // Current count
+    uint64_t space_size;  // Hash space modulo
+    uint64_t seed;        // Hash seed
+    uint64_t *hashes;     // Sorted descending
+    uint32_t reduce_mode; // KMH_REDUCE_* (MOD falls back to %)
+} kvalue_minhash64_t;
+
+static inline int kmh64_reduce_mode(uint64_t space_size) {
+    if (space_size == UINT64_MAX) return KMH_REDUCE_FULL;
+    if (space_size != 0 && (space_size & (space_size - 1)) == 0) return KMH_REDUCE_POW2;
+    return KMH_REDUCE_MOD;
+}
+
+static inline uint64_t kmh64_reduce(uint64_t hash, uint64_t space_size, int mode) {
+    switch (mode) {
+    case KMH_REDUCE_FULL: return hash + (hash == UINT64_MAX); // UINT64_MAX wraps to 0
+    case KMH_REDUCE_POW2: return hash & (space_size - 1);
+    default:              return hash % space_size;
+    }
+}
+
+static inline kvalue_minhash64_t* kmh64_init(uint32_t k, uint64_t space_size, uint64_t seed) {
+    kvalue_minhash64_t *kmh = kmh_alloc(sizeof(kvalue_minhash64_t) + (size_t)k * sizeof(uint64_t));
+    if (!kmh) return NULL;
+
+    kmh->k = k;
+    kmh->count = 0;
+    kmh->space_size = space_size;
+    kmh->seed = seed;
+    kmh->hashes = (uint64_t*)(kmh + 1);
+    kmh->reduce_mode = kmh64_reduce_mode(space_size);
+    return kmh;
+}
+
+static inline void kmh64_free(kvalue_minhash64_t *kmh) {
+    kmh_dealloc(kmh);
+}
+
+static inline uint32_t kmh64_search(const uint64_t *hashes, uint32_t n, uint64_t hash) {
+    if (n == 0) return 0;
+    const uint64_t *base = hashes;
+    while (n > 1) {
+        uint32_t half = n >> 1;
+        base = (base[half - 1] > hash) ? base + half : base;
+        n -= half;
+    }
+    return (uint32_t)(base - hashes) + (*base > hash);
+}
+
+static inline void kmh64_insert_hash_counted(kvalue_minhash64_t *kmh, uint64_t hash, kmh_stats_local_t *stats) {
+    KMH_LOCAL_COUNT(stats, KMH_STAT_ADDS, 1);
+    if (kmh->count == kmh->k && hash >= kmh->hashes[0]) {
+        return;
+    }
+
+    uint32_t pos = kmh64_search(kmh->hashes, kmh->count, hash);
+    if (pos < kmh->count && kmh->hashes[pos] == hash) {
+        KMH_LOCAL_COUNT(stats, KMH_STAT_DUPLICATES, 1);
+        return; // Duplicate
+    }
+
+    if (kmh->count < kmh->k) {
+        KMH_LOCAL_COUNT(stats, KMH_STAT_INSERTS, 1);
+        KMH_LOCAL_COUNT(stats, KMH_STAT_MEMMOVE_BYTES, (kmh->count - pos) * sizeof(uint64_t));
+        memmove(&kmh->hashes[pos + 1], &kmh->hashes[pos], (kmh->count - pos) * sizeof(uint64_t));
+        kmh->hashes[pos] = hash;
+        kmh->count++;
+        return;
+    }
+
+    KMH_LOCAL_COUNT(stats, KMH_STAT_INSERTS, 1);
+    KMH_LOCAL_COUNT(stats, KMH_STAT_MEMMOVE_BYTES, (pos - 1) * sizeof(uint64_t));
+    memmove(&kmh->hashes[0], &kmh->hashes[1], (pos - 1) * sizeof(uint64_t));
+    kmh->hashes[pos - 1] = hash;
+}
+
+static inline void kmh64_insert_hash(kvalue_minhash64_t *kmh, uint64_t hash) {
+#ifdef KMH_STATS
+    if (kmh->count == kmh->k && hash >= kmh->hashes[0]) {
+        KMH_COUNT_ADDS(1);
+        return;
+    }
+#endif
+    KMH_LOCAL_STATS(local);
+    kmh64_insert_hash_counted(kmh, hash, &local);
+    KMH_LOCAL_FLUSH(local);
+}
+
+static inline void kmh64_add(kvalue_minhash64_t *kmh, uint64_t value) {
+    kmh64_insert_hash(kmh, kmh64_reduce(xxh3_hash64(value, kmh->seed), kmh->space_size, kmh->reduce_mode));
+}
+
+// Add an arbitrary byte string (hashed with XXH64 using the sketch seed)
+static inline void kmh64_add_bytes(kvalue_minhash64_t *kmh, const void *data, size_t len) {
+    kmh64_insert_hash(kmh, kmh64_reduce(xxh64_bytes(data, len, kmh->seed), kmh->space_size, kmh->reduce_mode));
+}
+
+static inline double kmh64_cardinality(const kvalue_minhash64_t *kmh) {
+    if (kmh->count == 0) return 0.0;
+    if (kmh->count < kmh->k) {
+        return (double)kmh->count;
+    }
+    return (double)kmh->space_size * (kmh->k - 1) / ((double)kmh->hashes[0] + 1.0);
+}
+
+static inline uint64_t kmh64_setop_load(const void *hashes, uint32_t i) {
+    uint64_t v;
+    memcpy(&v, (const uint8_t *)hashes + (size_t)i * sizeof(uint64_t), sizeof(v));
+    return v;
+}
+
+static inline int kmh64_setop(const kvalue_minhash64_t *a, const kvalue_minhash64_t *b, kmh_setop_t *s) {
+    if (a->k != b->k || a->space_size != b->space_size || a->seed != b->seed) return 0;
+    *s = kmh_setop_walk(a->hashes, a->count, b->hashes, b->count, a->k, kmh64_setop_load);
+    return 1;
+}
+
+static inline double kmh64_union_cardinality(const kvalue_minhash64_t *a, const kvalue_minhash64_t *b) {
+    kmh_setop_t s;
+    return kmh64_setop(a, b, &s) ? kmh_setop_union(&s, a->k, (double)a->space_size) : -1.0;
+}
+
+static inline double kmh64_intersection_cardinality(const kvalue_minhash64_t *a, const kvalue_minhash64_t *b) {
+    kmh_setop_t s;
+    return kmh64_setop(a, b, &s) ? kmh_setop_share(&s, a->k, (double)a->space_size, s.both) : -1.0;
+}
+
+static inline double kmh64_difference_cardinality(const kvalue_minhash64_t *a, const kvalue_minhash64_t *b) {
+    kmh_setop_t s;
+    return kmh64_setop(a, b, &s) ? kmh_setop_share(&s, a->k, (double)a->space_size, s.only_a) : -1.0;
+}
+
+static inline double kmh64_containment(const kvalue_minhash64_t *a, const kvalue_minhash64_t *b) {
+    kmh_setop_t s;
+    return kmh64_setop(a, b, &s) ? kmh_setop_containment(&s) : -1.0;
+}
+
+static inline kvalue_minhash64_t* kmh64_merge(const kvalue_minhash64_t *a, const kvalue_minhash64_t *b) {
+    if (a->k != b->k || a->space_size != b->space_size || a->seed != b->seed) return NULL;
+
+    kvalue_minhash64_t *result = kmh64_init(a->k, a->space_size, a->seed);
+    if (!result) return NULL;
+
+    // Smallest values first, then reverse
+    int i = a->count - 1;
+    int j = b->count - 1;
+
+    while (result->count < result->k && (i >= 0 || j >= 0)) {
+        uint64_t hash;
+
+        if (i < 0) {
+            hash = b->hashes[j--];
+        } else if (j < 0) {
+            hash = a->hashes[i--];
+        } else if (a->hashes[i] < b->hashes[j]) {
+            hash = a->hashes[i--];
+        } else if (a->hashes[i] > b->hashes[j]) {
+            hash = b->hashes[j--];
+        } else {
+            hash = a->hashes[i--];
+            j--;
+        }
+
+        result->hashes[result->count++] = hash;
+    }
+
+    for (uint32_t idx = 0; idx < result->count / 2; idx++) {
+        uint64_t temp = result->hashes[idx];
+        result->hashes[idx] = result->hashes[result->count - 1 - idx];
+        result->hashes[result->count - 1 - idx] = temp;
+    }
+
+    return result;
+}
+
+static inline double kmh64_distance(const kvalue_minhash64_t *a, const kvalue_minhash64_t *b) {
+    if (a->k != b->k || a->space_size != b->space_size || a->seed != b->seed) return -1.0;
+
+    uint32_t matches = 0;
+    uint32_t i = 0, j = 0;
+    uint32_t compared = 0;
+
+    while (i < a->count && j < b->count && compared < a->k) {
+        if (a->hashes[i] == b->hashes[j]) {
+            matches++;
+            i++; j++;
+        } else if (a->hashes[i] > b->hashes[j]) {
+            i++;
+        } else {
+            j++;
+        }
+        compared++;
+    }
+
+    return compared > 0 ? 1.0 - (double)matches / compared : 1.0;
+}
+
+// Serialize into the portable format (width 8); the buffer comes from
+// kmh_get_buffer and is released with kmh_free_buffer
+static inline uint32_t kmh64_serialized_size(const kvalue_minhash64_t *kmh) {
+    return KMH_BLOB_HEADER_SIZE + kmh->count * sizeof(uint64_t);
+}
+
+// Returns the bytes written, 0 if buf_size < kmh64_serialized_size
+static inline uint32_t kmh64_serialize_into(const kvalue_minhash64_t *kmh, uint8_t *buf, uint32_t buf_size) {
+    uint32_t total_size = kmh64_serialized_size(kmh);
+    if (buf_size < total_size) return 0;
+
+    kmh_blob_write_header(buf, sizeof(uint64_t), kmh->k, kmh->count, kmh->space_size, kmh->seed);
+    uint8_t *p = buf + KMH_BLOB_HEADER_SIZE;
+    for (uint32_t i = 0; i < kmh->count; i++) {
+        kmh_store_le64(p + i * sizeof(uint64_t), kmh->hashes[i]);
+    }
+    return total_size;
+}
+
+static inline uint32_t kmh64_serialize(const kvalue_minhash64_t *kmh, uint8_t **out_buf) {
+    uint32_t total_size = kmh64_serialized_size(kmh);
     uint8_t *buf = kmh_get_buffer(total_size);
     if (!buf) return 0;
-    
-    // Copy the struct directly
-    memcpy(buf, kmh, struct_size);
-    
-    // Fix the hashes pointer in the copied struct to point to the buffer location
-    kvalue_minhash_t *copied_kmh = (kvalue_minhash_t*)buf;
-    copied_kmh->hashes = (uint32_t*)(buf + struct_size);
-    
-    // Copy the hash array
-    if (kmh->count > 0) {
-        memcpy(buf + struct_size, kmh->hashes, hash_size);
+
+    *out_buf = buf;
+    return kmh64_serialize_into(kmh, buf, total_size);
+}
+
+static inline kvalue_minhash64_t* kmh64_deserialize(const uint8_t *buf, uint32_t buf_size) {
+    KMH_COUNT(KMH_STAT_DESERIALIZES, 1);
+    kmh64_view_t view;
+    if (!kmh64_view_init(&view, buf, buf_size)) return NULL;
+
+    kvalue_minhash64_t *kmh = kmh64_init(view.k, view.space_size, view.seed);
+    if (!kmh) return NULL;
+
+    kmh->count = view.count;
+    for (uint32_t i = 0; i < view.count; i++) {
+        kmh->hashes[i] = kmh64_view_hash(&view, i);
+    }
+    return kmh;
+}
+
+static inline double kmh64_cardinality_from_serialized(const uint8_t *buf, uint32_t buf_size) {
+    kmh64_view_t view;
+    if (!kmh64_view_init(&view, buf, buf_size)) return -1.0;
+    return kmh64_view_cardinality(&view);
+}
+
+// Same as kmh_merge, reading both inputs in place
+static inline kvalue_minhash_t* kmh_view_merge(const kmh_view_t *a, const kmh_view_t *b) {
+    if (a->k != b->k || a->space_size != b->space_size || a->seed != b->seed) return NULL;
+
+    kvalue_minhash_t *result = kmh_init(a->k, a->space_size, a->seed);
+    if (!result) return NULL;
+
+    int i = a->count - 1;
+    int j = b->count - 1;
+
+    while (result->count < result->k && (i >= 0 || j >= 0)) {
+        uint32_t hash;
+
+        if (i < 0) {
+            hash = kmh_view_hash(b, j--);
+        } else if (j < 0) {
+            hash = kmh_view_hash(a, i--);
+        } else {
+            uint32_t ha = kmh_view_hash(a, i);
+            uint32_t hb = kmh_view_hash(b, j);
+            hash = ha < hb ? ha : hb;
+            i -= ha <= hb;
+            j -= hb <= ha;
+        }
+
+        result->hashes[result->count++] = hash;
     }
-    
-    *out_buf = buf;
-    return total_size;
+
+    // Reverse the result array to maintain descending order
+    for (uint32_t idx = 0; idx < result->count / 2; idx++) {
+        uint32_t temp = result->hashes[idx];
+        result->hashes[idx] = result->hashes[result->count - 1 - idx];
+        result->hashes[result->count - 1 - idx] = temp;
+    }
+
+    return result;
 }
 
+static inline kvalue_minhash64_t* kmh64_view_merge(const kmh64_view_t *a, const kmh64_view_t *b) {
+    if (a->k != b->k || a->space_size != b->space_size || a->seed != b->seed) return NULL;
 
-// Serialize (thread-safe optimized format)
-static inline uint32_t kmh_serialize_old(const kvalue_minhash_t *kmh, uint8_t **out_buf) {
-    // Calculate size needed
-    uint32_t header_size = 4 * sizeof(uint32_t); // k, count, space_size, seed
-    uint32_t data_size = 0;
-    
-    if (kmh->count > 0) {
-        data_size = kmh->count * 4; // 4 bytes per hash
+    kvalue_minhash64_t *result = kmh64_init(a->k, a->space_size, a->seed);
+    if (!result) return NULL;
+
+    int i = a->count - 1;
+    int j = b->count - 1;
+
+    while (result->count < result->k && (i >= 0 || j >= 0)) {
+        uint64_t hash;
+
+        if (i < 0) {
+            hash = kmh64_view_hash(b, j--);
+        } else if (j < 0) {
+            hash = kmh64_view_hash(a, i--);
+        } else {
+            uint64_t ha = kmh64_view_hash(a, i);
+            uint64_t hb = kmh64_view_hash(b, j);
+            hash = ha < hb ? ha : hb;
+            i -= ha <= hb;
+            j -= hb <= ha;
+        }
+
+        result->hashes[result->count++] = hash;
     }
-    
-    uint32_t total_size = header_size + data_size;
-    
-    uint8_t *buf = kmh_get_buffer(total_size);
-    if (!buf) return 0;
-    
-    uint32_t pos = 0;
-    
-    // Header
-    memcpy(buf + pos, &kmh->k, sizeof(uint32_t)); pos += sizeof(uint32_t);
-    memcpy(buf + pos, &kmh->count, sizeof(uint32_t)); pos += sizeof(uint32_t);
-    memcpy(buf + pos, &kmh->space_size, sizeof(uint32_t)); pos += sizeof(uint32_t);
-    memcpy(buf + pos, &kmh->seed, sizeof(uint32_t)); pos += sizeof(uint32_t);
-    
-    if (kmh->count > 0) {
-        for (int32_t i = 0; i < kmh->count; i++) {
-            pos += int32_encode_direct(kmh->hashes[i], buf + pos);
+
+    for (uint32_t idx = 0; idx < result->count / 2; idx++) {
+        uint64_t temp = result->hashes[idx];
+        result->hashes[idx] = result->hashes[result->count - 1 - idx];
+        result->hashes[result->count - 1 - idx] = temp;
+    }
+
+    return result;
+}
+
+// Accumulating merges for aggregates: the k smallest of dst and src are
+// built from the back of scratch (dst->k entries, owned by the caller, e.g.
+// an aggregate context) and copied over dst->hashes, so nothing is
+// allocated. Returns 0 if the sketches aren't comparable.
+static inline int kmh_merge_into(kvalue_minhash_t *dst, const kmh_view_t *src, uint32_t *scratch) {
+    if (dst->k != src->k || dst->space_size != src->space_size || dst->seed != src->seed) return 0;
+
+    // Nothing in src is below dst's k-th smallest
+    if (src->count == 0 ||
+        (dst->count == dst->k && kmh_view_hash(src, src->count - 1) >= dst->hashes[0])) {
+        return 1;
+    }
+
+    int i = dst->count - 1;
+    int j = src->count - 1;
+    uint32_t out = dst->k;
+
+    while (out > 0 && (i >= 0 || j >= 0)) {
+        uint32_t hash;
+
+        if (i < 0) {
+            hash = kmh_view_hash(src, j--);
+        } else if (j < 0) {
+            hash = dst->hashes[i--];
+        } else {
+            uint32_t ha = dst->hashes[i];
+            uint32_t hb = kmh_view_hash(src, j);
+            hash = ha < hb ? ha : hb;
+            i -= ha <= hb;
+            j -= hb <= ha;
         }
+
+        scratch[--out] = hash;
     }
-    
-    *out_buf = buf;
-    return pos;
+
+    dst->count = dst->k - out;
+    memcpy(dst->hashes, scratch + out, dst->count * sizeof(uint32_t));
+    return 1;
 }
 
-// Fast deserialize - direct struct read
-static inline kvalue_minhash_t* kmh_deserialize(const uint8_t *buf, uint32_t buf_size) {
-    if (buf_size < sizeof(kvalue_minhash_t)) return NULL;
-    
-    const kvalue_minhash_t *serialized_kmh = (const kvalue_minhash_t*)buf;
-    
-    // Validate the data makes sense
-    if (serialized_kmh->count > serialized_kmh->k || 
-        serialized_kmh->k > MAX_K * 10 || // Reasonable upper bound
-        buf_size < sizeof(kvalue_minhash_t) + serialized_kmh->count * sizeof(uint32_t)) {
+static inline int kmh64_merge_into(kvalue_minhash64_t *dst, const kmh64_view_t *src, uint64_t *scratch) {
+    if (dst->k != src->k || dst->space_size != src->space_size || dst->seed != src->seed) return 0;
+
+    if (src->count == 0 ||
+        (dst->count == dst->k && kmh64_view_hash(src, src->count - 1) >= dst->hashes[0])) {
+        return 1;
+    }
+
+    int i = dst->count - 1;
+    int j = src->count - 1;
+    uint32_t out = dst->k;
+
+    while (out > 0 && (i >= 0 || j >= 0)) {
+        uint64_t hash;
+
+        if (i < 0) {
+            hash = kmh64_view_hash(src, j--);
+        } else if (j < 0) {
+            hash = dst->hashes[i--];
+        } else {
+            uint64_t ha = dst->hashes[i];
+            uint64_t hb = kmh64_view_hash(src, j);
+            hash = ha < hb ? ha : hb;
+            i -= ha <= hb;
+            j -= hb <= ha;
+        }
+
+        scratch[--out] = hash;
+    }
+
+    dst->count = dst->k - out;
+    memcpy(dst->hashes, scratch + out, dst->count * sizeof(uint64_t));
+    return 1;
+}
+
+// Same as kmh_distance, reading both inputs in place
+static inline double kmh_view_distance(const kmh_view_t *a, const kmh_view_t *b) {
+    if (a->k != b->k || a->space_size != b->space_size || a->seed != b->seed) return -1.0;
+
+#ifdef KMH_BIG_ENDIAN
+    uint32_t matches = 0;
+    uint32_t i = 0, j = 0;
+    uint32_t compared = 0;
+
+    while (i < a->count && j < b->count && compared < a->k) {
+        uint32_t ha = kmh_view_hash(a, i);
+        uint32_t hb = kmh_view_hash(b, j);
+        matches += ha == hb;
+        i += ha >= hb;
+        j += hb >= ha;
+        compared++;
+    }
+#else
+    // Little-endian blobs are native arrays; the kernels handle misalignment
+    kmh_overlap_t r = kmh_overlap_select()(a->hashes, a->count, b->hashes, b->count, a->k);
+    uint32_t matches = r.matches, compared = r.compared;
+#endif
+
+    return compared > 0 ? 1.0 - (double)matches / compared : 1.0;
+}
+
+static inline double kmh64_view_distance(const kmh64_view_t *a, const kmh64_view_t *b) {
+    if (a->k != b->k || a->space_size != b->space_size || a->seed != b->seed) return -1.0;
+
+    uint32_t matches = 0;
+    uint32_t i = 0, j = 0;
+    uint32_t compared = 0;
+
+    while (i < a->count && j < b->count && compared < a->k) {
+        uint64_t ha = kmh64_view_hash(a, i);
+        uint64_t hb = kmh64_view_hash(b, j);
+        matches += ha == hb;
+        i += ha >= hb;
+        j += hb >= ha;
+        compared++;
+    }
+
+    return compared > 0 ? 1.0 - (double)matches / compared : 1.0;
+}
+
+// Set-operation estimates read in place from views; the kmh_setop_* helpers
+// turn the walk into |A u B|, |A n B|, |A \ B| or containment
+static inline uint64_t kmh_view_setop_load(const void *hashes, uint32_t i) {
+    return kmh_load_le32((const uint8_t *)hashes + (size_t)i * sizeof(uint32_t));
+}
+
+static inline uint64_t kmh64_view_setop_load(const void *hashes, uint32_t i) {
+    return kmh_load_le64((const uint8_t *)hashes + (size_t)i * sizeof(uint64_t));
+}
+
+static inline int kmh_view_setop(const kmh_view_t *a, const kmh_view_t *b, kmh_setop_t *s) {
+    if (a->k != b->k || a->space_size != b->space_size || a->seed != b->seed) return 0;
+    *s = kmh_setop_walk(a->hashes, a->count, b->hashes, b->count, a->k, kmh_view_setop_load);
+    return 1;
+}
+
+static inline int kmh64_view_setop(const kmh64_view_t *a, const kmh64_view_t *b, kmh_setop_t *s) {
+    if (a->k != b->k || a->space_size != b->space_size || a->seed != b->seed) return 0;
+    *s = kmh_setop_walk(a->hashes, a->count, b->hashes, b->count, a->k, kmh64_view_setop_load);
+    return 1;
+}
+
+#ifdef KMH_HAVE_MMAP
+// Sketch store: a file of serialized sketches keyed by a 64-bit id and read
+// in place from a read-only mapping, so a lookup is a hash probe and the
+// blob goes straight to the kmh_view_* / *_from_serialized readers with no
+// B-tree walk or deserialization. Layout (little-endian):
+//   0  u32 magic "KMHS"   4  u32 version   8  u64 count (live keys)
+//   16 u64 index_offset   24 u64 index_slots (0, or a power of two > count)
+//   32 records: u64 key, u32 blob size, u32 reserved, the blob, zero padding
+//      to 8 bytes (blobs start 8-aligned, and so do their hashes)
+//   index_offset: index_slots x {u64 key, u64 record offset}, linear probing
+//      from kmh_store_slot(key); offset 0 marks an empty slot
+// Writers only append: a commit writes its records, then a fresh index, and
+// only then the header, so readers and crashes see the last committed state.
+// Replaced and deleted records and old indexes stay in the file until
+// kmh_store_compact rewrites it. One writer at a time (flock).
+#define KMH_STORE_MAGIC       0x53484D4BU // "KMHS"
+#define KMH_STORE_VERSION     1
+#define KMH_STORE_HEADER_SIZE 32
+#define KMH_STORE_RECORD_SIZE 16
+#define KMH_STORE_SLOT_SIZE   16
+#define KMH_STORE_MIN_SLOTS   16
+#define KMH_STORE_BUFFER      (1 << 20) // writer append buffer
+
+typedef struct {
+    const uint8_t *map;
+    size_t size;
+    uint64_t count;
+    uint64_t index_offset;
+    uint64_t slots;
+} kmh_store_t;
+
+typedef struct {
+    uint64_t key;
+    uint64_t offset; // 0: empty
+} kmh_store_slot_t;
+
+typedef struct {
+    int fd;
+    uint64_t committed; // file size as of the last commit
+    uint64_t end;       // file offset of buf[0]
+    uint8_t *buf;
+    uint32_t buf_used;
+    kmh_store_slot_t *slots; // live keys in memory, at most half full
+    uint64_t mask;
+    uint64_t count;
+    int failed; // a write failed; only kmh_store_writer_abort is left
+} kmh_store_writer_t;
+
+static inline uint64_t kmh_store_slot(uint64_t key, uint64_t mask) {
+    uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+    return (h ^ (h >> 32)) & mask;
+}
+
+static inline void kmh_store_close(kmh_store_t *store) {
+    if (!store) return;
+    munmap((void *)store->map, store->size);
+    kmh_dealloc(store);
+}
+
+// Maps a committed store read-only; NULL if it can't be opened or the header
+// or index is malformed
+static inline kmh_store_t* kmh_store_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= KMH_STORE_HEADER_SIZE) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd); // the mapping keeps the file open
+    if (map == MAP_FAILED) return NULL;
+
+    const uint8_t *p = map;
+    size_t size = (size_t)st.st_size;
+    uint64_t count = kmh_load_le64(p + 8), index_offset = kmh_load_le64(p + 16), slots = kmh_load_le64(p + 24);
+    int ok = kmh_load_le32(p) == KMH_STORE_MAGIC && kmh_load_le32(p + 4) <= KMH_STORE_VERSION;
+    if (ok && slots == 0) {
+        ok = count == 0;
+    } else if (ok) {
+        ok = (slots & (slots - 1)) == 0 && count < slots && index_offset >= KMH_STORE_HEADER_SIZE &&
+             index_offset % 8 == 0 && index_offset <= size &&
+             slots <= (size - index_offset) / KMH_STORE_SLOT_SIZE;
+    }
+    kmh_store_t *store = ok ? kmh_alloc(sizeof(kmh_store_t)) : NULL;
+    if (!store) {
+        munmap(map, size);
         return NULL;
     }
-    
-    kvalue_minhash_t *kmh = kmh_init(serialized_kmh->k, serialized_kmh->space_size, serialized_kmh->seed);
-    if (!kmh) return NULL;
-    
-    // Copy the metadata
-    kmh->count = serialized_kmh->count;
-    
-    // Copy the hash array
-    if (kmh->count > 0) {
-        const uint32_t *serialized_hashes = (const uint32_t*)(buf + sizeof(kvalue_minhash_t));
-        memcpy(kmh->hashes, serialized_hashes, kmh->count * sizeof(uint32_t));
+    madvise(map, size, MADV_RANDOM);
+    *store = (kmh_store_t){ p, size, count, index_offset, slots };
+    return store;
+}
+
+static inline uint64_t kmh_store_count(const kmh_store_t *store) {
+    return store->count;
+}
+
+// Record offset of key, 0 if absent
+static inline uint64_t kmh_store_find(const kmh_store_t *store, uint64_t key) {
+    const uint8_t *index = store->map + store->index_offset;
+    uint64_t mask = store->slots - 1, s = kmh_store_slot(key, mask);
+    for (uint64_t probes = 0; probes < store->slots; probes++, s = (s + 1) & mask) {
+        uint64_t offset = kmh_load_le64(index + s * KMH_STORE_SLOT_SIZE + 8);
+        if (offset == 0 || kmh_load_le64(index + s * KMH_STORE_SLOT_SIZE) == key) return offset;
     }
-    
-    return kmh;
+    return 0;
 }
 
+// Blob of the record at offset, NULL if the record doesn't lie in the data
+// the index covers or isn't keyed key
+static inline const uint8_t* kmh_store_record(const kmh_store_t *store, uint64_t offset, uint64_t key,
+                                              uint32_t *size) {
+    if (offset < KMH_STORE_HEADER_SIZE || offset > store->index_offset - KMH_STORE_RECORD_SIZE) return NULL;
+    const uint8_t *rec = store->map + offset;
+    uint32_t n = kmh_load_le32(rec + 8);
+    if (kmh_load_le64(rec) != key || n > store->index_offset - offset - KMH_STORE_RECORD_SIZE) return NULL;
+    *size = n;
+    return rec + KMH_STORE_RECORD_SIZE;
+}
 
-// Deserialize
-static inline kvalue_minhash_t* kmh_deserialize_old(const uint8_t *buf, uint32_t buf_size) {
-    if (buf_size < 4 * sizeof(uint32_t)) return NULL;
-    uint32_t pos = 0;
-    uint32_t k, count, space_size, seed;
-    
-    // Header
-    memcpy(&k, buf + pos, sizeof(uint32_t)); pos += sizeof(uint32_t);
-    memcpy(&count, buf + pos, sizeof(uint32_t)); pos += sizeof(uint32_t);
-    memcpy(&space_size, buf + pos, sizeof(uint32_t)); pos += sizeof(uint32_t);
-    memcpy(&seed, buf + pos, sizeof(uint32_t)); pos += sizeof(uint32_t);
+// Serialized sketch of key, pointing into the mapping (valid until
+// kmh_store_close); NULL if the key is absent
+static inline const uint8_t* kmh_store_get(const kmh_store_t *store, uint64_t key, uint32_t *size) {
+    uint64_t offset = store->slots ? kmh_store_find(store, key) : 0;
+    return offset ? kmh_store_record(store, offset, key, size) : NULL;
+}
 
-    kvalue_minhash_t *kmh = kmh_init(k, space_size, seed);
-    if (!kmh) return NULL;
-    
-    kmh->count = count;
-    // Decode delta-encoded hashes
-    if (count > 0) {
-        for (int32_t i = 0; i < count && pos < buf_size; i++) {
-            uint32_t current;
-            pos += int32_decode_direct(buf + pos, &current);
-            kmh->hashes[i] = current;
+// Iterates the live records in index order: start with *pos = 0; NULL at the end
+static inline const uint8_t* kmh_store_next(const kmh_store_t *store, uint64_t *pos, uint64_t *key,
+                                            uint32_t *size) {
+    const uint8_t *index = store->map + store->index_offset;
+    while (*pos < store->slots) {
+        const uint8_t *slot = index + (*pos)++ * KMH_STORE_SLOT_SIZE;
+        uint64_t offset = kmh_load_le64(slot + 8);
+        if (!offset) continue;
+        *key = kmh_load_le64(slot);
+        const uint8_t *blob = kmh_store_record(store, offset, *key, size);
+        if (blob) return blob;
+    }
+    return NULL;
+}
+
+// View of a 32-bit raw sketch; 0 if the key is absent or the blob has no view
+static inline int kmh_store_view(const kmh_store_t *store, uint64_t key, kmh_view_t *v) {
+    uint32_t size;
+    const uint8_t *blob = kmh_store_get(store, key, &size);
+    return blob && kmh_view_init(v, blob, size);
+}
+
+// Cardinality of a stored 32-bit sketch of any encoding; -1 if absent
+static inline double kmh_store_cardinality(const kmh_store_t *store, uint64_t key) {
+    uint32_t size;
+    const uint8_t *blob = kmh_store_get(store, key, &size);
+    return blob ? kmh_cardinality_from_serialized(blob, size) : -1.0;
+}
+
+// Distance between two stored 32-bit raw sketches; -1 if either is absent
+// or they are incompatible
+static inline double kmh_store_distance(const kmh_store_t *store, uint64_t a, uint64_t b) {
+    kmh_view_t va, vb;
+    if (!kmh_store_view(store, a, &va) || !kmh_store_view(store, b, &vb)) return -1.0;
+    return kmh_view_distance(&va, &vb);
+}
+
+static inline int kmh_store_pwrite(int fd, const uint8_t *data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, (off_t)offset);
+        if (n < 0) return 0;
+        data += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 1;
+}
+
+static inline int kmh_store_flush(kmh_store_writer_t *w) {
+    if (w->buf_used && !kmh_store_pwrite(w->fd, w->buf, w->buf_used, w->end)) {
+        w->failed = 1;
+        return 0;
+    }
+    w->end += w->buf_used;
+    w->buf_used = 0;
+    return 1;
+}
+
+// Buffered append at the end of the file
+static inline int kmh_store_append(kmh_store_writer_t *w, const void *data, size_t len) {
+    if (w->buf_used + len > KMH_STORE_BUFFER) {
+        if (!kmh_store_flush(w)) return 0;
+        if (len > KMH_STORE_BUFFER) {
+            if (!kmh_store_pwrite(w->fd, data, len, w->end)) {
+                w->failed = 1;
+                return 0;
+            }
+            w->end += len;
+            return 1;
         }
     }
-    
-    return kmh;
+    memcpy(w->buf + w->buf_used, data, len);
+    w->buf_used += (uint32_t)len;
+    return 1;
 }
 
-// Fast cardinality from serialized data (without full deserialization)
-static inline double kmh_cardinality_from_serialized(const uint8_t *buf, uint32_t buf_size) {
-    if (buf_size < 4 * sizeof(uint32_t)) return -1.0;
-    
-    uint32_t k, count, space_size;
-    memcpy(&k, buf, sizeof(uint32_t));
-    memcpy(&count, buf + sizeof(uint32_t), sizeof(uint32_t));
-    memcpy(&space_size, buf + 2 * sizeof(uint32_t), sizeof(uint32_t));
-    
-    if (count == 0) return 0.0;
-    if (count < k) {
-        return (double) count;
+static inline int kmh_store_writer_grow(kmh_store_writer_t *w) {
+    uint64_t capacity = (w->mask + 1) * 2;
+    kmh_store_slot_t *slots = kmh_alloc(capacity * sizeof(kmh_store_slot_t));
+    if (!slots) return 0;
+    memset(slots, 0, capacity * sizeof(kmh_store_slot_t));
+    for (uint64_t s = 0; s <= w->mask; s++) {
+        if (!w->slots[s].offset) continue;
+        uint64_t d = kmh_store_slot(w->slots[s].key, capacity - 1);
+        while (slots[d].offset) d = (d + 1) & (capacity - 1);
+        slots[d] = w->slots[s];
     }
-    
-    // Need k-th hash - decode up to position k-1
-    uint32_t pos = 4 * sizeof(uint32_t);
-    //uint32_t current = space_size;
-    uint32_t delta;
-    int decoded = int32_decode_direct(buf + pos, &delta);
-    if(decoded > 0){
-      //current -= delta;
-      //return (double)space_size * (k - 1) / (current + 1);
-      return (double)space_size * (k - 1) / (delta + 1);
+    kmh_dealloc(w->slots);
+    w->slots = slots;
+    w->mask = capacity - 1;
+    return 1;
+}
+
+// Slot of key in the writer's table, or the empty slot where it would go
+static inline uint64_t kmh_store_writer_find(const kmh_store_writer_t *w, uint64_t key) {
+    uint64_t s = kmh_store_slot(key, w->mask);
+    while (w->slots[s].offset && w->slots[s].key != key) s = (s + 1) & w->mask;
+    return s;
+}
+
+// Appends a record for key (replacing any earlier one once committed);
+// returns 0 on a failed write or allocation
+static inline int kmh_store_put(kmh_store_writer_t *w, uint64_t key, const uint8_t *blob, uint32_t size) {
+    static const uint8_t zeros[8];
+    if (w->failed) return 0;
+    if ((w->count + 1) * 2 > w->mask + 1 && !kmh_store_writer_grow(w)) return 0;
+
+    uint8_t rec[KMH_STORE_RECORD_SIZE];
+    kmh_store_le64(rec, key);
+    kmh_store_le32(rec + 8, size);
+    kmh_store_le32(rec + 12, 0);
+    uint64_t offset = w->end + w->buf_used;
+    if (!kmh_store_append(w, rec, sizeof(rec)) || !kmh_store_append(w, blob, size) ||
+        !kmh_store_append(w, zeros, (8 - size % 8) % 8)) {
+        return 0;
     }
-    
-    return -1.0; // Error
+
+    uint64_t s = kmh_store_writer_find(w, key);
+    w->count += !w->slots[s].offset;
+    w->slots[s] = (kmh_store_slot_t){ key, offset };
+    return 1;
+}
+
+static inline int kmh_store_put_sketch(kmh_store_writer_t *w, uint64_t key, const kvalue_minhash_t *kmh) {
+    uint8_t *buf;
+    uint32_t size = kmh_serialize(kmh, &buf);
+    if (!size) return 0;
+    int ok = kmh_store_put(w, key, buf, size);
+    kmh_free_buffer(buf);
+    return ok;
+}
+
+// Drops key from the index at the next commit; 0 if it isn't there
+static inline int kmh_store_delete(kmh_store_writer_t *w, uint64_t key) {
+    uint64_t s = kmh_store_writer_find(w, key);
+    if (!w->slots[s].offset) return 0;
+
+    // Backward-shift deletion keeps probe chains intact without tombstones
+    for (uint64_t next = (s + 1) & w->mask; w->slots[next].offset; next = (next + 1) & w->mask) {
+        uint64_t home = kmh_store_slot(w->slots[next].key, w->mask);
+        if (((next - home) & w->mask) >= ((next - s) & w->mask)) {
+            w->slots[s] = w->slots[next];
+            s = next;
+        }
+    }
+    w->slots[s].offset = 0;
+    w->count--;
+    return 1;
+}
+
+static inline void kmh_store_writer_free(kmh_store_writer_t *w) {
+    if (w->fd >= 0) close(w->fd); // also drops the lock
+    kmh_dealloc(w->buf);
+    kmh_dealloc(w->slots);
+    kmh_dealloc(w);
+}
+
+// Opens (creating if needed) a store for appending, starting from its
+// committed keys; NULL if the file is malformed or another writer holds it
+static inline kmh_store_writer_t* kmh_store_writer_open(const char *path) {
+    kmh_store_writer_t *w = kmh_alloc(sizeof(kmh_store_writer_t));
+    if (!w) return NULL;
+    *w = (kmh_store_writer_t){ .fd = -1, .mask = KMH_STORE_MIN_SLOTS - 1 };
+    w->buf = kmh_alloc(KMH_STORE_BUFFER);
+    w->slots = kmh_alloc(KMH_STORE_MIN_SLOTS * sizeof(kmh_store_slot_t));
+    w->fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (!w->buf || !w->slots || w->fd < 0 || flock(w->fd, LOCK_EX | LOCK_NB) != 0 || fstat(w->fd, &st) != 0) {
+        kmh_store_writer_free(w);
+        return NULL;
+    }
+    memset(w->slots, 0, KMH_STORE_MIN_SLOTS * sizeof(kmh_store_slot_t));
+
+    if (st.st_size == 0) {
+        uint8_t header[KMH_STORE_HEADER_SIZE] = {0};
+        kmh_store_le32(header, KMH_STORE_MAGIC);
+        kmh_store_le32(header + 4, KMH_STORE_VERSION);
+        if (!kmh_store_pwrite(w->fd, header, sizeof(header), 0)) {
+            kmh_store_writer_free(w);
+            return NULL;
+        }
+        w->end = KMH_STORE_HEADER_SIZE;
+    } else {
+        kmh_store_t *store = kmh_store_open(path);
+        if (!store) {
+            kmh_store_writer_free(w);
+            return NULL;
+        }
+        uint64_t pos = 0, key;
+        uint32_t size;
+        const uint8_t *blob;
+        while ((blob = kmh_store_next(store, &pos, &key, &size))) {
+            if ((w->count + 1) * 2 > w->mask + 1 && !kmh_store_writer_grow(w)) break;
+            uint64_t s = kmh_store_writer_find(w, key);
+            w->slots[s] = (kmh_store_slot_t){ key, (uint64_t)(blob - store->map) - KMH_STORE_RECORD_SIZE };
+            w->count++;
+        }
+        int complete = w->count == store->count;
+        kmh_store_close(store);
+        if (!complete) {
+            kmh_store_writer_free(w);
+            return NULL;
+        }
+        w->end = ((uint64_t)st.st_size + 7) & ~UINT64_C(7);
+    }
+    w->committed = w->end;
+    return w;
+}
+
+// Writes the index and then the header, syncing before each, so the new
+// state appears atomically; returns 0 on a failed write
+static inline int kmh_store_commit(kmh_store_writer_t *w) {
+    if (w->failed) return 0;
+    uint64_t slots = w->mask + 1, index_offset;
+    if (!kmh_store_flush(w)) return 0;
+    index_offset = w->end;
+    for (uint64_t s = 0; s < slots; s++) {
+        uint8_t slot[KMH_STORE_SLOT_SIZE];
+        kmh_store_le64(slot, w->slots[s].key);
+        kmh_store_le64(slot + 8, w->slots[s].offset);
+        if (!kmh_store_append(w, slot, sizeof(slot))) return 0;
+    }
+    if (!kmh_store_flush(w) || fsync(w->fd) != 0) {
+        w->failed = 1;
+        return 0;
+    }
+
+    uint8_t header[KMH_STORE_HEADER_SIZE];
+    kmh_store_le32(header, KMH_STORE_MAGIC);
+    kmh_store_le32(header + 4, KMH_STORE_VERSION);
+    kmh_store_le64(header + 8, w->count);
+    kmh_store_le64(header + 16, index_offset);
+    kmh_store_le64(header + 24, slots);
+    if (!kmh_store_pwrite(w->fd, header, sizeof(header), 0) || fsync(w->fd) != 0) {
+        w->failed = 1;
+        return 0;
+    }
+    w->committed = w->end;
+    return 1;
+}
+
+// Commits and closes; returns the commit's result
+static inline int kmh_store_writer_close(kmh_store_writer_t *w) {
+    int ok = kmh_store_commit(w);
+    kmh_store_writer_free(w);
+    return ok;
+}
+
+// Discards everything since the last commit and closes
+static inline void kmh_store_writer_abort(kmh_store_writer_t *w) {
+    // If this fails the bytes stay, unreferenced, until the next compaction
+    int rc = ftruncate(w->fd, (off_t)w->committed);
+    (void)rc;
+    kmh_store_writer_free(w);
+}
+
+// Rewrites a store with only its live records (one copy each, one index)
+// and renames it over the original; 0 on failure, leaving the original
+static inline int kmh_store_compact(const char *path) {
+    size_t len = strlen(path);
+    char *tmp = kmh_alloc(len + sizeof(".compact"));
+    if (!tmp) return 0;
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".compact", sizeof(".compact"));
+
+    // Holding the writer lock keeps appends out until the rename
+    int fd = open(path, O_RDWR);
+    kmh_store_t *src = fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0 ? kmh_store_open(path) : NULL;
+    kmh_store_writer_t *w = NULL;
+    int ok = 0;
+    if (src && (unlink(tmp) == 0 || errno == ENOENT) && (w = kmh_store_writer_open(tmp))) {
+        uint64_t pos = 0, key;
+        uint32_t size;
+        const uint8_t *blob;
+        ok = 1;
+        while (ok && (blob = kmh_store_next(src, &pos, &key, &size))) ok = kmh_store_put(w, key, blob, size);
+        ok = ok ? kmh_store_writer_close(w) : (kmh_store_writer_abort(w), 0);
+        ok = ok && rename(tmp, path) == 0;
+        if (!ok) unlink(tmp);
+    }
+    kmh_store_close(src);
+    if (fd >= 0) close(fd);
+    kmh_dealloc(tmp);
+    return ok;
 }
+#endif // KMH_HAVE_MMAP
 
 #endif // KVALUE_MINHASH_H
@@ -0,0 +1,433 @@
+#ifndef KVALUE_MINHASH_HPP
+#define KVALUE_MINHASH_HPP
+
+// C++20 front-end for sketches with a configuration fixed at compile time.
+// KMinHash<K, HashT, Space> keeps its K hashes inline in a std::array, so k,
+// the space size and the hash width are constants: range reduction is a
+// mask or a multiply by a constant instead of a division, and the loops over
+// the hashes have a known bound. Hashing, ordering (K smallest, descending)
+// and the serialized blobs are those of kvalue_minhash_t / kvalue_minhash64_t
+// in kmh.h, so sketches built on either side can be read on the other.
+// kmh.h is C only; this header stands alone.
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+namespace kmh {
+
+namespace detail {
+
+constexpr uint32_t rotl32(uint32_t x, int r) { return (x << r) | (x >> (32 - r)); }
+constexpr uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+// xxh32_hash in kmh.h
+constexpr uint32_t xxh32(uint32_t input, uint32_t seed) {
+    uint32_t h32 = seed + 0x165667B1U + 4;
+    h32 += input * 0xC2B2AE3DU;
+    h32 = rotl32(h32, 17) * 0x27D4EB2FU;
+    h32 ^= h32 >> 15;
+    h32 *= 0x85EBCA77U;
+    h32 ^= h32 >> 13;
+    h32 *= 0xC2B2AE3DU;
+    h32 ^= h32 >> 16;
+    return h32;
+}
+
+constexpr uint32_t bswap32(uint32_t x) {
+    return (x >> 24) | ((x >> 8) & 0xFF00U) | ((x << 8) & 0xFF0000U) | (x << 24);
+}
+
+// xxh3_hash64 in kmh.h
+constexpr uint64_t xxh3_64(uint64_t input, uint64_t seed) {
+    seed ^= static_cast<uint64_t>(bswap32(static_cast<uint32_t>(seed))) << 32;
+    uint64_t bitflip = (0x1CAD21F72C81017CULL ^ 0xDB979083E96DD4DEULL) - seed;
+    uint64_t h64 = ((input >> 32) + (input << 32)) ^ bitflip;
+    h64 ^= rotl64(h64, 49) ^ rotl64(h64, 24);
+    h64 *= 0x9FB21C651E98DF25ULL;
+    h64 ^= (h64 >> 35) + 8;
+    h64 *= 0x9FB21C651E98DF25ULL;
+    return h64 ^ (h64 >> 28);
+}
+
+template <typename T>
+inline T load_le(const uint8_t *p) {
+    T v = 0;
+    for (size_t i = 0; i < sizeof(T); i++) v |= static_cast<T>(p[i]) << (8 * i);
+    return v;
+}
+
+template <typename T>
+inline void store_le(uint8_t *p, T v) {
+    for (size_t i = 0; i < sizeof(T); i++) p[i] = static_cast<uint8_t>(v >> (8 * i));
+}
+
+// Blob layout, see KMH_BLOB_MAGIC in kmh.h
+inline constexpr uint32_t blob_magic = 0x31484D4BU; // "KMH1"
+inline constexpr uint8_t blob_version = 1;
+inline constexpr size_t blob_header_size = 32;
+inline constexpr size_t legacy_header_size = 24;
+inline constexpr uint8_t encoding_raw = 0;
+inline constexpr uint8_t encoding_varint = 1;
+inline constexpr uint8_t encoding_bitpack = 2;
+inline constexpr uint32_t pack_block = 128;
+
+struct BlobInfo {
+    uint32_t k;
+    uint32_t count;
+    uint64_t space_size;
+    uint64_t seed;
+    uint8_t width;
+    uint8_t encoding;
+    size_t data_offset;
+};
+
+// kmh_blob_parse
+inline std::optional<BlobInfo> parse_blob(std::span<const uint8_t> buf) {
+    BlobInfo info{};
+    if (buf.size() >= blob_header_size && load_le<uint32_t>(buf.data()) == blob_magic) {
+        if (buf[4] > blob_version || buf[6] > encoding_bitpack) return std::nullopt;
+        info.k = load_le<uint32_t>(buf.data() + 8);
+        info.count = load_le<uint32_t>(buf.data() + 12);
+        info.space_size = load_le<uint64_t>(buf.data() + 16);
+        info.seed = load_le<uint64_t>(buf.data() + 24);
+        info.width = buf[5];
+        info.encoding = buf[6];
+        info.data_offset = blob_header_size;
+    } else {
+        if (buf.size() < legacy_header_size) return std::nullopt;
+        info.k = load_le<uint32_t>(buf.data());
+        info.count = load_le<uint32_t>(buf.data() + 4);
+        info.space_size = load_le<uint32_t>(buf.data() + 8);
+        info.seed = load_le<uint32_t>(buf.data() + 12);
+        info.width = sizeof(uint32_t);
+        info.encoding = encoding_raw;
+        info.data_offset = legacy_header_size;
+    }
+    if (info.count > info.k) return std::nullopt;
+    return info;
+}
+
+// sqlite4 varint (sqlite4_decode in kmh.h); 0 if it runs past the end
+inline size_t varint_decode(std::span<const uint8_t> in, uint64_t &value) {
+    if (in.empty()) return 0;
+    uint8_t first = in[0];
+    size_t len = first <= 240 ? 1 : first <= 248 ? 2 : first - 246u;
+    if (in.size() < len) return 0;
+    if (first <= 240) {
+        value = first;
+    } else if (first <= 248) {
+        value = 240 + 256 * (first - 241u) + in[1];
+    } else if (first == 249) {
+        value = 2288 + 256 * in[1] + in[2];
+    } else {
+        value = 0;
+        for (size_t i = 1; i < len; i++) value = (value << 8) | in[i];
+    }
+    return len;
+}
+
+// kmh_unpack_block: 128 gaps of b bits in four interleaved lanes
+inline void unpack_block(const uint8_t *in, uint32_t b, uint32_t *gaps) {
+    uint32_t mask = b == 32 ? 0xFFFFFFFFU : (1U << b) - 1;
+    for (uint32_t j = 0; j < pack_block / 4; j++) {
+        uint32_t bit = j * b, w = bit >> 5, s = bit & 31;
+        for (uint32_t lane = 0; lane < 4; lane++) {
+            const uint8_t *word = in + (w * 4 + lane) * sizeof(uint32_t);
+            uint32_t v = load_le<uint32_t>(word) >> s;
+            if (s + b > 32) v |= load_le<uint32_t>(word + 16) << (32 - s);
+            gaps[4 * j + lane] = v & mask;
+        }
+    }
+}
+
+} // namespace detail
+
+template <typename HashT>
+inline constexpr uint64_t full_space = std::numeric_limits<HashT>::max();
+
+template <uint32_t K, typename HashT, uint64_t Space>
+concept SketchConfig = K >= 1 && (std::is_same_v<HashT, uint32_t> || std::is_same_v<HashT, uint64_t>) &&
+                       Space >= 1 && Space <= full_space<HashT>;
+
+// Read-only view of a RAW serialized sketch; hashes are read in place. The
+// buffer must outlive the view.
+template <uint32_t K, typename HashT = uint32_t, uint64_t Space = full_space<HashT>>
+    requires SketchConfig<K, HashT, Space>
+class KMinHashView {
+public:
+    static std::optional<KMinHashView> from_blob(std::span<const uint8_t> blob) {
+        auto info = detail::parse_blob(blob);
+        if (!info || info->width != sizeof(HashT) || info->encoding != detail::encoding_raw ||
+            info->k != K || info->space_size != Space) {
+            return std::nullopt;
+        }
+        size_t bytes = static_cast<size_t>(info->count) * sizeof(HashT);
+        if (blob.size() - info->data_offset < bytes) return std::nullopt;
+        return KMinHashView(info->count, static_cast<HashT>(info->seed), blob.subspan(info->data_offset, bytes));
+    }
+
+    uint32_t count() const { return count_; }
+    HashT seed() const { return seed_; }
+    HashT hash(uint32_t i) const { return detail::load_le<HashT>(hashes_.data() + i * sizeof(HashT)); }
+
+    double cardinality() const {
+        if (count_ == 0) return 0.0;
+        if (count_ < K) return static_cast<double>(count_);
+        return static_cast<double>(Space) * (K - 1) / (static_cast<double>(hash(0)) + 1.0);
+    }
+
+private:
+    KMinHashView(uint32_t count, HashT seed, std::span<const uint8_t> hashes)
+        : count_(count), seed_(seed), hashes_(hashes) {}
+
+    uint32_t count_;
+    HashT seed_;
+    std::span<const uint8_t> hashes_;
+};
+
+template <uint32_t K, typename HashT = uint32_t, uint64_t Space = full_space<HashT>>
+    requires SketchConfig<K, HashT, Space>
+class KMinHash {
+public:
+    using hash_type = HashT;
+    using view_type = KMinHashView<K, HashT, Space>;
+    static constexpr uint32_t k = K;
+    static constexpr uint64_t space_size = Space;
+
+    explicit KMinHash(HashT seed = 0) : seed_(seed) {}
+
+    // Move-only: a copy is K hashes, so it has to be asked for with clone()
+    KMinHash(const KMinHash &) = delete;
+    KMinHash &operator=(const KMinHash &) = delete;
+    KMinHash(KMinHash &&) noexcept = default;
+    KMinHash &operator=(KMinHash &&) noexcept = default;
+
+    KMinHash clone() const {
+        KMinHash copy(seed_);
+        copy.count_ = count_;
+        std::copy_n(hashes_.begin(), count_, copy.hashes_.begin());
+        return copy;
+    }
+
+    // hash % Space, as kmh_reduce / kmh64_reduce compute it
+    static constexpr HashT reduce(HashT hash) {
+        constexpr HashT max = std::numeric_limits<HashT>::max();
+        if constexpr (Space == full_space<HashT>) {
+            return hash + (hash == max); // max wraps to 0
+        } else if constexpr ((Space & (Space - 1)) == 0) {
+            return hash & static_cast<HashT>(Space - 1);
+        } else {
+            return hash % static_cast<HashT>(Space);
+        }
+    }
+
+    // kmh_add / kmh64_add
+    void add(HashT value) {
+        if constexpr (sizeof(HashT) == sizeof(uint32_t)) {
+            insert(reduce(detail::xxh32(value, seed_)));
+        } else {
+            insert(reduce(detail::xxh3_64(value, seed_)));
+        }
+    }
+
+    void add(std::span<const HashT> values) {
+        for (HashT v : values) add(v);
+    }
+
+    // Insert an already reduced hash, keeping the K smallest
+    void insert(HashT hash) {
+        if (count_ == K && hash >= hashes_[0]) return;
+
+        uint32_t pos = search(hash);
+        if (pos < count_ && hashes_[pos] == hash) return;
+
+        if (count_ < K) {
+            std::copy_backward(hashes_.begin() + pos, hashes_.begin() + count_, hashes_.begin() + count_ + 1);
+            hashes_[pos] = hash;
+            count_++;
+            return;
+        }
+        // Full: drop hashes_[0]; pos >= 1 since hash < hashes_[0]
+        std::copy(hashes_.begin() + 1, hashes_.begin() + pos, hashes_.begin());
+        hashes_[pos - 1] = hash;
+    }
+
+    uint32_t count() const { return count_; }
+    HashT seed() const { return seed_; }
+    std::span<const HashT> hashes() const { return std::span<const HashT>(hashes_.data(), count_); }
+
+    double cardinality() const {
+        if (count_ == 0) return 0.0;
+        if (count_ < K) return static_cast<double>(count_);
+        return static_cast<double>(Space) * (K - 1) / (static_cast<double>(hashes_[0]) + 1.0);
+    }
+
+    // Merge other into this sketch (the K smallest distinct hashes of both);
+    // false if the seeds differ
+    bool merge(const KMinHash &other) {
+        return merge_from(other.seed_, other.count_, [&](uint32_t i) { return other.hashes_[i]; });
+    }
+
+    bool merge(const view_type &other) {
+        return merge_from(other.seed(), other.count(), [&](uint32_t i) { return other.hash(i); });
+    }
+
+    // kmh_distance; -1.0 if the seeds differ
+    double distance(const KMinHash &other) const {
+        return distance_to(other.seed_, other.count_, [&](uint32_t i) { return other.hashes_[i]; });
+    }
+
+    double distance(const view_type &other) const {
+        return distance_to(other.seed(), other.count(), [&](uint32_t i) { return other.hash(i); });
+    }
+
+    // RAW portable blob, as kmh_serialize / kmh64_serialize write it
+    size_t serialized_size() const { return detail::blob_header_size + count_ * sizeof(HashT); }
+
+    // Returns the bytes written, or 0 if out is smaller than serialized_size()
+    size_t serialize_into(std::span<uint8_t> out) const {
+        size_t size = serialized_size();
+        if (out.size() < size) return 0;
+        uint8_t *p = out.data();
+        detail::store_le<uint32_t>(p, detail::blob_magic);
+        p[4] = detail::blob_version;
+        p[5] = sizeof(HashT);
+        p[6] = detail::encoding_raw;
+        p[7] = 0;
+        detail::store_le<uint32_t>(p + 8, K);
+        detail::store_le<uint32_t>(p + 12, count_);
+        detail::store_le<uint64_t>(p + 16, Space);
+        detail::store_le<uint64_t>(p + 24, seed_);
+        for (uint32_t i = 0; i < count_; i++) {
+            detail::store_le<HashT>(p + detail::blob_header_size + i * sizeof(HashT), hashes_[i]);
+        }
+        return size;
+    }
+
+    std::vector<uint8_t> serialize() const {
+        std::vector<uint8_t> out(serialized_size());
+        serialize_into(out);
+        return out;
+    }
+
+    // Reads any blob kmh.h writes for this configuration (portable RAW,
+    // VARINT or BITPACK, or legacy); nullopt if it is malformed or k, the
+    // space size or the hash width differ
+    static std::optional<KMinHash> deserialize(std::span<const uint8_t> blob) {
+        auto info = detail::parse_blob(blob);
+        if (!info || info->width != sizeof(HashT) || info->k != K || info->space_size != Space ||
+            info->seed > std::numeric_limits<HashT>::max()) {
+            return std::nullopt;
+        }
+
+        KMinHash kmh(static_cast<HashT>(info->seed));
+        uint32_t n = info->count;
+        size_t pos = info->data_offset;
+        if (info->encoding == detail::encoding_raw) {
+            if (blob.size() - pos < static_cast<size_t>(n) * sizeof(HashT)) return std::nullopt;
+            for (uint32_t i = 0; i < n; i++) {
+                kmh.hashes_[i] = detail::load_le<HashT>(blob.data() + pos + i * sizeof(HashT));
+            }
+        } else if constexpr (sizeof(HashT) == sizeof(uint32_t)) {
+            if (n > 0 && !decode_gaps(blob, pos, n, info->encoding, kmh.hashes_.data())) return std::nullopt;
+        } else {
+            return std::nullopt; // compressed encodings are 32-bit only
+        }
+
+        for (uint32_t i = 1; i < n; i++) {
+            if (kmh.hashes_[i] >= kmh.hashes_[i - 1]) return std::nullopt;
+        }
+        kmh.count_ = n;
+        return kmh;
+    }
+
+private:
+    // Entries strictly greater than hash (kmh_search)
+    uint32_t search(HashT hash) const {
+        return static_cast<uint32_t>(std::upper_bound(hashes_.begin(), hashes_.begin() + count_, hash,
+                                                      [](HashT h, HashT e) { return e <= h; }) -
+                                     hashes_.begin());
+    }
+
+    // Branchless merge from the smallest hashes up, filling out from the end
+    template <typename Load>
+    bool merge_from(HashT seed, uint32_t other_count, Load other) {
+        if (seed != seed_) return false;
+        std::array<HashT, K> out;
+        uint32_t i = count_, j = other_count, o = K;
+        while (o > 0 && i > 0 && j > 0) {
+            HashT x = hashes_[i - 1], y = other(j - 1);
+            out[--o] = x < y ? x : y;
+            i -= x <= y;
+            j -= y <= x;
+        }
+        while (o > 0 && i > 0) out[--o] = hashes_[--i];
+        while (o > 0 && j > 0) out[--o] = other(--j);
+
+        count_ = K - o;
+        std::copy_n(out.begin() + o, count_, hashes_.begin());
+        return true;
+    }
+
+    // Walk from the largest hashes, at most K steps
+    template <typename Load>
+    double distance_to(HashT seed, uint32_t other_count, Load other) const {
+        if (seed != seed_) return -1.0;
+        uint32_t matches = 0, i = 0, j = 0, compared = 0;
+        for (; compared < K && i < count_ && j < other_count; compared++) {
+            HashT x = hashes_[i], y = other(j);
+            matches += x == y;
+            i += x >= y;
+            j += y >= x;
+        }
+        return compared > 0 ? 1.0 - static_cast<double>(matches) / compared : 1.0;
+    }
+
+    // kmh_blob_decode for VARINT and BITPACK payloads
+    static bool decode_gaps(std::span<const uint8_t> blob, size_t pos, uint32_t n, uint8_t encoding, uint32_t *out) {
+        if (blob.size() - pos < sizeof(uint32_t)) return false;
+        out[0] = detail::load_le<uint32_t>(blob.data() + pos);
+        pos += sizeof(uint32_t);
+
+        uint32_t i = 1;
+        if (encoding == detail::encoding_bitpack) {
+            for (; n - i >= detail::pack_block; i += detail::pack_block) {
+                if (pos >= blob.size()) return false;
+                uint32_t b = blob[pos++];
+                if (b == 0 || b > 32 || blob.size() - pos < 16 * b) return false;
+                detail::unpack_block(blob.data() + pos, b, out + i);
+                pos += 16 * b;
+            }
+        }
+        for (; i < n; i++) {
+            uint64_t gap;
+            size_t len = detail::varint_decode(blob.subspan(pos), gap);
+            if (len == 0 || gap > std::numeric_limits<uint32_t>::max()) return false;
+            pos += len;
+            out[i] = static_cast<uint32_t>(gap);
+        }
+
+        uint32_t prev = out[0];
+        for (i = 1; i < n; i++) {
+            if (out[i] == 0 || out[i] > prev) return false;
+            prev -= out[i];
+            out[i] = prev;
+        }
+        return true;
+    }
+
+    std::array<HashT, K> hashes_{};
+    uint32_t count_ = 0;
+    HashT seed_;
+};
+
+} // namespace kmh
+
+#endif // KVALUE_MINHASH_HPP
@@ -1,8 +1,33 @@
-#include "kvm.h"
+#include "kmh.h"
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
 
+static atomic_int hook_mallocs, hook_frees;
+static atomic_int hook_fail_at; // > 0: the hook's hook_fail_at-th malloc from now fails
+static void *counting_malloc(size_t size) {
+   if (atomic_load(&hook_fail_at) > 0 && atomic_fetch_sub(&hook_fail_at, 1) == 1) return NULL;
+   hook_mallocs++;
+   return malloc(size);
+}
+static void counting_free(void *ptr) { hook_frees++; free(ptr); }
+
+// Concurrent sketch workers: thread t adds values [t * 25000, (t + 1) * 25000)
+static kmh_concurrent_t *concurrent;
+static void *concurrent_worker(void *arg) {
+   uint32_t t = (uint32_t)(uintptr_t)arg;
+   uint32_t values[1000];
+   for (uint32_t base = t * 25000; base < (t + 1) * 25000; base += 1000) {
+       for (uint32_t i = 0; i < 1000; i++) values[i] = base + i;
+       if (t % 2) {
+           kmh_concurrent_add_batch(concurrent, t, values, 1000);
+       } else {
+           for (uint32_t i = 0; i < 1000; i++) kmh_concurrent_add(concurrent, t, values[i]);
+       }
+   }
+   return NULL;
+}
+
 #define TEST(name, condition) do { \
    if (condition) { \
        printf("✓ %s\n", name); \
@@ -15,6 +40,9 @@ int main() {
    printf("KValue MinHash Tests\n");
    printf("===================\n");
    
+   // The hook goes in before anything is allocated, for the whole run
+   TEST("Allocator install", kmh_set_allocator(counting_malloc, counting_free));
+   
    // Init tests
    kvalue_minhash_t *kmh = kmh_init(10, 1000, 42);
    TEST("Init", kmh != NULL && kmh->k == 10 && kmh->count == 0);
@@ -31,6 +59,88 @@ int main() {
    TEST("Add to capacity", kmh->count == 10);
    TEST("Descending order", kmh->hashes[0] > kmh->hashes[kmh->count-1]);
    
+   // Binary search insertion keeps exactly the K smallest unique hashes
+   kvalue_minhash_t *ref = kmh_init(64, 100000, 7);
+   uint32_t smallest[64];
+   uint32_t nsmallest = 0;
+   for(int i = 0; i < 5000; i++) {
+       uint32_t v = (uint32_t)rand() % 20000; // plenty of duplicates
+       kmh_add(ref, v);
+       uint32_t h = xxh32_hash(v, 7) % 100000;
+       int seen = 0;
+       for(uint32_t j = 0; j < nsmallest; j++) if(smallest[j] == h) seen = 1;
+       if(seen) continue;
+       if(nsmallest < 64) { smallest[nsmallest++] = h; continue; }
+       uint32_t max_j = 0;
+       for(uint32_t j = 1; j < 64; j++) if(smallest[j] > smallest[max_j]) max_j = j;
+       if(h < smallest[max_j]) smallest[max_j] = h;
+   }
+   int ref_ok = ref->count == nsmallest;
+   for(uint32_t i = 1; ref_ok && i < ref->count; i++) ref_ok = ref->hashes[i-1] > ref->hashes[i];
+   for(uint32_t j = 0; ref_ok && j < nsmallest; j++) {
+       uint32_t pos = kmh_search(ref->hashes, ref->count, smallest[j]);
+       ref_ok = pos < ref->count && ref->hashes[pos] == smallest[j];
+   }
+   TEST("Add keeps K smallest", ref_ok);
+   kmh_free(ref);
+   
+   // Build mode produces the same sketch as kmh_add
+   kvalue_minhash_t *direct = kmh_init(4096, 0xFFFFFFFF, 3);
+   kmh_builder_t *builder = kmh_builder_init(4096, 0xFFFFFFFF, 3);
+   for(int i = 0; i < 50000; i++) {
+       uint32_t v = (uint32_t)rand() % 30000;
+       kmh_add(direct, v);
+       kmh_builder_add(builder, v);
+   }
+   kvalue_minhash_t *built = kmh_finalize(builder);
+   TEST("Builder finalize", built != NULL && built->count == direct->count &&
+         memcmp(built->hashes, direct->hashes, direct->count * sizeof(uint32_t)) == 0);
+   kmh_builder_free(builder); kmh_free(direct); kmh_free(built);
+   
+   // k = 1 builders (kmh_group_create(value, 1)) keep replacing the minimum
+   kmh_builder_t *single_builder = kmh_builder_init(1, 0xFFFFFFFF, 3);
+   kvalue_minhash_t *one_direct = kmh_init(1, 0xFFFFFFFF, 3);
+   for (uint32_t i = 0; i < 1000; i++) {
+       kmh_builder_add(single_builder, i);
+       kmh_add(one_direct, i);
+   }
+   kvalue_minhash_t *one_built = kmh_finalize(single_builder);
+   TEST("Builder k = 1", one_built->count == 1 && one_built->hashes[0] == one_direct->hashes[0]);
+   kmh_builder_free(single_builder); kmh_free(one_direct); kmh_free(one_built);
+   
+   // Batch ingest matches per-value kmh_add for every reduction mode
+   uint32_t batch_values[10007];
+   for(int i = 0; i < 10007; i++) batch_values[i] = (uint32_t)rand();
+   uint32_t spaces[] = { 0xFFFFFFFF, 1U << 20, 10000000 };
+   int batch_ok = 1;
+   for(int s = 0; s < 3; s++) {
+       kvalue_minhash_t *one = kmh_init(100, spaces[s], 9);
+       kvalue_minhash_t *many = kmh_init(100, spaces[s], 9);
+       for(int i = 0; i < 10007; i++) kmh_add(one, batch_values[i]);
+       kmh_add_batch(many, batch_values, 10007);
+       batch_ok &= one->count == many->count &&
+                   memcmp(one->hashes, many->hashes, one->count * sizeof(uint32_t)) == 0;
+       kmh_free(one); kmh_free(many);
+   }
+   TEST("Batch add", batch_ok);
+   
+   // Range reduction must stay bit-identical to "% space_size" so persisted
+   // sketches remain compatible
+   uint32_t red_spaces[] = { 0xFFFFFFFF, 0x80000000, 1, 2, 3, 1000, 100000, 10000000, 0xFFFFFFFE, 0x7FFFFFFF };
+   uint32_t red_edges[] = { 0, 1, 2, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFE, 0xFFFFFFFF };
+   int reduce_ok = 1;
+   for(int s = 0; s < 10; s++) {
+       uint32_t d = red_spaces[s];
+       int mode = kmh_reduce_mode(d);
+       uint64_t m = kmh_fastmod_m(d);
+       for(int e = 0; e < 7; e++) reduce_ok &= kmh_reduce(red_edges[e], d, mode, m) == red_edges[e] % d;
+       for(int i = 0; i < 100000; i++) {
+           uint32_t h = xxh32_hash(i, d);
+           reduce_ok &= kmh_reduce(h, d, mode, m) == h % d;
+       }
+   }
+   TEST("Reduction matches modulo", reduce_ok);
+   
    // Cardinality tests
    double card = kmh_cardinality(kmh);
    TEST("Cardinality > 0", card > 0);
@@ -55,6 +165,27 @@ int main() {
    kvalue_minhash_t *bad_merge = kmh_merge(kmh, diff);
    TEST("Incompatible merge fails", bad_merge == NULL);
    
+   // Set-operation estimators: exact below k, KMV estimates above it
+   TEST("Union cardinality", kmh_union_cardinality(kmh, kmh2) == kmh_cardinality(merged) &&
+        kmh_union_cardinality(kmh, diff) == -1.0);
+   kvalue_minhash_t *set_a = kmh_init(100, 0xFFFFFFFF, 42), *set_b = kmh_init(100, 0xFFFFFFFF, 42);
+   for (uint32_t v = 1; v <= 10; v++) kmh_add(set_a, v);
+   for (uint32_t v = 5; v <= 20; v++) kmh_add(set_b, v);
+   TEST("Set operations exact", kmh_union_cardinality(set_a, set_b) == 20.0 &&
+        kmh_intersection_cardinality(set_a, set_b) == 6.0 && kmh_difference_cardinality(set_a, set_b) == 4.0 &&
+        kmh_difference_cardinality(set_b, set_a) == 10.0 && kmh_containment(set_a, set_b) == 0.6);
+   kmh_free(set_a); kmh_free(set_b);
+   set_a = kmh_init(1000, 0xFFFFFFFF, 42); set_b = kmh_init(1000, 0xFFFFFFFF, 42);
+   for (uint32_t v = 0; v < 60000; v++) kmh_add(set_a, v);
+   for (uint32_t v = 30000; v < 90000; v++) kmh_add(set_b, v);
+   double inter = kmh_intersection_cardinality(set_a, set_b), only_a = kmh_difference_cardinality(set_a, set_b);
+   double union_ab = kmh_union_cardinality(set_a, set_b), contained = kmh_containment(set_a, set_b);
+   kvalue_minhash_t *merged_ab = kmh_merge(set_a, set_b);
+   TEST("Set operations estimate", fabs(inter - 30000) < 3000 && fabs(only_a - 30000) < 3000 &&
+        fabs(contained - 0.5) < 0.05 && union_ab == kmh_cardinality(merged_ab) &&
+        fabs(inter + only_a + kmh_difference_cardinality(set_b, set_a) - union_ab) < 1e-6 * union_ab);
+   kmh_free(merged_ab); kmh_free(set_a); kmh_free(set_b);
+   
    // Distance tests
    double dist = kmh_distance(empty, empty);
    TEST("Empty distance", dist == 1.0);
@@ -65,11 +196,130 @@ int main() {
    dist = kmh_distance(kmh, kmh2);
    TEST("Valid distance", dist >= 0.0 && dist <= 1.0);
    
+   // SIMD overlap matches the scalar walk (partial, full, disjoint, nested), and
+   // the one-vs-many / all-pairs forms match kmh_distance pair by pair
+   kvalue_minhash_t *pairs[40];
+   for (uint32_t p = 0; p < 40; p++) {
+       pairs[p] = kmh_init(64, 0xFFFFFFFF, 42);
+       for (uint32_t v = (p % 7) * 20; v < (p % 7) * 20 + (p * 37) % 300; v++) kmh_add(pairs[p], v);
+   }
+   int overlap_ok = 1;
+   double *pair_dist = malloc(40 * 40 * sizeof(double));
+   double *pair_many = malloc(40 * 40 * sizeof(double));
+   kmh_distance_all_pairs((const kvalue_minhash_t *const *)pairs, 40,
+                          (const kvalue_minhash_t *const *)pairs, 40, pair_dist);
+   for (uint32_t p = 0; p < 40; p++) {
+       kmh_distance_many(pairs[p], (const kvalue_minhash_t *const *)pairs, 40, pair_many + p * 40);
+       for (uint32_t q = 0; q < 40; q++) {
+           kmh_overlap_t fast = kmh_overlap_select()(pairs[p]->hashes, pairs[p]->count,
+                                                     pairs[q]->hashes, pairs[q]->count, 64);
+           kmh_overlap_t slow = kmh_overlap_scalar(pairs[p]->hashes, pairs[p]->count,
+                                                   pairs[q]->hashes, pairs[q]->count, 64);
+           double d = kmh_distance(pairs[p], pairs[q]);
+           overlap_ok &= fast.matches == slow.matches && fast.compared == slow.compared &&
+                         pair_dist[p * 40 + q] == d && pair_many[p * 40 + q] == d;
+       }
+   }
+   TEST("SIMD overlap", overlap_ok);
+   kmh_pool_t *distance_pool = kmh_pool_create(3);
+   memset(pair_many, 0, 40 * 40 * sizeof(double));
+   kmh_pool_distance_all_pairs(distance_pool, (const kvalue_minhash_t *const *)pairs, 40,
+                               (const kvalue_minhash_t *const *)pairs, 40, pair_many);
+   overlap_ok = memcmp(pair_many, pair_dist, 40 * 40 * sizeof(double)) == 0;
+   kmh_pool_distance_many(distance_pool, pairs[5], (const kvalue_minhash_t *const *)pairs, 40, pair_many);
+   TEST("Pooled distances", overlap_ok && memcmp(pair_many, pair_dist + 5 * 40, 40 * sizeof(double)) == 0);
+   kmh_pool_destroy(distance_pool);
+   free(pair_dist); free(pair_many);
+   for (uint32_t p = 0; p < 40; p++) kmh_free(pairs[p]);
+   
+   // LSH index: queries return exactly what a brute-force scan verifies, and
+   // removes, replaces and small (unbanded) sets are handled
+   kmh_lsh_t *lsh = kmh_lsh_init(16, 4);
+   kvalue_minhash_t *docs[200];
+   for (uint32_t d = 0; d < 200; d++) {
+       docs[d] = kmh_init(128, 0xFFFFFFFF, 42);
+       uint32_t base = (d / 4) * 1000 + (d % 4) * 5;
+       for (uint32_t v = base; v < base + 400; v++) kmh_add(docs[d], v);
+       kmh_lsh_insert(lsh, d, docs[d]);
+   }
+   int lsh_ok = lsh && lsh->size == 200;
+   for (uint32_t d = 0; d < 200 && lsh_ok; d++) {
+       kmh_lsh_match_t *found;
+       size_t nfound = kmh_lsh_query(lsh, docs[d], 0.8, &found);
+       size_t expect = 0;
+       for (uint32_t e = 0; e < 200; e++) expect += 1.0 - kmh_distance(docs[d], docs[e]) >= 0.8;
+       lsh_ok &= nfound == expect && found[0].similarity == 1.0;
+       for (size_t f = 0; f < nfound && lsh_ok; f++) lsh_ok &= (uint32_t)found[f].id / 4 == d / 4;
+       kmh_dealloc(found);
+   }
+   kmh_lsh_match_t *found;
+   kmh_lsh_remove(lsh, 1);
+   kmh_lsh_insert(lsh, 2, docs[100]); // replace
+   size_t nfound = kmh_lsh_query(lsh, docs[0], 0.8, &found);
+   lsh_ok &= nfound == 2 && kmh_lsh_get(lsh, 1) == NULL && kmh_lsh_remove(lsh, 1) == 0;
+   kmh_dealloc(found);
+   kvalue_minhash_t *tiny = kmh_init(128, 0xFFFFFFFF, 42);
+   kmh_add(tiny, 7); kmh_add(tiny, 8);
+   kmh_lsh_insert(lsh, -5, tiny);
+   nfound = kmh_lsh_query(lsh, tiny, 0.5, &found);
+   lsh_ok &= nfound == 1 && found[0].id == -5 && lsh->size == 200;
+   kmh_dealloc(found);
+   TEST("LSH index", lsh_ok);
+   kmh_free(tiny);
+   
+   // Churn: replacing every sketch over and over frees the emptied buckets,
+   // so the bucket table stays the size one round needs
+   uint32_t churn_mask = 0;
+   for (uint32_t round = 1; round <= 20; round++) {
+       for (uint32_t d = 0; d < 200; d++) {
+           kvalue_minhash_t *next = kmh_init(128, 0xFFFFFFFF, 42);
+           for (uint32_t v = 0; v < 400; v++) kmh_add(next, round * 1000000 + d * 1000 + v);
+           kmh_lsh_insert(lsh, d, next);
+           kmh_free(next);
+       }
+       kmh_lsh_remove(lsh, -5);
+       if (round == 1) churn_mask = lsh->bucket_mask;
+   }
+   int churn_ok = lsh->size == 200 && lsh->bucket_mask == churn_mask && lsh->bucket_used <= 200 * 16;
+   for (uint32_t d = 0; d < 200 && churn_ok; d++) {
+       nfound = kmh_lsh_query(lsh, kmh_lsh_get(lsh, d), 0.8, &found);
+       churn_ok &= nfound == 1 && found[0].id == d;
+       kmh_dealloc(found);
+   }
+   TEST("LSH index churn", churn_ok);
+   
+   // Out of memory at every allocation of an insert in turn: a failed insert
+   // leaves no postings and no empty buckets behind
+   int oom_ok = 1, inserted = 0;
+   for (int fail = 1; !inserted && fail < 100; fail++) {
+       kvalue_minhash_t *next = kmh_init(128, 0xFFFFFFFF, 42);
+       for (uint32_t v = 0; v < 400; v++) kmh_add(next, 7000000 + v);
+       kmh_thread_cache_flush();
+       atomic_store(&hook_fail_at, fail);
+       inserted = kmh_lsh_insert(lsh, 500, next);
+       atomic_store(&hook_fail_at, 0);
+       kmh_free(next);
+       uint32_t used = 0;
+       for (uint32_t s = 0; s <= lsh->bucket_mask; s++) {
+           if (!lsh->buckets[s].key) continue;
+           used++;
+           oom_ok &= lsh->buckets[s].count > 0;
+       }
+       oom_ok &= used == lsh->bucket_used && lsh->size == 200u + inserted &&
+                 (kmh_lsh_get(lsh, 500) != NULL) == inserted;
+   }
+   TEST("LSH index insert out of memory", oom_ok && inserted);
+   for (uint32_t d = 0; d < 200; d++) kmh_free(docs[d]);
+   kmh_lsh_free(lsh);
+   
    // Serialization tests
    uint8_t *buf;
    uint32_t size = kmh_serialize(kmh, &buf);
    TEST("Serialize success", size > 0 && buf != NULL);
-   TEST("Serialize reasonable size", size == (kmh->k + 4) * sizeof(uint32_t));
+   TEST("Serialize reasonable size", size == KMH_BLOB_HEADER_SIZE + kmh->count * sizeof(uint32_t));
+   TEST("Serialize portable header", kmh_load_le32(buf) == KMH_BLOB_MAGIC && buf[4] == KMH_BLOB_VERSION &&
+        buf[5] == sizeof(uint32_t) && kmh_load_le32(buf + 8) == kmh->k &&
+        kmh_load_le32(buf + KMH_BLOB_HEADER_SIZE) == kmh->hashes[0]);
    
    // Deserialization tests
    kvalue_minhash_t *restored = kmh_deserialize(buf, size);
@@ -94,6 +344,139 @@ int main() {
    double normal_card = kmh_cardinality(kmh);
    TEST("Fast cardinality", fabs(fast_card - normal_card) < 0.001);
    
+   // Legacy struct-dump blobs are still readable
+   uint8_t legacy[KMH_LEGACY_HEADER_SIZE + 10 * sizeof(uint32_t)] = { 0 };
+   uint32_t legacy_fields[4] = { kmh->k, kmh->count, kmh->space_size, kmh->seed };
+   memcpy(legacy, legacy_fields, sizeof(legacy_fields));
+   memcpy(legacy + KMH_LEGACY_HEADER_SIZE, kmh->hashes, kmh->count * sizeof(uint32_t));
+   kvalue_minhash_t *from_legacy = kmh_deserialize(legacy, sizeof(legacy));
+   TEST("Deserialize legacy blob", from_legacy && from_legacy->count == kmh->count &&
+        memcmp(from_legacy->hashes, kmh->hashes, kmh->count * sizeof(uint32_t)) == 0 &&
+        kmh_cardinality_from_serialized(legacy, sizeof(legacy)) == kmh_cardinality(kmh));
+   kmh_free(from_legacy);
+   
+   // Unknown versions are rejected rather than misread
+   uint8_t *future = malloc(size);
+   memcpy(future, buf, size);
+   future[4] = KMH_BLOB_VERSION + 1;
+   TEST("Deserialize future version", kmh_deserialize(future, size) == NULL);
+   free(future);
+   
+   // Compressed encodings round-trip at block boundaries and keep the O(1) cardinality
+   kvalue_minhash_t *wide = kmh_init(300, 0xFFFFFFFF, 42);
+   uint32_t wide_counts[] = { 1, 129, 130, 300 };
+   int compressed_ok = 1, compressed_truncated = 1, compressed_smaller = 1, sized_ok = 1;
+   for (uint32_t c = 0, v = 0; c < 4; c++) {
+       while (wide->count < wide_counts[c]) kmh_add(wide, v++);
+       if (c == 3) for (; v < 100000; v++) kmh_add(wide, v);
+       for (uint8_t enc = KMH_ENCODING_VARINT; enc <= KMH_ENCODING_BITPACK; enc++) {
+           uint8_t *cbuf = NULL;
+           uint32_t csize = kmh_serialize_encoded(wide, enc, &cbuf);
+           if (!csize) {
+               compressed_ok = 0;
+               continue;
+           }
+           kvalue_minhash_t *cres = kmh_deserialize(cbuf, csize);
+           kmh_view_t cview;
+           compressed_ok &= cres && cres->count == wide->count && cbuf[6] == enc &&
+               memcmp(cres->hashes, wide->hashes, wide->count * sizeof(uint32_t)) == 0 &&
+               kmh_cardinality_from_serialized(cbuf, csize) == kmh_cardinality(wide) &&
+               !kmh_view_init(&cview, cbuf, csize);
+           compressed_truncated &= kmh_deserialize(cbuf, csize - 1) == NULL;
+           // Exact sizes: into a buffer of exactly that size, not one byte less
+           uint8_t into[KMH_BLOB_HEADER_SIZE + 5 * 300];
+           sized_ok &= kmh_serialized_size(wide, enc) == csize && kmh_serialize_into(wide, enc, into, csize) == csize &&
+                       memcmp(into, cbuf, csize) == 0 && kmh_serialize_into(wide, enc, into, csize - 1) == 0;
+           if (c == 3) compressed_smaller &= csize < KMH_BLOB_HEADER_SIZE + wide->count * sizeof(uint32_t);
+           kmh_free(cres);
+           kmh_free_buffer(cbuf);
+       }
+   }
+   TEST("Compressed round trip", compressed_ok);
+   TEST("Compressed truncated", compressed_truncated);
+   TEST("Compressed size", compressed_smaller);
+   uint8_t raw_into[KMH_BLOB_HEADER_SIZE + 300 * sizeof(uint32_t)];
+   TEST("Serialize into", sized_ok && kmh_serialized_size(wide, KMH_ENCODING_RAW) == sizeof(raw_into) &&
+        kmh_serialize_into(wide, KMH_ENCODING_RAW, raw_into, sizeof(raw_into)) == sizeof(raw_into) &&
+        kmh_serialize_into(wide, KMH_ENCODING_RAW, raw_into, sizeof(raw_into) - 1) == 0 &&
+        kmh_serialize_into(wide, 7, raw_into, sizeof(raw_into)) == 0);
+   kmh_free(wide);
+   
+   // Zero-copy views, including over an unaligned copy of the blob
+   uint8_t *unaligned = malloc(size + 1);
+   memcpy(unaligned + 1, buf, size);
+   kmh_view_t view, view2;
+   TEST("View init", kmh_view_init(&view, unaligned + 1, size) && view.count == kmh->count &&
+        kmh_view_hash(&view, 0) == kmh->hashes[0]);
+   TEST("View small buffer", !kmh_view_init(&view2, buf, 4));
+   TEST("View cardinality", kmh_view_cardinality(&view) == kmh_cardinality(kmh));
+   int search_ok = 1;
+   for (uint32_t i = 0; i < kmh->count; i++) {
+       uint32_t h = kmh->hashes[i];
+       search_ok &= kmh_view_search(&view, h) == kmh_search(kmh->hashes, kmh->count, h) &&
+                    kmh_view_search(&view, h + 1) == kmh_search(kmh->hashes, kmh->count, h + 1) &&
+                    kmh_view_search(&view, h - 1) == kmh_search(kmh->hashes, kmh->count, h - 1);
+   }
+   TEST("View search", search_ok && kmh_view_search(&view, 0xFFFFFFFF) == 0);
+   uint8_t *buf2;
+   uint32_t size2 = kmh_serialize(kmh2, &buf2);
+   kmh_view_init(&view2, buf2, size2);
+   TEST("View distance", kmh_view_distance(&view, &view2) == kmh_distance(kmh, kmh2));
+   kvalue_minhash_t *view_merged = kmh_view_merge(&view, &view2);
+   kvalue_minhash_t *plain_merged = kmh_merge(kmh, kmh2);
+   TEST("View merge", view_merged && view_merged->count == plain_merged->count &&
+        memcmp(view_merged->hashes, plain_merged->hashes, plain_merged->count * sizeof(uint32_t)) == 0);
+   kmh_free(view_merged); kmh_free(plain_merged);
+   
+   // Accumulating merge matches kmh_merge, including when src changes nothing
+   kvalue_minhash_t *acc = kmh_deserialize(buf, size);
+   uint32_t scratch[10];
+   plain_merged = kmh_merge(kmh, kmh2);
+   TEST("Merge into", acc && kmh_merge_into(acc, &view2, scratch) && acc->count == plain_merged->count &&
+        memcmp(acc->hashes, plain_merged->hashes, acc->count * sizeof(uint32_t)) == 0 &&
+        kmh_merge_into(acc, &view2, scratch) && acc->count == plain_merged->count &&
+        memcmp(acc->hashes, plain_merged->hashes, acc->count * sizeof(uint32_t)) == 0);
+   kmh_free(acc); kmh_free(plain_merged);
+   
+   // N-way merge matches folding kmh_merge, through the two-way kernels,
+   // the stack loser tree and the heap one
+   size_t many_sizes[] = { 1, 2, 3, 7, 70 };
+   int many_ok = 1;
+   const kvalue_minhash_t *many_inputs[70];
+   kvalue_minhash_t *many_owned[70];
+   for (size_t s = 0; s < 5; s++) {
+       size_t n = many_sizes[s];
+       for (size_t i = 0; i < n; i++) {
+           many_owned[i] = kmh_init(64, 0xFFFFFFFF, 11);
+           // Overlapping ranges and one short input exercise dedup and padding
+           uint32_t values = i == 1 ? 5 : 300;
+           for (uint32_t v = 0; v < values; v++) kmh_add(many_owned[i], (uint32_t)(i * 150 + v));
+           many_inputs[i] = many_owned[i];
+       }
+       kvalue_minhash_t *folded = kmh_init(64, 0xFFFFFFFF, 11);
+       for (size_t i = 0; i < n; i++) {
+           kvalue_minhash_t *next = kmh_merge(folded, many_owned[i]);
+           kmh_free(folded);
+           folded = next;
+       }
+       kvalue_minhash_t *many = kmh_merge_many(many_inputs, n);
+       many_ok &= many && many->count == folded->count &&
+           memcmp(many->hashes, folded->hashes, folded->count * sizeof(uint32_t)) == 0;
+       if (n == 2) {
+           uint32_t scalar_out[64], simd_out[64];
+           uint32_t ms = kmh_merge2_scalar(many_owned[0]->hashes, many_owned[0]->count,
+                                           many_owned[1]->hashes, many_owned[1]->count, 64, scalar_out);
+           uint32_t mv = kmh_merge2_select()(many_owned[0]->hashes, many_owned[0]->count,
+                                             many_owned[1]->hashes, many_owned[1]->count, 64, simd_out);
+           many_ok &= ms == mv && memcmp(scalar_out + 64 - ms, simd_out + 64 - mv, ms * sizeof(uint32_t)) == 0;
+       }
+       kmh_free(many); kmh_free(folded);
+       for (size_t i = 0; i < n; i++) kmh_free(many_owned[i]);
+   }
+   TEST("Merge many", many_ok);
+   kmh_free_buffer(buf2);
+   free(unaligned);
+   
    // Empty serialization
    uint8_t *empty_buf;
    uint32_t empty_size = kmh_serialize(empty, &empty_buf);
@@ -104,6 +487,212 @@ int main() {
    TEST("Deserialize small buffer", kmh_deserialize(buf, 4) == NULL);
    TEST("Fast cardinality small buffer", kmh_cardinality_from_serialized(buf, 4) == -1.0);
    
+   // Sliding window: every query equals a sketch built from scratch over the
+   // events still in the window, through in-order, late and expired events,
+   // clock jumps and a serialize round trip
+   kmh_window_t *win = kmh_window_init(8, 10, 64, 0xFFFFFFFF, 5);
+   static uint64_t ev_time[4000];
+   static uint32_t ev_value[4000];
+   uint32_t nev = 0;
+   uint64_t clock = 0;
+   int window_ok = win != NULL;
+   srand(11);
+   for (uint32_t step = 0; step < 4000 && window_ok; step++) {
+       clock += rand() % 4 == 0 ? (rand() % 7 == 0 ? 200 : rand() % 12) : 0;
+       uint64_t t = clock - (rand() % 5 == 0 ? (uint64_t)(rand() % 90) % (clock + 1) : 0); // late events
+       ev_time[nev] = t;
+       ev_value[nev++] = (uint32_t)rand() % 3000;
+       kmh_window_add(win, t, ev_value[nev - 1]);
+       if (step % 97 == 0) {
+           uint64_t head = clock / 10;
+           kvalue_minhash_t *expect = kmh_init(64, 0xFFFFFFFF, 5);
+           for (uint32_t e = 0; e < nev; e++) {
+               // The head only moves forward, so anything still in the window
+               // was also in it when it arrived
+               uint64_t epoch = ev_time[e] / 10;
+               if (epoch + 8 > head) kmh_add(expect, ev_value[e]);
+           }
+           kvalue_minhash_t *got = kmh_window_sketch(win, clock);
+           window_ok &= got && got->count == expect->count &&
+                        memcmp(got->hashes, expect->hashes, got->count * sizeof(uint32_t)) == 0 &&
+                        kmh_window_cardinality(win, clock) == kmh_cardinality(expect);
+           uint8_t *wbuf = NULL;
+           uint32_t wsize = kmh_window_serialize(win, &wbuf);
+           kmh_window_t *win2 = wsize ? kmh_window_deserialize(wbuf, wsize) : NULL;
+           kvalue_minhash_t *got2 = win2 ? kmh_window_sketch(win2, clock + 35) : NULL;
+           kvalue_minhash_t *moved = kmh_window_sketch(win, clock + 35);
+           window_ok &= got2 && moved && got2->count == moved->count &&
+                        memcmp(got2->hashes, moved->hashes, got2->count * sizeof(uint32_t)) == 0 &&
+                        kmh_window_deserialize(wbuf, wsize - 1) == NULL;
+           // Queries straight from the blob agree with the loaded ring at
+           // any end time, and a version 1 blob (buckets only) loads the same
+           kmh_window_view_t wview;
+           uint32_t *work = malloc(KMH_WINDOW_VIEW_WORK * 64 * sizeof(uint32_t));
+           window_ok &= wsize && kmh_window_view_init(&wview, wbuf, wsize);
+           uint32_t v1_size = kmh_window_view_offset(&wview, wview.nbuckets);
+           uint8_t *v1 = malloc(v1_size);
+           memcpy(v1, wbuf, v1_size);
+           v1[4] = 1;
+           for (uint64_t later = 0; later < 200 && window_ok; later += 7) {
+               kmh_window_t *loaded = kmh_window_deserialize(wbuf, wsize);
+               kmh_window_t *loaded1 = kmh_window_deserialize(v1, v1_size);
+               kvalue_minhash_t *want = loaded ? kmh_window_sketch(loaded, clock + later) : NULL;
+               kvalue_minhash_t *want1 = loaded1 ? kmh_window_sketch(loaded1, clock + later) : NULL;
+               uint32_t m = kmh_window_view_collect(&wview, clock + later, work);
+               window_ok &= want && want1 && m == want->count && want1->count == m &&
+                            memcmp(work + 64 - m, want->hashes, m * sizeof(uint32_t)) == 0 &&
+                            memcmp(want1->hashes, want->hashes, m * sizeof(uint32_t)) == 0 &&
+                            kmh_window_view_cardinality(&wview, clock + later, work) == kmh_cardinality(want);
+               kmh_window_free(loaded); kmh_window_free(loaded1);
+               kmh_free(want); kmh_free(want1);
+           }
+           // ... and is stored again as the same version 2 blob
+           kmh_window_t *reloaded = kmh_window_deserialize(v1, v1_size);
+           uint8_t *rebuf = NULL;
+           uint32_t resize = reloaded ? kmh_window_serialize(reloaded, &rebuf) : 0;
+           window_ok &= resize == wsize && memcmp(rebuf, wbuf, wsize) == 0;
+           if (resize) kmh_free_buffer(rebuf);
+           kmh_window_free(reloaded);
+           free(work); free(v1);
+           kmh_window_free(win);
+           win = win2; // carry on from the restored ring
+           clock += 35;
+           if (wsize) kmh_free_buffer(wbuf);
+           kmh_free(expect); kmh_free(got); kmh_free(got2); kmh_free(moved);
+       }
+   }
+   TEST("Sliding window", window_ok);
+   kmh_window_free(win);
+   
+   // Crafted rings: slot headers that overrun the blob or claim more than k
+   // hashes are rejected
+   uint8_t crafted[KMH_WINDOW_HEADER_SIZE + 64] = { 0 };
+   kmh_store_le32(crafted, KMH_WINDOW_MAGIC);
+   kmh_store_le32(crafted + 8, 8);         // nbuckets: 8 empty slots fill the blob
+   kmh_store_le32(crafted + 12, MAX_K * 10);
+   kmh_store_le64(crafted + 16, 10);       // bucket_width
+   kmh_store_le32(crafted + 32, 0xFFFFFFFF);
+   kmh_window_t *crafted_ok = kmh_window_deserialize(crafted, sizeof(crafted));
+   kmh_store_le32(crafted + KMH_WINDOW_HEADER_SIZE + 4, 1);  // first slot overruns the last
+   kmh_window_t *crafted_size = kmh_window_deserialize(crafted, sizeof(crafted));
+   kmh_store_le32(crafted + KMH_WINDOW_HEADER_SIZE + 4, 0);
+   kmh_store_le32(crafted + KMH_WINDOW_HEADER_SIZE + 56, MAX_K * 10 + 1); // last slot's count
+   kmh_window_t *crafted_count = kmh_window_deserialize(crafted, sizeof(crafted));
+   TEST("Sliding window crafted blobs", crafted_ok && crafted_ok->nbuckets == 8 && !crafted_size && !crafted_count);
+   kmh_window_free(crafted_ok);
+   
+   // Row frame: the sketch of the queued rows matches merging them from
+   // scratch, through pushes of empty, single-hash and multi-hash rows, pops
+   // that turn the stacks over and enough rows in a row to trigger pruning
+   kmh_frame_t *frame = kmh_frame_init(32, 0xFFFFFFFF, 3);
+   static kvalue_minhash_t *fifo[6000];
+   uint32_t fifo_head = 0, fifo_tail = 0;
+   int frame_ok = frame != NULL;
+   srand(13);
+   for (uint32_t step = 0; step < 6000 && frame_ok; step++) {
+       // Long runs of pushes early on, a frame of a few dozen rows later
+       if (fifo_tail - fifo_head > (step < 3000 ? 2500u : 40u) || (fifo_tail > fifo_head && rand() % 3 == 0)) {
+           frame_ok &= kmh_frame_pop(frame);
+           kmh_free(fifo[fifo_head++]);
+       }
+       kvalue_minhash_t *row = kmh_init(32, 0xFFFFFFFF, 3);
+       uint32_t n = rand() % 4 == 0 ? 0 : rand() % 2 ? 1 : (uint32_t)rand() % 60;
+       for (uint32_t i = 0; i < n; i++) kmh_add(row, (uint32_t)rand() % 20000);
+       frame_ok &= kmh_frame_push_hashes(frame, row->hashes, row->count);
+       fifo[fifo_tail++] = row;
+       if (step == 2999) {
+           size_t queued = 0;
+           for (uint32_t r = fifo_head; r < fifo_tail; r++) queued += fifo[r]->count;
+           frame_ok &= frame->in.used + frame->out.used < queued / 4; // pruned along the way
+       }
+       if (step % 7 == 0) {
+           kvalue_minhash_t *expect = kmh_init(32, 0xFFFFFFFF, 3);
+           for (uint32_t r = fifo_head; r < fifo_tail; r++) {
+               for (uint32_t i = 0; i < fifo[r]->count; i++) kmh_insert_hash(expect, fifo[r]->hashes[i]);
+           }
+           kvalue_minhash_t *got = kmh_frame_sketch(frame);
+           frame_ok &= got && frame->rows == fifo_tail - fifo_head && got->count == expect->count &&
+                       memcmp(got->hashes, expect->hashes, got->count * sizeof(uint32_t)) == 0 &&
+                       kmh_frame_cardinality(frame) == kmh_cardinality(expect);
+           kmh_free(expect); kmh_free(got);
+       }
+   }
+   TEST("Row frame", frame_ok);
+   while (fifo_head < fifo_tail) kmh_free(fifo[fifo_head++]);
+   kmh_frame_free(frame);
+
+   // Row batches: kmh_frame_push_rows matches pushing the rows one at a time
+   kmh_frame_t *one = kmh_frame_init(16, 0xFFFFFFFF, 3), *batched = kmh_frame_init(16, 0xFFFFFFFF, 3);
+   uint32_t batch[50];
+   int rows_ok = one && batched;
+   for (uint32_t step = 0; step < 400 && rows_ok; step++) {
+       uint32_t n = rand() % 50;
+       for (uint32_t i = 0; i < n; i++) {
+           batch[i] = rand() % 3 == 0 ? KMH_SET_EMPTY : (uint32_t)rand() % 5000;
+           rows_ok &= batch[i] == KMH_SET_EMPTY ? kmh_frame_push_hashes(one, NULL, 0) : kmh_frame_push_hash(one, batch[i]);
+       }
+       rows_ok &= kmh_frame_push_rows(batched, batch, n);
+       for (uint32_t i = rand() % 30; i-- > 0;) rows_ok &= kmh_frame_pop(one) && kmh_frame_pop(batched);
+       kvalue_minhash_t *a = kmh_frame_sketch(one), *b = kmh_frame_sketch(batched);
+       rows_ok &= a && b && one->rows == batched->rows && a->count == b->count &&
+                   memcmp(a->hashes, b->hashes, a->count * sizeof(uint32_t)) == 0;
+       kmh_free(a); kmh_free(b);
+   }
+   TEST("Row frame batches", rows_ok);
+   kmh_frame_free(one);
+   kmh_frame_free(batched);
+
+   // Sketch store: lookups read the committed blobs in place; replaces and
+   // deletes show up only after a commit, and compaction keeps the live set
+   char store_path[64];
+   snprintf(store_path, sizeof(store_path), "/tmp/kmh_test_%d.kmhs", (int)getpid());
+   unlink(store_path);
+   kmh_store_writer_t *sw = kmh_store_writer_open(store_path);
+   kvalue_minhash_t *stored[50] = {0};
+   int store_ok = sw != NULL && kmh_store_writer_open(store_path) == NULL; // one writer
+   for (uint32_t i = 0; i < 50 && store_ok; i++) {
+       stored[i] = kmh_init(64, 0xFFFFFFFF, 9);
+       for (uint32_t v = i * 100; v < i * 100 + 500; v++) kmh_add(stored[i], v);
+       store_ok &= kmh_store_put_sketch(sw, i * 7919, stored[i]);
+   }
+   store_ok &= kmh_store_writer_close(sw);
+   kmh_store_t *st = kmh_store_open(store_path);
+   store_ok &= st && kmh_store_count(st) == 50;
+   for (uint32_t i = 0; i < 50 && store_ok; i++) {
+       uint32_t blob_size;
+       const uint8_t *blob = kmh_store_get(st, i * 7919, &blob_size);
+       store_ok &= blob && (uintptr_t)blob % 8 == 0 && kmh_store_cardinality(st, i * 7919) == kmh_cardinality(stored[i]) &&
+                   kmh_store_distance(st, i * 7919, 0) == kmh_distance(stored[i], stored[0]);
+   }
+   store_ok &= kmh_store_get(st, 1, &(uint32_t){0}) == NULL && kmh_store_cardinality(st, 1) == -1.0;
+   sw = kmh_store_writer_open(store_path);
+   store_ok &= sw && kmh_store_delete(sw, 0) && !kmh_store_delete(sw, 0) && kmh_store_put_sketch(sw, 7919, stored[5]);
+   store_ok &= kmh_store_writer_close(sw);
+   kmh_store_t *st2 = kmh_store_open(store_path);
+   store_ok &= st2 && kmh_store_count(st2) == 49 && kmh_store_count(st) == 50 && // old mapping is a snapshot
+               kmh_store_get(st2, 0, &(uint32_t){0}) == NULL && kmh_store_distance(st2, 7919, 5 * 7919) == 0.0;
+   uint64_t pos = 0, key, seen = 0;
+   uint32_t blob_size;
+   while (kmh_store_next(st2, &pos, &key, &blob_size)) seen += key % 7919 == 0;
+   store_ok &= seen == 49;
+   size_t before = st2->size;
+   kmh_store_close(st);
+   kmh_store_close(st2);
+   store_ok &= kmh_store_compact(store_path);
+   st = kmh_store_open(store_path);
+   store_ok &= st && st->size < before && kmh_store_count(st) == 49 &&
+               kmh_store_cardinality(st, 49 * 7919) == kmh_cardinality(stored[49]);
+   kmh_store_close(st);
+   sw = kmh_store_writer_open(store_path);
+   store_ok &= sw && kmh_store_put_sketch(sw, 1, stored[1]);
+   kmh_store_writer_abort(sw);
+   st = kmh_store_open(store_path);
+   store_ok &= st && kmh_store_count(st) == 49 && kmh_store_get(st, 1, &blob_size) == NULL;
+   kmh_store_close(st);
+   TEST("Sketch store", store_ok);
+   for (uint32_t i = 0; i < 50; i++) kmh_free(stored[i]);
+   unlink(store_path);
+   
    // Edge cases
    kvalue_minhash_t *single = kmh_init(1, 100, 42);
    kmh_add(single, 50);
@@ -115,6 +704,64 @@ int main() {
    TEST("Single k serialize", single_restored->count == 1 && 
          single_restored->hashes[0] == single->hashes[0]);
    
+   // Allocator hooks, and freed blocks being reused from the thread cache
+   kmh_thread_cache_flush();
+   int mallocs_before = hook_mallocs, frees_before = hook_frees;
+   kvalue_minhash_t *hooked = kmh_init(400, 1000, 42);
+   int mallocs_after_init = hook_mallocs - mallocs_before;
+   kmh_free(hooked);
+   kvalue_minhash_t *reused = kmh_init(300, 1000, 42);
+   TEST("Allocator hook", hooked && mallocs_after_init == 1 && reused == hooked &&
+        hook_mallocs - mallocs_before == 1);
+   kmh_free(reused);
+   kmh_thread_cache_flush();
+   TEST("Thread cache flush", hook_frees - frees_before == 1);
+   TEST("Allocator install once", !kmh_set_allocator(malloc, free) &&
+        kmh_set_allocator(counting_malloc, counting_free));
+   
+   // Concurrent shards merge to the same sketch as one sequential sketch
+   concurrent = kmh_concurrent_init(200, 0xFFFFFFFF, 42, 4);
+   pthread_t workers[4];
+   for (uintptr_t t = 0; t < 4; t++) pthread_create(&workers[t], NULL, concurrent_worker, (void *)t);
+   for (int t = 0; t < 4; t++) pthread_join(workers[t], NULL);
+   kvalue_minhash_t *sequential = kmh_init(200, 0xFFFFFFFF, 42);
+   for (uint32_t v = 0; v < 100000; v++) kmh_add(sequential, v);
+   kvalue_minhash_t *snapshot = kmh_concurrent_snapshot(concurrent);
+   TEST("Concurrent snapshot", snapshot && snapshot->count == sequential->count &&
+        memcmp(snapshot->hashes, sequential->hashes, sequential->count * sizeof(uint32_t)) == 0 &&
+        atomic_load(&concurrent->threshold) >= sequential->hashes[0]);
+   kmh_free(snapshot); kmh_free(sequential);
+   kmh_concurrent_free(concurrent);
+   
+   // Parallel build matches a sequential build for any pool size, and pools are reusable
+   uint32_t *bulk = malloc(300000 * sizeof(uint32_t));
+   for (uint32_t i = 0; i < 300000; i++) bulk[i] = i * 7919;
+   kvalue_minhash_t *bulk_seq = kmh_init(200, 0xFFFFFFFF, 42);
+   kmh_add_batch(bulk_seq, bulk, 300000);
+   int bulk_ok = 1;
+   for (uint32_t threads = 1; threads <= 5; threads += 2) {
+       kmh_pool_t *pool = kmh_pool_create(threads);
+       for (int rep = 0; rep < 2 && pool; rep++) {
+           kvalue_minhash_t *built = kmh_pool_build(pool, 200, 0xFFFFFFFF, 42, bulk, 300000 - rep * 1000);
+           kvalue_minhash_t *expect = bulk_seq;
+           if (rep) {
+               expect = kmh_init(200, 0xFFFFFFFF, 42);
+               kmh_add_batch(expect, bulk, 299000);
+           }
+           bulk_ok &= built && built->count == expect->count &&
+                      memcmp(built->hashes, expect->hashes, expect->count * sizeof(uint32_t)) == 0;
+           kmh_free(built);
+           if (rep) kmh_free(expect);
+       }
+       bulk_ok &= pool != NULL;
+       kmh_pool_destroy(pool);
+   }
+   kvalue_minhash_t *bulk_one = kmh_build_parallel(bulk, 300000, 3, 200, 0xFFFFFFFF, 42);
+   TEST("Parallel build", bulk_ok && bulk_one && bulk_one->count == bulk_seq->count &&
+        memcmp(bulk_one->hashes, bulk_seq->hashes, bulk_seq->count * sizeof(uint32_t)) == 0);
+   kmh_free(bulk_one); kmh_free(bulk_seq);
+   free(bulk);
+   
    // Hash function consistency
    uint32_t h1 = xxh32_hash(12345, 42);
    uint32_t h2 = xxh32_hash(12345, 42);
@@ -122,6 +769,57 @@ int main() {
    
    uint32_t h3 = xxh32_hash(12345, 43);
    TEST("Hash seed sensitivity", h1 != h3);
+   
+   // Byte-string hashing: reference vectors, streaming, and the integer path
+   TEST("XXH32 bytes", xxh32_bytes("", 0, 0) == 0x02CC5D05U && xxh32_bytes("abc", 3, 0) == 0x32D153FFU);
+   TEST("XXH64 bytes", xxh64_bytes("", 0, 0) == 0xEF46DB3751D8E999ULL &&
+        xxh64_bytes("abc", 3, 0) == 0x44BC2CF5AD770999ULL);
+   const char *text = "The quick brown fox jumps over the lazy dog, twice over the lazy dog";
+   size_t text_len = strlen(text);
+   xxh32_state_t st32;
+   xxh64_state_t st64;
+   xxh32_reset(&st32, 42);
+   xxh64_reset(&st64, 42);
+   for(size_t off = 0; off < text_len; off += 5) {
+       size_t n = text_len - off < 5 ? text_len - off : 5;
+       xxh32_update(&st32, text + off, n);
+       xxh64_update(&st64, text + off, n);
+   }
+   TEST("Streaming xxHash", xxh32_digest(&st32) == xxh32_bytes(text, text_len, 42) &&
+        xxh64_digest(&st64) == xxh64_bytes(text, text_len, 42));
+   uint8_t le_value[4] = { 0x39, 0x30, 0x00, 0x00 }; // 12345
+   TEST("Bytes match integer hash", xxh32_bytes(le_value, 4, 42) == h1);
+   
+   kvalue_minhash_t *strs = kmh_init(10, 1000, 42);
+   kmh_add_bytes(strs, "alice", 5);
+   kmh_add_bytes(strs, "bob", 3);
+   kmh_add_bytes(strs, "alice", 5);
+   TEST("Add bytes", strs->count == 2);
+   kmh_free(strs);
+
+    // 64-bit sketch
+    kvalue_minhash64_t *w64 = kmh64_init(256, UINT64_MAX, 42);
+    kvalue_minhash64_t *w64b = kmh64_init(256, UINT64_MAX, 42);
+    for (uint64_t i = 0; i < 100000; i++) kmh64_add(w64, i * 0x9E3779B97F4A7C15ULL);
+    for (uint64_t i = 50000; i < 150000; i++) kmh64_add(w64b, i * 0x9E3779B97F4A7C15ULL);
+    int w64_sorted = w64->count == 256;
+    for (uint32_t i = 1; w64_sorted && i < w64->count; i++) w64_sorted = w64->hashes[i-1] > w64->hashes[i];
+    TEST("64-bit add", w64_sorted);
+    TEST("64-bit cardinality", fabs(kmh64_cardinality(w64) - 100000) / 100000 < 0.2);
+    kvalue_minhash64_t *w64m = kmh64_merge(w64, w64b);
+    TEST("64-bit merge", w64m && fabs(kmh64_cardinality(w64m) - 150000) / 150000 < 0.2);
+    double d64 = kmh64_distance(w64, w64b);
+    TEST("64-bit distance", d64 > 0.0 && d64 < 1.0);
+    uint8_t *w64buf = NULL;
+    uint32_t w64size = kmh64_serialize(w64, &w64buf);
+    kvalue_minhash64_t *w64r = w64size ? kmh64_deserialize(w64buf, w64size) : NULL;
+    TEST("64-bit width tag", w64size && kmh_serialized_width(w64buf, w64size) == 8 &&
+         kmh_serialized_width(buf, size) == 4 && kmh_deserialize(w64buf, w64size) == NULL);
+    TEST("64-bit serialize", w64r && w64r->count == w64->count &&
+         memcmp(w64r->hashes, w64->hashes, w64->count * sizeof(uint64_t)) == 0 &&
+         kmh64_cardinality_from_serialized(w64buf, w64size) == kmh64_cardinality(w64));
+    if (w64size) kmh_free_buffer(w64buf);
+    kmh64_free(w64); kmh64_free(w64b); kmh64_free(w64m); kmh64_free(w64r);
 
     // Cardinality estimation accuracy test
     printf("\nCardinality Estimation Tests:\n");
@@ -159,14 +857,119 @@ int main() {
 
     kmh_free(partial);
 
-   
+   // Hot-path counters (build with -DKMH_STATS)
+   kmh_stats_t stats_before, stats_after;
+   kmh_stats_snapshot(&stats_before);
+   kvalue_minhash_t *counted = kmh_init(16, 0xFFFFFFFF, 42);
+   for (uint32_t i = 0; i < 1000; i++) kmh_add(counted, i % 500);
+   uint32_t counted_values[256];
+   for (uint32_t i = 0; i < 256; i++) counted_values[i] = 1000 + i;
+   kmh_add_batch(counted, counted_values, 256);
+   kmh_stats_snapshot(&stats_after);
+   uint64_t d[KMH_STAT_COUNT];
+   for (int i = 0; i < KMH_STAT_COUNT; i++) d[i] = stats_after.counters[i] - stats_before.counters[i];
+   if (stats_after.enabled) {
+       TEST("Stats adds", d[KMH_STAT_ADDS] == 1256);
+       TEST("Stats outcomes", d[KMH_STAT_DUPLICATES] > 0 && d[KMH_STAT_INSERTS] >= 16 && d[KMH_STAT_EARLY_REJECTS] > 0 &&
+            d[KMH_STAT_EARLY_REJECTS] + d[KMH_STAT_DUPLICATES] + d[KMH_STAT_INSERTS] == 1256);
+       TEST("Stats pool", d[KMH_STAT_POOL_HITS] + d[KMH_STAT_POOL_MISSES] == 1);
+   } else {
+       TEST("Stats disabled", d[KMH_STAT_ADDS] == 0 && stats_after.counters[KMH_STAT_POOL_HITS] == 0);
+   }
+   kmh_free(counted);
+
+   // Blocked sketches hold the same hashes as flat ones, past MAX_K * 10
+   printf("\nBlocked Sketch Tests:\n");
+   const uint32_t huge_k = 100000;
+   kmh_blocked_t *ba = kmh_blocked_init(huge_k, 1U << 24, 5), *bb = kmh_blocked_init(huge_k, 1U << 24, 5);
+   kmh_builder_t *ra = kmh_builder_init(huge_k, 1U << 24, 5), *rb = kmh_builder_init(huge_k, 1U << 24, 5);
+   uint32_t *huge_values = malloc(400000 * sizeof(uint32_t));
+   for (uint32_t i = 0; i < 400000; i++) huge_values[i] = (uint32_t)rand();
+   for (uint32_t i = 0; i < 400000; i++) {
+       kmh_blocked_add(ba, huge_values[i]);
+       kmh_builder_add(ra, huge_values[i]);
+   }
+   // b shares a quarter of a's values; batch ingest for b
+   kmh_blocked_add_batch(bb, huge_values + 300000, 100000);
+   for (uint32_t i = 300000; i < 400000; i++) kmh_builder_add(rb, huge_values[i]);
+   for (uint32_t i = 0; i < 300000; i++) huge_values[i] = (uint32_t)rand();
+   kmh_blocked_add_batch(bb, huge_values, 300000);
+   for (uint32_t i = 0; i < 300000; i++) kmh_builder_add(rb, huge_values[i]);
+   kvalue_minhash_t *fa = kmh_finalize(ra), *fb = kmh_finalize(rb);
+   uint32_t *collected = malloc(huge_k * sizeof(uint32_t));
+   kmh_blocked_collect(ba, collected);
+   TEST("Blocked add", ba->count == fa->count && fa->count == huge_k &&
+        memcmp(collected, fa->hashes, huge_k * sizeof(uint32_t)) == 0);
+   kmh_blocked_collect(bb, collected);
+   TEST("Blocked add batch", bb->count == fb->count &&
+        memcmp(collected, fb->hashes, fb->count * sizeof(uint32_t)) == 0);
+   TEST("Blocked cardinality", kmh_blocked_cardinality(ba) == kmh_cardinality(fa));
+
+   kmh_blocked_t *bm = kmh_blocked_merge(ba, bb);
+   kvalue_minhash_t *fm = kmh_merge(fa, fb);
+   kmh_blocked_collect(bm, collected);
+   TEST("Blocked merge", bm->count == fm->count && memcmp(collected, fm->hashes, fm->count * sizeof(uint32_t)) == 0);
+   // Merging a flat array into a reused sketch: the path aggregates take
+   kmh_blocked_reset(bm);
+   kmh_blocked_merge_into(bm, ba, NULL, fb->hashes, fb->count);
+   kmh_blocked_collect(bm, collected);
+   int merge_into_ok = bm->count == fm->count && memcmp(collected, fm->hashes, fm->count * sizeof(uint32_t)) == 0;
+   kmh_blocked_reset(bm);
+   kmh_blocked_merge_into(bm, ba, NULL, NULL, 0);
+   TEST("Blocked merge into", merge_into_ok && bm->count == ba->count);
+   kmh_blocked_reset(bm);
+   kmh_blocked_merge_into(bm, ba, bb, NULL, 0);
+   TEST("Blocked distance", kmh_blocked_distance(ba, bb) == kmh_distance(fa, fb) &&
+        kmh_blocked_distance(ba, bm) == kmh_distance(fa, fm) && kmh_blocked_distance(ba, ba) == 0.0);
+
+   uint8_t *blocked_buf = NULL;
+   uint32_t blocked_size = kmh_blocked_serialize(bm, &blocked_buf);
+   kmh_blocked_t *brestored = kmh_blocked_deserialize(blocked_buf, blocked_size);
+   kmh_blocked_collect(brestored, collected);
+   TEST("Blocked round trip", blocked_size == kmh_blocked_serialized_size(bm) && brestored->count == fm->count &&
+        memcmp(collected, fm->hashes, fm->count * sizeof(uint32_t)) == 0);
+   // Flat readers see the hashes; only the flag lifts the K limit
+   kvalue_minhash_t *flat_restored = kmh_deserialize(blocked_buf, blocked_size);
+   TEST("Blocked blob as flat", flat_restored && flat_restored->count == fm->count &&
+        memcmp(flat_restored->hashes, fm->hashes, fm->count * sizeof(uint32_t)) == 0);
+   blocked_buf[7] = 0;
+   TEST("Huge K needs the flag", !kmh_deserialize(blocked_buf, blocked_size));
+   blocked_buf[7] = KMH_FLAG_BLOCKS;
+
+   kmh_view_t blocked_view, flat_view;
+   TEST("Blocked view", kmh_view_init(&blocked_view, blocked_buf, blocked_size) &&
+        blocked_view.nblocks == bm->nleaves && !kmh_view_init(&blocked_view, blocked_buf, blocked_size - 1));
+   flat_view = blocked_view;
+   flat_view.dir = NULL;
+   int dir_ok = kmh_view_search(&blocked_view, 0xFFFFFFFF) == 0 &&
+                kmh_view_search(&blocked_view, 0) == kmh_view_search(&flat_view, 0);
+   for (uint32_t i = 0; i < fm->count; i += 97) {
+       uint32_t h = fm->hashes[i];
+       dir_ok &= kmh_view_search(&blocked_view, h) == i &&
+                 kmh_view_search(&blocked_view, h + 1) == kmh_view_search(&flat_view, h + 1) &&
+                 kmh_view_search(&blocked_view, h - 1) == kmh_view_search(&flat_view, h - 1);
+   }
+   TEST("Blocked view search", dir_ok);
+
+   kmh_blocked_t *small_blocked = kmh_blocked_deserialize(single_buf, single_size);
+   TEST("Blocked from flat blob", small_blocked && small_blocked->count == single->count &&
+        kmh_blocked_max(small_blocked) == single->hashes[0]);
+   TEST("Blocked init limits", !kmh_blocked_init(0, 1000, 1) && !kmh_blocked_init(KMH_HUGE_MAX_K + 1, 1000, 1));
+
+   kmh_blocked_free(ba); kmh_blocked_free(bb); kmh_blocked_free(bm); kmh_blocked_free(brestored);
+   kmh_blocked_free(small_blocked);
+   kmh_builder_free(ra); kmh_builder_free(rb);
+   kmh_free(fa); kmh_free(fb); kmh_free(fm); kmh_free(flat_restored);
+   kmh_free_buffer(blocked_buf);
+   free(huge_values); free(collected);
+
    printf("\nAll tests passed! ✓\n");
    
    // Cleanup
    kmh_free(kmh); kmh_free(kmh2); kmh_free(empty); kmh_free(merged); 
    kmh_free(diff); kmh_free(restored); kmh_free(empty_restored);
    kmh_free(single); kmh_free(single_restored);
-   free(buf); free(empty_buf); free(single_buf);
+   kmh_free_buffer(buf); kmh_free_buffer(empty_buf); kmh_free_buffer(single_buf);
    
    return 0;
 }
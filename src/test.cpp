@@ -0,0 +1,184 @@
+#include "kmh.hpp"
+#include <cstdio>
+#include <cmath>
+#include <type_traits>
+
+// Blobs written by kmh.h: kmh_serialize of kmh_init(16, 1000003, 42) over
+// 0..999, kmh64_serialize of kmh64_init(16, UINT64_MAX, 7) over i * 0x9E3779B97F4A7C15
+// for i in 0..999, and kmh_serialize_encoded(BITPACK) of kmh_init(160, 0xFFFFFFFF, 3)
+// over 0..4999
+static const uint8_t golden32[] = {
+   0x4B, 0x4D, 0x48, 0x31, 0x01, 0x04, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00,
+   0x10, 0x00, 0x00, 0x00, 0x43, 0x42, 0x0F, 0x00, 0x00, 0x00, 0x00, 0x00,
+   0x2A, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xBE, 0x30, 0x00, 0x00,
+   0x92, 0x2B, 0x00, 0x00, 0x7E, 0x27, 0x00, 0x00, 0xA6, 0x24, 0x00, 0x00,
+   0x27, 0x23, 0x00, 0x00, 0x78, 0x1F, 0x00, 0x00, 0x9A, 0x1D, 0x00, 0x00,
+   0x99, 0x1C, 0x00, 0x00, 0x2D, 0x1C, 0x00, 0x00, 0xD6, 0x18, 0x00, 0x00,
+   0xEC, 0x16, 0x00, 0x00, 0x03, 0x10, 0x00, 0x00, 0x3E, 0x0E, 0x00, 0x00,
+   0x43, 0x0D, 0x00, 0x00, 0x4F, 0x07, 0x00, 0x00, 0x30, 0x00, 0x00, 0x00,
+};
+static const uint8_t golden64[] = {
+   0x4B, 0x4D, 0x48, 0x31, 0x01, 0x08, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00,
+   0x10, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+   0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07, 0x01, 0x35, 0xAE,
+   0x14, 0x67, 0x7E, 0x04, 0x9D, 0x3E, 0x48, 0xD4, 0x07, 0xE3, 0x7A, 0x04,
+   0x6D, 0x5E, 0x8C, 0x8D, 0xBB, 0x27, 0x7A, 0x04, 0x84, 0xA7, 0xF0, 0xBE,
+   0x9D, 0x74, 0xBF, 0x03, 0x82, 0xF0, 0x71, 0x26, 0x68, 0x81, 0x2D, 0x03,
+   0xF7, 0xBC, 0x12, 0x3E, 0x56, 0x28, 0xF5, 0x02, 0xD6, 0xD7, 0x05, 0x2B,
+   0x91, 0x65, 0xEE, 0x02, 0x91, 0x53, 0x8B, 0x70, 0xCB, 0x75, 0x6E, 0x02,
+   0x93, 0x1A, 0x5A, 0xAD, 0xFA, 0xB6, 0xEE, 0x01, 0x9B, 0x90, 0x0C, 0x46,
+   0x96, 0xC1, 0xBF, 0x01, 0x8F, 0x09, 0xC0, 0xD8, 0xB3, 0xDC, 0x6A, 0x01,
+   0x64, 0xBA, 0x6F, 0x46, 0x98, 0xC4, 0x37, 0x01, 0x90, 0x5A, 0xE7, 0x4C,
+   0x09, 0xC7, 0xB1, 0x00, 0xBC, 0xC9, 0x4E, 0xC4, 0xFB, 0x55, 0xA5, 0x00,
+   0x2E, 0xFD, 0x29, 0xEB, 0x3F, 0xB7, 0x5B, 0x00, 0x8C, 0x6C, 0xAD, 0x9E,
+   0xE1, 0xEF, 0x4A, 0x00,
+};
+static const uint8_t golden_bitpack[] = {
+   0x4B, 0x4D, 0x48, 0x31, 0x01, 0x04, 0x02, 0x00, 0xA0, 0x00, 0x00, 0x00,
+   0xA0, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00,
+   0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xF7, 0x37, 0x31, 0x09,
+   0x17, 0x5B, 0xDA, 0x15, 0x43, 0x54, 0x73, 0x01, 0x4F, 0x9E, 0xD5, 0x29,
+   0xEE, 0x96, 0x95, 0x05, 0x3F, 0x34, 0xD9, 0x6F, 0xEC, 0x10, 0x8A, 0x91,
+   0xEC, 0x4F, 0x80, 0x43, 0xBD, 0xBA, 0x46, 0x48, 0x74, 0xE7, 0xB1, 0x23,
+   0xC0, 0xE3, 0xD8, 0x7E, 0x10, 0xA4, 0xC7, 0x08, 0x90, 0xA0, 0x5A, 0x46,
+   0xE0, 0xC0, 0xA8, 0xA9, 0x67, 0x17, 0x72, 0xE8, 0x78, 0x96, 0x91, 0x01,
+   0x02, 0x78, 0x96, 0x09, 0x90, 0x17, 0x7C, 0xFD, 0x02, 0x26, 0xFC, 0xEA,
+   0x0A, 0x1F, 0x2C, 0x0D, 0x5A, 0x06, 0x35, 0xFB, 0x0F, 0xEC, 0x10, 0x0A,
+   0x1B, 0x8C, 0xA2, 0x29, 0x57, 0x42, 0xC3, 0x0E, 0x46, 0x68, 0x8B, 0x0F,
+   0x76, 0xC7, 0x9A, 0x6A, 0x04, 0x43, 0x03, 0x6D, 0xB9, 0xF7, 0x85, 0x59,
+   0xB2, 0x9F, 0x89, 0xE6, 0x00, 0x06, 0x46, 0x49, 0xE1, 0x44, 0xB3, 0x47,
+   0xA7, 0x8E, 0x27, 0x40, 0x84, 0x80, 0xED, 0x8C, 0xC0, 0x20, 0x6B, 0x50,
+   0x25, 0xD3, 0xD3, 0x80, 0x47, 0x09, 0x0A, 0xE1, 0xD8, 0xA4, 0x1C, 0x73,
+   0x65, 0x48, 0x20, 0xFC, 0xF5, 0x26, 0x78, 0xBA, 0x9B, 0x26, 0xB8, 0x82,
+   0x57, 0x65, 0x78, 0x97, 0x2B, 0xE0, 0xF8, 0xD2, 0x70, 0xC4, 0x9E, 0x1A,
+   0xE8, 0xEC, 0x0D, 0x21, 0xD8, 0xDC, 0x9F, 0xAA, 0x48, 0x9F, 0x44, 0x1D,
+   0x47, 0x44, 0x18, 0xD5, 0x30, 0xEF, 0x2F, 0x65, 0x94, 0x28, 0x03, 0x4F,
+   0xE6, 0x0B, 0xB0, 0x9B, 0x82, 0x1A, 0x0A, 0x26, 0x07, 0x07, 0x13, 0x43,
+   0x11, 0x31, 0x73, 0x29, 0x80, 0xAA, 0x61, 0x21, 0xDD, 0x8F, 0x0C, 0x02,
+   0xBD, 0x6C, 0x41, 0xC3, 0xEE, 0xB0, 0x19, 0xA3, 0x26, 0xC0, 0x81, 0x3D,
+   0x51, 0x50, 0xA4, 0xFC, 0x95, 0x84, 0x22, 0x88, 0x35, 0x18, 0x30, 0x80,
+   0x31, 0x20, 0x73, 0xD6, 0xC1, 0x30, 0xC3, 0x22, 0x60, 0x40, 0x2B, 0x53,
+   0xE0, 0x68, 0xE7, 0x15, 0x78, 0x6F, 0x10, 0x6E, 0xD5, 0x36, 0x27, 0xF2,
+   0xE5, 0x8C, 0x15, 0xAC, 0x3B, 0xFF, 0x3D, 0x42, 0x2C, 0x05, 0x58, 0x6B,
+   0x26, 0x2D, 0x6F, 0x84, 0x25, 0x0A, 0x9E, 0xC4, 0x44, 0x72, 0xED, 0x02,
+   0x83, 0xA3, 0xFB, 0x8F, 0xF2, 0xC8, 0xDD, 0xD5, 0xC6, 0x7C, 0xBA, 0x85,
+   0xA0, 0x1C, 0x9D, 0xC0, 0xDE, 0x76, 0x24, 0xFA, 0xAF, 0x35, 0x23, 0x42,
+   0xFC, 0x9B, 0x01, 0x0E, 0x24, 0x3F, 0x63, 0x79, 0xB8, 0x16, 0x60, 0x58,
+   0x28, 0xC0, 0x7D, 0x49, 0xF8, 0x10, 0x6D, 0x1B, 0xB8, 0x16, 0x09, 0x42,
+   0xE8, 0x77, 0x01, 0x0A, 0xD8, 0x9F, 0x12, 0xD8, 0x71, 0x23, 0x01, 0xE0,
+   0x16, 0x7D, 0x1F, 0x08, 0xAB, 0x15, 0x94, 0xD5, 0x08, 0x0B, 0xEC, 0x47,
+   0x01, 0x05, 0x5A, 0xE7, 0x01, 0x21, 0x4E, 0x23, 0x13, 0xFA, 0x07, 0xA8,
+   0xF9, 0xFA, 0x40, 0x4A, 0x8B, 0xFA, 0x05, 0x4D, 0x45, 0xF9, 0x51, 0xA7,
+   0xF9, 0x08, 0x8F, 0xFA, 0x0A, 0x1C, 0x85, 0xFA, 0x1A, 0xD7, 0x59, 0xFA,
+   0x07, 0x24, 0x42, 0xFA, 0x04, 0x10, 0x51, 0xFA, 0x05, 0xDC, 0xDA, 0xFA,
+   0x0A, 0x75, 0xC4, 0xFA, 0x01, 0x0D, 0xF9, 0xFA, 0x03, 0x9C, 0x45, 0xFA,
+   0x0C, 0x85, 0x66, 0xFA, 0x03, 0x2B, 0xBC, 0xFA, 0x2F, 0xD2, 0xC8, 0xFA,
+   0x0D, 0xED, 0xD3, 0xFA, 0x04, 0xA0, 0x6B, 0xFA, 0x03, 0x78, 0x25, 0xFA,
+   0x14, 0x4F, 0x33, 0xFA, 0x05, 0x9F, 0xDE, 0xFA, 0x27, 0x50, 0x0A, 0xFA,
+   0x0F, 0xF3, 0xCC, 0xFA, 0x01, 0xF4, 0x75, 0xFA, 0x14, 0xAE, 0x41, 0xFA,
+   0x04, 0x76, 0xC8, 0xFA, 0x06, 0xB2, 0xAC, 0xFA, 0x02, 0xAD, 0xE8, 0xFA,
+   0x2F, 0x01, 0x74, 0xFA, 0x0B, 0xDA, 0xF8, 0xFA, 0x24, 0x7E, 0xC6,
+};
+
+#define TEST(name, condition) do { \
+   if (condition) { \
+       printf("✓ %s\n", name); \
+   } else { \
+       printf("✗ %s FAILED\n", name); \
+   } \
+} while(0)
+
+using Sketch32 = kmh::KMinHash<16, uint32_t, 1000003>;
+using Sketch64 = kmh::KMinHash<16, uint64_t>;
+using Sketch160 = kmh::KMinHash<160>;
+using Sketch32k32 = kmh::KMinHash<32, uint32_t, 1000003>;
+using Sketch64m = kmh::KMinHash<16, uint64_t, 1000003>;
+
+static_assert(!std::is_copy_constructible_v<Sketch32> && std::is_nothrow_move_constructible_v<Sketch32>);
+static_assert(Sketch32::reduce(1000003) == 0 && Sketch32::reduce(2000007) == 1);
+static_assert(kmh::KMinHash<8, uint32_t, 1024>::reduce(1025) == 1);
+static_assert(Sketch160::reduce(0xFFFFFFFFU) == 0 && Sketch160::reduce(5) == 5);
+static_assert(sizeof(Sketch160) == 160 * sizeof(uint32_t) + 2 * sizeof(uint32_t));
+
+template <typename S, typename T>
+static bool same_hashes(const S &kmh, std::span<const T> expected) {
+   auto h = kmh.hashes();
+   return h.size() == expected.size() && std::equal(h.begin(), h.end(), expected.begin());
+}
+
+int main() {
+   printf("KValue MinHash C++ Tests\n");
+   printf("========================\n");
+
+   // Same hashes and bytes as the C library
+   Sketch32 a(42);
+   for (uint32_t i = 0; i < 1000; i++) a.add(i);
+   TEST("Serialize matches C", a.serialize() == std::vector<uint8_t>(std::begin(golden32), std::end(golden32)));
+   TEST("Cardinality matches C", a.cardinality() == 1202.0229986377115);
+
+   Sketch64 b(7);
+   for (uint64_t i = 0; i < 1000; i++) b.add(i * 0x9E3779B97F4A7C15ULL);
+   TEST("Serialize 64-bit matches C", b.serialize() == std::vector<uint8_t>(std::begin(golden64), std::end(golden64)));
+   TEST("Cardinality 64-bit matches C", b.cardinality() == 854.51819156102238);
+
+   // Round trips, including the C compressed and legacy layouts
+   auto a2 = Sketch32::deserialize(golden32);
+   TEST("Deserialize", a2 && a2->seed() == 42 && same_hashes(*a2, a.hashes()));
+   auto b2 = Sketch64::deserialize(golden64);
+   TEST("Deserialize 64-bit", b2 && b2->seed() == 7 && same_hashes(*b2, b.hashes()));
+
+   Sketch160 c(3);
+   for (uint32_t i = 0; i < 5000; i++) c.add(i);
+   auto c2 = Sketch160::deserialize(golden_bitpack);
+   TEST("Deserialize bitpack", c2 && same_hashes(*c2, c.hashes()) && c2->cardinality() == 4428.0730544536555);
+
+   std::vector<uint8_t> legacy(kmh::detail::legacy_header_size + a.count() * sizeof(uint32_t));
+   kmh::detail::store_le<uint32_t>(legacy.data(), 16);
+   kmh::detail::store_le<uint32_t>(legacy.data() + 4, a.count());
+   kmh::detail::store_le<uint32_t>(legacy.data() + 8, 1000003);
+   kmh::detail::store_le<uint32_t>(legacy.data() + 12, 42);
+   std::memcpy(legacy.data() + 24, golden32 + 32, a.count() * sizeof(uint32_t));
+   auto a3 = Sketch32::deserialize(legacy);
+   TEST("Deserialize legacy", a3 && same_hashes(*a3, a.hashes()));
+
+   std::vector<uint8_t> bad(std::begin(golden_bitpack), std::end(golden_bitpack));
+   bad[32 + 4] = 0; // zero-width block
+   TEST("Bad bitpack rejected", !Sketch160::deserialize(bad));
+   TEST("Truncated blob rejected", !Sketch32::deserialize(std::span(golden32, sizeof(golden32) - 1)));
+   TEST("Wrong k rejected", !Sketch32k32::deserialize(golden32));
+   TEST("Wrong space rejected", !kmh::KMinHash<16>::deserialize(golden32));
+   TEST("Wrong width rejected", !Sketch64m::deserialize(golden32));
+
+   uint8_t small[128];
+   TEST("Serialize into short buffer", a.serialize_into(std::span(small, 32)) == 0 &&
+                                           a.serialize_into(small) == a.serialized_size());
+
+   // Merge and distance
+   Sketch160 lo(3), hi(3), all(3);
+   for (uint32_t i = 0; i < 3000; i++) lo.add(i);
+   for (uint32_t i = 2000; i < 5000; i++) hi.add(i);
+   Sketch160 merged = lo.clone();
+   TEST("Merge", merged.merge(hi) && same_hashes(merged, c.hashes()));
+   TEST("Merge seed mismatch", !merged.merge(Sketch160(4)));
+   TEST("Distance self", c.distance(c) == 0.0);
+   double d = lo.distance(hi);
+   TEST("Distance overlap", fabs(d - (1.0 - 1000.0 / 5000.0)) < 0.15);
+   TEST("Distance seed mismatch", c.distance(Sketch160(4)) == -1.0);
+   TEST("Distance empty", Sketch160(3).distance(Sketch160(3)) == 1.0);
+
+   // Zero-copy views
+   std::vector<uint8_t> blob = c.serialize();
+   auto view = Sketch160::view_type::from_blob(blob);
+   TEST("View", view && view->count() == 160 && view->hash(0) == c.hashes()[0] &&
+                    view->cardinality() == c.cardinality());
+   TEST("View distance", view && lo.distance(*view) == lo.distance(c));
+   Sketch160 lo2 = lo.clone();
+   TEST("View merge", view && lo2.merge(*view) && same_hashes(lo2, c.hashes()));
+   TEST("View rejects compressed", !Sketch160::view_type::from_blob(golden_bitpack));
+
+   Sketch160 moved = std::move(lo);
+   TEST("Move", moved.count() == 160 && moved.distance(hi) == d);
+
+   printf("\nAll tests passed!\n");
+   return 0;
+}